@@ -25,6 +25,7 @@
 #include "core/layerstack.h"
 #include "core/layer.h"
 #include "core/tilevector.h"
+#include "core/concurrent.h"
 
 #include "../libshared/net/layer.h"
 #include "../libshared/net/annotation.h"
@@ -219,11 +220,44 @@ MessageList SnapshotLoader::loadInitCommands()
 		msgs.append(protocol::Chat::pin(m_contextId, m_pinnedMessage));
 	}
 
+	// Generate tile sets of all layers and sublayers in parallel
+	QVector<const paintcore::Layer*> tilesetLayers;
+	for(int i=0;i<m_layers->layerCount();++i) {
+		const paintcore::Layer *layer = m_layers->getLayerByIndex(i);
+		tilesetLayers << layer;
+		for(const paintcore::Layer *sublayer : layer->sublayers()) {
+			if(sublayer->id() > 0 && sublayer->id() < 256 && !sublayer->isHidden())
+				tilesetLayers << sublayer;
+		}
+	}
+
+	QVector<paintcore::LayerTileSet> tilesets(tilesetLayers.size());
+	{
+		paintcore::LayerTileSet *tilesetptr = tilesets.data();
+		QList<int> indices;
+		for(int i=0;i<tilesetLayers.size();++i)
+			indices << i;
+
+		paintcore::concurrentForEach<int>(indices, [&tilesetLayers, tilesetptr](int i) {
+			tilesetptr[i] = paintcore::LayerTileSet::fromLayer(*tilesetLayers.at(i));
+		});
+	}
+
+	// Compress tiles (also in parallel)
+	if(m_compressor) {
+		m_compressor->compress(tilesets);
+	} else {
+		paintcore::TileCompressor compressor;
+		compressor.compress(tilesets);
+	}
+
 	// Create layers
+	int tilesetIdx = 0;
 	for(int i=0;i<m_layers->layerCount();++i) {
 		const paintcore::Layer *layer = m_layers->getLayerByIndex(i);
 
-		const auto tileset = paintcore::LayerTileSet::fromLayer(*layer);
+		Q_ASSERT(tilesetLayers.at(tilesetIdx) == layer);
+		const auto &tileset = tilesets.at(tilesetIdx++);
 
 		msgs << protocol::MessagePtr(new protocol::LayerCreate(
 			m_contextId,
@@ -249,7 +283,8 @@ MessageList SnapshotLoader::loadInitCommands()
 		// Put active sublayers (if any)
 		for(const paintcore::Layer *sublayer : layer->sublayers()) {
 			if(sublayer->id() > 0 && sublayer->id() < 256 && !sublayer->isHidden()) {
-				const auto subtileset = paintcore::LayerTileSet::fromLayer(*sublayer);
+				Q_ASSERT(tilesetLayers.at(tilesetIdx) == sublayer);
+				const auto &subtileset = tilesets.at(tilesetIdx++);
 				msgs << protocol::MessagePtr(new protocol::LayerAttributes(
 					m_contextId,
 					layer->id(),
@@ -28,6 +28,7 @@
 
 namespace paintcore {
 	class LayerStack;
+	class TileCompressor;
 }
 
 namespace canvas {
@@ -163,7 +164,7 @@ public:
 	 * @param aclfilter Access controls (optional)
 	 */
 	SnapshotLoader(uint8_t contextId, const paintcore::LayerStack *layers, const AclFilter *aclfilter)
-		: m_layers(layers), m_aclfilter(aclfilter), m_defaultLayer(0), m_contextId(contextId) {}
+		: m_layers(layers), m_aclfilter(aclfilter), m_compressor(nullptr), m_defaultLayer(0), m_contextId(contextId) {}
 
 	//! Include a default layer message
 	void setDefaultLayer(int defaultLayer) { m_defaultLayer = defaultLayer; }
@@ -171,6 +172,14 @@ public:
 	//! Include a pinned chat message
 	void setPinnedMessage(const QString &message) { m_pinnedMessage = message; }
 
+	/**
+	 * @brief Use a persistent tile compressor
+	 *
+	 * When the same compressor is used for consecutive snapshots,
+	 * unchanged tiles don't need to be compressed again.
+	 */
+	void setTileCompressor(paintcore::TileCompressor *compressor) { m_compressor = compressor; }
+
 	protocol::MessageList loadInitCommands() override;
 	QString filename() const override { return QString(); }
 	QString errorMessage() const override { return QString(); }
@@ -179,6 +188,7 @@ public:
 private:
 	const paintcore::LayerStack *m_layers;
 	const AclFilter *m_aclfilter;
+	paintcore::TileCompressor *m_compressor;
 
 	QString m_pinnedMessage;
 	int m_defaultLayer;
@@ -24,6 +24,8 @@
 
 #include "core/layerstack.h"
 #include "core/layer.h"
+#include "core/resampler.h"
+#include "core/compressedimage.h"
 #include "brushes/brushpainter.h"
 #include "net/commands.h"
 #include "net/internalmsg.h"
@@ -41,6 +43,7 @@
 #include <QElapsedTimer>
 #include <QSettings>
 #include <QPainter>
+#include <QScopedPointer>
 
 namespace canvas {
 
@@ -442,13 +445,16 @@ void StateTracker::handleCanvasBackground(const protocol::CanvasBackground &cmd)
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()));
 
 	} else {
-		QByteArray data = qUncompress(cmd.image());
-		if(data.length() != paintcore::Tile::BYTES) {
-			qWarning() << "Invalid canvas background: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
+		quint32 *pixels = t.data();
+		const bool ok = paintcore::inflateImageRows(cmd.image(), paintcore::Tile::SIZE, paintcore::Tile::SIZE, paintcore::Tile::SIZE, paintcore::Tile::SIZE,
+			[pixels](int, int, const quint32 *band) {
+				memcpy(pixels, band, paintcore::Tile::BYTES);
+			});
+
+		if(!ok) {
+			qWarning("Invalid canvas background");
 			return;
 		}
-
-		t = paintcore::Tile(data);
 	}
 	t.setLastEditedBy(cmd.contextId());
 	m_layerstack->editor(cmd.contextId()).setBackground(t);
@@ -630,14 +636,23 @@ void StateTracker::handlePutImage(const protocol::PutImage &cmd)
 		return;
 	}
 
-	const int expectedLen = cmd.width() * cmd.height() * 4;
-	QByteArray data = qUncompress(cmd.image());
-	if(data.length() != expectedLen) {
-		qWarning() << "Invalid putImage: Expected" << expectedLen << "bytes, but got" << data.length();
+	if(cmd.width() == 0 || cmd.height() == 0) {
+		qWarning("Invalid putImage: zero size image");
 		return;
 	}
-	QImage img(reinterpret_cast<const uchar*>(data.constData()), cmd.width(), cmd.height(), QImage::Format_ARGB32_Premultiplied);
-	layer.putImage(cmd.x(), cmd.y(), img, paintcore::BlendMode::Mode(cmd.blendmode()));
+
+	// Decompress the image a band at a time, straight into the layer's tiles.
+	// The first band ends at a tile boundary, so that each tile is only composited once.
+	const auto mode = paintcore::BlendMode::Mode(cmd.blendmode());
+	const int firstBand = paintcore::Tile::SIZE - cmd.y() % paintcore::Tile::SIZE;
+
+	const bool ok = paintcore::inflateImageRows(cmd.image(), cmd.width(), cmd.height(), firstBand, paintcore::Tile::SIZE,
+		[&layer, &cmd, mode](int y, int rows, const quint32 *pixels) {
+			layer.putImageRows(cmd.x(), cmd.y() + y, cmd.width(), rows, pixels, mode);
+		});
+
+	if(!ok)
+		qWarning("Invalid putImage (%dx%d at %d,%d)", cmd.width(), cmd.height(), cmd.x(), cmd.y());
 
 	if(_showallmarkers || cmd.contextId() != m_myId)
 		emit userMarkerMove(cmd.contextId(), layer->id(), QPoint(cmd.x() + cmd.width()/2, cmd.y()+cmd.height()/2));
@@ -657,13 +672,17 @@ void StateTracker::handlePutTile(const protocol::PutTile &cmd)
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()), cmd.contextId());
 
 	} else {
-		QByteArray data = qUncompress(cmd.image());
-		if(data.length() != paintcore::Tile::BYTES) {
-			qWarning() << "Invalid putTile: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
+		quint32 *pixels = t.data();
+		const bool ok = paintcore::inflateImageRows(cmd.image(), paintcore::Tile::SIZE, paintcore::Tile::SIZE, paintcore::Tile::SIZE, paintcore::Tile::SIZE,
+			[pixels](int, int, const quint32 *band) {
+				memcpy(pixels, band, paintcore::Tile::BYTES);
+			});
+
+		if(!ok) {
+			qWarning("Invalid putTile");
 			return;
 		}
-
-		t = paintcore::Tile(data, cmd.contextId());
+		t.setLastEditedBy(cmd.contextId());
 	}
 
 	layer.putTile(cmd.column(), cmd.row(), cmd.repeat(), t, cmd.sublayer());
@@ -742,32 +761,47 @@ void StateTracker::handleMoveRegion(const protocol::MoveRegion &cmd)
 		mp.drawImage(0, 0, mask);
 	}
 
-	// Transform selected pixels
+	// Prepare transformation
+	const bool translationOnly = target.boundingRect().size() == bounds.size() && target[0].x() < target[1].x();
 
-	QPoint offset;
+	QScopedPointer<paintcore::Resampler> resampler;
 	QImage transformed;
-	if(target.boundingRect().size() == bounds.size() && target[0].x() < target[1].x()) {
-		// Just translation
+	QPoint offset;
+
+	if(translationOnly) {
 		transformed = selbuf;
 		offset = target[0];
 
 	} else {
-		transformed = tools::SelectionTool::transformSelectionImage(selbuf, target, &offset);
-		if(transformed.isNull()) {
-			qWarning("moveRegion: transformation failed (%d, %d -> %d, %d -> %d, %d -> %d, %d)!",
-				cmd.x1(), cmd.y1(), cmd.x2(), cmd.y2(), cmd.x3(), cmd.y3(), cmd.x4(), cmd.y4());
-			return;
+		resampler.reset(new paintcore::Resampler(selbuf, target));
+
+		// Affine transforms are resampled bit exactly. Perspective transforms
+		// are painted the old way, as the exact mapping doesn't fit in 64 bits.
+		if(!resampler->isValid()) {
+			resampler.reset();
+			transformed = tools::SelectionTool::transformSelectionImage(selbuf, target, &offset);
+			if(transformed.isNull()) {
+				qWarning("moveRegion: transformation failed (%d, %d -> %d, %d -> %d, %d -> %d, %d)!",
+					cmd.x1(), cmd.y1(), cmd.x2(), cmd.y2(), cmd.x3(), cmd.y3(), cmd.x4(), cmd.y4());
+				return;
+			}
 		}
 	}
 
-	// Erase selection mask and draw transformed image
+	// Erase selection mask
 	if(mask.isNull()) {
 		layer.fillRect(bounds, Qt::transparent, paintcore::BlendMode::MODE_REPLACE);
 	} else {
 		layer.putImage(bounds.x(), bounds.y(), mask, paintcore::BlendMode::MODE_ERASE);
 	}
 
-	layer.putImage(offset.x(), offset.y(), transformed, paintcore::BlendMode::MODE_NORMAL);
+	// Draw transformed pixels
+	if(resampler) {
+		// The selection is resampled directly into the layer's tiles
+		layer.putTransformedImage(*resampler, paintcore::BlendMode::MODE_NORMAL);
+	} else {
+		layer.putImage(offset.x(), offset.y(), transformed, paintcore::BlendMode::MODE_NORMAL);
+	}
 
 	if(_showallmarkers || cmd.contextId() != m_myId)
 		emit userMarkerMove(cmd.contextId(), layer->id(), target.boundingRect().center());
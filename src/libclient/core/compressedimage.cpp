@@ -0,0 +1,103 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "compressedimage.h"
+
+#include <QVector>
+#include <QtEndian>
+
+#include <zlib.h>
+
+namespace paintcore {
+
+bool inflateImageRows(const QByteArray &data, int width, int height, int firstBand, int bandHeight, std::function<void(int,int,const quint32*)> func)
+{
+	Q_ASSERT(width>0 && height>0);
+	Q_ASSERT(firstBand>0 && bandHeight>0);
+
+	// qCompress prefixes the zlib stream with the expected uncompressed length
+	if(data.length() < 4) {
+		qWarning("inflateImageRows: data too short");
+		return false;
+	}
+
+	const quint32 expectedLen = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(data.constData()));
+	if(expectedLen != quint32(width) * quint32(height) * 4) {
+		qWarning("inflateImageRows: expected %u bytes, but header says %u", width * height * 4, expectedLen);
+		return false;
+	}
+
+	z_stream stream;
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData() + 4));
+	stream.avail_in = uInt(data.length() - 4);
+
+	if(inflateInit(&stream) != Z_OK) {
+		qWarning("inflateImageRows: inflateInit failed");
+		return false;
+	}
+
+	QVector<quint32> band(width * qMax(firstBand, bandHeight));
+
+	bool ok = true;
+	int y = 0;
+	int rows = qMin(firstBand, height);
+
+	while(y < height) {
+		stream.next_out = reinterpret_cast<Bytef*>(band.data());
+		stream.avail_out = uInt(width * rows * 4);
+
+		const int ret = inflate(&stream, Z_SYNC_FLUSH);
+		if(stream.avail_out > 0 || (ret != Z_OK && ret != Z_STREAM_END)) {
+			qWarning("inflateImageRows: decompression failed at row %d (%s)", y, stream.msg ? stream.msg : "truncated data");
+			ok = false;
+			break;
+		}
+
+		func(y, rows, band.constData());
+
+		y += rows;
+		rows = qMin(bandHeight, height - y);
+
+		if(ret == Z_STREAM_END && y < height) {
+			qWarning("inflateImageRows: stream ended early at row %d", y);
+			ok = false;
+			break;
+		}
+	}
+
+	if(ok) {
+		// Make sure there is no trailing data
+		Bytef extra;
+		stream.next_out = &extra;
+		stream.avail_out = 1;
+		const int ret = inflate(&stream, Z_FINISH);
+		if(ret != Z_STREAM_END || stream.avail_out == 0) {
+			qWarning("inflateImageRows: invalid data at the end of the image");
+			ok = false;
+		}
+	}
+
+	inflateEnd(&stream);
+	return ok;
+}
+
+}
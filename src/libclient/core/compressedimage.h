@@ -0,0 +1,51 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_COMPRESSEDIMAGE_H
+#define PAINTCORE_COMPRESSEDIMAGE_H
+
+#include <QByteArray>
+#include <functional>
+
+namespace paintcore {
+
+/**
+ * @brief Decompress qCompress'd 32 bit pixel data a band of rows at a time
+ *
+ * This is used to decode PutImage and CanvasBackground payloads without
+ * inflating the whole image into an intermediate buffer first.
+ *
+ * The first band can be shorter than the others, so that the following bands
+ * line up with tile boundaries.
+ *
+ * If the data turns out to be invalid midway, the bands decoded so far
+ * will already have been passed to the callback.
+ *
+ * @param data compressed image data
+ * @param width image width in pixels
+ * @param height image height in pixels
+ * @param firstBand height of the first band
+ * @param bandHeight height of the subsequent bands
+ * @param func called with the first row's Y coordinate, the number of rows and the pixel data of each band
+ * @return false if the compressed data was invalid or of the wrong length
+ */
+bool inflateImageRows(const QByteArray &data, int width, int height, int firstBand, int bandHeight, std::function<void(int,int,const quint32*)> func);
+
+}
+
+#endif
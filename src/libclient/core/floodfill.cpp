@@ -22,79 +22,114 @@
 #include "layer.h"
 
 #include <QStack>
-#include <QPainter>
-#include <QVarLengthArray>
+#include <QVector>
+
+#include <cstring>
+#include <limits>
 
 namespace paintcore {
 
 namespace {
 
+/**
+ * @brief Test a run of pixels against the seed color
+ *
+ * This is written as a branch free loop over a row so the compiler can
+ * vectorize it. Each output byte is set to 1 if the pixel matches.
+ */
+void matchColorRow(const quint32 *pixels, uchar *out, int len, QRgb seed, int tolerance2)
+{
+	const int sb = seed & 0xff;
+	const int sg = (seed>>8) & 0xff;
+	const int sr = (seed>>16) & 0xff;
+	const int sa = (seed>>24) & 0xff;
+
+	for(int i=0;i<len;++i) {
+		const quint32 c = pixels[i];
+		const int b = int(c & 0xff) - sb;
+		const int g = int((c>>8) & 0xff) - sg;
+		const int r = int((c>>16) & 0xff) - sr;
+		const int a = int((c>>24) & 0xff) - sa;
+		out[i] = (b*b + g*g + r*r + a*a) <= tolerance2;
+	}
+}
+
 class Floodfill {
 public:
+	// Per pixel fill state
+	enum State : uchar {
+		MISMATCH = 0, // not part of the fillable area
+		MATCH = 1,    // fillable, but not filled yet
+		FILLED = 2    // filled
+	};
+
 	Floodfill(const LayerStack *image, int sourceLayer, bool merge, const QColor &color, int colorTolerance, unsigned int sizelimit) :
 		source(image),
-		scratch(0, QString(), Qt::transparent, image->size()),
-		fill(0, QString(), Qt::transparent, image->size()),
+		states(Tile::roundTiles(image->width()) * Tile::roundTiles(image->height())),
+		xtiles(Tile::roundTiles(image->width())),
+		width(image->width()),
+		height(image->height()),
 		layer(sourceLayer),
 		merge(merge),
 		fillColor(color.rgba()),
 		tolerance(colorTolerance),
 		filledSize(0),
-		sizelimit(sizelimit)
+		sizelimit(sizelimit),
+		boundsLeft(width), boundsRight(-1),
+		boundsTop(height), boundsBottom(-1)
 	{ }
 
-	Tile &scratchTile(int x, int y)
+	/**
+	 * @brief Get the source tile
+	 *
+	 * In merge mode, the tile is flattened on demand. Only the tiles the fill
+	 * actually reaches are ever flattened.
+	 */
+	Tile sourceTile(int tx, int ty) const
 	{
-		Tile &t = EditableLayer(&scratch, nullptr, 0).rtile(x, y);
-		if(t.isNull()) {
-			if(merge) {
-				t = source->getFlatTile(x, y);
-			} else {
-				const Layer *sl = source->getLayer(layer);
-				Q_ASSERT(sl);
-				const Tile &st = sl->tile(x, y);
-				if(st.isNull())
-					t = Tile(Qt::transparent);
-				else
-					t = st;
-			}
-		}
+		if(merge)
+			return source->getFlatTile(tx, ty);
 
-		return t;
+		const Layer *sl = source->getLayer(layer);
+		Q_ASSERT(sl);
+		return sl->tile(tx, ty);
 	}
 
-	Tile &fillTile(int x, int y) {
-		Tile &t = EditableLayer(&fill, nullptr, 0).rtile(x, y);
-		if(t.isNull())
-			t = Tile(Qt::transparent);
-
-		return t;
-	}
-
-	QRgb colorAt(int x, int y)
+	/**
+	 * @brief Get the fill state map of a tile
+	 *
+	 * The state map is generated the first time a tile is reached by
+	 * testing each pixel of the source tile against the seed color.
+	 * The source tile itself is not kept around.
+	 */
+	uchar *stateTile(int tx, int ty, const Tile &preloaded=Tile())
 	{
-		int tx = x / Tile::SIZE;
-		int ty = y / Tile::SIZE;
-		x = x - tx * Tile::SIZE;
-		y = y - ty * Tile::SIZE;
+		QByteArray &state = states[ty*xtiles + tx];
+		if(state.isNull()) {
+			const Tile src = preloaded.isNull() ? sourceTile(tx, ty) : preloaded;
 
-		const Tile &t = scratchTile(tx, ty);
+			state = QByteArray(Tile::LENGTH, Qt::Uninitialized);
+			uchar *s = reinterpret_cast<uchar*>(state.data());
 
-		return t.constData()[y*Tile::SIZE + x];
+			if(src.isNull()) {
+				memset(s, isSameColor(0, oldColor) ? MATCH : MISMATCH, Tile::LENGTH);
+			} else {
+				const quint32 *pixels = src.constData();
+				for(int y=0;y<Tile::SIZE;++y)
+					matchColorRow(pixels + y*Tile::SIZE, s + y*Tile::SIZE, Tile::SIZE, oldColor, tolerance*tolerance);
+			}
+		}
+		return reinterpret_cast<uchar*>(state.data());
 	}
 
-	void setPixel(int x, int y) {
-		int tx = x / Tile::SIZE;
-		int ty = y / Tile::SIZE;
-		x = x - tx * Tile::SIZE;
-		y = y - ty * Tile::SIZE;
-
-		int i = y*Tile::SIZE+x;
-		scratchTile(tx, ty).data()[i] = fillColor;
-		fillTile(tx, ty).data()[i] = fillColor;
+	inline uchar &stateAt(int x, int y)
+	{
+		const int tx = x / Tile::SIZE;
+		const int ty = y / Tile::SIZE;
+		return stateTile(tx, ty)[(y - ty*Tile::SIZE) * Tile::SIZE + (x - tx*Tile::SIZE)];
 	}
 
-	bool isSameColor(QRgb c1, QRgb c2) {
+	bool isSameColor(QRgb c1, QRgb c2) const {
 		// TODO better color distance function
 		int r = (c1 & 0xff) - (signed int)(c2 & 0xff);
 		int g = (c1>>8 & 0xff) - (signed int)(c2>>8 & 0xff);
@@ -103,13 +138,88 @@ public:
 		return r*r + g*g + b*b + a*a <= tolerance * tolerance;
 	}
 
-	inline bool isOldColorAt(int x, int y) {
-		return isSameColor(colorAt(x, y), oldColor);
+	/**
+	 * @brief Fill the horizontal span containing the given pixel
+	 *
+	 * The span is extended left and right a tile row segment at a time.
+	 *
+	 * @param x pixel in the span
+	 * @param y span row
+	 * @param left receives the leftmost filled pixel
+	 * @param right receives the rightmost filled pixel
+	 */
+	void fillSpan(int x, int y, int &left, int &right)
+	{
+		const int ty = y / Tile::SIZE;
+		const int row = (y - ty*Tile::SIZE) * Tile::SIZE;
+
+		// Extend left
+		left = x;
+		while(left > 0) {
+			const int tx = (left-1) / Tile::SIZE;
+			const uchar *s = stateTile(tx, ty) + row - tx*Tile::SIZE;
+			const int tileLeft = tx * Tile::SIZE;
+			while(left > tileLeft && s[left-1] == MATCH)
+				--left;
+			if(left > tileLeft)
+				break;
+		}
+
+		// Extend right
+		right = x;
+		while(right < width-1) {
+			const int tx = (right+1) / Tile::SIZE;
+			const uchar *s = stateTile(tx, ty) + row - tx*Tile::SIZE;
+			const int tileRight = qMin(width, (tx+1) * Tile::SIZE) - 1;
+			while(right < tileRight && s[right+1] == MATCH)
+				++right;
+			if(right < tileRight)
+				break;
+		}
+
+		// Mark the span as filled
+		for(int tx=left/Tile::SIZE;tx<=right/Tile::SIZE;++tx) {
+			uchar *s = stateTile(tx, ty) + row - tx*Tile::SIZE;
+			const int x0 = qMax(left, tx*Tile::SIZE);
+			const int x1 = qMin(right, (tx+1)*Tile::SIZE-1);
+			memset(s + x0, FILLED, x1 - x0 + 1);
+		}
+
+		filledSize += right - left + 1;
+
+		boundsLeft = qMin(boundsLeft, left);
+		boundsRight = qMax(boundsRight, right);
+		boundsTop = qMin(boundsTop, y);
+		boundsBottom = qMax(boundsBottom, y);
+	}
+
+	/**
+	 * @brief Find unfilled spans on a row adjacent to a filled span
+	 */
+	void scanRow(QStack<QPoint> &stack, int left, int right, int y)
+	{
+		if(y<0 || y>=height)
+			return;
+
+		bool inSpan = false;
+		for(int x=left;x<=right;++x) {
+			const bool match = stateAt(x, y) == MATCH;
+			if(match && !inSpan)
+				stack.push(QPoint(x, y));
+			inSpan = match;
+		}
 	}
 
 	void start(const QPoint &startPoint)
 	{
-		oldColor = colorAt(startPoint.x(), startPoint.y());
+		const int tx = startPoint.x() / Tile::SIZE;
+		const int ty = startPoint.y() / Tile::SIZE;
+		const int px = startPoint.x() - tx * Tile::SIZE;
+		const int py = startPoint.y() - ty * Tile::SIZE;
+
+		const Tile seedTile = sourceTile(tx, ty);
+		oldColor = seedTile.pixel(px, py);
+
 		if(qAlpha(fillColor) == 0) {
 			// Transparent fill: assign fill color to some other color
 			// than the starting point, unless it's transparent
@@ -130,61 +240,75 @@ public:
 		{
 			const Layer *sl = source->getLayer(layer);
 			Q_ASSERT(sl);
-
-			const int tx = startPoint.x() / Tile::SIZE;
-			const int ty = startPoint.y() / Tile::SIZE;
-			const int x = startPoint.x() - tx * Tile::SIZE;
-			const int y = startPoint.y() - ty * Tile::SIZE;
-
-			layerSeedColor = sl->tile(tx, ty).pixel(x, y);
+			layerSeedColor = sl->tile(tx, ty).pixel(px, py);
 		}
 
+		// Prime the seed tile's state map with the tile we already have
+		stateTile(tx, ty, seedTile);
+
 		QStack<QPoint> stack;
 		stack.push(startPoint);
 
-		const int w1 = scratch.width()-1;
-
 		while(!stack.isEmpty() && filledSize < sizelimit) {
-			QPoint p = stack.pop();
+			const QPoint p = stack.pop();
+
+			if(stateAt(p.x(), p.y()) != MATCH)
+				continue;
+
+			int left, right;
+			fillSpan(p.x(), p.y(), left, right);
+
+			scanRow(stack, left, right, p.y()-1);
+			scanRow(stack, left, right, p.y()+1);
+		}
+	}
+
+	FillResult result() const
+	{
+		FillResult res;
+		res.layerSeedColor = layerSeedColor;
+		res.oversize = filledSize >= sizelimit;
+
+		if(boundsRight < 0)
+			return res;
 
-			const int x = p.x();
-			int y = p.y();
+		const QRect bounds(QPoint(boundsLeft, boundsTop), QPoint(boundsRight, boundsBottom));
 
-			bool spanLeft = false;
-			bool spanRight = false;
+		res.x = bounds.x();
+		res.y = bounds.y();
+		res.image = QImage(bounds.size(), QImage::Format_ARGB32_Premultiplied);
+		res.image.fill(0);
 
-			while(y>=0 && isOldColorAt(x, y)) --y;
-			++y;
+		// Only tiles the fill reached have a state map
+		const int tx0 = bounds.left() / Tile::SIZE;
+		const int tx1 = bounds.right() / Tile::SIZE;
+		const int ty0 = bounds.top() / Tile::SIZE;
+		const int ty1 = bounds.bottom() / Tile::SIZE;
 
-			while(y < scratch.height() && isOldColorAt(x, y)) {
-				setPixel(x, y);
-				++filledSize;
+		for(int ty=ty0;ty<=ty1;++ty) {
+			const int y0 = qMax(bounds.top(), ty*Tile::SIZE);
+			const int y1 = qMin(bounds.bottom(), (ty+1)*Tile::SIZE-1);
 
-				if(!spanLeft && x>0 && isOldColorAt(x-1, y)) {
-					stack.push(QPoint(x-1, y));
-					spanLeft = true;
+			for(int tx=tx0;tx<=tx1;++tx) {
+				const QByteArray &state = states.at(ty*xtiles + tx);
+				if(state.isNull())
+					continue;
 
-				} else if(spanLeft && x>0 && !isOldColorAt(x-1, y)) {
-					spanLeft = false;
+				const int x0 = qMax(bounds.left(), tx*Tile::SIZE);
+				const int x1 = qMin(bounds.right(), (tx+1)*Tile::SIZE-1);
+				const int len = x1 - x0 + 1;
 
-				} else if(!spanRight && x<w1 && isOldColorAt(x+1, y)) {
-					stack.push(QPoint(x+1, y));
-					spanRight = true;
+				for(int y=y0;y<=y1;++y) {
+					const uchar *s = reinterpret_cast<const uchar*>(state.constData())
+						+ (y - ty*Tile::SIZE) * Tile::SIZE + (x0 - tx*Tile::SIZE);
+					quint32 *dest = reinterpret_cast<quint32*>(res.image.scanLine(y - bounds.top())) + (x0 - bounds.left());
 
-				} else if(spanRight && x<w1 && !isOldColorAt(x+1, y)) {
-					spanRight = false;
+					for(int i=0;i<len;++i)
+						dest[i] = s[i] == FILLED ? fillColor : 0;
 				}
-				++y;
 			}
 		}
-	}
 
-	FillResult result() const
-	{
-		FillResult res;
-		res.image = fill.toCroppedImage(&res.x, &res.y);
-		res.layerSeedColor = layerSeedColor;
-		res.oversize = filledSize >= sizelimit;
 		return res;
 	}
 
@@ -192,12 +316,10 @@ private:
 
 	const LayerStack *source;
 
-	// The (optionally) merged tile from the image. This layer is also
-	// updated during the fill.
-	Layer scratch;
-
-	// The fill layer, containing just the filled pixels
-	Layer fill;
+	// Fill state maps of the tiles reached so far (null if not yet reached)
+	QVector<QByteArray> states;
+	int xtiles;
+	int width, height;
 
 	// Target layer
 	int layer;
@@ -210,7 +332,7 @@ private:
 
 	// Seed color
 	QRgb oldColor;
-	QRgb layerSeedColor;
+	QRgb layerSeedColor = 0;
 
 	// Color matching tolerance
 	int tolerance;
@@ -218,6 +340,10 @@ private:
 	// Maximum number of pixels to fill
 	unsigned int filledSize;
 	unsigned int sizelimit;
+
+	// Bounding rectangle of the filled pixels
+	int boundsLeft, boundsRight;
+	int boundsTop, boundsBottom;
 };
 
 /**
@@ -234,8 +360,8 @@ QRect findOpaqueBoundingRect(const QImage &image)
 	int top=image.height(), bottom=0;
 	int left=image.width(), right=0;
 
-	const uchar *alpha = image.bits()+3;
 	for(int y=0;y<image.height();++y) {
+		const uchar *alpha = image.constScanLine(y)+3;
 		for(int x=0;x<image.width();++x, alpha+=4) {
 			if(*alpha) {
 				if(x<left)
@@ -255,6 +381,53 @@ QRect findOpaqueBoundingRect(const QImage &image)
 	return QRect(QPoint(left, top), QPoint(right, bottom));
 }
 
+/**
+ * @brief One dimensional squared distance transform threshold
+ *
+ * This is the lower envelope of parabolas algorithm by Felzenszwalb & Huttenlocher.
+ * Instead of returning the distances, a pixel is written to the output
+ * for each position whose squared distance is at most maxDist2.
+ *
+ * @param f squared column distances of this row
+ * @param n row length
+ * @param maxDist2 squared distance threshold
+ * @param out output row
+ * @param color color to write
+ * @param v scratch buffer of length n
+ * @param z scratch buffer of length n+1
+ */
+void dilateRow(const int *f, int n, int maxDist2, quint32 *out, QRgb color, int *v, double *z)
+{
+	int k = 0;
+	v[0] = 0;
+	z[0] = -std::numeric_limits<double>::infinity();
+	z[1] = std::numeric_limits<double>::infinity();
+
+	for(int q=1;q<n;++q) {
+		double s;
+		while(true) {
+			const int p = v[k];
+			s = ((f[q] + double(q)*q) - (f[p] + double(p)*p)) / (2.0*q - 2.0*p);
+			if(s > z[k])
+				break;
+			--k;
+		}
+		++k;
+		v[k] = q;
+		z[k] = s;
+		z[k+1] = std::numeric_limits<double>::infinity();
+	}
+
+	k = 0;
+	for(int q=0;q<n;++q) {
+		while(z[k+1] < q)
+			++k;
+		const qint64 dx = q - v[k];
+		if(dx*dx + f[v[k]] <= maxDist2)
+			out[q] = color;
+	}
+}
+
 }
 
 FillResult floodfill(const LayerStack *image, const QPoint &point, const QColor &color, int tolerance, int layer, bool merge, unsigned int sizelimit)
@@ -280,100 +453,77 @@ FillResult expandFill(const FillResult &input, int expansion, const QColor &colo
 
 	Q_ASSERT(input.image.format() == QImage::Format_ARGB32_Premultiplied);
 
-	FillResult out;
-
-	out.layerSeedColor = input.layerSeedColor;
-
 	const int R = expansion;
-	const int D = R*2 + 1;
 
-	// Step 1. Pad image to make sure there is room for expansion
-	QRect BOUNDS = findOpaqueBoundingRect(input.image);
+	// Step 1. Find the area the expanded fill can cover.
+	// The area is cropped at the canvas origin, since the protocol
+	// doesn't support signed PutImage coordinates.
+	const QRect BOUNDS = findOpaqueBoundingRect(input.image);
 	if(BOUNDS.isEmpty())
 		return input;
 
-	QImage inputImg;
-	if(QRect(0, 0, input.image.width(), input.image.height()).contains(BOUNDS.adjusted(-D,-D,D,D))) {
-		// Original image has enough padding around the content
-		inputImg = input.image;
-		out.x = input.x;
-		out.y = input.y;
-
-	} else {
-		// Not enough padding: add some
-		inputImg = QImage(input.image.width() + 2*D, input.image.height() + 2*D, input.image.format());
-		inputImg.fill(0);
+	QRect area = BOUNDS.adjusted(-R, -R, R, R);
+	if(input.x + area.left() < 0)
+		area.setLeft(-input.x);
+	if(input.y + area.top() < 0)
+		area.setTop(-input.y);
 
-		QPainter p(&inputImg);
-		p.drawImage(D, D, input.image);
-
-		out.x = input.x - D;
-		out.y = input.y - D;
-		BOUNDS.translate(D, D);
-	}
-
-	// Step 2. Generate convolution matrix for expanding the alpha channel
-	QVarLengthArray<int> kernel(D*D);
-	int i=0;
-	const int RR = R*R;
-	for(int y=0;y<D;++y) {
-		const int y0 = y-R;
-		for(int x=0;x<D;++x) {
-			const int x0 = x-R;
-			// TODO use a gaussian kernel?
-			kernel[i++] = x0*x0 + y0*y0 <= RR;
-		}
-	}
-	Q_ASSERT(i==kernel.length());
+	const int W = area.width();
+	const int H = area.height();
 
-	// Step 3. Generate expanded image
-	out.image = QImage(inputImg.width(), inputImg.height(), inputImg.format());
+	FillResult out;
+	out.layerSeedColor = input.layerSeedColor;
+	out.x = input.x + area.left();
+	out.y = input.y + area.top();
+	out.image = QImage(W, H, QImage::Format_ARGB32_Premultiplied);
 	out.image.fill(0);
 
-	const uchar *alphaIn = inputImg.bits()+3;
-	const QRgb fillColor = color.rgba();
-	quint32 *colorOut = reinterpret_cast<quint32*>(out.image.bits());
-
-	// Optimization: skip extra padding
-	QRect expBounds = BOUNDS.adjusted(-R, -R, R+1, R+1);
-	Q_ASSERT(QRect(0, 0, inputImg.width(), inputImg.height()).contains(expBounds));
-
-	for(int y=expBounds.top();y<expBounds.bottom();++y) {
-		for(int x=expBounds.left();x<expBounds.right();++x) {
-			int i=0, a=0;
-			for(int ky=y-R;ky<=y+R;++ky) {
-				for(int kx=x-R;kx<=x+R;++kx) {
-					a += alphaIn[ky*inputImg.bytesPerLine() + 4*kx] * kernel[i++];
-				}
-			}
-			Q_ASSERT(i==kernel.length());
-
-			// TODO adjustable threshold
-			if(a>0) {
-				int j = y*inputImg.width() + x;
-				Q_ASSERT(j <= out.image.width() * out.image.height());
-				colorOut[j] = fillColor;
-			}
+	// Step 2. Vertical pass: distance to the nearest filled pixel in the same column.
+	// Distances beyond the expansion radius can never be part of the
+	// result, so they're capped at R+1.
+	const int CAP = R + 1;
+	QVector<int> coldist(W * H);
+
+	auto isFilled = [&input, &area](int x, int y) -> bool {
+		x += area.left();
+		y += area.top();
+		if(x<0 || y<0 || x>=input.image.width() || y>=input.image.height())
+			return false;
+		return qAlpha(reinterpret_cast<const QRgb*>(input.image.constScanLine(y))[x]) > 0;
+	};
+
+	for(int x=0;x<W;++x) {
+		int d = CAP;
+		for(int y=0;y<H;++y) {
+			d = isFilled(x, y) ? 0 : qMin(d+1, CAP);
+			coldist[y*W+x] = d;
+		}
+		d = CAP;
+		for(int y=H-1;y>=0;--y) {
+			int &c = coldist[y*W+x];
+			d = c==0 ? 0 : qMin(d+1, CAP);
+			if(d < c)
+				c = d;
 		}
 	}
 
-	// Step 4. Crop image in case of negative offset
-	// (since the protocol doesn't support signed PutImage coordinates)
-	if(out.x<0 || out.y<0) {
-		const int cropx = out.x<0 ? -out.x : 0;
-		const int cropy = out.y<0 ? -out.y : 0;
-
-		Q_ASSERT(cropx < out.image.width());
-		Q_ASSERT(cropy < out.image.height());
+	for(int i=0;i<coldist.size();++i)
+		coldist[i] = coldist[i] * coldist[i];
 
-		QImage cropped = QImage(out.image.width() - cropx, out.image.height() - cropy, out.image.format());
-		for(int y=0;y<cropped.height();++y) {
-			memcpy(cropped.scanLine(y), out.image.scanLine(y+cropy) + cropx*4, cropped.width() * 4);
-		}
+	// Step 3. Horizontal pass: exact euclidean distance transform of each row.
+	// A pixel is included if its distance to the fill is within the radius,
+	// which is equivalent to dilating with a circular kernel.
+	QVector<int> v(W);
+	QVector<double> z(W+1);
+	const QRgb fillColor = color.rgba();
 
-		out.image = cropped;
-		out.x += cropx;
-		out.y += cropy;
+	for(int y=0;y<H;++y) {
+		dilateRow(
+			coldist.constData() + y*W, W, R*R,
+			reinterpret_cast<quint32*>(out.image.scanLine(y)),
+			fillColor,
+			v.data(), z.data()
+		);
 	}
 
 	// All done!
@@ -26,6 +26,7 @@
 #include "blendmodes.h"
 #include "rasterop.h"
 #include "concurrent.h"
+#include "resampler.h"
 
 #include <QPainter>
 #include <QImage>
@@ -38,6 +39,19 @@ namespace paintcore {
 
 namespace {
 
+//! A reference to a tile to be processed concurrently
+struct TileRef {
+	Tile *tile;
+	int x;
+	int y;
+};
+
+//! A pair of tiles to be merged concurrently
+struct TileMerge {
+	Tile *target;
+	const Tile *source;
+};
+
 //! Sample colors at layer edges and return the most frequent color
 QColor _sampleEdgeColors(const Layer *layer, bool top, bool right, bool bottom, bool left)
 {
@@ -112,10 +126,8 @@ Layer::Layer(int id, const QString& title, const QColor& color, const QSize& siz
 	  m_xtiles(Tile::roundTiles(size.width())),
 	  m_ytiles(Tile::roundTiles(size.height()))
 {
-	m_tiles = QVector<Tile>(
-		m_xtiles * m_ytiles,
-		color.alpha() > 0 ? Tile(color) : Tile()
-	);
+	if(color.alpha() > 0)
+		m_tiles.fill(Tile(color), m_xtiles, m_ytiles);
 }
 
 Layer::Layer(int id, const QSize &size)
@@ -126,17 +138,18 @@ Layer::Layer(int id, const QSize &size)
 
 Layer::Layer(const QVector<Tile> &tiles, const QSize &size, const LayerInfo &info, const QList<Layer*> sublayers)
 	: m_info(info),
-	  m_tiles(tiles),
 	  m_sublayers(sublayers),
 	  m_width(size.width()),
 	  m_height(size.height()),
 	  m_xtiles(Tile::roundTiles(size.width())),
 	  m_ytiles(Tile::roundTiles(size.height()))
 {
-	if(m_xtiles * m_ytiles != m_tiles.size()) {
+	if(m_xtiles * m_ytiles != tiles.size())
 		qWarning("Layer constructor: tile vector size mismatch!");
-		m_tiles.resize(m_xtiles * m_ytiles);
-	}
+
+	const int count = qMin(tiles.size(), m_xtiles * m_ytiles);
+	for(int i=0;i<count;++i)
+		m_tiles.set(i % m_xtiles, i / m_xtiles, tiles.at(i));
 }
 
 Layer::Layer(const Layer &layer)
@@ -162,35 +175,40 @@ Layer::~Layer() {
 
 QImage Layer::toImage() const {
 	QImage image(m_width, m_height, QImage::Format_ARGB32_Premultiplied);
-	int i=0;
 	for(int y=0;y<m_ytiles;++y) {
-		for(int x=0;x<m_xtiles;++x,++i)
-			m_tiles[i].copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
+		for(int x=0;x<m_xtiles;++x)
+			m_tiles.at(x, y).copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
 	}
 	return image;
 }
 
+QVector<Tile> Layer::tiles() const
+{
+	QVector<Tile> tiles(m_xtiles * m_ytiles);
+	m_tiles.forEach([&tiles, this](int x, int y, const Tile &t) {
+		tiles[y*m_xtiles + x] = t;
+	});
+	return tiles;
+}
+
 QImage Layer::toCroppedImage(int *xOffset, int *yOffset) const
 {
 	int top=m_ytiles, bottom=0;
 	int left=m_xtiles, right=0;
 
 	// Find bounding rectangle of non-blank tiles
-	for(int y=0;y<m_ytiles;++y) {
-		for(int x=0;x<m_xtiles;++x) {
-			const Tile &t = m_tiles.at(y*m_xtiles + x);
-			if(!t.isBlank()) {
-				if(x<left)
-					left=x;
-				if(x>right)
-					right=x;
-				if(y<top)
-					top=y;
-				if(y>bottom)
-					bottom=y;
-			}
+	m_tiles.forEach([&](int x, int y, const Tile &t) {
+		if(!t.isBlank()) {
+			if(x<left)
+				left=x;
+			if(x>right)
+				right=x;
+			if(y<top)
+				top=y;
+			if(y>bottom)
+				bottom=y;
 		}
-	}
+	});
 
 	if(top==m_ytiles) {
 		// Entire layer appears to be blank
@@ -201,7 +219,7 @@ QImage Layer::toCroppedImage(int *xOffset, int *yOffset) const
 	QImage image((right-left+1)*Tile::SIZE, (bottom-top+1)*Tile::SIZE, QImage::Format_ARGB32_Premultiplied);
 	for(int y=top;y<=bottom;++y) {
 		for(int x=left;x<=right;++x) {
-			m_tiles.at(y*m_xtiles+x).copyToImage(image, (x-left)*Tile::SIZE, (y-top)*Tile::SIZE);
+			m_tiles.at(x, y).copyToImage(image, (x-left)*Tile::SIZE, (y-top)*Tile::SIZE);
 		}
 	}
 
@@ -365,9 +383,7 @@ QColor Layer::getDabColor(const BrushStamp &stamp) const
 			const int xindex = x / Tile::SIZE;
 			const int xt = x - xindex * Tile::SIZE;
 			const int wb = xt+dia-xb < Tile::SIZE ? dia-xb : Tile::SIZE-xt;
-			const int i = m_xtiles * yindex + xindex;
-
-			std::array<quint32, 5> avg = m_tiles.at(i).weightedAverage(weights + yb * dia + xb, xt, yt, wb, hb, dia-wb);
+			std::array<quint32, 5> avg = m_tiles.at(xindex, yindex).weightedAverage(weights + yb * dia + xb, xt, yt, wb, hb, dia-wb);
 			weight += avg[0];
 			red += avg[1];
 			green += avg[2];
@@ -405,10 +421,7 @@ QColor Layer::getDabColor(const BrushStamp &stamp) const
 void Layer::optimize()
 {
 	// Optimize tile memory usage
-	for(int i=0;i<m_tiles.size();++i) {
-		if(!m_tiles[i].isNull() && m_tiles[i].isBlank())
-			m_tiles[i] = Tile();
-	}
+	m_tiles.removeBlank();
 
 	// Delete unused sublayers
 	QMutableListIterator<Layer*> li(m_sublayers);
@@ -430,7 +443,7 @@ Layer *Layer::getSubLayer(int id, BlendMode::Mode blendmode, uchar opacity)
 		if(sl->id() == id) {
 			if(sl->isHidden()) {
 				// Hidden, reset properties
-				sl->m_tiles.fill(Tile());
+				sl->m_tiles.clear();
 				sl->m_info.opacity = opacity;
 				sl->m_info.blend = blendmode;
 				sl->m_info.hidden = false;
@@ -444,7 +457,7 @@ Layer *Layer::getSubLayer(int id, BlendMode::Mode blendmode, uchar opacity)
 		if(sl->isHidden()) {
 			// Set these flags directly to avoid markDirty call.
 			// We know the layer is invisible at this point
-			sl->m_tiles.fill(Tile());
+			sl->m_tiles.clear();
 			sl->m_info.id = id;
 			sl->m_info.opacity = opacity;
 			sl->m_info.blend = blendmode;
@@ -474,7 +487,8 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 {
 	Q_ASSERT(d);
 
-	// Minimize amount of data that needs to be copied
+	// Minimize amount of data that needs to be copied.
+	// (Only the tiles that exist are scanned, since the tile map is sparse.)
 	d->optimize();
 
 	// Resize sublayers
@@ -487,22 +501,13 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 
 	int xtiles = Tile::roundTiles(width);
 	int ytiles = Tile::roundTiles(height);
-	QVector<Tile> tiles(xtiles * ytiles);
 
 	// if there is no old content, resizing is simple
-	bool hascontent = false;
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!d->m_tiles.at(i).isBlank()) {
-			hascontent = true;
-			break;
-		}
-	}
-	if(!hascontent) {
+	if(d->m_tiles.isEmpty()) {
 		d->m_width = width;
 		d->m_height = height;
 		d->m_xtiles = xtiles;
 		d->m_ytiles = ytiles;
-		d->m_tiles = tiles;
 		return;
 	}
 
@@ -518,14 +523,12 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 	if((left % Tile::SIZE) || (top % Tile::SIZE)) {
 		// If top/left adjustment is not divisble by tile size,
 		// we need to move the layer content
-
 		QImage oldcontent = d->toImage();
 
 		d->m_width = width;
 		d->m_height = height;
 		d->m_xtiles = xtiles;
 		d->m_ytiles = ytiles;
-		d->m_tiles = tiles;
 		if(left<0 || top<0) {
 			int cropx = 0;
 			if(left<0) {
@@ -540,7 +543,7 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 			oldcontent = oldcontent.copy(cropx, cropy, oldcontent.width()-cropx, oldcontent.height()-cropy);
 		}
 
-		d->m_tiles.fill(bgtile);
+		d->m_tiles.fill(bgtile, xtiles, ytiles);
 
 		// temporarily set the hidden flag, because markDirty must not
 		// be called during a resize operation.
@@ -551,34 +554,33 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 
 	} else {
 		// top/left offset is aligned at tile boundary:
-		// existing tile content can be reused
-
-		const int firstrow = Tile::roundTiles(-top);
-		const int firstcol = Tile::roundTiles(-left);
-
-		int oldy = firstrow;
-		for(int y=0;y<ytiles;++y,++oldy) {
-			int oldx = firstcol;
-			const int oldyy = d->m_xtiles * oldy;
-			const int yy = xtiles * y;
-			for(int x=0;x<xtiles;++x,++oldx) {
-				const int i = yy + x;
-
-				if(oldy<0 || oldy>=d->m_ytiles || oldx<0 || oldx>=d->m_xtiles) {
-					tiles[i] = bgtile;
-
-				} else {
-					const int oldi = oldyy + oldx;
-					tiles[i] = d->m_tiles.at(oldi);
-				}
-			}
+		// existing tiles can just be shifted in place.
+		const int dx = left / Tile::SIZE;
+		const int dy = top / Tile::SIZE;
+		const int oldxtiles = d->m_xtiles;
+		const int oldytiles = d->m_ytiles;
+
+		d->m_tiles.translate(dx, dy);
+
+		// Only a shrinking layer has tiles that fall outside the new bounds
+		if(top<0 || right<0 || bottom<0 || left<0)
+			d->m_tiles.crop(xtiles, ytiles);
+
+		// Fill the newly exposed area with the sampled background color
+		if(!bgtile.isNull()) {
+			const int oldTop = qMax(0, dy);
+			const int oldBottom = qMin(ytiles, dy + oldytiles) - 1;
+
+			d->m_tiles.fillRect(bgtile, 0, 0, xtiles-1, oldTop-1);
+			d->m_tiles.fillRect(bgtile, 0, oldBottom+1, xtiles-1, ytiles-1);
+			d->m_tiles.fillRect(bgtile, 0, oldTop, dx-1, oldBottom);
+			d->m_tiles.fillRect(bgtile, dx + oldxtiles, oldTop, xtiles-1, oldBottom);
 		}
 
 		d->m_width = width;
 		d->m_height = height;
 		d->m_xtiles = xtiles;
 		d->m_ytiles = ytiles;
-		d->m_tiles = tiles;
 	}
 }
 
@@ -680,6 +682,107 @@ void EditableLayer::putImage(int x, int y, QImage image, BlendMode::Mode mode)
 		OBSERVERS(markDirty(QRect(x, y, image.width(), image.height())));
 }
 
+void EditableLayer::putImageRows(int x, int y, int w, int h, const quint32 *pixels, BlendMode::Mode mode)
+{
+	Q_ASSERT(d);
+
+	const QRect rect = QRect(x, y, w, h).intersected(QRect(0, 0, d->m_width, d->m_height));
+	if(rect.isEmpty())
+		return;
+
+	// Create the tile entries up front, so the tile map is not modified
+	// while the tiles are processed concurrently
+	QList<TileRef> tiles;
+	for(int ty=rect.top()/Tile::SIZE;ty<=rect.bottom()/Tile::SIZE;++ty) {
+		for(int tx=rect.left()/Tile::SIZE;tx<=rect.right()/Tile::SIZE;++tx)
+			tiles << TileRef { &d->rtile(tx, ty), tx, ty };
+	}
+
+	concurrentForEach<TileRef>(tiles, [this, &rect, pixels, x, y, w, mode](TileRef ref) {
+		const QRect tr = QRect(ref.x * Tile::SIZE, ref.y * Tile::SIZE, Tile::SIZE, Tile::SIZE).intersected(rect);
+		const int offset = (tr.y() - ref.y * Tile::SIZE) * Tile::SIZE + (tr.x() - ref.x * Tile::SIZE);
+		const quint32 *src = pixels + (tr.y() - y) * w + (tr.x() - x);
+
+		if(mode == BlendMode::MODE_REPLACE) {
+			// Replace mode is special: layer merge can't distinguish
+			// padding from image transparency, so pixels are copied directly
+			quint32 *dest = ref.tile->data() + offset;
+			for(int row=0;row<tr.height();++row) {
+				memcpy(dest, src, tr.width() * sizeof(quint32));
+				dest += Tile::SIZE;
+				src += w;
+			}
+			ref.tile->setLastEditedBy(contextId);
+
+		} else {
+			Tile t;
+			quint32 *dest = t.data() + offset;
+			for(int row=0;row<tr.height();++row) {
+				memcpy(dest, src, tr.width() * sizeof(quint32));
+				dest += Tile::SIZE;
+				src += w;
+			}
+			t.setLastEditedBy(contextId);
+			ref.tile->merge(t, 255, mode);
+		}
+	});
+
+	if(owner && d->isVisible())
+		OBSERVERS(markDirty(rect));
+}
+
+/**
+ * The image is resampled directly into the layer's tiles, so no
+ * intermediate full size image is needed. Tiles are processed in parallel.
+ *
+ * @param resampler the transformation to apply
+ * @param mode blending/compositing mode
+ */
+void EditableLayer::putTransformedImage(const Resampler &resampler, BlendMode::Mode mode)
+{
+	Q_ASSERT(d);
+	Q_ASSERT(resampler.isValid());
+
+	const QRect bounds = resampler.bounds().intersected(QRect(0, 0, d->m_width, d->m_height));
+	if(bounds.isEmpty())
+		return;
+
+	const int tx0 = bounds.left() / Tile::SIZE;
+	const int tx1 = bounds.right() / Tile::SIZE;
+	const int ty0 = bounds.top() / Tile::SIZE;
+	const int ty1 = bounds.bottom() / Tile::SIZE;
+
+	// Create the tile entries up front, so the tile map is not modified
+	// while the tiles are processed concurrently
+	QList<TileRef> tiles;
+	for(int ty=ty0;ty<=ty1;++ty) {
+		for(int tx=tx0;tx<=tx1;++tx)
+			tiles << TileRef { &d->rtile(tx, ty), tx, ty };
+	}
+
+	concurrentForEach<TileRef>(tiles, [this, &resampler, &bounds, mode](TileRef ref) {
+		const int tx = ref.x * Tile::SIZE;
+		const int ty = ref.y * Tile::SIZE;
+		const QRect r = QRect(tx, ty, Tile::SIZE, Tile::SIZE).intersected(bounds);
+
+		Tile t;
+		quint32 *pixels = t.data() + (r.y() - ty) * Tile::SIZE + (r.x() - tx);
+		if(resampler.resample(pixels, r.x(), r.y(), r.width(), r.height(), Tile::SIZE)) {
+			t.setLastEditedBy(contextId);
+			ref.tile->merge(t, 255, mode);
+		}
+	});
+
+	// Drop the entries of tiles the image didn't touch
+	for(const TileRef &ref : tiles) {
+		if(ref.tile->isNull())
+			d->m_tiles.set(ref.x, ref.y, Tile());
+	}
+
+	if(owner && d->isVisible())
+		OBSERVERS(markDirty(bounds));
+}
+
 void EditableLayer::putTile(int col, int row, int repeat, const Tile &tile, int sublayer)
 {
 	Q_ASSERT(d);
@@ -694,9 +797,9 @@ void EditableLayer::putTile(int col, int row, int repeat, const Tile &tile, int
 	}
 
 	int i=row*d->m_xtiles+col;
-	const int end = qMin(i+repeat, d->m_tiles.size()-1);
+	const int end = qMin(i+repeat, d->m_xtiles*d->m_ytiles-1);
 	for(;i<=end;++i) {
-		d->m_tiles[i] = tile;
+		d->m_tiles.set(i % d->m_xtiles, i / d->m_xtiles, tile);
 		if(owner && d->isVisible())
 			OBSERVERS(markDirty(i));
 	}
@@ -708,7 +811,7 @@ void EditableLayer::fillRect(const QRect &rectangle, const QColor &color, BlendM
 
 	if(rectangle.contains(canvas) && (blendmode==BlendMode::MODE_REPLACE || (blendmode==BlendMode::MODE_NORMAL && color.alpha() == 255))) {
 		// Special case: overwrite whole layer
-		d->m_tiles.fill(Tile(color));
+		d->m_tiles.fill(Tile(color), d->m_xtiles, d->m_ytiles);
 
 	} else {
 		// The usual case: only a portion of the layer is filled or pixel blending is needed
@@ -742,11 +845,13 @@ void EditableLayer::fillRect(const QRect &rectangle, const QColor &color, BlendM
 				int w = qMin((tx+1)*size, right) - tx*size - left;
 				int h = qMin((ty+1)*size, bottom) - ty*size - top;
 
-				Tile &t = d->m_tiles[ty*d->m_xtiles+tx];
-				t.setLastEditedBy(contextId);
+				// Don't create entries for tiles that stay empty
+				if(!canIncrOpacity && d->m_tiles.at(tx, ty).isNull())
+					continue;
 
-				if(!t.isNull() || canIncrOpacity)
-					t.composite(blendmode, mask, color, left, top, w, h, 0);
+				Tile &t = d->rtile(tx, ty);
+				t.setLastEditedBy(contextId);
+				t.composite(blendmode, mask, color, left, top, w, h, 0);
 			}
 		}
 	}
@@ -784,8 +889,8 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 			const int xindex = x / Tile::SIZE;
 			const int xt = x - xindex * Tile::SIZE;
 			const int wb = xt+dia-xb < Tile::SIZE ? dia-xb : Tile::SIZE-xt;
-			const int i = d->m_xtiles * yindex + xindex;
-			d->m_tiles[i].composite(
+			Tile &t = d->rtile(xindex, yindex);
+			t.composite(
 					blendmode,
 					values + yb * dia + xb,
 					color,
@@ -793,7 +898,7 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 					wb, hb,
 					dia-wb
 					);
-			d->m_tiles[i].setLastEditedBy(contextId);
+			t.setLastEditedBy(contextId);
 
 			x = (xindex+1) * Tile::SIZE;
 			xb = xb + wb;
@@ -820,20 +925,18 @@ void EditableLayer::merge(const Layer *layer)
 	Q_ASSERT(layer->m_xtiles == d->m_xtiles);
 	Q_ASSERT(layer->m_ytiles == d->m_ytiles);
 
-	// Gather a list of non-null source tiles to merge
-	QList<int> mergeidx;
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!layer->m_tiles.at(i).isNull())
-			mergeidx.append(i);
-	}
-
-	// Detach tile vector explicitly to make sure concurrent modifications
-	// are all done to the same vector
-	d->m_tiles.detach();
+	// Gather a list of non-null source tiles to merge.
+	// The target tile entries are created here, so the tile map is
+	// not modified during the concurrent merge.
+	QList<TileMerge> merges;
+	layer->m_tiles.forEach([this, &merges](int x, int y, const Tile &t) {
+		if(!t.isNull())
+			merges << TileMerge { &d->rtile(x, y), &t };
+	});
 
 	// Merge tiles
-	concurrentForEach<int>(mergeidx, [this, layer](int idx) {
-		d->m_tiles[idx].merge(layer->m_tiles.at(idx), layer->opacity(), layer->blendmode());
+	concurrentForEach<TileMerge>(merges, [layer](TileMerge m) {
+		m.target->merge(*m.source, layer->opacity(), layer->blendmode());
 	});
 
 	// Merging a layer does not cause an immediate visual change, so we don't
@@ -843,7 +946,7 @@ void EditableLayer::merge(const Layer *layer)
 void EditableLayer::makeBlank()
 {
 	Q_ASSERT(d);
-	d->m_tiles.fill(Tile());
+	d->m_tiles.clear();
 
 	if(owner && d->isVisible())
 		OBSERVERS(markDirty());
@@ -918,10 +1021,10 @@ void EditableLayer::markOpaqueDirty(bool forceVisible)
 	if(!owner || !(forceVisible || d->isVisible()))
 		return;
 
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!d->m_tiles.at(i).isNull())
-			OBSERVERS(markDirty(i));
-	}
+	d->m_tiles.forEach([this](int x, int y, const Tile &t) {
+		if(!t.isNull())
+			OBSERVERS(markDirty(y * d->m_xtiles + x));
+	});
 }
 
 }
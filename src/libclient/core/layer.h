@@ -20,6 +20,7 @@
 #define PAINTCORE_LAYER_H
 
 #include "tile.h"
+#include "tilemap.h"
 
 #include <QVector>
 #include <QColor>
@@ -35,6 +36,7 @@ class Brush;
 struct BrushStamp;
 class Point;
 class LayerStack;
+class Resampler;
 struct StrokeState;
 
 /**
@@ -167,11 +169,11 @@ public:
 	const Tile &tile(int x, int y) const {
 		Q_ASSERT(x>=0 && x<m_xtiles);
 		Q_ASSERT(y>=0 && y<m_ytiles);
-		return m_tiles[y*m_xtiles+x];
+		return m_tiles.at(x, y);
 	}
 
 	//! Get a tile
-	const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return m_tiles[index]; }
+	const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return m_tiles.at(index % m_xtiles, index / m_xtiles); }
 
 	//! Get the sublayers
 	const QList<Layer*> &sublayers() const { return m_sublayers; }
@@ -189,8 +191,13 @@ public:
 	 */
 	const LayerInfo &info() const { return m_info; }
 
-	//! Get this layer's tile vector
-	const QVector<Tile> tiles() const { return m_tiles; }
+	/**
+	 * @brief Get this layer's tiles as a dense vector
+	 *
+	 * The layer stores its tiles in a sparse map, so this
+	 * allocates a new vector of xtiles*ytiles entries.
+	 */
+	QVector<Tile> tiles() const;
 
 	/**
 	 * @brief Get the layer's change bounds
@@ -221,14 +228,14 @@ private:
 	Tile &rtile(int x, int y) {
 		Q_ASSERT(x>=0 && x<m_xtiles);
 		Q_ASSERT(y>=0 && y<m_ytiles);
-		return m_tiles[y*m_xtiles+x];
+		return m_tiles.ref(x, y);
 	}
 
 
 	LayerInfo m_info;
 	QRect m_changeBounds;
 
-	QVector<Tile> m_tiles;
+	TileMap m_tiles;
 	QList<Layer*> m_sublayers;
 
 	int m_width;
@@ -284,6 +291,25 @@ public:
 	//! Draw an image onto the layer
 	void putImage(int x, int y, QImage image, BlendMode::Mode mode);
 
+	/**
+	 * @brief Draw a band of raw image rows onto the layer
+	 *
+	 * This is used for decoding a large image one band at a time.
+	 * If the band lines up with tile boundaries, each affected tile is
+	 * composited just once.
+	 *
+	 * @param x x coordinate of the band
+	 * @param y y coordinate of the band
+	 * @param w band width
+	 * @param h number of rows in the band
+	 * @param pixels premultiplied ARGB pixel data (w*h pixels)
+	 * @param mode blending/compositing mode
+	 */
+	void putImageRows(int x, int y, int w, int h, const quint32 *pixels, BlendMode::Mode mode);
+
+	//! Draw a transformed image onto the layer
+	void putTransformedImage(const Resampler &resampler, BlendMode::Mode mode);
+
 	//! Set a tile
 	void putTile(int col, int row, int repeat, const Tile &tile, int sublayer=0);
 
@@ -296,7 +322,7 @@ public:
 	//! Get a reference to a tile
 	Tile &rtile(int x, int y) { Q_ASSERT(d); return d->rtile(x, y); }
 
-	Tile &rtile(int index) { return d->m_tiles[index]; }
+	Tile &rtile(int index) { Q_ASSERT(d); return d->rtile(index % d->m_xtiles, index / d->m_xtiles); }
 
 	//! Merge a sublayer with this layer
 	void mergeSublayer(int id);
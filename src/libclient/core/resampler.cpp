@@ -0,0 +1,174 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "resampler.h"
+#include "concurrent.h"
+#include "tile.h"
+
+namespace paintcore {
+
+namespace {
+
+/**
+ * @brief Interpolate between two pixels
+ *
+ * Two channels are processed at a time in a single 32 bit word.
+ * The weights a and b must sum to 256.
+ */
+inline quint32 interpolate256(quint32 x, uint a, quint32 y, uint b)
+{
+	quint32 t = (x & 0x00ff00ff) * a + (y & 0x00ff00ff) * b;
+	t = (t >> 8) & 0x00ff00ff;
+
+	quint32 u = ((x >> 8) & 0x00ff00ff) * a + ((y >> 8) & 0x00ff00ff) * b;
+	u &= 0xff00ff00;
+
+	return u | t;
+}
+
+}
+
+Resampler::Resampler(const QImage &source, const QPolygon &target)
+	: m_source(source.convertToFormat(QImage::Format_ARGB32_Premultiplied)),
+	  m_bounds(target.boundingRect()),
+	  m_x1(0), m_y1(0), m_x3(0), m_y3(0), m_det(0),
+	  m_valid(false)
+{
+	Q_ASSERT(target.size() == 4);
+
+	if(source.isNull() || target.size() != 4)
+		return;
+
+	if(source.width() > MAX_SIZE || source.height() > MAX_SIZE || m_bounds.width() > MAX_SIZE || m_bounds.height() > MAX_SIZE)
+		return;
+
+	// Only parallelograms (affine transforms) are supported
+	if(target[0] - target[1] + target[2] - target[3] != QPoint())
+		return;
+
+	m_origin = target[0];
+	m_x1 = target[1].x() - m_origin.x();
+	m_y1 = target[1].y() - m_origin.y();
+	m_x3 = target[3].x() - m_origin.x();
+	m_y3 = target[3].y() - m_origin.y();
+
+	// Target point T = u*P1 + v*P3, where u and v are the normalized
+	// source coordinates. Solved with Cramer's rule, the denominator is:
+	m_det = m_x1 * m_y3 - m_x3 * m_y1;
+
+	if(m_det == 0)
+		return;
+
+	// Keep the determinant positive, so the signs of the numerators
+	// alone tell if a point is inside the source image
+	if(m_det < 0) {
+		m_det = -m_det;
+		m_x1 = -m_x1;
+		m_y1 = -m_y1;
+		m_x3 = -m_x3;
+		m_y3 = -m_y3;
+	}
+
+	m_valid = true;
+}
+
+bool Resampler::resample(quint32 *dest, int x, int y, int w, int h, int stride) const
+{
+	Q_ASSERT(m_valid);
+
+	const qint64 sw = m_source.width();
+	const qint64 sh = m_source.height();
+	const qint64 det2 = m_det * 2;
+
+	bool written = false;
+
+	for(int row=0;row<h;++row) {
+		quint32 *d = dest + row * stride;
+
+		// Pixel center relative to the origin, in half pixels
+		const qint64 tx = 2 * qint64(x - m_origin.x()) + 1;
+		const qint64 ty = 2 * qint64(y + row - m_origin.y()) + 1;
+
+		// Numerators of u and v (the denominator is 2*det)
+		qint64 nu = tx * m_y3 - ty * m_x3;
+		qint64 nv = ty * m_x1 - tx * m_y1;
+
+		for(int col=0;col<w;++col, nu += 2*m_y3, nv -= 2*m_y1) {
+			if(nu < 0 || nv < 0 || nu >= det2 || nv >= det2)
+				continue;
+
+			// Source coordinates in 1/256th of a pixel, rounded down.
+			// Sample positions are offset by half a pixel (to the nearest
+			// pixel centers) and biased by one pixel to keep them positive.
+			const int su = int(nu * sw * 128 / m_det) + 128;
+			const int sv = int(nv * sh * 128 / m_det) + 128;
+
+			const int x0 = (su >> 8) - 1;
+			const int y0 = (sv >> 8) - 1;
+			const uint fx = su & 0xff;
+			const uint fy = sv & 0xff;
+
+			const int xa = qMax(0, x0);
+			const int xb = qMin(int(sw)-1, x0+1);
+			const QRgb *l0 = reinterpret_cast<const QRgb*>(m_source.constScanLine(qMax(0, y0)));
+			const QRgb *l1 = reinterpret_cast<const QRgb*>(m_source.constScanLine(qMin(int(sh)-1, y0+1)));
+
+			const quint32 top = interpolate256(l0[xa], 256-fx, l0[xb], fx);
+			const quint32 bottom = interpolate256(l1[xa], 256-fx, l1[xb], fx);
+
+			d[col] = interpolate256(top, 256-fy, bottom, fy);
+			written = true;
+		}
+	}
+
+	return written;
+}
+
+QImage Resampler::toImage(QPoint *offset) const
+{
+	if(!m_valid)
+		return QImage();
+
+	if(offset)
+		*offset = m_bounds.topLeft();
+
+	QImage out(m_bounds.size(), QImage::Format_ARGB32_Premultiplied);
+	out.fill(0);
+
+	const int stride = out.bytesPerLine() / 4;
+	quint32 *pixels = reinterpret_cast<quint32*>(out.bits());
+
+	// Resample in bands of tile height (in parallel if there is more than one)
+	QList<int> bands;
+	for(int y=0;y<m_bounds.height();y+=Tile::SIZE)
+		bands << y;
+
+	concurrentForEach<int>(bands, [this, pixels, stride](int y) {
+		resample(
+			pixels + y * stride,
+			m_bounds.x(), m_bounds.y() + y,
+			m_bounds.width(), qMin(Tile::SIZE, m_bounds.height() - y),
+			stride
+		);
+	});
+
+	return out;
+}
+
+}
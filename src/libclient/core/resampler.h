@@ -0,0 +1,100 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_RESAMPLER_H
+#define PAINTCORE_RESAMPLER_H
+
+#include <QImage>
+#include <QPolygon>
+
+namespace paintcore {
+
+/**
+ * @brief Bit exact bilinear resampler for affine image transforms
+ *
+ * The source image is mapped onto a target parallelogram. Each target pixel
+ * is mapped back to the source image and sampled.
+ *
+ * Only integer arithmetic is used: the target to source mapping is solved
+ * exactly and the source coordinates are rounded down to 1/256th of a pixel.
+ * The results are therefore identical on every client.
+ *
+ * Perspective transforms are not supported, since their exact mapping does
+ * not fit in 64 bit integers. Neither are targets or source images larger
+ * than MAX_SIZE. For those, isValid() returns false and the caller must
+ * fall back to some other method.
+ */
+class Resampler {
+public:
+	//! Maximum source image and target quad size
+	static const int MAX_SIZE = 1<<15;
+
+	/**
+	 * @brief Prepare a transformation
+	 *
+	 * @param source source image
+	 * @param target target quad (top-left, top-right, bottom-right, bottom-left)
+	 */
+	Resampler(const QImage &source, const QPolygon &target);
+
+	//! Is this a valid (non-degenerate affine) transformation?
+	bool isValid() const { return m_valid; }
+
+	//! Get the bounding rectangle of the target quad
+	QRect bounds() const { return m_bounds; }
+
+	/**
+	 * @brief Resample a block of target pixels
+	 *
+	 * Pixels that fall outside the transformed image are left untouched.
+	 *
+	 * @param dest destination pixels
+	 * @param x target X coordinate of the first pixel
+	 * @param y target Y coordinate of the first pixel
+	 * @param w block width
+	 * @param h block height
+	 * @param stride destination line length in pixels
+	 * @return true if at least one pixel was written
+	 */
+	bool resample(quint32 *dest, int x, int y, int w, int h, int stride) const;
+
+	/**
+	 * @brief Resample the whole transformed image
+	 *
+	 * @param offset if not null, the offset of the image is stored here
+	 * @return transformed image or a null image if this transform is not valid
+	 */
+	QImage toImage(QPoint *offset=nullptr) const;
+
+private:
+	QImage m_source;
+	QRect m_bounds;
+
+	// Target quad corners, relative to the top-left one
+	QPoint m_origin;
+	qint64 m_x1, m_y1, m_x3, m_y3;
+
+	// Determinant of the target to source mapping (always positive)
+	qint64 m_det;
+
+	bool m_valid;
+};
+
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilemap.h"
+
+namespace paintcore {
+
+const Tile TileMap::NULL_TILE;
+
+void TileMap::set(int x, int y, const Tile &tile)
+{
+	if(tile.isNull())
+		m_tiles.remove(key(x, y));
+	else
+		m_tiles[key(x, y)] = tile;
+}
+
+void TileMap::fill(const Tile &tile, int cols, int rows)
+{
+	m_tiles.clear();
+	fillRect(tile, 0, 0, cols-1, rows-1);
+}
+
+void TileMap::fillRect(const Tile &tile, int x0, int y0, int x1, int y1)
+{
+	for(int y=y0;y<=y1;++y) {
+		for(int x=x0;x<=x1;++x)
+			set(x, y, tile);
+	}
+}
+
+void TileMap::crop(int cols, int rows)
+{
+	auto i = m_tiles.begin();
+	while(i != m_tiles.end()) {
+		const int x = keyX(i.key());
+		const int y = keyY(i.key());
+		if(x<0 || y<0 || x>=cols || y>=rows)
+			i = m_tiles.erase(i);
+		else
+			++i;
+	}
+}
+
+void TileMap::removeBlank()
+{
+	auto i = m_tiles.begin();
+	while(i != m_tiles.end()) {
+		if(i.value().isBlank())
+			i = m_tiles.erase(i);
+		else
+			++i;
+	}
+}
+
+}
@@ -0,0 +1,118 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILEMAP_H
+#define PAINTCORE_TILEMAP_H
+
+#include "tile.h"
+
+#include <QHash>
+
+namespace paintcore {
+
+/**
+ * @brief A sparse map of tiles
+ *
+ * Only non-null tiles take up space, so memory usage is proportional
+ * to the amount of painted content rather than the size of the layer.
+ *
+ * Tiles are keyed by their coordinates relative to a movable origin,
+ * so the whole map can be shifted by whole tiles in constant time.
+ */
+class TileMap {
+public:
+	TileMap() : m_xoffset(0), m_yoffset(0) { }
+
+	//! Get a tile (a null tile is returned if not set)
+	const Tile &at(int x, int y) const {
+		const auto i = m_tiles.constFind(key(x, y));
+		return i != m_tiles.constEnd() ? *i : NULL_TILE;
+	}
+
+	/**
+	 * @brief Get a modifiable reference to a tile
+	 *
+	 * An entry is created if the tile was not set yet, so use at()
+	 * when the tile is only read.
+	 * References remain valid until the entry is removed
+	 * or the map is copied and then modified.
+	 */
+	Tile &ref(int x, int y) { return m_tiles[key(x, y)]; }
+
+	//! Set a tile (setting a null tile removes the entry)
+	void set(int x, int y, const Tile &tile);
+
+	//! Remove all tiles
+	void clear() { m_tiles.clear(); }
+
+	//! Set every tile in the rectangle (0, 0, cols, rows)
+	void fill(const Tile &tile, int cols, int rows);
+
+	//! Set every tile in the given tile rectangle
+	void fillRect(const Tile &tile, int x0, int y0, int x1, int y1);
+
+	/**
+	 * @brief Move every tile by the given number of tiles
+	 *
+	 * This is a constant time operation
+	 */
+	void translate(int dx, int dy) { m_xoffset -= dx; m_yoffset -= dy; }
+
+	//! Remove all tiles outside the rectangle (0, 0, cols, rows)
+	void crop(int cols, int rows);
+
+	//! Remove null and blank tiles
+	void removeBlank();
+
+	//! Get the number of tile entries
+	int count() const { return m_tiles.size(); }
+
+	//! Is the map empty?
+	bool isEmpty() const { return m_tiles.isEmpty(); }
+
+	//! Detach from any shared copies
+	void detach() { m_tiles.detach(); }
+
+	/**
+	 * @brief Call the function for each tile entry
+	 *
+	 * The function is given the tile coordinates and the tile.
+	 * The iteration order is undefined.
+	 */
+	template<typename Func> void forEach(Func func) const {
+		for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i)
+			func(keyX(i.key()), keyY(i.key()), i.value());
+	}
+
+private:
+	quint64 key(int x, int y) const {
+		return (quint64(quint32(x + m_xoffset)) << 32) | quint32(y + m_yoffset);
+	}
+	int keyX(quint64 key) const { return int(quint32(key >> 32)) - m_xoffset; }
+	int keyY(quint64 key) const { return int(quint32(key)) - m_yoffset; }
+
+	static const Tile NULL_TILE;
+
+	QHash<quint64, Tile> m_tiles;
+	int m_xoffset;
+	int m_yoffset;
+};
+
+}
+
+#endif
@@ -19,10 +19,12 @@
 
 #include "tilevector.h"
 #include "layer.h"
+#include "concurrent.h"
 #include "../libshared/net/layer.h"
 #include "../libshared/net/image.h"
 
 #include <QImage>
+#include <QCryptographicHash>
 
 namespace paintcore {
 
@@ -103,11 +105,72 @@ void LayerTileSet::toPutTiles(uint8_t contextId, uint16_t layerId, uint8_t subla
 			Q_ASSERT(!t.tile.isNull());
 
 			msgs << protocol::MessagePtr(new protocol::PutTile(contextId, layerId, sublayer, t.col, t.row, t.len-1,
-				qCompress(reinterpret_cast<const uchar*>(t.tile.constData()), paintcore::Tile::BYTES)
+				t.compressed.isEmpty() ? qCompress(reinterpret_cast<const uchar*>(t.tile.constData()), paintcore::Tile::BYTES) : t.compressed
 				));
 		}
 	}
 }
 
+void TileCompressor::compress(QVector<LayerTileSet> &tilesets)
+{
+	// Gather the tile runs that need compressed data
+	QVector<TileRun*> runs;
+	for(LayerTileSet &ts : tilesets) {
+		for(TileRun &tr : ts.tiles) {
+			if(!tr.color.isValid())
+				runs << &tr;
+		}
+	}
+
+	QList<int> indices;
+	indices.reserve(runs.size());
+	for(int i=0;i<runs.size();++i)
+		indices << i;
+
+	// Hash the tile contents.
+	// Hashing is much cheaper than compressing, so this is used to find
+	// both duplicates and tiles compressed for the previous snapshot.
+	QVector<QByteArray> hashes(runs.size());
+	QByteArray *hashptr = hashes.data();
+
+	concurrentForEach<int>(indices, [&runs, hashptr](int i) {
+		hashptr[i] = QCryptographicHash::hash(
+			QByteArray::fromRawData(reinterpret_cast<const char*>(runs.at(i)->tile.constData()), Tile::BYTES),
+			QCryptographicHash::Sha256
+		);
+	});
+
+	// Find unique tiles that haven't been compressed yet.
+	// Entries not needed for this snapshot are dropped from the cache.
+	QHash<QByteArray, QByteArray> cache;
+	QList<int> uncompressed;
+	for(int i=0;i<runs.size();++i) {
+		const QByteArray &hash = hashes.at(i);
+		if(cache.contains(hash))
+			continue;
+
+		const QByteArray cached = m_cache.value(hash);
+		if(cached.isEmpty())
+			uncompressed << i;
+		cache[hash] = cached;
+	}
+
+	// Compress the new tiles
+	QVector<QByteArray> compressed(runs.size());
+	QByteArray *compressedptr = compressed.data();
+
+	concurrentForEach<int>(uncompressed, [&runs, compressedptr](int i) {
+		compressedptr[i] = qCompress(reinterpret_cast<const uchar*>(runs.at(i)->tile.constData()), Tile::BYTES);
+	});
+
+	for(int i : uncompressed)
+		cache[hashes.at(i)] = compressed.at(i);
+
+	// Assign compressed data. Duplicate tiles share the same data.
+	for(int i=0;i<runs.size();++i)
+		runs[i]->compressed = cache.value(hashes.at(i));
+
+	m_cache = cache;
 }
 
+}
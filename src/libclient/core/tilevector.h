@@ -25,6 +25,7 @@
 
 #include <QVector>
 #include <QColor>
+#include <QHash>
 
 class QSize;
 class QPoint;
@@ -42,6 +43,7 @@ struct TileRun {
 	int row;
 	int len;      // the length of the tile run (always at least 1)
 	QColor color; // if valid, this tile is filled with solid color
+	QByteArray compressed; // precompressed tile data (see TileCompressor)
 };
 
 /**
@@ -71,6 +73,29 @@ struct LayerTileSet {
 	void toPutTiles(uint8_t contextid, uint16_t layerId, uint8_t sublayer, protocol::MessageList &msgs) const;
 };
 
+/**
+ * @brief Parallel compressor for snapshot tile data
+ *
+ * Tiles with identical content are compressed only once, even when they
+ * are not adjacent or are on different layers. The compressed data is retained
+ * until the next call to compress(), so when the same compressor is used
+ * to generate consecutive snapshots, tiles that haven't changed are not
+ * compressed again.
+ */
+class TileCompressor {
+public:
+	/**
+	 * @brief Fill in the compressed data of each non-solid tile run
+	 *
+	 * Hashing and compression are done in the global thread pool.
+	 */
+	void compress(QVector<LayerTileSet> &tilesets);
+
+private:
+	// content hash -> compressed tile data
+	QHash<QByteArray, QByteArray> m_cache;
+};
+
 }
 
 #endif
@@ -32,6 +32,7 @@
 #include "canvas/canvassaverrunnable.h"
 #include "canvas/loader.h"
 #include "tools/toolcontroller.h"
+#include "core/tilevector.h"
 #include "utils/settings.h"
 #include "utils/images.h"
 
@@ -724,6 +725,11 @@ void Document::snapshotNeeded()
 			 loader.setDefaultLayer(m_canvas->layerlist()->defaultLayer());
 			 loader.setPinnedMessage(m_canvas->pinnedMessage());
 
+			 // Reuse compressed tiles from the previous reset
+			 if(!m_tileCompressor)
+				 m_tileCompressor.reset(new paintcore::TileCompressor);
+			 loader.setTileCompressor(m_tileCompressor.data());
+
 			 m_resetstate = loader.loadInitCommands();
 		}
 
@@ -26,6 +26,7 @@
 
 #include <QObject>
 #include <QStringListModel>
+#include <QScopedPointer>
 
 class QString;
 class QTimer;
@@ -42,6 +43,7 @@ namespace net {
 	class BanlistModel;
 	class AnnouncementListModel;
 }
+namespace paintcore { class TileCompressor; }
 namespace recording { class Writer; }
 namespace tools { class ToolController; }
 
@@ -261,6 +263,7 @@ private:
 	QString m_currentFilename;
 
 	protocol::MessageList m_resetstate;
+	QScopedPointer<paintcore::TileCompressor> m_tileCompressor;
 
 	canvas::CanvasModel *m_canvas;
 	tools::ToolController *m_toolctrl;
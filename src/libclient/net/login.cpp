@@ -25,6 +25,7 @@
 
 #include "../libshared/net/protover.h"
 #include "../libshared/net/control.h"
+#include "../libshared/net/messagequeue.h"
 #include "../libshared/util/networkaccess.h"
 
 #include <QDebug>
@@ -73,6 +74,7 @@ LoginHandler::LoginHandler(Mode mode, const QUrl &url, QObject *parent)
 	  m_canReport(false),
 	  m_needUserPassword(false),
 	  m_supportsCustomAvatars(false),
+	  m_supportsCompression(false),
 	  m_supportsExtAuthAvatars(false),
 	  m_isGuest(true)
 {
@@ -196,6 +198,8 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 			m_canReport = true;
 		} else if(flag == "AVATAR") {
 			m_supportsCustomAvatars = true;
+		} else if(flag == "DEFLATE") {
+			m_supportsCompression = true;
 		} else {
 			qWarning() << "Unknown server capability:" << flag;
 		}
@@ -283,6 +287,12 @@ void LoginHandler::selectIdentity(const QString &username, const QString &passwo
 
 void LoginHandler::sendIdentity()
 {
+	// Start compressing right before identifying, so that
+	// TLS (if used) is already set up at this point.
+	// The server will respond by compressing its messages too.
+	if(m_supportsCompression)
+		m_server->m_msgqueue->startCompression();
+
 	protocol::ServerCommand cmd;
 	cmd.cmd = "ident";
 	cmd.args.append(m_address.userName());
@@ -415,6 +415,7 @@ private:
 	bool m_mustAuth;
 	bool m_needUserPassword;
 	bool m_supportsCustomAvatars;
+	bool m_supportsCompression;
 	bool m_supportsExtAuthAvatars;
 
 	// User flags
@@ -0,0 +1,408 @@
+#include "../core/floodfill.h"
+#include "../core/layerstack.h"
+#include "../core/layer.h"
+
+#include <QtTest/QtTest>
+#include <QPainter>
+#include <QQueue>
+#include <QStack>
+
+using paintcore::FillResult;
+using paintcore::LayerStack;
+using paintcore::BlendMode;
+
+class TestFloodfill : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testTolerance_data()
+	{
+		QTest::addColumn<int>("tolerance");
+		QTest::addColumn<int>("width");
+		QTest::newRow("exact") << 0 << 50;
+		QTest::newRow("too small") << 3 << 50;
+		QTest::newRow("just enough") << 4 << 100;
+	}
+
+	void testTolerance()
+	{
+		QFETCH(int, tolerance);
+		QFETCH(int, width);
+
+		// The two halves differ by 4 in the red channel
+		QImage img = blank(100, 50);
+		img.fill(0xff808080);
+		QPainter(&img).fillRect(50, 0, 50, 50, QColor(0x84, 0x80, 0x80));
+
+		LayerStack stack;
+		makeCanvas(stack, img, blank(100, 50));
+
+		const FillResult r = paintcore::floodfill(&stack, QPoint(10, 10), Qt::red, tolerance, 1, false, 100000);
+		QVERIFY(!r.oversize);
+		QCOMPARE(r.x, 0);
+		QCOMPARE(r.y, 0);
+		QCOMPARE(r.image.size(), QSize(width, 50));
+		QCOMPARE(countFilled(r.image), width * 50);
+	}
+
+	void testSizeLimit()
+	{
+		LayerStack stack;
+		makeCanvas(stack, blank(200, 200), blank(200, 200));
+
+		const FillResult limited = paintcore::floodfill(&stack, QPoint(100, 100), Qt::red, 0, 1, false, 1000);
+		QVERIFY(limited.oversize);
+
+		const FillResult unlimited = paintcore::floodfill(&stack, QPoint(100, 100), Qt::red, 0, 1, false, 200*200+1);
+		QVERIFY(!unlimited.oversize);
+		QCOMPARE(unlimited.image.size(), QSize(200, 200));
+		QCOMPARE(countFilled(unlimited.image), 200*200);
+	}
+
+	void testMergedSource()
+	{
+		// A vertical line on the bottom layer, nothing on the top layer
+		QImage bottom = blank(150, 100);
+		QPainter(&bottom).fillRect(70, 0, 2, 100, Qt::black);
+
+		LayerStack stack;
+		makeCanvas(stack, bottom, blank(150, 100));
+
+		// The line stops a merged fill...
+		const FillResult merged = paintcore::floodfill(&stack, QPoint(10, 10), Qt::red, 0, 2, true, 100000);
+		QCOMPARE(QRect(merged.x, merged.y, merged.image.width(), merged.image.height()), QRect(0, 0, 70, 100));
+		QCOMPARE(countFilled(merged.image), 70 * 100);
+
+		// ...but is not seen when only the top layer is sampled
+		const FillResult layer = paintcore::floodfill(&stack, QPoint(10, 10), Qt::red, 0, 2, false, 100000);
+		QCOMPARE(QRect(layer.x, layer.y, layer.image.width(), layer.image.height()), QRect(0, 0, 150, 100));
+		QCOMPARE(countFilled(layer.image), 150 * 100);
+	}
+
+	void testFillUnder()
+	{
+		// The fill tool fills under the existing content when the target
+		// layer is transparent at the seed point, even in merged mode.
+		QImage bottom = blank(100, 100);
+		bottom.fill(0xff0000ff);
+		QImage top = blank(100, 100);
+		QPainter(&top).fillRect(0, 0, 10, 10, Qt::green);
+
+		LayerStack stack;
+		makeCanvas(stack, bottom, top);
+
+		const FillResult under = paintcore::floodfill(&stack, QPoint(50, 50), Qt::red, 0, 2, true, 100000);
+		QCOMPARE(under.layerSeedColor, QRgb(0));
+		QCOMPARE(countFilled(under.image), 100*100 - 10*10);
+
+		const FillResult over = paintcore::floodfill(&stack, QPoint(5, 5), Qt::red, 0, 2, true, 100000);
+		QCOMPARE(over.layerSeedColor, QRgb(0xff00ff00));
+
+		const FillResult bottomLayer = paintcore::floodfill(&stack, QPoint(50, 50), Qt::red, 0, 1, false, 100000);
+		QCOMPARE(bottomLayer.layerSeedColor, QRgb(0xff0000ff));
+	}
+
+	void testNothingToFill()
+	{
+		LayerStack stack;
+		makeCanvas(stack, blank(100, 100), blank(100, 100));
+
+		// Filling with the seed color does nothing
+		QVERIFY(paintcore::floodfill(&stack, QPoint(5, 5), QColor(Qt::transparent), 0, 1, false, 100000).image.isNull());
+
+		// Nor does filling outside the canvas
+		QVERIFY(paintcore::floodfill(&stack, QPoint(-1, 5), Qt::red, 0, 1, false, 100000).image.isNull());
+		QVERIFY(paintcore::floodfill(&stack, QPoint(5, 100), Qt::red, 0, 1, false, 100000).image.isNull());
+	}
+
+	void testExpansion_data()
+	{
+		QTest::addColumn<QPoint>("pos");
+		QTest::addColumn<int>("radius");
+		QTest::newRow("r1") << QPoint(10, 10) << 1;
+		QTest::newRow("r3") << QPoint(20, 15) << 3;
+		QTest::newRow("r8") << QPoint(30, 30) << 8;
+		QTest::newRow("near origin") << QPoint(2, 1) << 5;
+	}
+
+	void testExpansion()
+	{
+		QFETCH(QPoint, pos);
+		QFETCH(int, radius);
+
+		// A small L shaped fill area
+		FillResult input;
+		input.x = pos.x();
+		input.y = pos.y();
+		input.image = blank(3, 3);
+		input.image.setPixel(0, 0, 0xffff0000);
+		input.image.setPixel(0, 1, 0xffff0000);
+		input.image.setPixel(1, 1, 0xffff0000);
+
+		const FillResult out = paintcore::expandFill(input, radius, Qt::blue);
+		QVERIFY(out.x >= 0);
+		QVERIFY(out.y >= 0);
+
+		// Compare against a brute force dilation with a circular kernel
+		const QImage actual = toCanvas(out, QSize(64, 64));
+		const QImage source = toCanvas(input, QSize(64, 64));
+		for(int y=0;y<64;++y) {
+			for(int x=0;x<64;++x) {
+				bool expected = false;
+				for(int ky=-radius;ky<=radius && !expected;++ky) {
+					for(int kx=-radius;kx<=radius && !expected;++kx) {
+						if(kx*kx + ky*ky <= radius*radius && QRect(0, 0, 64, 64).contains(x+kx, y+ky))
+							expected = qAlpha(pixel(source, x+kx, y+ky)) > 0;
+					}
+				}
+				QCOMPARE(pixel(actual, x, y), expected ? QColor(Qt::blue).rgba() : QRgb(0));
+			}
+		}
+	}
+
+	// The span based fill must fill the same pixels as the old
+	// column scanning implementation did.
+	void testSameAsOldAlgorithm_data()
+	{
+		QTest::addColumn<QImage>("source");
+		QTest::addColumn<QPoint>("seed");
+		QTest::addColumn<int>("tolerance");
+
+		const QImage rings = ringsFixture();
+		const QImage maze = mazeFixture();
+
+		QTest::newRow("rings outside") << rings << QPoint(1, 1) << 0;
+		QTest::newRow("rings inside") << rings << QPoint(100, 75) << 0;
+		QTest::newRow("rings between") << rings << QPoint(100, 35) << 0;
+		QTest::newRow("maze") << maze << QPoint(1, 1) << 0;
+		QTest::newRow("maze edge") << maze << QPoint(maze.width()-1, maze.height()-1) << 10;
+	}
+
+	void testSameAsOldAlgorithm()
+	{
+		QFETCH(QImage, source);
+		QFETCH(QPoint, seed);
+		QFETCH(int, tolerance);
+
+		LayerStack stack;
+		makeCanvas(stack, source, blank(source.width(), source.height()));
+
+		const QRgb color = 0xffff0000;
+		const FillResult r = paintcore::floodfill(&stack, seed, QColor::fromRgba(color), tolerance, 1, false, 10000000);
+		QVERIFY(!r.oversize);
+
+		const QImage expected = oldFloodfill(source, seed, color, tolerance);
+		QCOMPARE(toCanvas(r, source.size()), expected);
+
+		// Merged mode sees the same pixels here
+		const FillResult merged = paintcore::floodfill(&stack, seed, QColor::fromRgba(color), tolerance, 2, true, 10000000);
+		QCOMPARE(toCanvas(merged, source.size()), expected);
+	}
+
+	// On noisy images, the old implementation could miss areas that
+	// were connected to the rest through a single pixel, so a plain
+	// breadth first fill is used as the reference instead.
+	void testNoise_data()
+	{
+		QTest::addColumn<QPoint>("seed");
+		QTest::addColumn<int>("tolerance");
+
+		QTest::newRow("exact") << QPoint(64, 64) << 0;
+		QTest::newRow("tolerant") << QPoint(64, 64) << 40;
+		QTest::newRow("very tolerant") << QPoint(130, 20) << 90;
+	}
+
+	void testNoise()
+	{
+		QFETCH(QPoint, seed);
+		QFETCH(int, tolerance);
+
+		const QImage source = noiseFixture();
+		LayerStack stack;
+		makeCanvas(stack, source, blank(source.width(), source.height()));
+
+		const QRgb color = 0xffff0000;
+		const FillResult r = paintcore::floodfill(&stack, seed, QColor::fromRgba(color), tolerance, 1, false, 10000000);
+		QCOMPARE(toCanvas(r, source.size()), referenceFloodfill(source, seed, color, tolerance));
+	}
+
+private:
+	static QImage blank(int w, int h)
+	{
+		QImage img(w, h, QImage::Format_ARGB32_Premultiplied);
+		img.fill(0);
+		return img;
+	}
+
+	static QRgb pixel(const QImage &img, int x, int y)
+	{
+		return reinterpret_cast<const QRgb*>(img.constScanLine(y))[x];
+	}
+
+	static int countFilled(const QImage &img)
+	{
+		int count = 0;
+		for(int y=0;y<img.height();++y)
+			for(int x=0;x<img.width();++x)
+				count += qAlpha(pixel(img, x, y)) > 0;
+		return count;
+	}
+
+	//! Create a two layer canvas (layer IDs 1 and 2)
+	static void makeCanvas(LayerStack &stack, const QImage &bottom, const QImage &top)
+	{
+		auto editor = stack.editor(0);
+		editor.resize(0, bottom.width(), bottom.height(), 0);
+		editor.createLayer(1, 0, Qt::transparent, false, false, "bottom").putImage(0, 0, bottom, BlendMode::MODE_REPLACE);
+		editor.createLayer(2, 0, Qt::transparent, false, false, "top").putImage(0, 0, top, BlendMode::MODE_REPLACE);
+	}
+
+	//! Place a fill result on a canvas sized image
+	static QImage toCanvas(const FillResult &result, const QSize &size)
+	{
+		QImage img = blank(size.width(), size.height());
+		if(!result.image.isNull()) {
+			QPainter p(&img);
+			p.setCompositionMode(QPainter::CompositionMode_Source);
+			p.drawImage(result.x, result.y, result.image);
+		}
+		return img;
+	}
+
+	static QImage ringsFixture()
+	{
+		// Concentric rings, crossing tile boundaries, with a gap in the outer ring
+		QImage img = blank(200, 150);
+		QPainter p(&img);
+		p.setPen(QPen(Qt::black, 3));
+		p.drawEllipse(QPoint(100, 75), 60, 60);
+		p.drawEllipse(QPoint(100, 75), 20, 20);
+		p.setCompositionMode(QPainter::CompositionMode_Source);
+		p.fillRect(155, 70, 10, 10, Qt::transparent);
+		return img;
+	}
+
+	static QImage noiseFixture()
+	{
+		// Random shades of gray (deterministic)
+		QImage img = blank(160, 130);
+		quint32 state = 12345;
+		for(int y=0;y<img.height();++y) {
+			QRgb *row = reinterpret_cast<QRgb*>(img.scanLine(y));
+			for(int x=0;x<img.width();++x) {
+				state = state * 1103515245 + 12345;
+				const int v = 96 + (state >> 16) % 64;
+				row[x] = qRgb(v, v, v);
+			}
+		}
+		return img;
+	}
+
+	static QImage mazeFixture()
+	{
+		// Walls with gaps at alternating ends
+		QImage img = blank(131, 97);
+		QPainter p(&img);
+		for(int x=8, i=0;x<img.width();x+=8, ++i)
+			p.fillRect(x, i%2 ? 6 : 0, 2, img.height()-6, QColor(10, 20, 30));
+		return img;
+	}
+
+	static bool isSameColor(QRgb c1, QRgb c2, int tolerance)
+	{
+		int r = (c1 & 0xff) - (signed int)(c2 & 0xff);
+		int g = (c1>>8 & 0xff) - (signed int)(c2>>8 & 0xff);
+		int b = (c1>>16 & 0xff) - (signed int)(c2>>16 & 0xff);
+		int a = (c1>>24 & 0xff) - (signed int)(c2>>24 & 0xff);
+		return r*r + g*g + b*b + a*a <= tolerance * tolerance;
+	}
+
+	//! A plain four way connected breadth first flood fill
+	static QImage referenceFloodfill(const QImage &source, const QPoint &start, QRgb fillColor, int tolerance)
+	{
+		QImage fill = blank(source.width(), source.height());
+		const QRgb oldColor = pixel(source, start.x(), start.y());
+		if(isSameColor(oldColor, fillColor, tolerance))
+			return fill;
+
+		const QRect bounds(QPoint(), source.size());
+		QQueue<QPoint> queue;
+		queue.enqueue(start);
+		reinterpret_cast<QRgb*>(fill.scanLine(start.y()))[start.x()] = fillColor;
+
+		while(!queue.isEmpty()) {
+			const QPoint p = queue.dequeue();
+			for(const QPoint &n : { p + QPoint(-1, 0), p + QPoint(1, 0), p + QPoint(0, -1), p + QPoint(0, 1) }) {
+				if(bounds.contains(n) && pixel(fill, n.x(), n.y()) == 0 && isSameColor(pixel(source, n.x(), n.y()), oldColor, tolerance)) {
+					reinterpret_cast<QRgb*>(fill.scanLine(n.y()))[n.x()] = fillColor;
+					queue.enqueue(n);
+				}
+			}
+		}
+
+		return fill;
+	}
+
+	//! The original column scanning flood fill, operating on a flat image
+	static QImage oldFloodfill(const QImage &source, const QPoint &start, QRgb fillColor, int tolerance)
+	{
+		QImage scratch = source.copy();
+		QImage fill = blank(source.width(), source.height());
+
+		const QRgb oldColor = pixel(scratch, start.x(), start.y());
+		if(isSameColor(oldColor, fillColor, tolerance))
+			return fill;
+
+		auto isOldColorAt = [&](int x, int y) {
+			return isSameColor(pixel(scratch, x, y), oldColor, tolerance);
+		};
+		auto setPixel = [&](int x, int y) {
+			reinterpret_cast<QRgb*>(scratch.scanLine(y))[x] = fillColor;
+			reinterpret_cast<QRgb*>(fill.scanLine(y))[x] = fillColor;
+		};
+
+		QStack<QPoint> stack;
+		stack.push(start);
+
+		const int w1 = scratch.width()-1;
+
+		while(!stack.isEmpty()) {
+			QPoint p = stack.pop();
+
+			const int x = p.x();
+			int y = p.y();
+
+			bool spanLeft = false;
+			bool spanRight = false;
+
+			while(y>=0 && isOldColorAt(x, y)) --y;
+			++y;
+
+			while(y < scratch.height() && isOldColorAt(x, y)) {
+				setPixel(x, y);
+
+				if(!spanLeft && x>0 && isOldColorAt(x-1, y)) {
+					stack.push(QPoint(x-1, y));
+					spanLeft = true;
+
+				} else if(spanLeft && x>0 && !isOldColorAt(x-1, y)) {
+					spanLeft = false;
+
+				} else if(!spanRight && x<w1 && isOldColorAt(x+1, y)) {
+					stack.push(QPoint(x+1, y));
+					spanRight = true;
+
+				} else if(spanRight && x<w1 && !isOldColorAt(x+1, y)) {
+					spanRight = false;
+				}
+				++y;
+			}
+		}
+
+		return fill;
+	}
+};
+
+
+QTEST_MAIN(TestFloodfill)
+#include "floodfill.moc"
@@ -0,0 +1,117 @@
+#include "../core/resampler.h"
+
+#include <QtTest/QtTest>
+
+using paintcore::Resampler;
+
+class TestResampler : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testIdentity()
+	{
+		const QImage source = testImage();
+		const QPolygon target({ QPoint(0, 0), QPoint(4, 0), QPoint(4, 4), QPoint(0, 4) });
+		const Resampler resampler(source, target);
+		QVERIFY(resampler.isValid());
+
+		QPoint offset;
+		const QImage result = resampler.toImage(&offset);
+		QCOMPARE(offset, QPoint());
+		QCOMPARE(result.size(), QSize(5, 5));
+
+		for(int y=0;y<source.height();++y)
+			for(int x=0;x<source.width();++x)
+				QCOMPARE(result.pixel(x, y), source.pixel(x, y));
+	}
+
+	void testScale_data()
+	{
+		QTest::addColumn<int>("size");
+		QTest::newRow("up") << 12;
+		QTest::newRow("up uneven") << 7;
+		QTest::newRow("down") << 2;
+		QTest::newRow("down uneven") << 3;
+	}
+
+	void testScale()
+	{
+		QFETCH(int, size);
+		const QImage source = testImage();
+		const QPolygon target({ QPoint(0, 0), QPoint(size, 0), QPoint(size, size), QPoint(0, size) });
+		const Resampler resampler(source, target);
+		QVERIFY(resampler.isValid());
+
+		const QImage result = resampler.toImage();
+
+		for(int y=0;y<size;++y) {
+			for(int x=0;x<size;++x) {
+				// Pixel center (x+0.5)*4/size in 1/256ths, biased by half a pixel
+				const int su = 128 * (2*x+1) * source.width() / size + 128;
+				const int sv = 128 * (2*y+1) * source.height() / size + 128;
+				QCOMPARE(result.pixel(x, y), bilinear(source, su, sv));
+			}
+		}
+	}
+
+	void testRotateAndMirror()
+	{
+		const QImage source = testImage();
+
+		// Rotated 90 degrees clockwise
+		const Resampler rotated(source, QPolygon({ QPoint(4, 0), QPoint(4, 4), QPoint(0, 4), QPoint(0, 0) }));
+		QVERIFY(rotated.isValid());
+		const QImage r = rotated.toImage();
+
+		// Mirrored horizontally
+		const Resampler mirrored(source, QPolygon({ QPoint(4, 0), QPoint(0, 0), QPoint(0, 4), QPoint(4, 4) }));
+		QVERIFY(mirrored.isValid());
+		const QImage m = mirrored.toImage();
+
+		for(int y=0;y<4;++y) {
+			for(int x=0;x<4;++x) {
+				QCOMPARE(r.pixel(3-y, x), source.pixel(x, y));
+				QCOMPARE(m.pixel(3-x, y), source.pixel(x, y));
+			}
+		}
+	}
+
+	void testPerspectiveNotSupported()
+	{
+		const QPolygon target({ QPoint(0, 0), QPoint(4, 1), QPoint(4, 3), QPoint(0, 4) });
+		QVERIFY(!Resampler(testImage(), target).isValid());
+	}
+
+private:
+	static QImage testImage()
+	{
+		QImage img(4, 4, QImage::Format_ARGB32_Premultiplied);
+		for(int y=0;y<img.height();++y)
+			for(int x=0;x<img.width();++x)
+				img.setPixel(x, y, qRgba(x * 80, y * 80, (x+y) * 30, 255));
+		return img;
+	}
+
+	// Reference bilinear sample at biased source coordinates (su,sv) given in 1/256ths of a pixel
+	static QRgb bilinear(const QImage &img, int su, int sv)
+	{
+		const int x0 = su / 256 - 1, y0 = sv / 256 - 1;
+		const int fx = su % 256, fy = sv % 256;
+
+		auto px = [&img](int x, int y) {
+			return img.pixel(qBound(0, x, img.width()-1), qBound(0, y, img.height()-1));
+		};
+
+		QRgb out = 0;
+		for(int shift=0;shift<32;shift+=8) {
+			auto ch = [shift](QRgb p) { return int((p >> shift) & 0xff); };
+			const int top = (ch(px(x0, y0)) * (256-fx) + ch(px(x0+1, y0)) * fx) / 256;
+			const int bottom = (ch(px(x0, y0+1)) * (256-fx) + ch(px(x0+1, y0+1)) * fx) / 256;
+			out |= QRgb((top * (256-fy) + bottom * fy) / 256) << shift;
+		}
+		return out;
+	}
+};
+
+QTEST_MAIN(TestResampler)
+#include "resampler.moc"
@@ -0,0 +1,143 @@
+#include "../core/tilemap.h"
+#include "../core/layer.h"
+
+#include <QtTest/QtTest>
+
+using paintcore::Tile;
+using paintcore::TileMap;
+using paintcore::Layer;
+using paintcore::EditableLayer;
+
+class TestTileMap : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testSparseReads()
+	{
+		TileMap map;
+
+		// Reading does not create entries
+		QVERIFY(map.at(3, 4).isNull());
+		QVERIFY(map.at(-1, -1).isNull());
+		QCOMPARE(map.count(), 0);
+
+		map.set(3, 4, Tile(Qt::red));
+		QCOMPARE(map.count(), 1);
+		QCOMPARE(map.at(3, 4).pixel(0, 0), qRgb(255, 0, 0));
+		QVERIFY(map.at(4, 3).isNull());
+		QCOMPARE(map.count(), 1);
+
+		// Setting a null tile removes the entry
+		map.set(3, 4, Tile());
+		QVERIFY(map.isEmpty());
+	}
+
+	void testTranslate()
+	{
+		TileMap map;
+		map.set(1, 2, Tile(Qt::red));
+		map.set(0, 0, Tile(Qt::blue));
+
+		map.translate(2, -1);
+		QCOMPARE(map.count(), 2);
+		QCOMPARE(map.at(3, 1).pixel(0, 0), qRgb(255, 0, 0));
+		QCOMPARE(map.at(2, -1).pixel(0, 0), qRgb(0, 0, 255));
+		QVERIFY(map.at(1, 2).isNull());
+		QVERIFY(map.at(0, 0).isNull());
+
+		// New tiles are placed relative to the new origin
+		map.set(0, 0, Tile(Qt::green));
+		map.translate(-2, 1);
+		QCOMPARE(map.at(-2, 1).pixel(0, 0), qRgb(0, 255, 0));
+		QCOMPARE(map.at(1, 2).pixel(0, 0), qRgb(255, 0, 0));
+		QCOMPARE(map.at(0, 0).pixel(0, 0), qRgb(0, 0, 255));
+
+		QVector<QPoint> seen;
+		map.forEach([&seen](int x, int y, const Tile &) { seen << QPoint(x, y); });
+		std::sort(seen.begin(), seen.end(), [](const QPoint &a, const QPoint &b) {
+			return a.y() < b.y() || (a.y() == b.y() && a.x() < b.x());
+		});
+		QCOMPARE(seen, QVector<QPoint>({ QPoint(0, 0), QPoint(-2, 1), QPoint(1, 2) }));
+	}
+
+	void testCropAndFill()
+	{
+		TileMap map;
+		map.fill(Tile(Qt::red), 3, 2);
+		QCOMPARE(map.count(), 6);
+
+		map.fillRect(Tile(Qt::blue), 2, 1, 4, 1);
+		QCOMPARE(map.count(), 8);
+		QCOMPARE(map.at(2, 1).pixel(0, 0), qRgb(0, 0, 255));
+
+		map.crop(3, 2);
+		QCOMPARE(map.count(), 6);
+		QVERIFY(map.at(3, 1).isNull());
+
+		map.set(0, 0, Tile(QColor(Qt::transparent)));
+		map.removeBlank();
+		QCOMPARE(map.count(), 5);
+	}
+
+	void testAlignedResize()
+	{
+		Layer layer(1, QString(), Qt::transparent, QSize(100, 100));
+		EditableLayer el(&layer, nullptr, 0);
+		el.fillRect(QRect(10, 10, 5, 5), Qt::red, paintcore::BlendMode::MODE_REPLACE);
+
+		// Grow by one tile to the top and left
+		el.resize(64, 0, 0, 64);
+		QCOMPARE(layer.width(), 164);
+		QCOMPARE(layer.height(), 164);
+		QCOMPARE(layer.pixelAt(74, 74), qRgb(255, 0, 0));
+		QCOMPARE(layer.pixelAt(10, 10), 0u);
+
+		// And shrink back
+		el.resize(-64, 0, 0, -64);
+		QCOMPARE(layer.width(), 100);
+		QCOMPARE(layer.height(), 100);
+		QCOMPARE(layer.pixelAt(10, 10), qRgb(255, 0, 0));
+		QCOMPARE(layer.pixelAt(74, 74), 0u);
+
+		// Crop away the content
+		el.resize(0, -50, -50, 0);
+		QCOMPARE(layer.width(), 50);
+		QCOMPARE(layer.pixelAt(10, 10), qRgb(255, 0, 0));
+		el.resize(-64, 64, 64, -64);
+		QCOMPARE(layer.width(), 50);
+		QCOMPARE(layer.pixelAt(10, 10), 0u);
+		QVERIFY(layer.toCroppedImage(nullptr, nullptr).isNull());
+	}
+
+	void testUnalignedResize()
+	{
+		Layer layer(1, QString(), Qt::transparent, QSize(100, 100));
+		EditableLayer el(&layer, nullptr, 0);
+		el.fillRect(QRect(10, 10, 5, 5), Qt::red, paintcore::BlendMode::MODE_REPLACE);
+
+		el.resize(10, 3, 0, 5);
+		QCOMPARE(layer.width(), 108);
+		QCOMPARE(layer.height(), 110);
+		QCOMPARE(layer.pixelAt(15, 20), qRgb(255, 0, 0));
+		QCOMPARE(layer.pixelAt(14, 20), 0u);
+		QCOMPARE(layer.pixelAt(10, 10), 0u);
+	}
+
+	void testResizePurgesSublayers()
+	{
+		Layer layer(1, QString(), Qt::transparent, QSize(100, 100));
+		EditableLayer el(&layer, nullptr, 0);
+		el.getEditableSubLayer(2, paintcore::BlendMode::MODE_NORMAL, 255)
+			.fillRect(QRect(0, 0, 10, 10), Qt::red, paintcore::BlendMode::MODE_REPLACE);
+		el.mergeSublayer(2);
+		QCOMPARE(layer.sublayers().size(), 1);
+
+		el.resize(64, 0, 0, 0);
+		QVERIFY(layer.sublayers().isEmpty());
+		QCOMPARE(layer.pixelAt(5, 69), qRgb(255, 0, 0));
+	}
+};
+
+
+QTEST_MAIN(TestTileMap)
+#include "tilemap.moc"
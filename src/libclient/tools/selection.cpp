@@ -20,6 +20,7 @@
 #include "canvas/canvasmodel.h"
 #include "canvas/aclfilter.h"
 #include "core/layer.h"
+#include "core/resampler.h"
 #include "net/client.h"
 
 #include "tools/selection.h"
@@ -221,6 +222,13 @@ QImage SelectionTool::transformSelectionImage(const QImage &source, const QPolyg
 	Q_ASSERT(!source.isNull());
 	Q_ASSERT(target.size() == 4);
 
+	// Use the same resampler as MoveRegion, so the preview matches the end result
+	const paintcore::Resampler resampler(source, target);
+	if(resampler.isValid())
+		return resampler.toImage(offset);
+
+	// Perspective transforms cannot be resampled bit exactly,
+	// so they are still painted with QPainter
 	const QRect bounds = target.boundingRect();
 	const QPolygonF srcPolygon({
 		QPointF(0, 0),
@@ -22,6 +22,7 @@
 
 #include "serverconfig.h"
 #include "serverlog.h"
+#include "workerthreads.h"
 
 #include <QTimerEvent>
 
@@ -30,8 +31,9 @@ namespace sessionlisting {
 Announcable::~Announcable() { }
 
 Announcements::Announcements(server::ServerConfig *config, QObject *parent)
-	: QObject(parent), m_config(config)
+	: QObject(parent), m_config(config), m_mutex(QMutex::Recursive)
 {
+	qRegisterMetaType<const sessionlisting::Announcable*>();
 	m_timerId = startTimer(30 * 1000, Qt::VeryCoarseTimer);
 }
 
@@ -51,18 +53,22 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 	auto description = session->getSessionAnnouncement();
 	description.isPrivate = mode;
 
-	// Don't announce twice at the same server
-	if(findListing(listServer, session))
-		return;
+	{
+		QMutexLocker lock(&m_mutex);
 
-	// Make announcement
-	m_announcements << Listing {
-		listServer,
-		session,
-		Announcement {},
-		QDeadlineTimer(),
-		PrivacyMode::Undefined
-	};
+		// Don't announce twice at the same server
+		if(findListing(listServer, session))
+			return;
+
+		// Make announcement
+		m_announcements << Listing {
+			listServer,
+			session,
+			Announcement {},
+			QDeadlineTimer(),
+			PrivacyMode::Undefined
+		};
+	}
 
 	server::Log()
 		.about(server::Log::Level::Info, server::Log::Topic::PubList)
@@ -70,11 +76,23 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 		.message("Announcing session at at " + listServer.toString())
 		.to(m_config->logger());
 
+	// The session may live in another thread, but the listing server
+	// requests are always made from this object's thread.
+	runInThread(this, [this, listServer, session, description]() {
+		sendAnnouncement(listServer, session, description);
+	});
+}
+
+void Announcements::sendAnnouncement(const QUrl &listServer, Announcable *session, const Session &description)
+{
 	auto *response = sessionlisting::announceSession(listServer, description);
 
 	connect(response, &AnnouncementApiResponse::finished, this, [listServer, session, response, this](const QVariant &result, const QString &message, const QString &error) {
 		response->deleteLater();
 
+		// Note: the listing must be found while the lock is held. This guarantees
+		// the session has not been deleted.
+		QMutexLocker lock(&m_mutex);
 		Listing *listing = findListing(listServer, session);
 		if(!listing) {
 			// Whoops! Looks like this session has ended
@@ -87,9 +105,8 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 				.message(listServer.toString() + ": announcement failed: " + error)
 				.to(m_config->logger());
 
-			unlistSession(listing->session, listing->listServer, false);
-
 			listing->session->sendListserverMessage(error);
+			unlistSession(listing->session, listing->listServer, false);
 			return;
 		}
 
@@ -117,6 +134,7 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 
 void Announcements::unlistSession(Announcable *session, const QUrl &listServer, bool delist)
 {
+	QMutexLocker lock(&m_mutex);
 	QMutableVectorIterator<Listing> i(m_announcements);
 	QSet<Announcable*> changes;
 
@@ -136,8 +154,11 @@ void Announcements::unlistSession(Announcable *session, const QUrl &listServer,
 				.to(m_config->logger());
 
 			if(listing.mode != PrivacyMode::Undefined && delist) {
-				auto *response = sessionlisting::unlistSession(listing.announcement);
-				connect(response, &AnnouncementApiResponse::finished, response, &AnnouncementApiResponse::deleteLater);
+				const Announcement announcement = listing.announcement;
+				runInThread(this, [announcement]() {
+					auto *response = sessionlisting::unlistSession(announcement);
+					connect(response, &AnnouncementApiResponse::finished, response, &AnnouncementApiResponse::deleteLater);
+				});
 			}
 
 			i.remove();
@@ -148,6 +169,16 @@ void Announcements::unlistSession(Announcable *session, const QUrl &listServer,
 		emit announcementsChanged(session);
 }
 
+void Announcements::transferSession(const Announcable *from, Announcable *to)
+{
+	Q_ASSERT(to);
+	QMutexLocker lock(&m_mutex);
+	for(Listing &listing : m_announcements) {
+		if(listing.session == from && listing.mode != PrivacyMode::Undefined)
+			listing.session = to;
+	}
+}
+
 Announcements::Listing *Announcements::findListing(const QUrl &listServer, const Announcable *session)
 {
 	for(Listing &listing : m_announcements) {
@@ -175,6 +206,7 @@ void Announcements::timerEvent(QTimerEvent *event)
 
 void Announcements::refreshListings()
 {
+	QMutexLocker lock(&m_mutex);
 	QVector<QPair<Announcement, Session>> updates;
 	QUrl refreshServer;
 	bool needsSecondPass = false;
@@ -224,6 +256,8 @@ void Announcements::refreshListings()
 	connect(response, &AnnouncementApiResponse::finished, [this, refreshServer, updates, response](const QVariant &result, const QString &message, const QString &error) {
 		response->deleteLater();
 
+		QMutexLocker lock(&m_mutex);
+
 		if(!message.isEmpty()) {
 			server::Log()
 				.about(server::Log::Level::Info, server::Log::Topic::PubList)
@@ -275,6 +309,7 @@ void Announcements::refreshListings()
 
 QVector<Announcement> Announcements::getAnnouncements(const Announcable *session) const
 {
+	QMutexLocker lock(&m_mutex);
 	QVector<Announcement> list;
 	for(const auto &listing : m_announcements) {
 		if(listing.mode != PrivacyMode::Undefined && listing.session == session)
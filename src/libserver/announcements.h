@@ -24,6 +24,7 @@
 #include <QObject>
 #include <QVector>
 #include <QDeadlineTimer>
+#include <QMutex>
 
 namespace server {
 	class ServerConfig;
@@ -35,6 +36,10 @@ class Announcable;
 
 /**
  * @brief All session announcements made from this server
+ *
+ * The announcement functions are thread-safe: sessions living in worker
+ * threads may announce and unlist themselves. Requests to listing servers
+ * are always made from this object's own thread.
  */
 class Announcements : public QObject
 {
@@ -62,6 +67,17 @@ public:
 	 */
 	void unlistSession(Announcable *session, const QUrl &listServer=QUrl(), bool delist=true);
 
+	/**
+	 * @brief Move the finished announcements of a session to another announcable
+	 *
+	 * The listings are kept and refreshed as usual, but the new announcable
+	 * provides their descriptions. Announcements still in progress are not moved.
+	 *
+	 * @param from the session whose listings to move
+	 * @param to the announcable that takes over the listings
+	 */
+	void transferSession(const Announcable *from, Announcable *to);
+
 	/**
 	 * @brief Return all active announcements for the given session
 	 * @param session
@@ -89,14 +105,18 @@ private:
 	Listing *findListing(const QUrl &listServer, const Announcable *session);
 	Listing *findListingById(const QUrl &listServer, int id);
 
+	void sendAnnouncement(const QUrl &listServer, Announcable *session, const Session &description);
 	void refreshListings();
 
 	QVector<Listing> m_announcements;
 	server::ServerConfig *m_config;
+	mutable QMutex m_mutex;
 
 	int m_timerId;
 };
 
 }
 
+Q_DECLARE_METATYPE(const sessionlisting::Announcable*)
+
 #endif // ANNOUNCEMENTS_H
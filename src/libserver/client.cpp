@@ -21,7 +21,9 @@
 #include "session.h"
 #include "sessionhistory.h"
 #include "serverlog.h"
+#include "metrics.h"
 #include "serverconfig.h"
+#include "stalldetector.h"
 
 #include "../libshared/net/messagequeue.h"
 #include "../libshared/net/control.h"
@@ -47,6 +49,8 @@ struct Client::Private {
 	QString authId;
 	QByteArray avatar;
 
+	qint64 receiveTime = 0;
+
 	uint8_t id = 0;
 	bool isOperator = false;
 	bool isModerator = false;
@@ -55,6 +59,7 @@ struct Client::Private {
 	bool isMuted = false;
 	bool isHoldLocked = false;
 	bool isAwaitingReset = false;
+	bool isCompressionAllowed = false;
 
 	Private(QTcpSocket *socket, ServerLog *logger)
 		: socket(socket), logger(logger)
@@ -74,6 +79,7 @@ Client::Client(QTcpSocket *socket, ServerLog *logger, QObject *parent)
 	connect(d->socket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &Client::socketError);
 	connect(d->msgqueue, &protocol::MessageQueue::messageAvailable, this, &Client::receiveMessages);
 	connect(d->msgqueue, &protocol::MessageQueue::badData, this, &Client::gotBadData);
+	connect(d->msgqueue, &protocol::MessageQueue::outboxOverflow, this, &Client::uploadQueueOverflow);
 }
 
 Client::~Client()
@@ -107,6 +113,10 @@ QJsonObject Client::description(bool includeSession) const
 	u["muted"] = isMuted();
 	u["mod"] = isModerator();
 	u["tls"] = isSecure();
+	u["queue"] = d->msgqueue->uploadQueueBytes();
+	u["queuePeak"] = d->msgqueue->uploadQueuePeak();
+	u["coalesced"] = d->msgqueue->coalescedCount();
+	u["lagging"] = d->msgqueue->isLagging();
 	if(includeSession && d->session)
 		u["session"] = d->session->idString();
 	return u;
@@ -253,6 +263,21 @@ void Client::setConnectionTimeout(int timeout)
 	d->msgqueue->setIdleTimeout(timeout);
 }
 
+void Client::setFlushDelay(int delay)
+{
+	d->msgqueue->setFlushDelay(delay);
+}
+
+void Client::setCompressionAllowed(bool allow)
+{
+	d->isCompressionAllowed = allow;
+}
+
+void Client::setUploadQueueLimits(int softLimit, int hardLimit)
+{
+	d->msgqueue->setOutboxLimits(softLimit, hardLimit);
+}
+
 #ifndef NDEBUG
 void Client::setRandomLag(uint lag)
 {
@@ -267,21 +292,52 @@ QHostAddress Client::peerAddress() const
 
 void Client::sendDirectMessage(protocol::MessagePtr msg)
 {
-	if(!d->isAwaitingReset || msg->isControl())
+	if(!d->isAwaitingReset || msg->isControl()) {
+		countSent(msg);
 		d->msgqueue->send(msg);
+	}
 }
 
 void Client::sendDirectMessage(const protocol::MessageList &msgs)
 {
 	if(d->isAwaitingReset) {
-		for(MessagePtr msg : msgs)
-			if(msg->isControl())
+		for(MessagePtr msg : msgs) {
+			if(msg->isControl()) {
+				countSent(msg);
 				d->msgqueue->send(msg);
+			}
+		}
 	} else {
+		for(const MessagePtr &msg : msgs)
+			countSent(msg);
 		d->msgqueue->send(msgs);
 	}
 }
 
+void Client::countSent(const protocol::MessagePtr &msg)
+{
+	metrics::global().sent.count(msg->type(), msg->length());
+	if(d->session)
+		d->session->traffic()->sent.count(msg->type(), msg->length());
+}
+
+void Client::countSentBatch(const QByteArray &batch)
+{
+	metrics::global().sent.countBatch(batch);
+	if(d->session)
+		d->session->traffic()->sent.countBatch(batch);
+}
+
+int Client::uploadQueueBytes() const
+{
+	return d->msgqueue->uploadQueueBytes();
+}
+
+qint64 Client::receiveTime() const
+{
+	return d->receiveTime;
+}
+
 void Client::sendSystemChat(const QString &message)
 {
 	protocol::ServerReply msg {
@@ -290,14 +346,37 @@ void Client::sendSystemChat(const QString &message)
 		QJsonObject()
 	};
 
-	d->msgqueue->send(MessagePtr(new protocol::Command(0, msg.toJson())));
+	const MessagePtr chat(new protocol::Command(0, msg.toJson()));
+	countSent(chat);
+	d->msgqueue->send(chat);
 }
 
 void Client::receiveMessages()
 {
+	// Messages read from the socket at once are handled right away,
+	// so they all share the same receive time.
+	// Messages held during a reset are timed from the latest receive.
+	d->receiveTime = metrics::now();
+	const StallDetector::Activity activity("handling messages", d->session ? d->session->id() : QUuid(), d->id);
+
+	// A client that compresses its messages can decompress ours too.
+	// (Clients should only start compressing if the server announced support for it.)
+	if(d->msgqueue->isReceivingCompressed() && !d->msgqueue->isSendingCompressed()) {
+		if(!d->isCompressionAllowed) {
+			log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message("Received compressed data, but compression is not enabled"));
+			d->socket->abort();
+			return;
+		}
+		d->msgqueue->startCompression();
+	}
+
 	while(d->msgqueue->isPending()) {
 		MessagePtr msg = d->msgqueue->getPending();
 
+		metrics::global().received.count(msg->type(), msg->length());
+		if(d->session)
+			d->session->traffic()->received.count(msg->type(), msg->length());
+
 		if(d->session.isNull()) {
 			// No session? We must be in the login phase
 			if(msg->type() == protocol::MSG_COMMAND)
@@ -343,6 +422,14 @@ void Client::socketDisconnect()
 	this->deleteLater();
 }
 
+void Client::uploadQueueOverflow()
+{
+	log(Log().about(Log::Level::Warn, Log::Topic::Status).message(
+		QString("Upload queue limit exceeded (peak %1 bytes)").arg(d->msgqueue->uploadQueuePeak())
+		));
+	disconnectClient(DisconnectionReason::Error, "Connection too slow");
+}
+
 void Client::disconnectClient(DisconnectionReason reason, const QString &message)
 {
 	protocol::Disconnect::Reason pr { protocol::Disconnect::OTHER };
@@ -147,6 +147,31 @@ public:
 	 */
 	void setConnectionTimeout(int timeout);
 
+	/**
+	 * @brief Set the maximum time outgoing messages may be held back for batching
+	 * @param delay delay in milliseconds
+	 */
+	void setFlushDelay(int delay);
+
+	/**
+	 * @brief Set the limits for this client's upload queue
+	 *
+	 * Past the soft limit, cursor and laser pointer updates are coalesced.
+	 * Past the hard limit, the client is disconnected.
+	 *
+	 * @param softLimit soft limit in bytes (0 for no limit)
+	 * @param hardLimit hard limit in bytes (0 for no limit)
+	 */
+	void setUploadQueueLimits(int softLimit, int hardLimit);
+
+	/**
+	 * @brief Allow this client to use compression
+	 *
+	 * This should be set when compression support is announced to the client.
+	 * A client that sends compressed data without it is dropped.
+	 */
+	void setCompressionAllowed(bool allow);
+
 #ifndef NDEBUG
 	void setRandomLag(uint lag);
 #endif
@@ -178,6 +203,12 @@ public:
 	void sendDirectMessage(protocol::MessagePtr msg);
 	void sendDirectMessage(const protocol::MessageList &msgs);
 
+	//! Get the number of bytes waiting in the upload queue
+	int uploadQueueBytes() const;
+
+	//! Get the time (see metrics::now()) the latest messages from this client were received
+	qint64 receiveTime() const;
+
 	/**
 	 * @brief Send a message from the server directly to this user
 	 * @param message
@@ -277,12 +308,17 @@ private slots:
 	void receiveMessages();
 	void socketError(QAbstractSocket::SocketError error);
 	void socketDisconnect();
+	void uploadQueueOverflow();
 
 protected:
 	Client(QTcpSocket *socket, ServerLog *logger, QObject *parent);
 	protocol::MessageQueue *messageQueue();
 
+	//! Count a batch of serialized messages sent without sendDirectMessage
+	void countSentBatch(const QByteArray &batch);
+
 private:
+	void countSent(const protocol::MessagePtr &msg);
 	void handleSessionMessage(protocol::MessagePtr msg);
 
 	struct Private;
@@ -0,0 +1,127 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "credentialverifier.h"
+#include "workerthreads.h"
+
+namespace server {
+
+CredentialVerifier::CredentialVerifier(int threads, int maxQueued)
+	: m_workers(new WorkerThreads(threads)), m_maxQueued(maxQueued), m_pending(0)
+{
+	m_clock.start();
+}
+
+CredentialVerifier::~CredentialVerifier()
+{
+	delete m_workers;
+}
+
+int CredentialVerifier::pending() const
+{
+	QMutexLocker lock(&m_mutex);
+	return m_pending;
+}
+
+CredentialVerifier::Status CredentialVerifier::submit(const QHostAddress &address, QObject *receiver, const std::function<void()> &work, const std::function<void()> &done)
+{
+	QMutexLocker lock(&m_mutex);
+
+	if(m_pending >= m_workers->count() + m_maxQueued)
+		return Busy;
+
+	if(!takeAttempt(address))
+		return RateLimited;
+
+	++m_pending;
+	QObject *context = m_workers->acquire();
+	lock.unlock();
+
+	// The result is delivered via a queued signal, so nothing is
+	// called if the receiver is deleted in the mean time.
+	auto *job = new detail::VerificationJob(work);
+	QObject::connect(job, &detail::VerificationJob::finished, receiver, done, Qt::QueuedConnection);
+	job->moveToThread(context->thread());
+
+	runInThread(context, [this, job, context]() {
+		job->run();
+		delete job;
+
+		QMutexLocker lock(&m_mutex);
+		m_workers->release(context);
+		--m_pending;
+	});
+
+	return Queued;
+}
+
+bool CredentialVerifier::takeAttempt(const QHostAddress &address)
+{
+	// Note: the caller must hold the mutex
+	const qint64 now = m_clock.elapsed();
+
+	expireBuckets(now);
+
+	auto bucket = m_buckets.find(address);
+	if(bucket == m_buckets.end()) {
+		if(m_buckets.size() >= MAX_ADDRESSES) {
+			m_buckets.remove(m_order.front());
+			m_order.pop_front();
+		}
+
+		m_order.push_back(address);
+		bucket = m_buckets.insert(address, Bucket { BURST_ATTEMPTS, now, now, std::prev(m_order.end()) });
+
+	} else {
+		const qint64 refill = (now - bucket->refilled) / ATTEMPT_INTERVAL;
+		if(refill > 0) {
+			bucket->attempts = int(qMin(qint64(BURST_ATTEMPTS), bucket->attempts + refill));
+			bucket->refilled += refill * ATTEMPT_INTERVAL;
+		}
+
+		bucket->lastSeen = now;
+		m_order.splice(m_order.end(), m_order, bucket->order);
+	}
+
+	if(bucket->attempts <= 0)
+		return false;
+
+	--bucket->attempts;
+	return true;
+}
+
+void CredentialVerifier::expireBuckets(qint64 now)
+{
+	// Note: the caller must hold the mutex
+
+	// An address that has been quiet for this long has a full bucket again,
+	// so forgetting it changes nothing. Since m_order is sorted by the time
+	// of the last attempt, only the expired entries at the front are visited.
+	while(!m_order.empty()) {
+		const auto bucket = m_buckets.find(m_order.front());
+		Q_ASSERT(bucket != m_buckets.end());
+		if(now - bucket->lastSeen < BURST_ATTEMPTS * ATTEMPT_INTERVAL)
+			break;
+
+		m_buckets.erase(bucket);
+		m_order.pop_front();
+	}
+}
+
+}
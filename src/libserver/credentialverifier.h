@@ -0,0 +1,169 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_CREDENTIALVERIFIER_H
+#define DP_SERVER_CREDENTIALVERIFIER_H
+
+#include <QObject>
+#include <QHash>
+#include <QHostAddress>
+#include <QMutex>
+#include <QElapsedTimer>
+
+#include <functional>
+#include <memory>
+#include <list>
+
+namespace server {
+
+class WorkerThreads;
+
+namespace detail {
+
+//! A credential check running in a verifier thread
+class VerificationJob : public QObject
+{
+	Q_OBJECT
+public:
+	explicit VerificationJob(const std::function<void()> &work) : m_work(work) { }
+
+	void run() { m_work(); emit finished(); }
+
+signals:
+	void finished();
+
+private:
+	std::function<void()> m_work;
+};
+
+}
+
+/**
+ * @brief A bounded pool of threads for checking passwords and auth tokens
+ *
+ * Password hashes are deliberately slow to check. Doing it in the
+ * thread that relays drawing commands would stall every session in that thread
+ * whenever someone logs in.
+ *
+ * The checks are done in a fixed number of threads. The result is delivered to
+ * the receiver object's thread. If the receiver is deleted before the check
+ * finishes, the result is discarded.
+ *
+ * To slow down password guessing, each IP address may make only a limited
+ * number of verification attempts: a burst of up to BURST_ATTEMPTS, then one
+ * every ATTEMPT_INTERVAL milliseconds. Addresses that have been quiet long
+ * enough to have their full burst back are forgotten. At most MAX_ADDRESSES
+ * are remembered at once; beyond that, the least recently seen are dropped.
+ * When too many checks are already queued, new ones are rejected without
+ * using up an attempt.
+ *
+ * All functions are thread safe.
+ */
+class CredentialVerifier
+{
+public:
+	enum Status {
+		Queued,      // the check was started
+		RateLimited, // too many attempts from this address
+		Busy         // too many checks already waiting
+	};
+
+	static const int BURST_ATTEMPTS = 10;
+	static const int ATTEMPT_INTERVAL = 1000;
+	static const int MAX_ADDRESSES = 10000;
+
+	/**
+	 * @brief Start the verifier threads
+	 *
+	 * @param threads number of threads
+	 * @param maxQueued maximum number of checks waiting for a thread
+	 */
+	CredentialVerifier(int threads, int maxQueued);
+	~CredentialVerifier();
+
+	/**
+	 * @brief Run a check in a verifier thread
+	 *
+	 * The check function is called in a verifier thread. Everything it
+	 * touches must be thread safe. The done function is called with its result
+	 * in the receiver's thread.
+	 *
+	 * @param address the address of the client whose credentials are being checked
+	 * @param receiver the object whose thread the done function is called in
+	 * @param check the check to perform
+	 * @param done the function to call with the result
+	 * @return Queued if the check was started
+	 */
+	template<typename Check, typename Done>
+	Status verify(const QHostAddress &address, QObject *receiver, Check check, Done done)
+	{
+		typedef decltype(check()) Result;
+		std::shared_ptr<Result> result(new Result);
+		return submit(
+			address,
+			receiver,
+			[check, result]() { *result = check(); },
+			[done, result]() { done(*result); }
+		);
+	}
+
+	//! Get the number of checks currently queued or running
+	int pending() const;
+
+private:
+	Status submit(const QHostAddress &address, QObject *receiver, const std::function<void()> &work, const std::function<void()> &done);
+	bool takeAttempt(const QHostAddress &address);
+	void expireBuckets(qint64 now);
+
+	struct Bucket {
+		int attempts;     // attempts left
+		qint64 refilled;  // time of the last refill
+		qint64 lastSeen;  // time of the last attempt
+		std::list<QHostAddress>::iterator order; // position in m_order
+	};
+
+	mutable QMutex m_mutex;
+	WorkerThreads *m_workers;
+	QHash<QHostAddress, Bucket> m_buckets;
+	std::list<QHostAddress> m_order; // least recently seen address first
+	QElapsedTimer m_clock;
+	int m_maxQueued;
+	int m_pending;
+};
+
+/**
+ * @brief Check credentials using the given verifier
+ *
+ * If there is no verifier, the check is done synchronously in the calling thread.
+ *
+ * @see CredentialVerifier::verify()
+ */
+template<typename Check, typename Done>
+CredentialVerifier::Status verifyCredentials(CredentialVerifier *verifier, const QHostAddress &address, QObject *receiver, Check check, Done done)
+{
+	if(verifier)
+		return verifier->verify(address, receiver, check, done);
+
+	done(check());
+	return CredentialVerifier::Queued;
+}
+
+}
+
+#endif
@@ -18,22 +18,119 @@
 */
 
 #include "filedhistory.h"
+#include "historycache.h"
 #include "../libshared/util/passwordhash.h"
 #include "../libshared/util/filename.h"
 #include "../libshared/record/header.h"
 #include "../libshared/net/meta.h"
 
 #include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QCryptographicHash>
 #include <QJsonObject>
-#include <QVarLengthArray>
 #include <QDebug>
+#include <QTimer>
 #include <QTimerEvent>
+#include <QThreadPool>
+#include <QRunnable>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace server {
 
 // A block is closed when its size goes above this limit
 static const qint64 MAX_BLOCK_SIZE = 0xffff * 10;
 
+// Block index file format identifier ("DPIX") and version
+static const quint32 INDEX_MAGIC = 0x44504958;
+static const quint32 INDEX_VERSION = 2;
+
+// How much of the end of each indexed block is included in its index entry's checksum
+static const qint64 INDEX_CHECKSUM_WINDOW = 0x1000;
+
+static bool syncDescriptor(int fd)
+{
+#ifdef Q_OS_WIN
+	return _commit(fd) == 0;
+#else
+	return fsync(fd) == 0;
+#endif
+}
+
+static int duplicateDescriptor(int fd)
+{
+	if(fd < 0)
+		return -1;
+#ifdef Q_OS_WIN
+	return _dup(fd);
+#else
+	return dup(fd);
+#endif
+}
+
+static void closeDescriptor(int fd)
+{
+#ifdef Q_OS_WIN
+	_close(fd);
+#else
+	close(fd);
+#endif
+}
+
+//! Flush the file's buffers and wait until its content is on the disk
+static void syncFile(QFile *file)
+{
+	if(!file->flush() || file->handle() < 0 || !syncDescriptor(file->handle()))
+		qWarning() << file->fileName() << "sync failed";
+}
+
+/**
+ * @brief Sync files to disk in a background thread
+ *
+ * The task has its own copies of the file descriptors, so the
+ * files can be closed (or the history deleted) while the sync is in progress.
+ */
+class SyncTask : public QRunnable
+{
+public:
+	SyncTask(const QVector<int> &fds, QSharedPointer<QAtomicInt> pending)
+		: m_fds(fds), m_pending(pending)
+	{
+	}
+
+	void run() override
+	{
+		for(const int fd : m_fds) {
+			if(fd >= 0) {
+				if(!syncDescriptor(fd))
+					qWarning("Background sync of file descriptor %d failed", fd);
+				closeDescriptor(fd);
+			}
+		}
+		m_pending->storeRelease(0);
+	}
+
+private:
+	QVector<int> m_fds;
+	QSharedPointer<QAtomicInt> m_pending;
+};
+
+// Syncing can block for a long time, so it's done in a thread pool of its own
+static QThreadPool *syncThreadPool()
+{
+	static QThreadPool *pool = []() {
+		QThreadPool *p = new QThreadPool;
+		p->setMaxThreadCount(2);
+		return p;
+	}();
+	return pool;
+}
+
 FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QUuid &id, const QString &alias, const protocol::ProtocolVersion &version, const QString &founder, QObject *parent)
 	: SessionHistory(id, parent),
 	  m_dir(dir),
@@ -44,8 +141,15 @@ FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QUuid &id, con
 	  m_version(version),
 	  m_maxUsers(254),
 	  m_flags(0),
+	  m_indexedBlocks(0),
 	  m_fileCount(0),
-	  m_archive(false)
+	  m_archive(false),
+	  m_durability(Durability::Relaxed),
+	  m_groupCommitDelay(1000),
+	  m_groupCommitSize(1024*1024),
+	  m_unsyncedBytes(0),
+	  m_syncTimer(nullptr),
+	  m_syncPending(new QAtomicInt(0))
 {
 	Q_ASSERT(journal);
 
@@ -60,6 +164,134 @@ FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QUuid &id, QOb
 
 FiledHistory::~FiledHistory()
 {
+	if(m_cache)
+		m_cache->removeAll(this);
+
+	// Make sure everything is on the disk before the files are closed
+	if(m_durability != Durability::Relaxed) {
+		if(m_recording && m_recording->isOpen())
+			syncFile(m_recording);
+		if(m_journal->isOpen())
+			syncFile(m_journal);
+	}
+}
+
+void FiledHistory::setDurability(Durability durability, int groupCommitDelay, int groupCommitSize)
+{
+	m_durability = durability;
+	m_groupCommitDelay = qMax(1, groupCommitDelay);
+	m_groupCommitSize = qMax(1, groupCommitSize);
+
+	if(durability == Durability::GroupCommit && !m_syncTimer) {
+		m_syncTimer = new QTimer(this);
+		m_syncTimer->setSingleShot(true);
+		connect(m_syncTimer, &QTimer::timeout, this, &FiledHistory::syncInBackground);
+	}
+}
+
+void FiledHistory::setCache(const QSharedPointer<HistoryCache> &cache)
+{
+	if(m_cache == cache)
+		return;
+
+	if(m_cache)
+		m_cache->removeAll(this);
+
+	m_cache = cache;
+
+	if(m_cache) {
+		for(const Block &b : m_blocks) {
+			if(b.count > 0 && b.messages.size() == b.count)
+				cacheBlock(b);
+		}
+	}
+}
+
+void FiledHistory::cacheBlock(const Block &b) const
+{
+	if(m_cache)
+		m_cache->touch(this, b.startIndex, b.endOffset - b.startOffset);
+}
+
+void FiledHistory::evictCachedBlock(int startIndex)
+{
+	// Ignore the eviction if the block was used again after it was evicted
+	if(!m_cache || m_cache->contains(this, startIndex))
+		return;
+
+	for(Block &b : m_blocks) {
+		if(b.startIndex == startIndex) {
+			if(!b.messages.isEmpty()) {
+				qDebug() << "evicting history block cache from" << b.startIndex << "to" << b.startIndex+b.count-1;
+				b.messages = protocol::MessageList();
+			}
+			break;
+		}
+	}
+}
+
+void FiledHistory::commitJournal()
+{
+	switch(m_durability) {
+	case Durability::Relaxed:
+		m_journal->flush();
+		break;
+	case Durability::GroupCommit:
+		m_journal->flush();
+		scheduleSync(0);
+		break;
+	case Durability::Strict:
+		syncFile(m_journal);
+		break;
+	}
+}
+
+void FiledHistory::commitRecording(int bytes)
+{
+	switch(m_durability) {
+	case Durability::Relaxed:
+		// The recording is flushed periodically
+		break;
+	case Durability::GroupCommit:
+		scheduleSync(bytes);
+		break;
+	case Durability::Strict:
+		syncFile(m_recording);
+		break;
+	}
+}
+
+void FiledHistory::scheduleSync(int bytes)
+{
+	Q_ASSERT(m_syncTimer);
+	m_unsyncedBytes += bytes;
+	if(m_unsyncedBytes >= m_groupCommitSize)
+		syncInBackground();
+	else if(!m_syncTimer->isActive())
+		m_syncTimer->start(m_groupCommitDelay);
+}
+
+void FiledHistory::syncInBackground()
+{
+	m_syncTimer->stop();
+	if(!m_recording || !m_recording->isOpen() || !m_journal->isOpen())
+		return;
+
+	// QFile is not thread safe, so the buffers are flushed here
+	m_recording->flush();
+	m_journal->flush();
+
+	if(!m_syncPending->testAndSetAcquire(0, 1)) {
+		// Previous sync is still in progress. Try again a bit later.
+		m_syncTimer->start(m_groupCommitDelay);
+		return;
+	}
+
+	m_unsyncedBytes = 0;
+	syncThreadPool()->start(new SyncTask(
+		{ duplicateDescriptor(m_recording->handle()), duplicateDescriptor(m_journal->handle()) },
+		m_syncPending
+	));
 }
 
 QString FiledHistory::journalFilename(const QUuid &id)
@@ -141,7 +373,7 @@ bool FiledHistory::create()
 	if(!m_alias.isEmpty())
 		m_journal->write(QString("ALIAS %1\n").arg(m_alias).toUtf8());
 	m_journal->write(QString("FOUNDER %1\n").arg(m_founder).toUtf8());
-	m_journal->flush();
+	commitJournal();
 
 	return true;
 }
@@ -158,6 +390,9 @@ bool FiledHistory::initRecording()
 		return false;
 	}
 
+	// Make sure a leftover index of an earlier recording is not mistaken for this one's
+	QFile::remove(indexFilename());
+
 	QJsonObject metadata;
 	metadata["version"] = m_version.asString(); // the hosting client's protocol version
 	recording::writeRecordingHeader(m_recording, metadata);
@@ -165,14 +400,15 @@ bool FiledHistory::initRecording()
 	m_recording->flush();
 
 	m_journal->write(QString("FILE %1\n").arg(filename).toUtf8());
-	m_journal->flush();
+	commitJournal();
 
 	m_blocks << Block {
 		m_recording->pos(),
 		firstIndex(),
 		0,
 		m_recording->pos(),
-		protocol::MessageList()
+		protocol::MessageList(),
+		QVector<int>()
 		};
 
 	return true;
@@ -186,7 +422,20 @@ bool FiledHistory::load()
 
 	// Parse the journal
 	do {
-		line = m_journal->readLine().trimmed();
+		const qint64 lineStart = m_journal->pos();
+		line = m_journal->readLine();
+		if(!line.endsWith('\n') && m_journal->atEnd()) {
+			// The last entry was not completely written (the server crashed?)
+			// Cut it off, so the next entry won't be appended to it.
+			if(!line.isEmpty()) {
+				qWarning() << id().toString() << "incomplete journal entry discarded.";
+				m_journal->resize(lineStart);
+				m_journal->seek(lineStart);
+			}
+			break;
+		}
+
+		line = line.trimmed();
 		if(line.isEmpty() || line.at(0) == '#')
 			continue;
 
@@ -369,70 +618,265 @@ bool FiledHistory::scanBlocks()
 	Q_ASSERT(m_blocks.isEmpty());
 	// Note: m_recording should be at the start of the recording
 
-	m_blocks << Block {
-		m_recording->pos(),
-		firstIndex(),
-		0,
-		m_recording->pos(),
-		protocol::MessageList()
-	};
-
-	QSet<uint8_t> users;
+	// Closed blocks never change, so they can be loaded from the index.
+	// Only the part of the recording after the last indexed block needs to be scanned.
+	loadIndex();
+
+	if(m_blocks.isEmpty()) {
+		m_blocks << Block {
+			m_recording->pos(),
+			firstIndex(),
+			0,
+			m_recording->pos(),
+			protocol::MessageList(),
+			QVector<int>()
+		};
+	}
 
-	do {
+	while(!m_recording->atEnd()) {
 		Block &b = m_blocks.last();
 		uint8_t msgType, ctxId;
 
 		const int msglen = recording::skipRecordingMessage(m_recording, &msgType, &ctxId);
 		if(msglen<0) {
 			// Truncated message encountered.
-			// Rewind back to the end of the previous message
+			// Cut the partial message off and rewind back to the end of the previous message,
+			// so new messages won't be mixed with the remains of the old one.
 			qWarning() << m_recording->fileName() << "Recording truncated at" << int(b.endOffset);
+			m_recording->resize(b.endOffset);
 			m_recording->seek(b.endOffset);
 			break;
 		}
+		b.offsets << int(b.endOffset - b.startOffset);
 		++m_blocks.last().count;
 
 		b.endOffset += msglen;
 		Q_ASSERT(b.endOffset == m_recording->pos());
 
+		trackUser(msgType, ctxId);
+		if(msgType == protocol::MSG_USER_LEAVE)
+			idQueue().reserveId(ctxId);
+
 		if(b.endOffset-b.startOffset >= MAX_BLOCK_SIZE) {
+			// Only the last block is indexed
+			b.offsets = QVector<int>();
 			m_blocks << Block {
 				b.endOffset,
 				b.startIndex+b.count,
 				0,
 				b.endOffset,
-				protocol::MessageList()
+				protocol::MessageList(),
+				QVector<int>()
 			};
-		}
 
-		switch(msgType) {
-		case protocol::MSG_USER_JOIN: users.insert(ctxId); break;
-		case protocol::MSG_USER_LEAVE:
-			users.remove(ctxId);
-			idQueue().reserveId(ctxId);
-			break;
+			// Save the closed block so it need not be scanned again
+			appendIndex();
 		}
-	} while(!m_recording->atEnd());
+	}
 
 	// There should be no users at the end of the recording.
-	for(const uint8_t user : users) {
+	const QSet<uint8_t> remainingUsers = m_users.present;
+	for(const uint8_t user : remainingUsers) {
 		protocol::UserLeave msg(user);
+		m_blocks.last().offsets << int(m_blocks.last().endOffset - m_blocks.last().startOffset);
 		m_blocks.last().count++;
 		m_blocks.last().endOffset += msg.length();
 		char buf[16];
 		msg.serialize(buf);
 		m_recording->write(buf, msg.length());
+		trackUser(protocol::MSG_USER_LEAVE, user);
 		idQueue().reserveId(user);
 	}
+
+	return true;
+}
+
+void FiledHistory::trackUser(uint8_t msgType, uint8_t ctxId)
+{
+	switch(msgType) {
+	case protocol::MSG_USER_JOIN:
+		m_users.present.insert(ctxId);
+		break;
+	case protocol::MSG_USER_LEAVE:
+		m_users.present.remove(ctxId);
+		m_users.left.removeOne(ctxId);
+		m_users.left.append(ctxId);
+		break;
+	}
+}
+
+QString FiledHistory::indexFilename() const
+{
+	Q_ASSERT(m_recording);
+	const QFileInfo recording(m_recording->fileName());
+	return recording.dir().absoluteFilePath(recording.completeBaseName() + ".dpidx");
+}
+
+QByteArray FiledHistory::indexChecksum(const QByteArray &entry, qint64 blockStart, qint64 blockEnd) const
+{
+	// Checksumming whole blocks would mean reading the whole recording when the
+	// index is loaded, defeating its purpose. The tail of each block is enough
+	// to tell if the index was made for a different recording.
+	const QByteArray tail = readRecording(qMax(blockStart, blockEnd - INDEX_CHECKSUM_WINDOW), blockEnd);
+	if(tail.isEmpty())
+		return QByteArray();
+
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+	hash.addData(entry);
+	hash.addData(tail);
+	return hash.result();
+}
+
+bool FiledHistory::loadIndex()
+{
+	QFile f(indexFilename());
+	if(!f.open(QFile::ReadWrite))
+		return false;
+
+	QDataStream ds(&f);
+	ds.setVersion(QDataStream::Qt_5_0);
+
+	quint32 magic, version;
+	qint64 startOffset;
+	ds >> magic >> version >> startOffset;
+
+	if(ds.status() != QDataStream::Ok || magic != INDEX_MAGIC || version != INDEX_VERSION || startOffset != m_recording->pos()) {
+		qWarning() << f.fileName() << "invalid block index";
+		f.remove();
+		return false;
+	}
+
+	// Each entry describes one closed block. Entries are appended as blocks
+	// are closed, so if the server crashed mid-write, or the recording was
+	// truncated, the entries up to the damaged one are still usable.
+	QVector<Block> blocks;
+	UserState users;
+	qint64 offset = startOffset;
+	int index = firstIndex();
+	qint64 validEnd = f.pos();
+
+	while(!ds.atEnd()) {
+		QByteArray entry, checksum;
+		ds >> entry >> checksum;
+		if(ds.status() != QDataStream::Ok)
+			break;
+
+		QDataStream es(entry);
+		es.setVersion(QDataStream::Qt_5_0);
+
+		quint32 count, size;
+		UserState entryUsers;
+		es >> count >> size >> entryUsers.present >> entryUsers.left;
+
+		if(
+			es.status() != QDataStream::Ok ||
+			count == 0 || size == 0 ||
+			count > size ||
+			offset + size > m_recording->size() ||
+			checksum.isEmpty() ||
+			checksum != indexChecksum(entry, offset, offset + size)
+		)
+			break;
+
+		blocks << Block {
+			offset,
+			index,
+			int(count),
+			offset + size,
+			protocol::MessageList(),
+			QVector<int>()
+		};
+		offset += size;
+		index += count;
+		users = entryUsers;
+		validEnd = f.pos();
+	}
+
+	if(blocks.isEmpty()) {
+		qWarning() << f.fileName() << "block index does not match the recording";
+		f.remove();
+		return false;
+	}
+
+	if(validEnd < f.size()) {
+		qWarning() << f.fileName() << "block index does not match the recording after block" << blocks.size();
+		if(!f.resize(validEnd)) {
+			qWarning() << f.fileName() << f.errorString();
+			f.remove();
+			return false;
+		}
+	}
+
+	blocks << Block {
+		offset,
+		index,
+		0,
+		offset,
+		protocol::MessageList(),
+		QVector<int>()
+	};
+
+	m_blocks = blocks;
+	m_users = users;
+	m_indexedBlocks = blocks.size() - 1;
+	for(const uint8_t user : users.left) {
+		if(user >= IdQueue::FIRST_ID && user <= IdQueue::LAST_ID)
+			idQueue().reserveId(user);
+	}
+
+	m_recording->seek(offset);
 	return true;
 }
 
+void FiledHistory::appendIndex()
+{
+	// Only closed blocks are indexed, and each one just once, in order
+	const int block = m_blocks.size() - 2;
+	if(block < 0 || block != m_indexedBlocks)
+		return;
+
+	const Block &b = m_blocks.at(block);
+
+	QFile f(indexFilename());
+	if(!f.open(QFile::WriteOnly | QFile::Append)) {
+		qWarning() << f.fileName() << f.errorString();
+		return;
+	}
+
+	QDataStream ds(&f);
+	ds.setVersion(QDataStream::Qt_5_0);
+
+	if(f.size() == 0)
+		ds << INDEX_MAGIC << INDEX_VERSION << m_blocks.first().startOffset;
+
+	QByteArray entry;
+	{
+		QDataStream es(&entry, QIODevice::WriteOnly);
+		es.setVersion(QDataStream::Qt_5_0);
+		es << quint32(b.count) << quint32(b.endOffset - b.startOffset) << m_users.present << m_users.left;
+	}
+
+	ds << entry << indexChecksum(entry, b.startOffset, b.endOffset);
+
+	if(ds.status() != QDataStream::Ok || !f.flush()) {
+		// A gap in the index would misplace the entries after it
+		qWarning() << f.fileName() << f.errorString();
+		f.remove();
+		m_indexedBlocks = -1;
+		return;
+	}
+
+	++m_indexedBlocks;
+}
+
 void FiledHistory::terminate()
 {
 	m_recording->close();
 	m_journal->close();
 
+	// The index can be regenerated from the recording, so it is never archived
+	QFile::remove(indexFilename());
+
 	if(m_archive) {
 		m_journal->rename(m_journal->fileName() + ".archived");
 		m_recording->rename(m_recording->fileName() + ".archived");
@@ -453,14 +897,22 @@ void FiledHistory::closeBlock()
 	if(b.count==0)
 		return;
 
-	// Mark last block as closed and start a new one
+	// Mark last block as closed and start a new one.
+	// Only the open block needs the message index.
+	b.offsets = QVector<int>();
+	if(b.messages.size() == b.count)
+		cacheBlock(b);
+
 	m_blocks << Block {
 				b.endOffset,
 				b.startIndex+b.count,
 				0,
 				b.endOffset,
-				protocol::MessageList()
+				protocol::MessageList(),
+				QVector<int>()
 	};
+
+	appendIndex();
 }
 
 void FiledHistory::setPasswordHash(const QByteArray &password)
@@ -472,7 +924,7 @@ void FiledHistory::setPasswordHash(const QByteArray &password)
 		if(!m_password.isEmpty())
 			m_journal->write(m_password);
 		m_journal->write("\n");
-		m_journal->flush();
+		commitJournal();
 	}
 }
 
@@ -484,7 +936,7 @@ void FiledHistory::setOpwordHash(const QByteArray &opword)
 	if(!m_opword.isEmpty())
 		m_journal->write(m_opword);
 	m_journal->write("\n");
-	m_journal->flush();
+	commitJournal();
 }
 
 QDateTime FiledHistory::startTime() const
@@ -498,7 +950,7 @@ void FiledHistory::setMaxUsers(int max)
 	if(newMax != m_maxUsers) {
 		m_maxUsers = newMax;
 		m_journal->write(QString("MAXUSERS %1\n").arg(newMax).toUtf8());
-		m_journal->flush();
+		commitJournal();
 	}
 }
 
@@ -508,7 +960,7 @@ void FiledHistory::setAutoResetThreshold(uint limit)
 	if(newLimit != m_autoResetThreshold) {
 		m_autoResetThreshold = newLimit;
 		m_journal->write(QString("AUTORESET %1\n").arg(newLimit).toUtf8());
-		m_journal->flush();
+		commitJournal();
 	}
 }
 
@@ -517,7 +969,7 @@ void FiledHistory::setTitle(const QString &title)
 	if(title != m_title) {
 		m_title = title;
 		m_journal->write(QString("TITLE %1\n").arg(title).toUtf8());
-		m_journal->flush();
+		commitJournal();
 	}
 }
 
@@ -537,7 +989,7 @@ void FiledHistory::setFlags(Flags f)
 		if(f.testFlag(AuthOnly))
 			fstr << "authonly";
 		m_journal->write(QString("FLAGS %1\n").arg(fstr.join(' ')).toUtf8());
-		m_journal->flush();
+		commitJournal();
 	}
 }
 
@@ -550,10 +1002,10 @@ void FiledHistory::joinUser(uint8_t id, const QString &name)
 		+ " "
 		+ name.toUtf8().toPercentEncoding(QByteArray(), " ")
 		+ "\n");
-	m_journal->flush();
+	commitJournal();
 }
 
-std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
+int FiledHistory::findBlock(int after) const
 {
 	// Find the block that contains the index *after*
 	int i=m_blocks.size()-1;
@@ -562,26 +1014,55 @@ std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
 		if(b.startIndex+b.count-1 <= after)
 			break;
 	}
+	return i;
+}
 
+QByteArray FiledHistory::readRecording(qint64 from, qint64 to) const
+{
+	const qint64 prevPos = m_recording->pos();
+	m_recording->seek(from);
+	const QByteArray data = m_recording->read(to - from);
+	m_recording->seek(prevPos);
+
+	if(data.length() != to - from) {
+		qWarning() << m_recording->fileName() << "read error!";
+		return QByteArray();
+	}
+	return data;
+}
+
+std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
+{
+	const int i = findBlock(after);
 	const Block &b = m_blocks.at(i);
 
 	const int idxOffset = qMax(0, after - b.startIndex + 1);
 	if(idxOffset >= b.count)
 		return std::make_tuple(protocol::MessageList(), b.startIndex+b.count-1);
 
-	if(b.messages.isEmpty() && b.count>0) {
+	if(!b.messages.isEmpty()) {
+		if(m_cache)
+			m_cache->countHit();
+
+	} else if(b.count>0) {
 		// Load the block worth of messages to memory if not already loaded
-		const qint64 prevPos = m_recording->pos();
+		if(m_cache)
+			m_cache->countMiss();
+
 		qDebug() << m_recording->fileName() << "loading block" << i;
-		m_recording->seek(b.startOffset);
-		QByteArray buffer;
+		const QByteArray data = readRecording(b.startOffset, b.endOffset);
+		const uchar *ptr = reinterpret_cast<const uchar*>(data.constData());
+		int offset = 0;
 		for(int m=0;m<b.count;++m) {
-			if(!recording::readRecordingMessage(m_recording, buffer)) {
-				qWarning() << m_recording->fileName() << "read error!";
-				m_recording->close();
-				break;
+			protocol::NullableMessageRef msg;
+			if(data.length() - offset >= protocol::Message::HEADER_LEN) {
+				const int len = protocol::Message::sniffLength(data.constData() + offset);
+				if(data.length() - offset >= len) {
+					msg = protocol::Message::deserialize(ptr + offset, len, false);
+					offset += len;
+				}
 			}
-			protocol::NullableMessageRef msg = protocol::Message::deserialize((const uchar*)buffer.constData(), buffer.length(), false);
+
 			if(msg.isNull()) {
 				qWarning() << m_recording->fileName() << "Invalid message in block" << i;
 				m_recording->close();
@@ -589,27 +1070,79 @@ std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
 			}
 			const_cast<Block&>(b).messages << protocol::MessagePtr::fromNullable(msg);
 		}
-
-		m_recording->seek(prevPos);
 	}
 	Q_ASSERT(b.messages.size() == b.count);
+	cacheBlock(b);
 	return std::make_tuple(b.messages.mid(idxOffset), b.startIndex+b.count-1);
 }
 
+std::tuple<QByteArray, int> FiledHistory::getRawBatch(int after) const
+{
+	const int i = findBlock(after);
+	const Block &b = m_blocks.at(i);
+	const int lastIndex = b.startIndex+b.count-1;
+
+	const int idxOffset = qMax(0, after - b.startIndex + 1);
+	if(idxOffset >= b.count)
+		return std::make_tuple(QByteArray(), lastIndex);
+
+	if(b.messages.size() == b.count) {
+		// The block is cached and the messages' wire format is already in memory
+		if(m_cache) {
+			m_cache->countHit();
+			cacheBlock(b);
+		}
+		QByteArray data;
+		for(int m=idxOffset;m<b.count;++m)
+			data.append(b.messages.at(m)->serialized());
+		return std::make_tuple(data, lastIndex);
+	}
+
+	// The recording file contains the messages in the same format
+	// as they are sent, so they can be read and sent as is.
+	if(m_cache)
+		m_cache->countMiss();
+
+	if(b.offsets.size() == b.count)
+		return std::make_tuple(readRecording(b.startOffset + b.offsets.at(idxOffset), b.endOffset), lastIndex);
+
+	const QByteArray data = readRecording(b.startOffset, b.endOffset);
+	int offset = 0;
+	for(int m=0;m<idxOffset && data.length() - offset >= protocol::Message::HEADER_LEN;++m)
+		offset += protocol::Message::sniffLength(data.constData() + offset);
+
+	if(offset >= data.length()) {
+		qWarning() << m_recording->fileName() << "Invalid message in block" << i;
+		return std::make_tuple(QByteArray(), lastIndex);
+	}
+
+	return std::make_tuple(offset > 0 ? data.mid(offset) : data, lastIndex);
+}
+
 void FiledHistory::historyAdd(const protocol::MessagePtr &msg)
 {
-	QVarLengthArray<char> buf(msg->length());
-	const int len = msg->serialize(buf.data());
-	Q_ASSERT(len == buf.length());
-	m_recording->write(buf.data(), len);
+	const QByteArray buf = msg->serialized();
+	const int len = buf.length();
+	m_recording->write(buf);
+	commitRecording(len);
 
 	Block &b = m_blocks.last();
+
+	// Add message to cache, if already active (if cache is empty, it will be loaded from disk when needed.)
+	// A new block's cache starts out active, since its messages are in memory already.
+	const bool cached = b.messages.size() == b.count;
+	if(cached)
+		b.messages.append(msg);
+	if(b.offsets.size() == b.count)
+		b.offsets.append(int(b.endOffset - b.startOffset));
+
 	b.count++;
 	b.endOffset += len;
 
-	// Add message to cache, if already active (if cache is empty, it will be loaded from disk when needed)
-	if(!b.messages.isEmpty())
-		b.messages.append(msg);
+	// Note: the open block is registered with the shared cache only when it is
+	// closed or read, so the cache's mutex is not taken for every message.
+
+	trackUser(msg->type(), msg->contextId());
 
 	if(b.endOffset-b.startOffset > MAX_BLOCK_SIZE)
 		closeBlock();
@@ -619,9 +1152,14 @@ void FiledHistory::historyReset(const protocol::MessageList &newHistory)
 {
 	QFile *oldRecording = m_recording;
 	oldRecording->close();
+	QFile::remove(indexFilename());
 
 	m_recording = nullptr;
 	m_blocks.clear();
+	m_users = UserState();
+	m_indexedBlocks = 0;
+	if(m_cache)
+		m_cache->removeAll(this);
 	initRecording();
 
 	// Remove old recording after the new one has been created so
@@ -644,6 +1182,8 @@ void FiledHistory::cleanupBatches(int before)
 		if(!b.messages.isEmpty()) {
 			qDebug() << "releasing history block cache from" << b.startIndex << "to" << b.startIndex+b.count-1;
 			b.messages = protocol::MessageList();
+			if(m_cache)
+				m_cache->remove(this, b.startIndex);
 		}
 	}
 }
@@ -658,13 +1198,13 @@ void FiledHistory::historyAddBan(int id, const QString &username, const QHostAdd
 			extAuthId.toUtf8().toPercentEncoding(QByteArray(), include) + " " +
 			bannedBy.toUtf8().toPercentEncoding(QByteArray(), include) + "\n";
 	m_journal->write(entry);
-	m_journal->flush();
+	commitJournal();
 }
 
 void FiledHistory::historyRemoveBan(int id)
 {
 	m_journal->write(QByteArray("UNBAN ") + QByteArray::number(id) + "\n");
-	m_journal->flush();
+	commitJournal();
 }
 
 void FiledHistory::timerEvent(QTimerEvent *)
@@ -678,7 +1218,7 @@ void FiledHistory::addAnnouncement(const QString &url)
 	if(!m_announcements.contains(url)) {
 		m_announcements << url;
 		m_journal->write(QString("ANNOUNCE %1\n").arg(url).toUtf8());
-		m_journal->flush();
+		commitJournal();
 	}
 }
 
@@ -687,7 +1227,7 @@ void FiledHistory::removeAnnouncement(const QString &url)
 	if(m_announcements.contains(url)) {
 		m_announcements.removeAll(url);
 		m_journal->write(QString("UNANNOUNCE %1\n").arg(url).toUtf8());
-		m_journal->flush();
+		commitJournal();
 	}
 }
 
@@ -700,13 +1240,13 @@ void FiledHistory::setAuthenticatedOperator(const QString &authId, bool op)
 		if(!m_ops.contains(authId)) {
 			m_ops.insert(authId);
 			m_journal->write(QStringLiteral("OP %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			commitJournal();
 		}
 	} else {
 		if(m_ops.contains(authId)) {
 			m_ops.remove(authId);
 			m_journal->write(QStringLiteral("DEOP %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			commitJournal();
 		}
 	}
 }
@@ -720,13 +1260,13 @@ void FiledHistory::setAuthenticatedTrust(const QString &authId, bool trusted)
 		if(!m_trusted.contains(authId)) {
 			m_trusted.insert(authId);
 			m_journal->write(QStringLiteral("TRUST %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			commitJournal();
 		}
 	} else {
 		if(m_trusted.contains(authId)) {
 			m_trusted.remove(authId);
 			m_journal->write(QStringLiteral("UNTRUST %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			commitJournal();
 		}
 	}
 }
@@ -27,15 +27,29 @@
 #include <QDateTime>
 #include <QVector>
 #include <QSet>
+#include <QSharedPointer>
+#include <QAtomicInt>
+
+class QTimer;
 
 namespace server {
 
+class HistoryCache;
+
 class FiledHistory : public SessionHistory
 {
 	Q_OBJECT
+	friend class HistoryCache;
 public:
 	~FiledHistory();
 
+	//! How safely changes are written to disk
+	enum class Durability {
+		Relaxed,     // changes are flushed to the OS periodically
+		GroupCommit, // changes are synced to disk in batches in the background
+		Strict       // every change is synced to disk before continuing
+	};
+
 	/**
 	 * @brief Start a new file backed history
 	 * @param dir where to put the session files
@@ -70,9 +84,34 @@ public:
 	 */
 	void setArchive(bool archive) { m_archive = archive; }
 
+	/**
+	 * @brief Set the durability mode
+	 *
+	 * In group commit mode, changes are synced to disk at most
+	 * groupCommitDelay milliseconds after they were made, or as soon as
+	 * groupCommitSize bytes of history have been written.
+	 *
+	 * @param durability the durability mode
+	 * @param groupCommitDelay maximum time (in milliseconds) to wait before syncing
+	 * @param groupCommitSize maximum number of bytes to write before syncing
+	 */
+	void setDurability(Durability durability, int groupCommitDelay=1000, int groupCommitSize=1024*1024);
+	Durability durability() const { return m_durability; }
+
+	/**
+	 * @brief Register the message caches of this history with a shared cache manager
+	 *
+	 * The manager may evict cached blocks to keep the total memory usage
+	 * of all sessions within its budget.
+	 */
+	void setCache(const QSharedPointer<HistoryCache> &cache);
+
 	//! Get the metadata journal file name for the given session ID
 	static QString journalFilename(const QUuid &id);
 
+	//! Get the name of the block index file of the current recording
+	QString indexFilename() const;
+
 	QString idAlias() const override { return m_alias; }
 	QString founderName() const override { return m_founder; }
 	protocol::ProtocolVersion protocolVersion() const override { return m_version; }
@@ -95,6 +134,7 @@ public:
 	void terminate() override;
 	void cleanupBatches(int before) override;
 	std::tuple<protocol::MessageList, int> getBatch(int after) const override;
+	std::tuple<QByteArray, int> getRawBatch(int after) const override;
 
 	void addAnnouncement(const QString &) override;
 	void removeAnnouncement(const QString &url) override;
@@ -123,13 +163,34 @@ private:
 		int startIndex;
 		int count;
 		qint64 endOffset;
-		protocol::MessageList messages;
+		protocol::MessageList messages; // cached messages (either empty or complete)
+		QVector<int> offsets;           // message offsets relative to startOffset (open block only)
+	};
+
+	// Users present in the recording and the IDs of those who have left (in the order they left)
+	struct UserState {
+		QSet<uint8_t> present;
+		QList<uint8_t> left;
 	};
 
 	bool create();
 	bool load();
 	bool scanBlocks();
+	bool loadIndex();
+	void appendIndex();
+	QByteArray indexChecksum(const QByteArray &entry, qint64 blockStart, qint64 blockEnd) const;
+	void trackUser(uint8_t msgType, uint8_t ctxId);
 	bool initRecording();
+	int findBlock(int after) const;
+	QByteArray readRecording(qint64 from, qint64 to) const;
+
+	void commitJournal();
+	void commitRecording(int bytes);
+	void scheduleSync(int bytes);
+	void syncInBackground();
+
+	void cacheBlock(const Block &b) const;
+	void evictCachedBlock(int startIndex);
 
 	QDir m_dir;
 	QFile *m_journal;
@@ -150,8 +211,19 @@ private:
 	QSet<QString> m_trusted;
 
 	QVector<Block> m_blocks;
+	UserState m_users;        // state at the end of the recording
+	int m_indexedBlocks;      // number of blocks in the index file (-1 if indexing failed)
 	int m_fileCount;
 	bool m_archive;
+
+	Durability m_durability;
+	int m_groupCommitDelay;
+	int m_groupCommitSize;
+	int m_unsyncedBytes;
+	QTimer *m_syncTimer;
+	QSharedPointer<QAtomicInt> m_syncPending; // shared with the background sync task
+
+	QSharedPointer<HistoryCache> m_cache;
 };
 
 }
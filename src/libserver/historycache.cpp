@@ -0,0 +1,144 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "historycache.h"
+#include "filedhistory.h"
+
+#include <QTimer>
+
+namespace server {
+
+HistoryCache::HistoryCache(qint64 budget)
+	: m_clock(0), m_budget(budget), m_size(0), m_hits(0), m_misses(0), m_evictions(0)
+{
+}
+
+void HistoryCache::setBudget(qint64 budget)
+{
+	QMutexLocker lock(&m_mutex);
+	if(m_budget != budget) {
+		m_budget = budget;
+		evict();
+	}
+}
+
+void HistoryCache::touch(const FiledHistory *owner, int block, qint64 size)
+{
+	QMutexLocker lock(&m_mutex);
+	const Key key { owner, block };
+
+	auto entry = m_entries.find(key);
+	if(entry == m_entries.end()) {
+		entry = m_entries.insert(key, Entry { size, 0 });
+		m_size += size;
+
+	} else {
+		m_lru.remove(entry->lastUse);
+		m_size += size - entry->size;
+		entry->size = size;
+	}
+
+	entry->lastUse = ++m_clock;
+	m_lru.insert(entry->lastUse, key);
+
+	evict();
+}
+
+bool HistoryCache::contains(const FiledHistory *owner, int block) const
+{
+	QMutexLocker lock(&m_mutex);
+	return m_entries.contains(Key { owner, block });
+}
+
+void HistoryCache::remove(const FiledHistory *owner, int block)
+{
+	QMutexLocker lock(&m_mutex);
+	const auto entry = m_entries.find(Key { owner, block });
+	if(entry != m_entries.end()) {
+		m_lru.remove(entry->lastUse);
+		m_size -= entry->size;
+		m_entries.erase(entry);
+	}
+}
+
+void HistoryCache::removeAll(const FiledHistory *owner)
+{
+	QMutexLocker lock(&m_mutex);
+	auto entry = m_entries.begin();
+	while(entry != m_entries.end()) {
+		if(entry.key().first == owner) {
+			m_lru.remove(entry->lastUse);
+			m_size -= entry->size;
+			entry = m_entries.erase(entry);
+		} else {
+			++entry;
+		}
+	}
+}
+
+void HistoryCache::countHit()
+{
+	QMutexLocker lock(&m_mutex);
+	++m_hits;
+}
+
+void HistoryCache::countMiss()
+{
+	QMutexLocker lock(&m_mutex);
+	++m_misses;
+}
+
+HistoryCache::Stats HistoryCache::stats() const
+{
+	QMutexLocker lock(&m_mutex);
+	return Stats {
+		m_budget,
+		m_size,
+		m_entries.size(),
+		m_hits,
+		m_misses,
+		m_evictions
+	};
+}
+
+void HistoryCache::evict()
+{
+	// Note: the caller must hold the mutex
+	if(m_budget <= 0)
+		return;
+
+	// The most recently used block is always kept, even if it alone exceeds the budget
+	while(m_size > m_budget && m_lru.size() > 1) {
+		const Key key = m_lru.take(m_lru.firstKey());
+		m_size -= m_entries.take(key).size;
+		++m_evictions;
+
+		// The owner is notified in its own thread. If it used the block again in
+		// the mean time, the block is registered again and the eviction is ignored.
+		// The owner's destructor removes its blocks while holding the mutex, so the
+		// owner is guaranteed to still exist here.
+		FiledHistory *owner = const_cast<FiledHistory*>(key.first);
+		const int block = key.second;
+		QTimer::singleShot(0, owner, [owner, block]() {
+			owner->evictCachedBlock(block);
+		});
+	}
+}
+
+}
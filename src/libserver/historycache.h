@@ -0,0 +1,119 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_HISTORYCACHE_H
+#define DP_SERVER_HISTORYCACHE_H
+
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QMutex>
+
+namespace server {
+
+class FiledHistory;
+
+/**
+ * @brief Serverwide memory budget for the message caches of file backed sessions
+ *
+ * FiledHistory objects register their cached blocks here. When the total size
+ * of the cached blocks exceeds the budget, the least recently used blocks
+ * are evicted, regardless of which session they belong to. Evicted blocks
+ * are simply reloaded from disk when they are needed again.
+ *
+ * The sessions may live in different threads, so this class is thread safe.
+ * Evictions are delivered to the owning FiledHistory through its event loop,
+ * so the budget may be exceeded for a moment.
+ *
+ * The budget is approximate: a block's size is the length of its messages'
+ * wire encoding, which does not include the overhead of the decoded message
+ * objects. Also, the block a session is currently appending to is registered
+ * only when it is closed or read, so up to one block per session is not counted.
+ */
+class HistoryCache
+{
+public:
+	struct Stats {
+		qint64 budget;    // memory budget in bytes (0 if unlimited)
+		qint64 size;      // total size of cached blocks in bytes
+		int blocks;       // number of cached blocks
+		quint64 hits;     // number of batches served from the cache
+		quint64 misses;   // number of batches read from disk
+		quint64 evictions;// number of blocks evicted to stay within the budget
+	};
+
+	//! Create a cache with the given budget (0 means unlimited)
+	explicit HistoryCache(qint64 budget=0);
+
+	//! Change the memory budget. Blocks are evicted immediately if needed
+	void setBudget(qint64 budget);
+
+	/**
+	 * @brief Mark a block as cached and most recently used
+	 *
+	 * If the block is already registered, its size is updated.
+	 *
+	 * @param owner the history the block belongs to
+	 * @param block the index of the block's first message
+	 * @param size the size of the block's messages in bytes (in wire format)
+	 */
+	void touch(const FiledHistory *owner, int block, qint64 size);
+
+	//! Check if the given block is registered
+	bool contains(const FiledHistory *owner, int block) const;
+
+	//! Remove a block whose cache was released by its owner
+	void remove(const FiledHistory *owner, int block);
+
+	//! Remove all blocks belonging to the given history
+	void removeAll(const FiledHistory *owner);
+
+	//! Record a batch served from a cached block
+	void countHit();
+
+	//! Record a batch that had to be read from disk
+	void countMiss();
+
+	Stats stats() const;
+
+private:
+	typedef QPair<const FiledHistory*, int> Key;
+
+	struct Entry {
+		qint64 size;
+		quint64 lastUse;
+	};
+
+	void evict();
+
+	mutable QMutex m_mutex;
+	QHash<Key, Entry> m_entries;
+	QMap<quint64, Key> m_lru; // least recently used block first
+	quint64 m_clock;
+
+	qint64 m_budget;
+	qint64 m_size;
+	quint64 m_hits;
+	quint64 m_misses;
+	quint64 m_evictions;
+};
+
+}
+
+#endif
@@ -21,6 +21,8 @@
 
 #include "serverconfig.h"
 
+#include <QMutex>
+
 namespace server {
 
 class ServerLog;
@@ -40,6 +42,7 @@ protected:
 
 private:
 	QHash<int, QString> m_config;
+	mutable QMutex m_mutex;
 	ServerLog *m_logger;
 };
 
@@ -20,6 +20,8 @@
 #include "inmemoryhistory.h"
 #include "../libshared/util/passwordhash.h"
 
+#include <algorithm>
+
 namespace server {
 
 InMemoryHistory::InMemoryHistory(const QUuid &id, const QString &alias, const protocol::ProtocolVersion &version, const QString &founder, QObject *parent)
@@ -39,20 +41,84 @@ std::tuple<protocol::MessageList, int> InMemoryHistory::getBatch(int after) cons
 	if(after >= lastIndex())
 		return std::make_tuple(protocol::MessageList(), lastIndex());
 
-	const int offset = qMax(0, after - firstIndex() + 1);
-	Q_ASSERT(offset<m_history.size());
+	const int first = qMax(0, after - firstIndex() + 1);
+	Q_ASSERT(first<m_offsets.size());
+
+	protocol::MessageList batch;
+	batch.reserve(m_offsets.size() - first);
+	for(int i=first;i<m_offsets.size();++i) {
+		const protocol::NullableMessageRef msg = messageAt(i);
+		if(msg.isNull())
+			qWarning("InMemoryHistory: couldn't decode message %d", firstIndex() + i);
+		else
+			batch << protocol::MessagePtr::fromNullable(msg);
+	}
+
+	return std::make_tuple(batch, lastIndex());
+}
+
+std::tuple<QByteArray, int> InMemoryHistory::getRawBatch(int after) const
+{
+	if(after >= lastIndex())
+		return std::make_tuple(QByteArray(), lastIndex());
+
+	const int first = qMax(0, after - firstIndex() + 1);
+	Q_ASSERT(first<m_offsets.size());
+
+	// Find the first message that starts past the batch size limit.
+	// The batch always includes at least one message.
+	const int start = m_offsets.at(first);
+	const auto next = std::lower_bound(m_offsets.constBegin() + first + 1, m_offsets.constEnd(), start + MAX_RAW_BATCH);
+	const int last = int(next - m_offsets.constBegin()) - 1;
 
-	return std::make_tuple(m_history.mid(offset), lastIndex());
+	// Note: the batch is copied out of the arena. A view into the arena would
+	// dangle as soon as the arena is reallocated to make room for new messages,
+	// and a shared reference (which mid() returns when the batch covers the whole
+	// arena) would make the next addition copy the entire arena instead.
+	return std::make_tuple(
+		QByteArray(m_arena.constData() + start, messageEnd(last) - start),
+		firstIndex() + last
+		);
+}
+
+protocol::NullableMessageRef InMemoryHistory::messageAt(int i) const
+{
+	const int offset = m_offsets.at(i);
+	return protocol::Message::deserialize(
+		reinterpret_cast<const uchar*>(m_arena.constData()) + offset,
+		messageEnd(i) - offset,
+		true
+		);
+}
+
+int InMemoryHistory::messageEnd(int i) const
+{
+	return i+1 < m_offsets.size() ? m_offsets.at(i+1) : m_arena.length();
 }
 
 void InMemoryHistory::historyAdd(const protocol::MessagePtr &msg)
 {
-	m_history << msg;
+	// Note: the message is serialized straight into the arena, so the message
+	// object doesn't need to keep a cached copy of its wire format.
+	const int offset = m_arena.length();
+	m_offsets << offset;
+	m_arena.resize(offset + msg->length());
+	msg->serialize(m_arena.data() + offset);
 }
 
 void InMemoryHistory::historyReset(const protocol::MessageList &newHistory)
 {
-	m_history = newHistory;
+	int size = 0;
+	for(const protocol::MessagePtr &msg : newHistory)
+		size += msg->length();
+
+	m_arena = QByteArray();
+	m_arena.reserve(size);
+	m_offsets.clear();
+	m_offsets.reserve(newHistory.size());
+
+	for(const protocol::MessagePtr &msg : newHistory)
+		historyAdd(msg);
 }
 
 }
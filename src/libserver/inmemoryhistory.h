@@ -24,11 +24,15 @@
 
 #include <QDateTime>
 #include <QSet>
+#include <QVector>
 
 namespace server {
 
 /**
  * @brief A session history backend that stores the session in memory
+ *
+ * This is used by both thin sessions without a session directory and
+ * thick sessions.
  */
 class InMemoryHistory : public SessionHistory {
 	Q_OBJECT
@@ -36,6 +40,7 @@ public:
 	InMemoryHistory(const QUuid &id, const QString &alias, const protocol::ProtocolVersion &version, const QString &founder, QObject *parent=nullptr);
 
 	std::tuple<protocol::MessageList, int> getBatch(int after) const override;
+	std::tuple<QByteArray, int> getRawBatch(int after) const override;
 
 	void terminate() override { /* nothing to do */ }
 	void cleanupBatches(int) override { /* no caching, nothing to do */ }
@@ -87,7 +92,14 @@ protected:
 	void historyRemoveBan(int) override { /* not persistent */ }
 
 private:
-	protocol::MessageList m_history;
+	protocol::NullableMessageRef messageAt(int i) const;
+	int messageEnd(int i) const;
+
+	// The messages are stored in their wire format, one after another.
+	// This takes much less memory than keeping the message objects around,
+	// and raw batches are made with a single copy, without serializing anything.
+	QByteArray m_arena;
+	QVector<int> m_offsets; // start offset of each message in the arena
 	QSet<QString> m_ops;
 	QSet<QString> m_trusted;
 	QSet<QString> m_announcements;
@@ -42,6 +42,7 @@ struct JsonApiResult {
 		Ok=200,
 		BadRequest=400,
 		NotFound=404,
+		ServiceUnavailable=503,
 		InternalError=505,
 		ConnectionError=-1
 	};
@@ -23,9 +23,11 @@
 #include "sessions.h"
 #include "serverconfig.h"
 #include "serverlog.h"
+#include "metrics.h"
 
 #include "../libshared/net/control.h"
 #include "../libshared/util/authtoken.h"
+#include "../libshared/util/passwordhash.h"
 #include "../libshared/util/networkaccess.h"
 #include "../libshared/util/validators.h"
 
@@ -35,6 +37,7 @@
 #include <QRegularExpression>
 #include <QNetworkRequest>
 #include <QNetworkReply>
+#include <QPointer>
 
 namespace server {
 
@@ -42,6 +45,18 @@ Sessions::~Sessions()
 {
 }
 
+bool Sessions::callInSession(const QString &id, const std::function<void(Session*)> &func)
+{
+	func(getSessionById(id, false));
+	return true;
+}
+
+void Sessions::enterSession(Client *client, const QString &id, const std::function<void(Session*)> &func)
+{
+	Q_UNUSED(client);
+	func(getSessionById(id, true));
+}
+
 LoginHandler::LoginHandler(Client *client, Sessions *sessions, ServerConfig *config)
 	: QObject(client), m_client(client), m_sessions(sessions), m_config(config)
 {
@@ -50,6 +65,7 @@ LoginHandler::LoginHandler(Client *client, Sessions *sessions, ServerConfig *con
 
 void LoginHandler::startLoginProcess()
 {
+	m_loginTime.start();
 	m_state = State::WaitForIdent;
 
 	protocol::ServerReply greeting;
@@ -73,6 +89,10 @@ void LoginHandler::startLoginProcess()
 		flags << "REPORT";
 	if(m_config->getConfigBool(config::AllowCustomAvatars))
 		flags << "AVATAR";
+	if(m_config->getConfigBool(config::AllowCompression)) {
+		flags << "DEFLATE";
+		m_client->setCompressionAllowed(true);
+	}
 
 	greeting.reply["flags"] = flags;
 
@@ -167,6 +187,17 @@ void LoginHandler::handleLoginMessage(protocol::MessagePtr msg)
 			sendError("tlsRequired", "TLS required");
 		}
 
+	} else if(m_state == State::WaitForVerification) {
+		// The client must wait for the result before sending anything else
+		m_client->log(Log().about(Log::Level::Error, Log::Topic::RuleBreak).message("Login command received while verifying credentials: " + cmd.cmd));
+		m_client->disconnectClient(Client::DisconnectionReason::Error, "invalid message");
+
+	} else if(m_state == State::WaitForSession) {
+		// The client is being handed over to the session's thread.
+		// The login handler may no longer access the session list.
+		m_client->log(Log().about(Log::Level::Error, Log::Topic::RuleBreak).message("Login command received while joining a session: " + cmd.cmd));
+		m_client->disconnectClient(Client::DisconnectionReason::Error, "invalid message");
+
 	} else if(m_state == State::WaitForIdent) {
 		// Wait for user identification before moving on to session listing
 		if(cmd.cmd == "ident") {
@@ -204,7 +235,28 @@ void LoginHandler::handleIdentMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
-	const RegisteredUser userAccount = m_config->getUserAccount(username, password);
+	// Checking the password is slow, so it is done in the background
+	const ServerConfig *serverConfig = m_config;
+	m_state = State::WaitForVerification;
+
+	const auto status = verifyCredentials(
+		m_config->credentialVerifier(),
+		m_client->peerAddress(),
+		this,
+		[serverConfig, username, password]() { return serverConfig->getUserAccount(username, password); },
+		[this, cmd](const RegisteredUser &userAccount) { handleIdentResult(cmd, userAccount); }
+	);
+
+	if(status != CredentialVerifier::Queued)
+		sendVerificationError(status);
+}
+
+void LoginHandler::handleIdentResult(const protocol::ServerCommand &cmd, const RegisteredUser &userAccount)
+{
+	m_state = State::WaitForIdent;
+
+	const QString username = cmd.args[0].toString();
+	const QString password = cmd.args.size()>1 ? cmd.args[1].toString() : QString();
 
 	if(userAccount.status != RegisteredUser::NotFound && cmd.kwargs.contains("extauth")) {
 		// This should never happen. If it does, it means there's a bug in the client
@@ -233,41 +285,22 @@ void LoginHandler::handleIdentMessage(const protocol::ServerCommand &cmd)
 					sendError("extAuthError", "Ext auth not requested!");
 					return;
 				}
+
+				// Signature checking is done in the background too
 				const AuthToken extAuthToken(cmd.kwargs["extauth"].toString().toUtf8());
 				const QByteArray key = QByteArray::fromBase64(m_config->getConfigString(config::ExtAuthKey).toUtf8());
-				if(!extAuthToken.checkSignature(key)) {
-					sendError("extAuthError", "Ext auth token signature mismatch!");
-					return;
-				}
-				if(!extAuthToken.validatePayload(m_config->getConfigString(config::ExtAuthGroup), m_extauth_nonce)) {
-					sendError("extAuthError", "Ext auth token is invalid!");
-					return;
-				}
-
-				// Token is valid: log in as an authenticated user
-				const QJsonObject ea = extAuthToken.payload();
-				const QJsonValue uid = ea["uid"];
+				m_state = State::WaitForVerification;
 
-				// We need some unique identifier. If the server didn't provide one,
-				// the username is better than nothing.
-				QString extAuthId = uid.isDouble() ? QString::number(uid.toInt()) : uid.toString();
-				if(extAuthId.isEmpty())
-					extAuthId = ea["username"].toString();
+				const auto status = verifyCredentials(
+					m_config->credentialVerifier(),
+					m_client->peerAddress(),
+					this,
+					[extAuthToken, key]() { return extAuthToken.checkSignature(key); },
+					[this, extAuthToken](bool ok) { extAuthLogin(extAuthToken, ok); }
+				);
 
-				// Prefix to identify this auth ID as an ext-auth ID
-				extAuthId = m_config->internalConfig().extAuthUrl.host() + ":" + extAuthId;
-
-				QByteArray avatar;
-				if(m_config->getConfigBool(config::ExtAuthAvatars))
-					avatar = extAuthToken.avatar();
-
-				authLoginOk(
-					ea["username"].toString(),
-					extAuthId,
-					ea["flags"].toArray(),
-					avatar,
-					m_config->getConfigBool(config::ExtAuthMod)
-					);
+				if(status != CredentialVerifier::Queued)
+					sendVerificationError(status);
 
 			} else {
 				// No ext-auth token provided: request it now
@@ -308,6 +341,7 @@ void LoginHandler::handleIdentMessage(const protocol::ServerCommand &cmd)
 			send(identReply);
 
 		} else {
+			metrics::add(metrics::global().authFailures);
 			sendError("badPassword", "Incorrect password");
 		}
 		return;
@@ -329,6 +363,49 @@ void LoginHandler::handleIdentMessage(const protocol::ServerCommand &cmd)
 	}
 }
 
+#ifdef HAVE_LIBSODIUM
+void LoginHandler::extAuthLogin(const AuthToken &extAuthToken, bool signatureOk)
+{
+	m_state = State::WaitForIdent;
+
+	if(!signatureOk) {
+		metrics::add(metrics::global().authFailures);
+		sendError("extAuthError", "Ext auth token signature mismatch!");
+		return;
+	}
+	if(!extAuthToken.validatePayload(m_config->getConfigString(config::ExtAuthGroup), m_extauth_nonce)) {
+		metrics::add(metrics::global().authFailures);
+		sendError("extAuthError", "Ext auth token is invalid!");
+		return;
+	}
+
+	// Token is valid: log in as an authenticated user
+	const QJsonObject ea = extAuthToken.payload();
+	const QJsonValue uid = ea["uid"];
+
+	// We need some unique identifier. If the server didn't provide one,
+	// the username is better than nothing.
+	QString extAuthId = uid.isDouble() ? QString::number(uid.toInt()) : uid.toString();
+	if(extAuthId.isEmpty())
+		extAuthId = ea["username"].toString();
+
+	// Prefix to identify this auth ID as an ext-auth ID
+	extAuthId = m_config->internalConfig().extAuthUrl.host() + ":" + extAuthId;
+
+	QByteArray avatar;
+	if(m_config->getConfigBool(config::ExtAuthAvatars))
+		avatar = extAuthToken.avatar();
+
+	authLoginOk(
+		ea["username"].toString(),
+		extAuthId,
+		ea["flags"].toArray(),
+		avatar,
+		m_config->getConfigBool(config::ExtAuthMod)
+		);
+}
+#endif
+
 void LoginHandler::authLoginOk(const QString &username, const QString &authId, const QJsonArray &flags, const QByteArray &avatar, bool allowMod)
 {
 	Q_ASSERT(!authId.isEmpty());
@@ -520,9 +597,10 @@ void LoginHandler::handleHostMessage(const protocol::ServerCommand &cmd)
 	}
 
 	// Create a new session
+	const QUuid sessionId = QUuid::createUuid();
 	Session *session;
 	QString sessionErrorCode;
-	std::tie(session, sessionErrorCode) = m_sessions->createSession(QUuid::createUuid(), sessionAlias, protocolVersion, m_client->username());
+	std::tie(session, sessionErrorCode) = m_sessions->createSession(sessionId, sessionAlias, protocolVersion, m_client->username());
 
 	if(!session) {
 		QString msg;
@@ -539,26 +617,40 @@ void LoginHandler::handleHostMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
-	if(cmd.kwargs["password"].isString())
-		session->history()->setPassword(cmd.kwargs["password"].toString());
+	// The new session may live in another thread: the rest
+	// of the login process is completed in the session's thread.
+	m_state = State::WaitForSession;
+	const QJsonValue password = cmd.kwargs["password"];
+	const QString sessionIdString = sessionId.toString().mid(1, 36); // strip braces
 
-	// Mark login phase as complete. No more login messages will be sent to this user
-	protocol::ServerReply reply;
-	reply.type = protocol::ServerReply::RESULT;
-	reply.message = "Starting new session!";
-	reply.reply["state"] = "host";
+	m_sessions->enterSession(m_client, sessionIdString, [this, password, sessionAlias, userId](Session *session) {
+		if(!session) {
+			sendError("notFound", "Session not found!");
+			return;
+		}
 
-	QJsonObject joinInfo;
-	joinInfo["id"] = sessionAlias.isEmpty() ? session->idString() : sessionAlias;
-	joinInfo["user"] = userId;
-	joinInfo["flags"] = sessionFlags(session);
-	reply.reply["join"] = joinInfo;
-	send(reply);
+		if(password.isString())
+			session->history()->setPassword(password.toString());
 
-	m_complete = true;
-	session->joinUser(m_client, true);
+		// Mark login phase as complete. No more login messages will be sent to this user
+		protocol::ServerReply reply;
+		reply.type = protocol::ServerReply::RESULT;
+		reply.message = "Starting new session!";
+		reply.reply["state"] = "host";
 
-	deleteLater();
+		QJsonObject joinInfo;
+		joinInfo["id"] = sessionAlias.isEmpty() ? session->idString() : sessionAlias;
+		joinInfo["user"] = userId;
+		joinInfo["flags"] = sessionFlags(session);
+		reply.reply["join"] = joinInfo;
+		send(reply);
+
+		m_complete = true;
+		countLogin();
+		session->joinUser(m_client, true);
+
+		deleteLater();
+	});
 }
 
 void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
@@ -569,9 +661,20 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
-	QString sessionId = cmd.args.at(0).toString();
+	const QString sessionId = cmd.args.at(0).toString();
+	const QString password = cmd.kwargs.value("password").toString();
+
+	// The session may live in another thread: the rest
+	// of the login process is completed in the session's thread.
+	m_state = State::WaitForSession;
+
+	m_sessions->enterSession(m_client, sessionId, [this, password](Session *session) {
+		joinSession(session, password);
+	});
+}
 
-	Session *session = m_sessions->getSessionById(sessionId, true);
+void LoginHandler::joinSession(Session *session, const QString &password)
+{
 	if(!session) {
 		sendError("notFound", "Session not found!");
 		return;
@@ -592,12 +695,38 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 			return;
 		}
 
-		if(!session->history()->checkPassword(cmd.kwargs.value("password").toString())) {
-			sendError("badPassword", "Incorrect password");
-			return;
-		}
+		// Password protected sessions check the password in the background.
+		// The session may end while we're waiting for the result.
+		const QByteArray passwordHash = session->history()->passwordHash();
+		const QPointer<Session> sessionPtr = session;
+
+		const auto status = verifyCredentials(
+			passwordHash.isEmpty() ? nullptr : m_config->credentialVerifier(),
+			m_client->peerAddress(),
+			this,
+			[password, passwordHash]() { return passwordhash::check(password, passwordHash); },
+			[this, sessionPtr](bool ok) {
+				if(!sessionPtr) {
+					sendError("notFound", "Session not found!");
+				} else if(!ok) {
+					metrics::add(metrics::global().authFailures);
+					sendError("badPassword", "Incorrect password");
+				} else {
+					completeJoin(sessionPtr.data());
+				}
+			}
+		);
+
+		if(status != CredentialVerifier::Queued)
+			sendVerificationError(status);
+
+	} else {
+		completeJoin(session);
 	}
+}
 
+void LoginHandler::completeJoin(Session *session)
+{
 	if(session->getClientByUsername(m_client->username())) {
 #ifdef NDEBUG
 		sendError("nameInuse", "This username is already in use");
@@ -625,6 +754,7 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 	send(reply);
 
 	m_complete = true;
+	countLogin();
 
 	session->joinUser(m_client, false);
 
@@ -633,10 +763,14 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 
 void LoginHandler::handleAbuseReport(const protocol::ServerCommand &cmd)
 {
-	Session *s = m_sessions->getSessionById(cmd.kwargs["session"].toString(), false);
-	if(s) {
-		s->sendAbuseReport(m_client, 0, cmd.kwargs["reason"].toString());
-	}
+	const QString reason = cmd.kwargs["reason"].toString();
+	const QString sessionId = cmd.kwargs["session"].toString();
+	const bool called = m_sessions->callInSession(sessionId, [this, reason](Session *s) {
+		if(s)
+			s->sendAbuseReport(m_client, 0, reason);
+	});
+	if(!called)
+		qWarning("Abuse report for session %s dropped: session is busy or being loaded", qPrintable(sessionId));
 }
 
 void LoginHandler::handleStarttls()
@@ -683,6 +817,24 @@ void LoginHandler::sendError(const QString &code, const QString &message)
 	r.reply["code"] = code;
 	send(r);
 	m_client->disconnectClient(Client::DisconnectionReason::Error, "Login error");
+	metrics::add(metrics::global().loginErrors);
+}
+
+void LoginHandler::countLogin()
+{
+	metrics::add(metrics::global().logins);
+	if(m_loginTime.isValid())
+		metrics::global().loginTime.observe(m_loginTime.elapsed() / 1000.0);
+}
+
+void LoginHandler::sendVerificationError(CredentialVerifier::Status status)
+{
+	if(status == CredentialVerifier::RateLimited) {
+		m_client->log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message("Too many login attempts"));
+		sendError("rateLimited", "Too many login attempts. Try again later.");
+	} else {
+		sendError("busy", "Server is too busy. Try again later.");
+	}
 }
 
 }
@@ -20,10 +20,12 @@
 #define DP_SERVER_LOGINHANDLER_H
 
 #include "../libshared/net/message.h"
+#include "credentialverifier.h"
 
 #include <QObject>
 #include <QStringList>
 #include <QByteArray>
+#include <QElapsedTimer>
 
 namespace protocol {
 	struct ServerCommand;
@@ -36,6 +38,8 @@ class Client;
 class Session;
 class Sessions;
 class ServerConfig;
+class AuthToken;
+struct RegisteredUser;
 
 /**
  * @brief Perform the client login handshake
@@ -98,13 +102,19 @@ private:
 	enum class State {
 		WaitForSecure,
 		WaitForIdent,
-		WaitForLogin
+		WaitForVerification,
+		WaitForLogin,
+		WaitForSession
 	};
 
 	void announceServerInfo();
 	void handleIdentMessage(const protocol::ServerCommand &cmd);
+	void handleIdentResult(const protocol::ServerCommand &cmd, const RegisteredUser &userAccount);
+	void extAuthLogin(const AuthToken &extAuthToken, bool signatureOk);
 	void handleHostMessage(const protocol::ServerCommand &cmd);
 	void handleJoinMessage(const protocol::ServerCommand &cmd);
+	void joinSession(Session *session, const QString &password);
+	void completeJoin(Session *session);
 	void handleAbuseReport(const protocol::ServerCommand &cmd);
 	void handleStarttls();
 	void requestExtAuth();
@@ -112,6 +122,8 @@ private:
 	void authLoginOk(const QString &username, const QString &authId, const QJsonArray &flags, const QByteArray &avatar, bool allowMod);
 	bool send(const protocol::ServerReply &cmd);
 	void sendError(const QString &code, const QString &message);
+	void sendVerificationError(CredentialVerifier::Status status);
+	void countLogin();
 	void extAuthGuestLogin(const QString &username);
 
 	Client *m_client;
@@ -122,6 +134,7 @@ private:
 	quint64 m_extauth_nonce = 0;
 	bool m_hostPrivilege = false;
 	bool m_complete = false;
+	QElapsedTimer m_loginTime;
 };
 
 }
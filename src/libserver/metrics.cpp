@@ -0,0 +1,248 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "metrics.h"
+#include "../libshared/net/message.h"
+
+#include <QFile>
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+#include <cmath>
+#include <chrono>
+
+namespace server {
+namespace metrics {
+
+qint64 now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+		).count();
+}
+
+void Traffic::countBatch(const QByteArray &batch)
+{
+	const char *data = batch.constData();
+	int pos = 0;
+	while(pos + protocol::Message::HEADER_LEN <= batch.length()) {
+		const int len = protocol::Message::sniffLength(data + pos);
+		count(uchar(data[pos+2]), len);
+		pos += len;
+	}
+}
+
+Histogram::Histogram(std::initializer_list<double> bounds)
+	: m_bounds(bounds)
+{
+	Q_ASSERT(m_bounds.size() <= MAX_BUCKETS);
+	m_bounds.resize(qMin(m_bounds.size(), int(MAX_BUCKETS)));
+}
+
+void Histogram::observe(double value)
+{
+	for(int i=0;i<m_bounds.size();++i) {
+		if(value <= m_bounds.at(i)) {
+			add(m_buckets[i]);
+			break;
+		}
+	}
+	add(m_count);
+	add(m_sum, quint64(qMax(0.0, value) * 1000000.0));
+}
+
+quint64 Histogram::cumulativeCount(int bucket) const
+{
+	quint64 total = 0;
+	for(int i=0;i<=bucket;++i)
+		total += m_buckets[i].load();
+	return total;
+}
+
+LatencyHistogram::LatencyHistogram()
+	: m_max(0)
+{
+}
+
+int LatencyHistogram::bucket(qint64 usecs)
+{
+	// The first SUB_BUCKETS values each have their own bucket
+	if(usecs < SUB_BUCKETS)
+		return qMax(qint64(0), usecs);
+
+	int exponent = 0;
+	while((usecs >> exponent) >= 2 * SUB_BUCKETS)
+		++exponent;
+
+	// Each doubling of the value adds SUB_BUCKETS linear buckets
+	const int b = (exponent + 1) * SUB_BUCKETS + int(usecs >> exponent) - SUB_BUCKETS;
+	return qMin(b, BUCKETS - 1);
+}
+
+qint64 LatencyHistogram::bucketMax(int bucket)
+{
+	if(bucket < SUB_BUCKETS)
+		return bucket;
+
+	const int exponent = bucket / SUB_BUCKETS - 1;
+	const qint64 mantissa = bucket % SUB_BUCKETS + SUB_BUCKETS;
+	return ((mantissa + 1) << exponent) - 1;
+}
+
+void LatencyHistogram::observe(qint64 usecs)
+{
+	usecs = qMax(qint64(0), usecs);
+	add(m_buckets[bucket(usecs)]);
+	add(m_count);
+	add(m_sum, usecs);
+
+	qint64 max = m_max.loadAcquire();
+	while(usecs > max && !m_max.testAndSetOrdered(max, usecs, max)) { }
+}
+
+qint64 LatencyHistogram::quantile(double q) const
+{
+	// Observations may arrive while we're counting, so the bucket counts
+	// are summed up first instead of relying on the total count.
+	quint64 counts[BUCKETS];
+	quint64 total = 0;
+	for(int i=0;i<BUCKETS;++i) {
+		counts[i] = m_buckets[i].load();
+		total += counts[i];
+	}
+
+	if(total == 0)
+		return 0;
+
+	const quint64 rank = qMax(quint64(1), quint64(std::ceil(qBound(0.0, q, 1.0) * total)));
+	quint64 seen = 0;
+	for(int i=0;i<BUCKETS;++i) {
+		seen += counts[i];
+		if(seen >= rank)
+			return qMin(bucketMax(i), qMax(m_max.load(), qint64(0)));
+	}
+	return m_max.load();
+}
+
+ServerMetrics::ServerMetrics()
+	: loginTime({0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30})
+{
+}
+
+ServerMetrics &global()
+{
+	static ServerMetrics metrics;
+	return metrics;
+}
+
+qint64 residentMemory()
+{
+#ifdef Q_OS_LINUX
+	// The second field of statm is the number of resident pages
+	QFile statm(QStringLiteral("/proc/self/statm"));
+	if(statm.open(QFile::ReadOnly)) {
+		const QList<QByteArray> fields = statm.readAll().split(' ');
+		if(fields.size() > 1)
+			return fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE);
+	}
+#endif
+	return -1;
+}
+
+void Writer::family(const char *name, const char *type, const char *help)
+{
+	m_data += QByteArray("# HELP ") + name + ' ' + help + '\n';
+	m_data += QByteArray("# TYPE ") + name + ' ' + type + '\n';
+}
+
+void Writer::sample(const char *name, double value, const QByteArray &labels)
+{
+	m_data += name;
+	if(!labels.isEmpty())
+		m_data += '{' + labels + '}';
+	m_data += ' ';
+
+	if(std::isinf(value))
+		m_data += value > 0 ? "+Inf" : "-Inf";
+	else
+		m_data += QByteArray::number(value, 'g', 15);
+	m_data += '\n';
+}
+
+void Writer::histogram(const char *name, const Histogram &histogram, const QByteArray &labels)
+{
+	const QByteArray prefix = labels.isEmpty() ? QByteArray() : labels + ',';
+	const QByteArray bucket = QByteArray(name) + "_bucket";
+
+	for(int i=0;i<histogram.bucketCount();++i)
+		sample(bucket.constData(), histogram.cumulativeCount(i), prefix + label("le", QString::number(histogram.bound(i))));
+	sample(bucket.constData(), histogram.count(), prefix + label("le", QStringLiteral("+Inf")));
+
+	sample((QByteArray(name) + "_sum").constData(), histogram.sum(), labels);
+	sample((QByteArray(name) + "_count").constData(), histogram.count(), labels);
+}
+
+void Writer::latency(const char *name, const LatencyHistogram &histogram, const QByteArray &labels)
+{
+	const QByteArray prefix = labels.isEmpty() ? QByteArray() : labels + ',';
+	const QByteArray bucket = QByteArray(name) + "_bucket";
+
+	// Boundaries are placed at the last bucket of each power of two range,
+	// from 127 microseconds to about 67 seconds.
+	const int sub = LatencyHistogram::SUB_BUCKETS;
+	const int firstBound = sub * 5 - 1;
+	const int lastBound = sub * 24 - 1;
+
+	// Observations may arrive while we're counting, so the total
+	// is summed up from the buckets to keep the samples consistent.
+	quint64 count = 0;
+	for(int i=0;i<LatencyHistogram::BUCKETS;++i) {
+		count += histogram.bucketCount(i);
+		if(i >= firstBound && i <= lastBound && (i - firstBound) % sub == 0)
+			sample(bucket.constData(), count, prefix + label("le", QString::number(LatencyHistogram::bucketMax(i) / 1000000.0, 'g', 10)));
+	}
+	sample(bucket.constData(), count, prefix + label("le", QStringLiteral("+Inf")));
+
+	sample((QByteArray(name) + "_sum").constData(), histogram.sum(), labels);
+	sample((QByteArray(name) + "_count").constData(), count, labels);
+}
+
+void Writer::traffic(const char *name, const Traffic &traffic, bool bytes, const QByteArray &labels)
+{
+	const QByteArray prefix = labels.isEmpty() ? QByteArray() : labels + ',';
+	const Counter *counters = bytes ? traffic.bytes : traffic.messages;
+
+	for(int type=0;type<256;++type) {
+		const quint64 value = counters[type].load();
+		if(value > 0)
+			sample(name, value, prefix + label("type", QString::number(type)));
+	}
+}
+
+QByteArray Writer::label(const char *key, const QString &value)
+{
+	QByteArray escaped = value.toUtf8();
+	escaped.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+	return QByteArray(key) + "=\"" + escaped + '"';
+}
+
+}
+}
@@ -0,0 +1,219 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_METRICS_H
+#define DP_SERVER_METRICS_H
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QVector>
+#include <QString>
+
+#include <initializer_list>
+
+namespace server {
+namespace metrics {
+
+//! A lock-free counter that can be updated from any thread
+typedef QAtomicInteger<quint64> Counter;
+
+inline void add(Counter &counter, quint64 value=1) { counter.fetchAndAddRelaxed(value); }
+
+//! Get the current time of a monotonic clock in microseconds
+qint64 now();
+
+/**
+ * @brief Message counts and total sizes by message type
+ *
+ * Updating the counters is cheap enough to do for every message.
+ */
+struct Traffic {
+	Counter messages[256];
+	Counter bytes[256];
+
+	void count(int type, int length)
+	{
+		add(messages[type & 0xff]);
+		add(bytes[type & 0xff], length);
+	}
+
+	//! Count every message in a batch of serialized messages
+	void countBatch(const QByteArray &batch);
+};
+
+/**
+ * @brief A histogram with fixed bucket boundaries
+ *
+ * Observations can be made from any thread.
+ */
+class Histogram {
+public:
+	static const int MAX_BUCKETS = 16;
+
+	//! Create a histogram with the given (ascending) bucket upper bounds
+	Histogram(std::initializer_list<double> bounds);
+
+	void observe(double value);
+
+	int bucketCount() const { return m_bounds.size(); }
+	double bound(int bucket) const { return m_bounds.at(bucket); }
+
+	//! Get the number of observations less than or equal to the bucket's bound
+	quint64 cumulativeCount(int bucket) const;
+
+	quint64 count() const { return m_count.load(); }
+	double sum() const { return m_sum.load() / 1000000.0; }
+
+private:
+	QVector<double> m_bounds;
+	Counter m_buckets[MAX_BUCKETS];
+	Counter m_count;
+	Counter m_sum; // in millionths
+};
+
+/**
+ * @brief A high dynamic range histogram of durations
+ *
+ * Durations from one microsecond to several hours are recorded
+ * with a relative precision of 1/SUB_BUCKETS. Each power of two range is divided
+ * into SUB_BUCKETS equal parts, so percentiles can be read from the histogram
+ * without knowing the interesting range in advance.
+ *
+ * Observations can be made from any thread.
+ */
+class LatencyHistogram {
+public:
+	static const int SUB_BUCKETS = 8;
+	static const int BUCKETS = SUB_BUCKETS * 33; // up to 2^35 us (about 9.5 hours)
+
+	LatencyHistogram();
+
+	//! Record a duration in microseconds
+	void observe(qint64 usecs);
+
+	/**
+	 * @brief Get a percentile
+	 *
+	 * @param q the quantile (0.0 - 1.0)
+	 * @return the highest duration (in microseconds) in the quantile's bucket
+	 */
+	qint64 quantile(double q) const;
+
+	quint64 count() const { return m_count.load(); }
+	qint64 max() const { return m_max.load(); }
+
+	//! Get the number of observations recorded in the given bucket
+	quint64 bucketCount(int bucket) const { return m_buckets[bucket].load(); }
+
+	//! Get the total of all observed durations in seconds
+	double sum() const { return m_sum.load() / 1000000.0; }
+
+	//! Get the bucket a duration is recorded in
+	static int bucket(qint64 usecs);
+
+	//! Get the highest duration that is recorded in the bucket
+	static qint64 bucketMax(int bucket);
+
+private:
+	Counter m_buckets[BUCKETS];
+	Counter m_count;
+	Counter m_sum; // in microseconds
+	QAtomicInteger<qint64> m_max;
+};
+
+//! Traffic counters of a session
+struct SessionTraffic {
+	Traffic received;
+	Traffic sent;
+};
+
+/**
+ * @brief Relay latencies of a session
+ *
+ * Each message is timed from the moment it was received from its author.
+ * Messages generated by the server are timed from when they were added to
+ * the history.
+ */
+struct RelayLatency {
+	LatencyHistogram history; // until added to the session history
+	LatencyHistogram dequeue; // until handed to a recipient's connection
+	LatencyHistogram written; // until fully written to a recipient's socket
+};
+
+//! Serverwide metrics
+struct ServerMetrics {
+	ServerMetrics();
+
+	Traffic received;
+	Traffic sent;
+
+	Counter logins;        // successfully completed logins
+	Counter loginErrors;   // logins that ended in an error
+	Counter authFailures;  // rejected passwords and auth tokens
+	Histogram loginTime;   // from greeting to joining a session (seconds)
+};
+
+//! Get the serverwide metrics
+ServerMetrics &global();
+
+//! Get the resident set size of this process or -1 if not available
+qint64 residentMemory();
+
+/**
+ * @brief Formatter for the Prometheus text exposition format
+ *
+ * Call family() once for each metric and follow it with its samples.
+ */
+class Writer {
+public:
+	//! Start a new metric (type is "counter", "gauge", "histogram" or "summary")
+	void family(const char *name, const char *type, const char *help);
+
+	//! Add a sample
+	void sample(const char *name, double value, const QByteArray &labels=QByteArray());
+
+	//! Add all the samples of a histogram
+	void histogram(const char *name, const Histogram &histogram, const QByteArray &labels=QByteArray());
+
+	/**
+	 * @brief Add the samples of a latency histogram (in seconds)
+	 *
+	 * Exporting every bucket would make far too many series, so only the
+	 * power of two boundaries from about 100 microseconds to about one minute
+	 * are included. The cumulative counts let quantiles be calculated over
+	 * any time window.
+	 */
+	void latency(const char *name, const LatencyHistogram &histogram, const QByteArray &labels=QByteArray());
+
+	//! Add the nonzero message (or byte) counts of a traffic counter set, labeled by message type
+	void traffic(const char *name, const Traffic &traffic, bool bytes, const QByteArray &labels=QByteArray());
+
+	//! Format a label (key="value"). Multiple labels can be joined with a comma.
+	static QByteArray label(const char *key, const QString &value);
+
+	const QByteArray &data() const { return m_data; }
+
+private:
+	QByteArray m_data;
+};
+
+}
+}
+
+#endif
@@ -21,6 +21,9 @@
 #include "client.h"
 #include "session.h"
 #include "serverlog.h"
+#include "serverconfig.h"
+#include "credentialverifier.h"
+#include "metrics.h"
 #include "../libshared/net/control.h"
 #include "../libshared/net/meta.h"
 #include "../libshared/util/passwordhash.h"
@@ -122,12 +125,33 @@ void opWord(Client *client, const QJsonArray &args, const QJsonObject &kwargs)
 	if(opwordHash.isEmpty())
 		throw CmdError("No opword set");
 
-	if(passwordhash::check(args.at(0).toString(), opwordHash)) {
-		client->session()->changeOpStatus(client->id(), true, "password");
+	// The opword is checked in the background. The client may
+	// have left the session by the time the result arrives.
+	const QString opword = args.at(0).toString();
+	const Session *session = client->session();
+
+	const auto status = verifyCredentials(
+		session->config()->credentialVerifier(),
+		client->peerAddress(),
+		client,
+		[opword, opwordHash]() { return passwordhash::check(opword, opwordHash); },
+		[client, session](bool ok) {
+			if(client->session() != session)
+				return;
 
-	} else {
-		throw CmdError("Incorrect password");
-	}
+			if(ok) {
+				client->session()->changeOpStatus(client->id(), true, "password");
+			} else {
+				metrics::add(metrics::global().authFailures);
+				client->sendDirectMessage(protocol::Command::error("Incorrect password"));
+			}
+		}
+	);
+
+	if(status == CredentialVerifier::Busy)
+		throw CmdError("Server is too busy. Try again later.");
+	else if(status != CredentialVerifier::Queued)
+		throw CmdError("Too many attempts. Try again later.");
 }
 
 Client *_getClient(Session *session, const QJsonValue &idOrName)
@@ -30,6 +30,7 @@ class QHostAddress;
 namespace  server {
 
 class ServerLog;
+class CredentialVerifier;
 
 class ConfigKey {
 public:
@@ -74,7 +75,20 @@ namespace config {
 		LogPurgeDays(18, "logpurgedays", "0", ConfigKey::INT),               // Automatically purge log entries older than this many days (DB log only)
 		AutoresetThreshold(19, "autoResetThreshold", "15mb", ConfigKey::SIZE), // Default autoreset threshold in bytes
 		AllowCustomAvatars(20, "customAvatars", "true", ConfigKey::BOOL),      // Allow users to set a custom avatar when logging in
-		ExtAuthAvatars(21, "extAuthAvatars", "true", ConfigKey::BOOL)          // Use avatars received from ext-auth server (unless a custom avatar has been set)
+		ExtAuthAvatars(21, "extAuthAvatars", "true", ConfigKey::BOOL),         // Use avatars received from ext-auth server (unless a custom avatar has been set)
+		FlushDelay(22, "flushDelay", "0", ConfigKey::INT),                     // Maximum time (in milliseconds) outgoing messages are held back to be sent in larger batches
+		AllowCompression(23, "compression", "true", ConfigKey::BOOL),          // Allow clients to enable stream compression
+		UploadQueueSoftLimit(24, "uploadQueueSoftLimit", "1mb", ConfigKey::SIZE), // Coalesce cursor updates sent to clients whose upload queue is longer than this
+		UploadQueueHardLimit(25, "uploadQueueHardLimit", "32mb", ConfigKey::SIZE), // Disconnect clients whose upload queue grows longer than this (0 for no limit)
+		PointerCoalescingWindow(26, "pointerCoalescingWindow", "20", ConfigKey::INT), // Relay only the newest cursor/laser pointer message of each user within this many milliseconds (0 to disable)
+		HistoryDurability(27, "historyDurability", "relaxed", ConfigKey::STRING), // How file backed sessions are written to disk: "relaxed" (OS decides when to sync), "group" (sync batches in the background, see groupCommitDelay/Size) or "strict" (sync every change)
+		GroupCommitDelay(28, "groupCommitDelay", "1000", ConfigKey::INT),    // Maximum time (in milliseconds) before changes are synced to disk in group commit mode
+		GroupCommitSize(29, "groupCommitSize", "1mb", ConfigKey::SIZE),      // Maximum amount of history written before changes are synced to disk in group commit mode
+		HistoryCacheSize(30, "historyCacheSize", "256mb", ConfigKey::SIZE),  // Memory budget for the message caches of all file backed sessions (0 for no limit)
+		HibernationTime(31, "hibernationTime", "0", ConfigKey::TIME),        // Unload persistent file backed sessions that have been empty for this long (0 to disable)
+		SnapshotInterval(32, "snapshotInterval", "0", ConfigKey::SIZE),      // Take a canvas snapshot for new users every time the history grows this much (0 to disable)
+		ServerAutoreset(33, "serverAutoreset", "false", ConfigKey::BOOL),    // Let the server autoreset sessions when no operator is available (requires snapshot support. Every session then replays its history in a snapshot thread)
+		LogMaxEntries(34, "logMaxEntries", "0", ConfigKey::INT)              // Keep at most this many log entries (DB log only, 0 for no limit)
 		;
 }
 
@@ -114,7 +128,7 @@ class ServerConfig : public QObject
 {
 	Q_OBJECT
 public:
-	explicit ServerConfig(QObject *parent=nullptr) : QObject(parent) {}
+	explicit ServerConfig(QObject *parent=nullptr) : QObject(parent), m_verifier(nullptr) {}
 
 	void setInternalConfig(const InternalConfig &cfg) { m_internalCfg = cfg; }
 	const InternalConfig &internalConfig() const { return m_internalCfg; }
@@ -166,6 +180,15 @@ public:
 	 */
 	virtual ServerLog *logger() const = 0;
 
+	/**
+	 * @brief Set the thread pool used for checking passwords
+	 *
+	 * The verifier is not owned by the configuration object.
+	 * If not set, passwords are checked in the calling thread.
+	 */
+	void setCredentialVerifier(CredentialVerifier *verifier) { m_verifier = verifier; }
+	CredentialVerifier *credentialVerifier() const { return m_verifier; }
+
 	/**
 	 * @brief Parse a time interval string (e.g. "1d" or "5h")
 	 * @param str
@@ -195,6 +218,7 @@ protected:
 
 private:
 	InternalConfig m_internalCfg;
+	CredentialVerifier *m_verifier;
 };
 
 }
@@ -37,6 +37,8 @@ QString Log::toString(bool abridged) const
 QJsonObject Log::toJson(JsonOptions options) const
 {
 	QJsonObject o;
+	if(m_id > 0)
+		o["id"] = double(m_id);
 	o["timestamp"] = m_timestamp.toString(Qt::ISODate);
 	o["level"] = QMetaEnum::fromType<Log::Level>().valueToKey(int(m_level));
 	o["topic"] = QMetaEnum::fromType<Log::Topic>().valueToKey(int(m_topic));
@@ -73,6 +75,7 @@ void ServerLog::logMessage(const Log &entry)
 
 void InMemoryLog::setHistoryLimit(int limit)
 {
+	QMutexLocker lock(&m_mutex);
 	m_limit = limit;
 	if(limit>0 && limit<m_history.size())
 		m_history.erase(m_history.begin() + limit, m_history.end());
@@ -80,19 +83,25 @@ void InMemoryLog::setHistoryLimit(int limit)
 
 void InMemoryLog::storeMessage(const Log &entry)
 {
+	QMutexLocker lock(&m_mutex);
 	m_history.prepend(entry);
+	m_history.first().id(++m_lastId);
 	if(m_limit>0 && m_history.size() >= m_limit)
 		m_history.pop_back();
 }
 
-QList<Log> InMemoryLog::getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const
+QList<Log> InMemoryLog::getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, qint64 before, int offset, int limit) const
 {
+	QMutexLocker lock(&m_mutex);
 	QList<Log> filtered;
 
 	for(const Log &l : m_history) {
 		if(after.isValid() && after.msecsTo(l.timestamp()) < 1000)
 			break;
 
+		if(before > 0 && l.id() >= before)
+			continue;
+
 		if(!session.isNull() && session != l.session())
 			continue;
 
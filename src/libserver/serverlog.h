@@ -23,6 +23,7 @@
 #include <QDateTime>
 #include <QUuid>
 #include <QHostAddress>
+#include <QMutex>
 
 class QJsonObject;
 
@@ -63,11 +64,14 @@ public:
 	};
 	Q_ENUM(Topic)
 
-	Log() : m_timestamp(QDateTime::currentDateTimeUtc()), m_level(Level::Warn), m_topic(Topic::Status) { }
+	Log() : m_id(0), m_timestamp(QDateTime::currentDateTimeUtc()), m_level(Level::Warn), m_topic(Topic::Status) { }
 	Log(const QDateTime &ts, const QUuid &session, const QString &user, Level level, Topic topic, const QString message)
-		: m_timestamp(ts), m_session(session), m_user(user), m_level(level), m_topic(topic), m_message(message)
+		: m_id(0), m_timestamp(ts), m_session(session), m_user(user), m_level(level), m_topic(topic), m_message(message)
 		{ }
 
+	//! Get the entry's ID in the log storage (0 if not stored yet)
+	qint64 id() const { return m_id; }
+
 	//! Get the entry timestamp
 	QDateTime timestamp() const { return m_timestamp; }
 
@@ -86,6 +90,7 @@ public:
 	//! Get the freeform message part
 	QString message() const { return m_message; }
 
+	Log &id(qint64 id) { m_id=id; return *this; }
 	Log &about(Level l, Topic t) { m_level=l; m_topic=t; return *this; }
 	Log &user(uint8_t id, const QHostAddress &ip, const QString &name) { m_user = QStringLiteral("%1;%2;%3").arg(int(id)).arg(ip.toString()).arg(name); return *this; }
 	Log &session(const QUuid &id) { m_session=id; return *this; }
@@ -117,6 +122,7 @@ public:
 	QJsonObject toJson(JsonOptions options=NoOptions) const;
 
 private:
+	qint64 m_id;
 	QDateTime m_timestamp;
 	QUuid m_session;
 	QString m_user;
@@ -134,14 +140,17 @@ class ServerLog;
  */
 class ServerLogQuery {
 public:
-	ServerLogQuery(const ServerLog &log) : m_log(log), m_offset(0), m_limit(0), m_atleast(Log::Level::Debug) { }
+	ServerLogQuery(const ServerLog &log) : m_log(log), m_offset(0), m_limit(0), m_atleast(Log::Level::Debug), m_before(0) { }
 
 	ServerLogQuery &session(const QUuid &id) { m_session = id; return *this; }
 	ServerLogQuery &page(int page, int entriesPerPage) { m_offset = page*entriesPerPage; m_limit=entriesPerPage; return *this; }
 	ServerLogQuery &after(const QDateTime &ts) { m_after = ts; return *this; }
 	ServerLogQuery &atleast(Log::Level level) { m_atleast = level; return *this; }
 
-	bool isFiltered() const { return !m_session.isNull() || m_offset>0 || m_limit>0; }
+	//! Get only entries older than the one with the given ID (for paging without offsets)
+	ServerLogQuery &before(qint64 id) { m_before = id; return *this; }
+
+	bool isFiltered() const { return !m_session.isNull() || m_offset>0 || m_limit>0 || m_before>0; }
 	QList<Log> get() const;
 
 private:
@@ -151,6 +160,7 @@ private:
 	int m_limit;
 	Log::Level m_atleast;
 	QDateTime m_after;
+	qint64 m_before;
 };
 
 /**
@@ -178,10 +188,11 @@ public:
 	 * @param session get only log entries for this session
 	 * @param after get messages whose timestamp is greater than this
 	 * @param atleast minimum log level
+	 * @param before get messages whose ID is less than this (if greater than zero)
 	 * @param offset ignore first *offset* messages
 	 * @param limit return at most this many messages
 	 */
-	virtual QList<Log> getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const = 0;
+	virtual QList<Log> getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, qint64 before, int offset, int limit) const = 0;
 
 	/**
 	 * @brief Return a query builder
@@ -197,7 +208,7 @@ private:
 };
 
 inline QList<Log> ServerLogQuery::get() const {
-	return m_log.getLogEntries(m_session, m_after, m_atleast, m_offset, m_limit);
+	return m_log.getLogEntries(m_session, m_after, m_atleast, m_before, m_offset, m_limit);
 }
 
 void Log::to(ServerLog *logger)
@@ -210,14 +221,16 @@ void Log::to(ServerLog *logger)
 
 /**
  * @brief A simple ServerLog implementation that keeps the latest messages in memory
+ *
+ * This class is thread-safe.
  */
 class InMemoryLog : public ServerLog
 {
 public:
-	InMemoryLog() : m_limit(1000) { }
+	InMemoryLog() : m_limit(1000), m_lastId(0) { }
 	void setHistoryLimit(int limit);
 
-	QList<Log> getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const override;
+	QList<Log> getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, qint64 before, int offset, int limit) const override;
 
 protected:
 	void storeMessage(const Log &entry) override;
@@ -225,6 +238,8 @@ protected:
 private:
 	QList<Log> m_history;
 	int m_limit;
+	qint64 m_lastId;
+	mutable QMutex m_mutex;
 };
 
 }
@@ -23,6 +23,7 @@
 #include "serverlog.h"
 #include "opcommands.h"
 #include "announcements.h"
+#include "workerthreads.h"
 
 #include "../libshared/net/control.h"
 #include "../libshared/net/meta.h"
@@ -45,17 +46,25 @@ Session::Session(SessionHistory *history, ServerConfig *config, sessionlisting::
 	: QObject(parent),
 	m_history(history),
 	m_config(config),
+	m_traffic(new metrics::SessionTraffic),
+	m_latency(new metrics::RelayLatency),
 	m_announcements(announcements)
 {
 	m_history->setParent(this);
 
 	m_lastEventTime.start();
 
+	m_pointerTimer = new QTimer(this);
+	m_pointerTimer->setSingleShot(true);
+	connect(m_pointerTimer, &QTimer::timeout, this, &Session::releasePointerMessages);
+
 	// History already exists? Skip the Initialization state.
 	if(history->sizeInBytes()>0)
 		m_state = State::Running;
 
 	// Session announcements
+	updateAnnouncementSnapshot();
+	connect(this, &Session::sessionAttributeChanged, this, &Session::updateAnnouncementSnapshot);
 	connect(m_announcements, &sessionlisting::Announcements::announcementsChanged, this, &Session::onAnnouncementsChanged);
 	for(const QString &announcement : m_history->announcements())
 		makeAnnouncement(QUrl(announcement), false);
@@ -109,34 +118,16 @@ void Session::switchState(State newstate)
 		if(m_state==State::Reset && !m_resetstream.isEmpty()) {
 			// Reset buffer uploaded. Now perform the reset before returning to
 			// normal running state.
-
-			auto resetImage = serverSideStateMessages() + m_resetstream;
-
-			// Send reset snapshot
-			if(!m_history->reset(resetImage)) {
-				// This shouldn't normally happen, as the size limit should be caught while
-				// still uploading the reset.
-				messageAll("Session reset failed!", true);
-				success = false;
-
-			} else {
-				protocol::ServerReply resetcmd;
-				resetcmd.type = protocol::ServerReply::RESET;
-				resetcmd.reply["state"] = "reset";
-				resetcmd.message = "Session reset!";
-				directToAll(MessagePtr(new protocol::Command(0, resetcmd)));
-
-				onSessionReset();
-
-				sendUpdatedSessionProperties();
-			}
+			// This shouldn't normally fail, as the size limit should be caught while
+			// still uploading the reset.
+			success = resetHistory(m_resetstream);
 
 			m_resetstream = protocol::MessageList();
 			m_resetstreamsize = 0;
-		}
 
-		if(success && !m_recordingFile.isEmpty())
+		} else if(!m_recordingFile.isEmpty()) {
 			restartRecording();
+		}
 
 		for(Client *c : m_clients)
 			c->setHoldLocked(false);
@@ -153,6 +144,30 @@ void Session::switchState(State newstate)
 	m_state = newstate;
 }
 
+bool Session::resetHistory(const protocol::MessageList &resetImage)
+{
+	// Send reset snapshot
+	if(!m_history->reset(serverSideStateMessages() + resetImage)) {
+		messageAll("Session reset failed!", true);
+		return false;
+	}
+
+	protocol::ServerReply resetcmd;
+	resetcmd.type = protocol::ServerReply::RESET;
+	resetcmd.reply["state"] = "reset";
+	resetcmd.message = "Session reset!";
+	directToAll(MessagePtr(new protocol::Command(0, resetcmd)));
+
+	onSessionReset();
+
+	sendUpdatedSessionProperties();
+
+	if(!m_recordingFile.isEmpty())
+		restartRecording();
+
+	return true;
+}
+
 void Session::assignId(Client *user)
 {
 	uint8_t id = m_history->idQueue().getIdForName(user->username());
@@ -242,6 +257,8 @@ void Session::removeUser(Client *user)
 	disconnect(user, nullptr, this, nullptr);
 	disconnect(m_history, nullptr, user, nullptr);
 
+	releasePointerMessage(user->id());
+
 	if(user->id() == m_initUser && m_state == State::Reset) {
 		// Whoops, the resetter left before the job was done!
 		// We simply cancel the reset in that case and go on
@@ -604,6 +621,15 @@ void Session::sendUpdatedMuteList()
 }
 
 void Session::handleClientMessage(Client &client, protocol::MessagePtr msg)
+{
+	// Messages added to the history while handling this one are timed
+	// from when the client's message was received
+	m_relayStart = client.receiveTime();
+	processClientMessage(client, msg);
+	m_relayStart = 0;
+}
+
+void Session::processClientMessage(Client &client, protocol::MessagePtr msg)
 {
 	// Filter away server-to-client-only messages
 	switch(msg->type()) {
@@ -673,10 +699,65 @@ void Session::handleClientMessage(Client &client, protocol::MessagePtr msg)
 	}
 
 	// Rest of the messages are added to session history
-	if(initUserId() == client.id())
+	if(initUserId() == client.id()) {
 		addToInitStream(msg);
-	else
+
+	} else if(msg->type() == protocol::MSG_MOVEPOINTER || msg->type() == protocol::MSG_LASERTRAIL) {
+		if(!holdPointerMessage(msg))
+			addToHistory(msg);
+
+	} else {
+		releasePointerMessage(client.id());
 		addToHistory(msg);
+	}
+}
+
+bool Session::holdPointerMessage(const protocol::MessagePtr &msg)
+{
+	if(!m_pointerTimer->isActive()) {
+		const int window = pointerCoalescingWindow();
+		if(window <= 0)
+			return false;
+		m_pointerTimer->start(window);
+	}
+
+	const auto held = m_heldPointerMessages.find(msg->contextId());
+	if(held == m_heldPointerMessages.end()) {
+		m_heldPointerMessages.insert(msg->contextId(), msg);
+
+	} else {
+		// A laser trail start or end marker must not be moved across pointer movements
+		if(held.value()->type() != msg->type())
+			addToHistory(MessagePtr::fromNullable(held.value()));
+		held.value() = msg;
+	}
+
+	return true;
+}
+
+void Session::releasePointerMessage(uint8_t ctxId)
+{
+	const protocol::NullableMessageRef held = m_heldPointerMessages.take(ctxId);
+	if(!held.isNull())
+		addToHistory(MessagePtr::fromNullable(held));
+}
+
+void Session::releasePointerMessages()
+{
+	const auto held = m_heldPointerMessages;
+	m_heldPointerMessages.clear();
+	for(const protocol::NullableMessageRef &msg : held)
+		addToHistory(MessagePtr::fromNullable(msg));
+}
+
+int Session::pointerCoalescingWindow()
+{
+	// Cached, since this may be needed for every pointer message
+	if(!m_pointerWindowAge.isValid() || m_pointerWindowAge.hasExpired(1000)) {
+		m_pointerWindow = m_config->getConfigInt(config::PointerCoalescingWindow);
+		m_pointerWindowAge.start();
+	}
+	return m_pointerWindow;
 }
 
 void Session::addToInitStream(protocol::MessagePtr msg)
@@ -803,9 +884,11 @@ void Session::killSession(bool terminate)
 
 void Session::directToAll(protocol::MessagePtr msg)
 {
+	msg->cacheSerialized();
 	for(Client *c : m_clients) {
 		c->sendDirectMessage(msg);
 	}
+	msg->releaseSerialized();
 }
 
 void Session::messageAll(const QString &message, bool alert)
@@ -951,6 +1034,30 @@ void Session::unlistAnnouncement(const QUrl &url, bool terminate)
 }
 
 sessionlisting::Session Session::getSessionAnnouncement() const
+{
+	if(QThread::currentThread() != thread()) {
+		QMutexLocker lock(&m_announcementMutex);
+		return m_announcementSnapshot;
+	}
+
+	return makeSessionAnnouncement();
+}
+
+void Session::updateAnnouncementSnapshot()
+{
+	const sessionlisting::Session snapshot = makeSessionAnnouncement();
+	QMutexLocker lock(&m_announcementMutex);
+	m_announcementSnapshot = snapshot;
+}
+
+void Session::sendListserverMessage(const QString &message)
+{
+	runInThread(this, [this, message]() {
+		messageAll(message, false);
+	});
+}
+
+sessionlisting::Session Session::makeSessionAnnouncement() const
 {
 	const bool privateUserList = m_config->getConfigBool(config::PrivateUserList);
 
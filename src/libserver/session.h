@@ -21,10 +21,12 @@
 #define DP_SHARED_SERVER_SESSION_H
 
 #include "announcable.h"
+#include "../libshared/listings/announcementapi.h"
 #include "../libshared/net/message.h"
 #include "../libshared/net/protover.h"
 #include "sessionhistory.h"
 #include "jsonapi.h"
+#include "metrics.h"
 
 #include <QHash>
 #include <QString>
@@ -33,6 +35,8 @@
 #include <QElapsedTimer>
 #include <QUuid>
 #include <QJsonObject>
+#include <QMutex>
+#include <QSharedPointer>
 
 class QTimer;
 
@@ -211,6 +215,20 @@ public:
 	 */
 	qint64 lastEventTime() const { return m_lastEventTime.elapsed(); }
 
+	/**
+	 * @brief Get the session's message traffic counters
+	 *
+	 * The counters may be read from any thread, even after the session is gone.
+	 */
+	const QSharedPointer<metrics::SessionTraffic> &traffic() const { return m_traffic; }
+
+	/**
+	 * @brief Get the session's relay latency histograms
+	 *
+	 * The histograms may be read from any thread, even after the session is gone.
+	 */
+	const QSharedPointer<metrics::RelayLatency> &latency() const { return m_latency; }
+
 	//! Get the session history
 	const SessionHistory *history() const { return m_history; }
 	SessionHistory *history() { return m_history; }
@@ -262,9 +280,17 @@ public:
 	 */
 	void unlistAnnouncement(const QUrl &url, bool terminate=true);
 
+	/**
+	 * @brief Get the session announcement
+	 *
+	 * This is thread-safe: when called from a thread other than
+	 * the session's own, a snapshot taken the last time session
+	 * attributes changed is returned.
+	 */
 	sessionlisting::Session getSessionAnnouncement() const override;
 
-	void sendListserverMessage(const QString &message) override { messageAll(message, false); }
+	//! Message all users (this can be called from any thread)
+	void sendListserverMessage(const QString &message) override;
 
 	//! Get the session state
 	State state() const { return m_state; }
@@ -377,8 +403,24 @@ protected:
 	//! This message was just added to session history
 	void addedToHistory(protocol::MessagePtr msg);
 
+	/**
+	 * @brief Get the time the client message currently being handled was received
+	 * @return time (see metrics::now()) or 0 if no client message is being handled
+	 */
+	qint64 relayStart() const { return m_relayStart; }
+
 	void switchState(State newstate);
 
+	/**
+	 * @brief Replace the session history with a reset image
+	 *
+	 * The server side state messages are prepended to the image.
+	 * All clients are told to reset their canvases and download the new history.
+	 *
+	 * @return false if the reset failed
+	 */
+	bool resetHistory(const protocol::MessageList &resetImage);
+
 	//! Get the user join, SessionOwner, etc. messages that should be prepended to a reset image
 	protocol::MessageList serverSideStateMessages() const;
 
@@ -392,6 +434,26 @@ private:
 	 */
 	void addToInitStream(protocol::MessagePtr msg);
 
+	/**
+	 * @brief Hold back a cursor or laser pointer message for a moment
+	 *
+	 * Only the newest message of each user is kept. It is added to the
+	 * history when the coalescing window closes, or just before the next
+	 * message of another type from the same user, so the history stays in order.
+	 *
+	 * @return false if coalescing is disabled and the message should be added to the history right away
+	 */
+	bool holdPointerMessage(const protocol::MessagePtr &msg);
+
+	//! Add the user's held back pointer message (if any) to the history
+	void releasePointerMessage(uint8_t ctxId);
+
+	//! Add all held back pointer messages to the history
+	void releasePointerMessages();
+
+	//! Get the (cached) pointer message coalescing window length in milliseconds
+	int pointerCoalescingWindow();
+
 	/**
 	 * @brief Update session operator bits
 	 *
@@ -423,8 +485,16 @@ private:
 
 	JsonApiResult callListingsJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 
+	sessionlisting::Session makeSessionAnnouncement() const;
+	void updateAnnouncementSnapshot();
+
+	void processClientMessage(Client &client, protocol::MessagePtr msg);
+
 	SessionHistory *m_history;
 	ServerConfig *m_config;
+	QSharedPointer<metrics::SessionTraffic> m_traffic;
+	QSharedPointer<metrics::RelayLatency> m_latency;
+	qint64 m_relayStart = 0;
 	sessionlisting::Announcements *m_announcements;
 
 	State m_state = State::Initialization;
@@ -442,6 +512,14 @@ private:
 	QElapsedTimer m_lastEventTime;
 
 	bool m_closed = false;
+
+	QTimer *m_pointerTimer;
+	QHash<int, protocol::NullableMessageRef> m_heldPointerMessages;
+	QElapsedTimer m_pointerWindowAge;
+	int m_pointerWindow = 0;
+
+	mutable QMutex m_announcementMutex;
+	sessionlisting::Session m_announcementSnapshot;
 };
 
 }
@@ -59,6 +59,11 @@ int SessionBanList::addBan(const QString &username, const QHostAddress &ip, cons
 		toIpv6(ip), // Always use IPv6 notation for consistency
 		bannedBy
 	};
+
+	// Registered users are banned by their ID only
+	if(extAuthId.isEmpty())
+		m_ipbans.add(id, ip, 0);
+
 	return id;
 }
 
@@ -69,6 +74,7 @@ QString SessionBanList::removeBan(int id)
 		SessionBan entry = i.next();
 		if(entry.id == id) {
 			i.remove();
+			m_ipbans.remove(id);
 			return entry.username;
 		}
 	}
@@ -90,15 +96,8 @@ bool SessionBanList::isBanned(const QHostAddress &address, const QString &authId
 	}
 
 	// Guest users are banned by IP, because that's the best we can do.
-	if(!address.isNull()) {
-		const QHostAddress ip = toIpv6(address);
-		for(const SessionBan &b : m_banlist) {
-			if(b.authId.isEmpty() && b.ip == ip)
-				return true;
-		}
-
-		return false;
-	}
+	if(!address.isNull())
+		return m_ipbans.contains(address);
 
 	qWarning("isBanned() called without a valid address or extAuthId");
 	return false;
@@ -19,6 +19,8 @@
 #ifndef DP_SERVER_SESSIONBAN_H
 #define DP_SERVER_SESSIONBAN_H
 
+#include "subnettrie.h"
+
 #include <QString>
 #include <QHostAddress>
 #include <QList>
@@ -87,6 +89,7 @@ public:
 
 private:
 	QList<SessionBan> m_banlist;
+	SubnetTrie m_ipbans; // guest IP bans for fast lookup
 	int m_idautoinc;
 };
 
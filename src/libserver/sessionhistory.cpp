@@ -44,6 +44,24 @@ QString SessionHistory::removeBan(int id)
 	return unbanned;
 }
 
+std::tuple<QByteArray, int> SessionHistory::getRawBatch(int after) const
+{
+	protocol::MessageList batch;
+	int lastIndex;
+	std::tie(batch, lastIndex) = getBatch(after);
+
+	QByteArray data;
+	int count = 0;
+	for(const protocol::MessagePtr &msg : batch) {
+		if(data.length() >= MAX_RAW_BATCH)
+			break;
+		data.append(msg->serialized());
+		++count;
+	}
+
+	return std::make_tuple(data, lastIndex - (batch.size() - count));
+}
+
 void SessionHistory::joinUser(uint8_t id, const QString &name)
 {
 	idQueue().setIdForName(id, name);
@@ -159,6 +159,18 @@ public:
 	 */
 	virtual std::tuple<protocol::MessageList, int> getBatch(int after) const = 0;
 
+	/**
+	 * @brief Get a batch of messages in their wire format
+	 *
+	 * This is like getBatch(), except the messages are returned
+	 * already serialized and concatenated, ready to be sent as is.
+	 * The batch may contain fewer messages than getBatch() would return.
+	 *
+	 * The default implementation serializes the messages returned by getBatch().
+	 * Storage backends can override this to avoid deserializing the messages.
+	 */
+	virtual std::tuple<QByteArray, int> getRawBatch(int after) const;
+
 	/**
 	 * @brief Mark messages before the given index as unneeded (for now)
 	 *
@@ -288,6 +300,9 @@ public:
 	 */
 	virtual bool isAuthenticatedOperators() const = 0;
 
+	//! Maximum size of a batch returned by getRawBatch (a single message may be bigger)
+	static const int MAX_RAW_BATCH = 1024 * 1024;
+
 signals:
 	/**
 	 * @brief This signal is emited when new messages are added to the history
@@ -21,6 +21,7 @@
 #define SESSIONS_INTERFACE_H
 
 #include <tuple>
+#include <functional>
 
 class QJsonArray;
 class QString;
@@ -33,6 +34,7 @@ namespace protocol {
 namespace server {
 
 class Session;
+class Client;
 
 /**
  * Interface for a class that can accept client logins
@@ -72,6 +74,40 @@ public:
 	 * @return session, error string pair: if session is null, error string contains the error code
 	 */
 	virtual std::tuple<Session*, QString> createSession(const QUuid &id, const QString &alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder) = 0;
+
+	/**
+	 * Call a function in the thread of the given session
+	 *
+	 * The function is called with a null pointer if the session was not found.
+	 * The calling thread waits until the function has returned, but
+	 * not indefinitely: if the session's thread is too busy to make the call
+	 * in time, the call is cancelled.
+	 *
+	 * The default implementation calls the function directly.
+	 *
+	 * @param id session ID or alias
+	 * @param func the function to call
+	 * @return false if the function was not called because the session was busy
+	 *         or is still being loaded (the call can be retried later)
+	 */
+	virtual bool callInSession(const QString &id, const std::function<void(Session*)> &func);
+
+	/**
+	 * Hand a logging in client over to the thread of the given session
+	 *
+	 * The client and its children are moved to the thread the session lives in
+	 * and the function is called in that thread once the handover is complete.
+	 * The function is called with a null pointer if the session was not found or
+	 * ended before the handover was completed. Note that the function is not called
+	 * at all if the client is deleted before the handover completes.
+	 *
+	 * The default implementation calls the function directly.
+	 *
+	 * @param client the client to hand over
+	 * @param id session ID or alias. A session is loaded from template if it's not yet live
+	 * @param func the function to call
+	 */
+	virtual void enterSession(Client *client, const QString &id, const std::function<void(Session*)> &func);
 };
 
 }
@@ -27,20 +27,106 @@
 #include "filedhistory.h"
 #include "templateloader.h"
 #include "announcements.h"
+#include "announcable.h"
+#include "workerthreads.h"
+#include "credentialverifier.h"
+#include "historycache.h"
+#include "stalldetector.h"
 
 #include <QTimer>
 #include <QJsonArray>
 #include <QJsonDocument>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QDateTime>
+#include <QMutex>
+
+#include <algorithm>
 
 namespace server {
 
+namespace {
+
+//! How long to wait for a busy worker thread (milliseconds)
+static const int WORKER_TIMEOUT = 5000;
+
+//! Load a file backed session and move it to the target thread
+static FiledHistory *loadHistory(const QString &path, QThread *target)
+{
+	FiledHistory *fh = FiledHistory::load(path);
+	if(fh)
+		fh->moveToThread(target);
+	return fh;
+}
+
+//! The result of loading a session in the background
+struct LoadedHistory {
+	FiledHistory *history = nullptr;
+
+	// If the result is never picked up (the server is shutting down)
+	~LoadedHistory() { delete history; }
+};
+
+//! Load a file backed session in a thread pool and deliver it to the context object's thread
+class LoadHistoryAsyncTask : public QRunnable
+{
+public:
+	LoadHistoryAsyncTask(const QString &path, QObject *context, const std::function<void(FiledHistory*)> &done)
+		: m_path(path), m_context(context), m_done(done)
+	{ }
+
+	void run() override
+	{
+		const QSharedPointer<LoadedHistory> result(new LoadedHistory);
+		result->history = loadHistory(m_path, m_context->thread());
+
+		const auto done = m_done;
+		QTimer::singleShot(0, m_context, [result, done]() {
+			FiledHistory *fh = result->history;
+			result->history = nullptr;
+			done(fh);
+		});
+	}
+
+private:
+	QString m_path;
+	QObject *m_context;
+	std::function<void(FiledHistory*)> m_done;
+};
+
+//! Keeps the announcements of a hibernated session listed
+class HibernatedListing : public sessionlisting::Announcable
+{
+public:
+	HibernatedListing(const QUuid &id, const sessionlisting::Session &announcement)
+		: m_id(id), m_announcement(announcement)
+	{ }
+
+	QUuid id() const override { return m_id; }
+	sessionlisting::Session getSessionAnnouncement() const override { return m_announcement; }
+	void sendListserverMessage(const QString &) override { } // nobody is there to see it
+
+private:
+	QUuid m_id;
+	sessionlisting::Session m_announcement;
+};
+
+}
+
 SessionServer::SessionServer(ServerConfig *config, QObject *parent)
 	: QObject(parent),
 	m_config(config),
 	m_tpls(nullptr),
+	m_workers(nullptr),
+	m_snapshotWorkers(nullptr),
+	m_verifier(nullptr),
+	m_stallDetector(new StallDetector),
+	m_historyCache(new HistoryCache),
 	m_useFiledSessions(false)
 {
 	m_announcements = new sessionlisting::Announcements(config, this);
+	m_loadPool = new QThreadPool(this);
+	m_stallDetector->watch(this, QStringLiteral("main thread"));
 
 	QTimer *cleanupTimer = new QTimer(this);
 	connect(cleanupTimer, &QTimer::timeout, this, &SessionServer::cleanupSessions);
@@ -52,6 +138,222 @@ SessionServer::SessionServer(ServerConfig *config, QObject *parent)
 #endif
 }
 
+SessionServer::~SessionServer()
+{
+	delete m_stallDetector;
+
+	// Sessions still being loaded or woken up are discarded
+	m_loadPool->waitForDone();
+
+	for(const SessionEntry &e : m_sessions) {
+		if(e.listing)
+			m_announcements->unlistSession(e.listing.data());
+	}
+
+	if(m_workers || m_snapshotWorkers) {
+		// Sessions in worker threads must be deleted in their own threads.
+		// The sessions must also be gone before the snapshot threads are stopped.
+		// Everything is deleted in parallel and a stalled worker is not waited for forever.
+		const QSharedPointer<QSemaphore> deleted(new QSemaphore);
+		int count = 0;
+
+		sessionlisting::Announcements *announcements = m_announcements;
+		const QList<SessionEntry> sessions = m_sessions;
+		m_sessions.clear();
+		for(const SessionEntry &e : sessions) {
+			const QPointer<Session> session = e.session;
+			runInThread(e.context, [session, announcements, deleted]() {
+				if(session) {
+					announcements->unlistSession(session.data());
+					delete session.data();
+				}
+				deleted->release();
+			});
+			++count;
+		}
+
+		// Clients handed over to the worker threads have no parent
+		const QHash<QObject*, HandedOverClient> clients = m_handedOverClients;
+		m_handedOverClients.clear();
+		for(const HandedOverClient &c : clients) {
+			const QPointer<QObject> client = c.client;
+			runInThread(c.context, [client, deleted]() {
+				delete client.data();
+				deleted->release();
+			});
+			++count;
+		}
+
+		if(!deleted->tryAcquire(count, WORKER_TIMEOUT))
+			qWarning("Timed out while deleting sessions: some worker threads are busy");
+
+		delete m_workers;
+		delete m_snapshotWorkers;
+	}
+
+	if(m_verifier) {
+		m_config->setCredentialVerifier(nullptr);
+		delete m_verifier;
+	}
+}
+
+void SessionServer::setWorkerThreads(int count)
+{
+	if(!m_sessions.isEmpty()) {
+		qWarning("Cannot change worker thread count while sessions exist");
+		return;
+	}
+
+	delete m_workers;
+	m_workers = count > 0 ? new WorkerThreads(count) : nullptr;
+
+	if(m_workers) {
+		const QVector<QObject*> contexts = m_workers->contexts();
+		for(int i=0;i<contexts.size();++i)
+			m_stallDetector->watch(contexts.at(i), QStringLiteral("session worker %1").arg(i+1));
+	}
+}
+
+int SessionServer::workerThreads() const
+{
+	return m_workers ? m_workers->count() : 0;
+}
+
+void SessionServer::setSnapshotterFactory(const SnapshotterFactory &factory, int threads)
+{
+	if(!m_sessions.isEmpty()) {
+		qWarning("Cannot enable snapshots while sessions exist");
+		return;
+	}
+
+	delete m_snapshotWorkers;
+	m_snapshotWorkers = factory && threads > 0 ? new WorkerThreads(threads) : nullptr;
+	m_snapshotterFactory = factory;
+}
+
+void SessionServer::setAuthThreads(int count)
+{
+	m_config->setCredentialVerifier(nullptr);
+	delete m_verifier;
+
+	// Up to 16 checks per thread may wait in the queue before new ones are turned away
+	m_verifier = count > 0 ? new CredentialVerifier(count, count * 16) : nullptr;
+	m_config->setCredentialVerifier(m_verifier);
+}
+
+void SessionServer::setStallThreshold(int threshold)
+{
+	m_stallDetector->setThreshold(threshold);
+}
+
+void SessionServer::writeMetrics(metrics::Writer &writer) const
+{
+	// Sessions in worker threads may be busy and must never be waited for here.
+	// Traffic counters and latency histograms are atomic and read directly,
+	// the rest comes from the snapshot each session publishes periodically.
+
+	// Upload queue sizes of all clients. Clients still logging in live in this thread.
+	QVector<int> outboxes;
+	for(const ThinServerClient *c : m_clients)
+		outboxes << c->uploadQueueBytes();
+
+	int hibernated = 0;
+	for(const SessionEntry &e : m_sessions) {
+		if(e.hibernated.isEmpty())
+			outboxes += e.stats.outboxes;
+		else
+			++hibernated;
+	}
+
+	writer.family("drawpile_sessions", "gauge", "Number of sessions");
+	writer.sample("drawpile_sessions", m_sessions.size() - hibernated, metrics::Writer::label("state", "active"));
+	writer.sample("drawpile_sessions", hibernated, metrics::Writer::label("state", "hibernated"));
+
+	writer.family("drawpile_users", "gauge", "Number of connected users");
+	writer.sample("drawpile_users", totalUsers());
+
+	m_stallDetector->writeMetrics(writer);
+
+	const HistoryCache::Stats cache = m_historyCache->stats();
+	writer.family("drawpile_history_cache_budget_bytes", "gauge", "Memory budget of the file backed history cache");
+	writer.sample("drawpile_history_cache_budget_bytes", cache.budget);
+	writer.family("drawpile_history_cache_bytes", "gauge", "Memory used by the file backed history cache");
+	writer.sample("drawpile_history_cache_bytes", cache.size);
+	writer.family("drawpile_history_cache_blocks", "gauge", "Number of blocks in the file backed history cache");
+	writer.sample("drawpile_history_cache_blocks", cache.blocks);
+	writer.family("drawpile_history_cache_hits_total", "counter", "History cache hits");
+	writer.sample("drawpile_history_cache_hits_total", cache.hits);
+	writer.family("drawpile_history_cache_misses_total", "counter", "History cache misses");
+	writer.sample("drawpile_history_cache_misses_total", cache.misses);
+	writer.family("drawpile_history_cache_evictions_total", "counter", "History cache evictions");
+	writer.sample("drawpile_history_cache_evictions_total", cache.evictions);
+
+	// Upload queue size distribution of all clients
+	std::sort(outboxes.begin(), outboxes.end());
+	writer.family("drawpile_client_outbox_bytes", "summary", "Bytes waiting in clients' upload queues");
+	for(const double q : { 0.5, 0.9, 0.99, 1.0 }) {
+		const double value = outboxes.isEmpty() ? 0 : outboxes.at(qMin(outboxes.size()-1, int(q * outboxes.size())));
+		writer.sample("drawpile_client_outbox_bytes", value, metrics::Writer::label("quantile", QString::number(q)));
+	}
+	qint64 outboxTotal = 0;
+	for(const int outbox : outboxes)
+		outboxTotal += outbox;
+	writer.sample("drawpile_client_outbox_bytes_sum", outboxTotal);
+	writer.sample("drawpile_client_outbox_bytes_count", outboxes.size());
+
+	// Per session metrics
+	struct SessionMetrics {
+		const SessionEntry *e;
+		QByteArray label;
+	};
+	QVector<SessionMetrics> sessions;
+	for(const SessionEntry &e : m_sessions) {
+		if(e.hibernated.isEmpty() && !e.session.isNull()) {
+			const QString id = e.id.toString();
+			sessions << SessionMetrics { &e, metrics::Writer::label("session", id.mid(1, id.length()-2)) };
+		}
+	}
+
+	writer.family("drawpile_session_history_bytes", "gauge", "Size of the session history");
+	for(const SessionMetrics &m : sessions)
+		writer.sample("drawpile_session_history_bytes", m.e->stats.historySize, m.label);
+
+	writer.family("drawpile_session_users", "gauge", "Number of users in the session");
+	for(const SessionMetrics &m : sessions)
+		writer.sample("drawpile_session_users", m.e->stats.users, m.label);
+
+	writer.family("drawpile_session_outbox_max_bytes", "gauge", "Largest upload queue of the session's users");
+	for(const SessionMetrics &m : sessions) {
+		int maxOutbox = 0;
+		for(const int outbox : m.e->stats.outboxes)
+			maxOutbox = qMax(maxOutbox, outbox);
+		writer.sample("drawpile_session_outbox_max_bytes", maxOutbox, m.label);
+	}
+
+	writer.family("drawpile_session_messages_received_total", "counter", "Messages received from the session's users by type");
+	for(const SessionMetrics &m : sessions)
+		writer.traffic("drawpile_session_messages_received_total", m.e->traffic->received, false, m.label);
+
+	writer.family("drawpile_session_received_bytes_total", "counter", "Bytes received from the session's users by message type");
+	for(const SessionMetrics &m : sessions)
+		writer.traffic("drawpile_session_received_bytes_total", m.e->traffic->received, true, m.label);
+
+	writer.family("drawpile_session_messages_sent_total", "counter", "Messages sent to the session's users by type");
+	for(const SessionMetrics &m : sessions)
+		writer.traffic("drawpile_session_messages_sent_total", m.e->traffic->sent, false, m.label);
+
+	writer.family("drawpile_session_sent_bytes_total", "counter", "Bytes sent to the session's users by message type");
+	for(const SessionMetrics &m : sessions)
+		writer.traffic("drawpile_session_sent_bytes_total", m.e->traffic->sent, true, m.label);
+
+	writer.family("drawpile_session_relay_latency_seconds", "histogram", "Time from receiving a message to each stage of relaying it");
+	for(const SessionMetrics &m : sessions) {
+		writer.latency("drawpile_session_relay_latency_seconds", m.e->latency->history, m.label + ',' + metrics::Writer::label("stage", "history"));
+		writer.latency("drawpile_session_relay_latency_seconds", m.e->latency->dequeue, m.label + ',' + metrics::Writer::label("stage", "dequeue"));
+		writer.latency("drawpile_session_relay_latency_seconds", m.e->latency->written, m.label + ',' + metrics::Writer::label("stage", "written"));
+	}
+}
+
 void SessionServer::setSessionDir(const QDir &dir)
 {
 	if(dir.isReadable()) {
@@ -68,30 +370,52 @@ void SessionServer::loadNewSessions()
 	if(!m_useFiledSessions)
 		return;
 
-	auto sessionFiles = m_sessiondir.entryInfoList(QStringList() << "*.session", QDir::Files|QDir::Writable|QDir::Readable);
+	QStringList paths;
+	const auto sessionFiles = m_sessiondir.entryInfoList(QStringList() << "*.session", QDir::Files|QDir::Writable|QDir::Readable);
 	for(const QFileInfo &f : sessionFiles) {
-		if(getSessionById(f.baseName(), false))
-			continue;
+		if(!findSession(f.baseName()) && !m_loadingSessions.contains(f.absoluteFilePath()))
+			paths << f.absoluteFilePath();
+	}
 
-		FiledHistory *fh = FiledHistory::load(f.absoluteFilePath());
-		if(fh) {
-			fh->setArchive(m_config->getConfigBool(config::ArchiveMode));
-			Session *session = new ThinSession(fh, m_config, m_announcements, this);
-			initSession(session);
-			session->log(Log().about(Log::Level::Debug, Log::Topic::Status).message("Loaded from file."));
-		}
+	// Sessions are loaded in parallel in the background,
+	// since scanning large recordings can take a while
+	for(const QString &path : paths) {
+		m_loadingSessions.insert(path);
+		m_loadPool->start(new LoadHistoryAsyncTask(path, this, [this, path](FiledHistory *fh) {
+			m_loadingSessions.remove(path);
+			if(fh)
+				startLoadedSession(fh);
+		}));
 	}
 }
 
+void SessionServer::startLoadedSession(FiledHistory *fh)
+{
+	// A new session may have claimed the alias while this one was loading
+	if(findSession(fh->id().toString()) || (!fh->idAlias().isEmpty() && findSession(fh->idAlias()))) {
+		qWarning("Session %s was not loaded because its ID or alias is already in use", qPrintable(fh->id().toString()));
+		delete fh;
+		return;
+	}
+
+	configureHistory(fh);
+	Session *session = new ThinSession(fh, m_config, m_announcements, this);
+	initSession(session);
+	session->log(Log().about(Log::Level::Debug, Log::Topic::Status).message("Loaded from file."));
+}
+
 QJsonArray SessionServer::sessionDescriptions() const
 {
 	QJsonArray descs;
 	QStringList aliases;
 
-	for(const Session *s : m_sessions) {
-		descs.append(s->getDescription());
-		if(!s->idAlias().isEmpty())
-			aliases << s->idAlias();
+	// Sessions in worker threads may be busy, so the cached descriptions are used
+	for(const SessionEntry &e : m_sessions) {
+		const QJsonObject &desc = e.hibernated.isEmpty() ? e.description : e.hibernated;
+		if(!desc.isEmpty())
+			descs.append(desc);
+		if(!e.alias.isEmpty())
+			aliases << e.alias;
 	}
 
 	if(templateLoader()) {
@@ -110,13 +434,36 @@ SessionHistory *SessionServer::initHistory(const QUuid &id, const QString alias,
 {
 	if(m_useFiledSessions) {
 		FiledHistory *fh = FiledHistory::startNew(m_sessiondir, id, alias, protocolVersion, founder);
-		fh->setArchive(m_config->getConfigBool(config::ArchiveMode));
+		configureHistory(fh);
 		return fh;
 	} else {
 		return new InMemoryHistory(id, alias, protocolVersion, founder);
 	}
 }
 
+void SessionServer::configureHistory(FiledHistory *history) const
+{
+	history->setArchive(m_config->getConfigBool(config::ArchiveMode));
+
+	m_historyCache->setBudget(m_config->getConfigSize(config::HistoryCacheSize));
+	history->setCache(m_historyCache);
+
+	const QString durabilityName = m_config->getConfigString(config::HistoryDurability);
+	FiledHistory::Durability durability = FiledHistory::Durability::Relaxed;
+	if(durabilityName == "strict")
+		durability = FiledHistory::Durability::Strict;
+	else if(durabilityName == "group")
+		durability = FiledHistory::Durability::GroupCommit;
+	else if(durabilityName != "relaxed")
+		qWarning("Unknown history durability mode \"%s\", using relaxed mode", qPrintable(durabilityName));
+
+	history->setDurability(
+		durability,
+		m_config->getConfigInt(config::GroupCommitDelay),
+		m_config->getConfigSize(config::GroupCommitSize)
+	);
+}
+
 std::tuple<Session*, QString> SessionServer::createSession(const QUuid &id, const QString &idAlias, const protocol::ProtocolVersion &protocolVersion, const QString &founder)
 {
 	Q_ASSERT(!id.isNull());
@@ -125,7 +472,7 @@ std::tuple<Session*, QString> SessionServer::createSession(const QUuid &id, cons
 		return std::tuple<Session*, QString> { nullptr, "closed" };
 	}
 
-	if(getSessionById(id.toString(), false) || (!idAlias.isEmpty() && getSessionById(idAlias, false))) {
+	if(findSession(id.toString()) || (!idAlias.isEmpty() && findSession(idAlias))) {
 		return std::tuple<Session*, QString> { nullptr, "idInUse" };
 	}
 
@@ -176,36 +523,131 @@ Session *SessionServer::createFromTemplate(const QString &idAlias)
 
 void SessionServer::initSession(Session *session)
 {
-	m_sessions.append(session);
-
+	QObject *context = m_workers ? m_workers->acquire() : this;
+
+	const QJsonObject description = session->getDescription();
+
+	m_sessions << SessionEntry {
+		session,
+		context,
+		session->id(),
+		session->idAlias(),
+		description,
+		QJsonObject(),
+		0,
+		QSharedPointer<sessionlisting::Announcable>(),
+		SessionStats(),
+		session->traffic(),
+		session->latency()
+	};
+
+	const QUuid id = session->id();
 	const QString idString = session->idString();
 
-	connect(session, &Session::sessionAttributeChanged, this, &SessionServer::onSessionAttributeChanged);
-	connect(session, &Session::destroyed, this, [this, idString](QObject *object) {
-		auto *session = static_cast<Session*>(object);
-		m_sessions.removeOne(session);
-		m_announcements->unlistSession(session); // just to be safe
+	// Snapshots (used for new users and server-side autoresets) are drawn in their own threads
+	QObject *snapshotContext = nullptr;
+	Snapshotter *snapshotter = nullptr;
+	const uint snapshotInterval = m_config->getConfigSize(config::SnapshotInterval);
+	if(m_snapshotWorkers && (snapshotInterval > 0 || m_config->getConfigBool(config::ServerAutoreset))) {
+		snapshotContext = m_snapshotWorkers->acquire();
+		snapshotter = m_snapshotterFactory(snapshotContext->thread());
+	}
 
-		emit sessionEnded(idString);
+	// Attribute changes are handled in the session's own thread
+	connect(session, &Session::sessionAttributeChanged, session, [this](Session *s) {
+		onSessionAttributeChanged(s);
+	});
+
+	connect(session, &Session::destroyed, this, [this, id, idString, context, snapshotContext]() {
+		// Note: if the session lived in a worker thread, it no longer exists at this point
+		// and another session may already have been allocated at the same address.
+		// The session unlisted itself (or handed its listings over) before it was deleted.
+
+		// A hibernated session keeps its entry, unless it was woken up already
+		const bool hibernated = m_hibernatingSessions.remove(id);
+		QJsonObject hibernatedDescription;
+
+		for(int i=0;i<m_sessions.size();++i) {
+			const SessionEntry &e = m_sessions.at(i);
+			if(e.id == id && e.session.isNull()) {
+				if(hibernated)
+					hibernatedDescription = e.hibernated;
+				else
+					m_sessions.removeAt(i);
+				break;
+			}
+		}
+		if(m_workers)
+			m_workers->release(context);
+		if(snapshotContext && m_snapshotWorkers)
+			m_snapshotWorkers->release(snapshotContext);
+
+		if(!hibernated) {
+			emit sessionEnded(idString);
+
+		} else {
+			if(!hibernatedDescription.isEmpty())
+				emit sessionChanged(hibernatedDescription);
+
+			// Someone tried to join while the session was still being unloaded
+			if(m_wakingSessions.contains(id))
+				startWakingSession(id);
+		}
 	});
 
 	emit sessionCreated(session);
-	emit sessionChanged(session->getDescription());
+	emit sessionChanged(description);
+
+	if(context != this) {
+		session->setParent(nullptr);
+		session->moveToThread(context->thread());
+	}
+
+	if(snapshotter) {
+		// The snapshotter catches up with the history in the session's thread
+		const QPointer<ThinSession> thinSession = static_cast<ThinSession*>(session);
+		runInThread(context, [thinSession, snapshotter, snapshotInterval]() {
+			if(thinSession)
+				thinSession->setSnapshotter(snapshotter, snapshotInterval);
+			else
+				snapshotter->dispose();
+		});
+	}
 }
 
-Session *SessionServer::getSessionById(const QString &id, bool load)
+const SessionServer::SessionEntry *SessionServer::findSession(const QString &id) const
 {
 	const QUuid uuid(id);
-	for(Session *s : m_sessions) {
+	for(const SessionEntry &e : m_sessions) {
+		if(e.session.isNull() && e.hibernated.isEmpty())
+			continue;
+
 		if(uuid.isNull()) {
-			if(s->idAlias() == id)
-				return s;
+			if(e.alias == id)
+				return &e;
 		} else {
-			if(s->id() == uuid)
-				return s;
+			if(e.id == uuid)
+				return &e;
 		}
 	}
 
+	return nullptr;
+}
+
+Session *SessionServer::getSessionById(const QString &id, bool load)
+{
+	const SessionEntry *e = findSession(id);
+	if(e) {
+		if(e->hibernated.isEmpty())
+			return e->session.data();
+
+		// Hibernated sessions are only woken up when they're actually needed.
+		// Loading takes a while, so it's done in the background.
+		if(load)
+			wakeSession(e->id, [](Session*) { });
+		return nullptr;
+	}
+
 	if(load && templateLoader() && templateLoader()->exists(id)) {
 		return createFromTemplate(id);
 	}
@@ -213,6 +655,79 @@ Session *SessionServer::getSessionById(const QString &id, bool load)
 	return nullptr;
 }
 
+bool SessionServer::callInSession(const QString &id, const std::function<void(Session*)> &func)
+{
+	const SessionEntry *e = findSession(id);
+	if(e && !e->hibernated.isEmpty()) {
+		// Not available until it has been loaded in the background
+		wakeSession(e->id, [](Session*) { });
+		return false;
+	}
+
+	if(!e) {
+		func(nullptr);
+		return true;
+	}
+
+	const QPointer<Session> session = e->session;
+	if(!runInThreadBlocking(e->context, [session, &func]() { func(session.data()); }, WORKER_TIMEOUT)) {
+		qWarning("Session %s is busy: call timed out", qPrintable(id));
+		return false;
+	}
+
+	return true;
+}
+
+void SessionServer::enterSession(Client *client, const QString &id, const std::function<void(Session*)> &func)
+{
+	const SessionEntry *hibernated = findSession(id);
+	if(hibernated && !hibernated->hibernated.isEmpty()) {
+		// The session is loaded in the background and the handover continues when it's ready
+		const QPointer<Client> c = client;
+		const QString uuid = hibernated->id.toString();
+		wakeSession(hibernated->id, [this, c, uuid, func](Session *session) {
+			if(!c)
+				return;
+			if(session)
+				enterSession(c.data(), uuid, func);
+			else
+				func(nullptr);
+		});
+		return;
+	}
+
+	if(!getSessionById(id, true)) {
+		func(nullptr);
+		return;
+	}
+
+	const SessionEntry *e = findSession(id);
+	if(!e) {
+		// Session ended already
+		func(nullptr);
+		return;
+	}
+
+	if(e->context == this) {
+		func(e->session.data());
+		return;
+	}
+
+	// Hand the client over to the session's thread
+	m_clients.removeOne(static_cast<ThinServerClient*>(client));
+	m_handedOverClients.insert(client, HandedOverClient { client, e->context });
+
+	client->setParent(nullptr);
+	client->moveToThread(e->context->thread());
+
+	// Note: the client is used as the context object so the call
+	// is dropped if the client is deleted before the handover completes.
+	const QPointer<Session> session = e->session;
+	QTimer::singleShot(0, client, [session, func]() {
+		func(session.data());
+	});
+}
+
 void SessionServer::stopAll()
 {
 	for(ThinServerClient *c : m_clients) {
@@ -220,14 +735,23 @@ void SessionServer::stopAll()
 		c->disconnectClient(Client::DisconnectionReason::Shutdown, "Server shutting down");
 	}
 
-	for(Session *s : m_sessions)
-		s->killSession(false);
+	for(const SessionEntry &e : m_sessions) {
+		const QPointer<Session> session = e.session;
+		runInThread(e.context, [session]() {
+			if(session)
+				session->killSession(false);
+		});
+	}
 }
 
 void SessionServer::messageAll(const QString &message, bool alert)
 {
-	for(Session *s : m_sessions) {
-		s->messageAll(message, alert);
+	for(const SessionEntry &e : m_sessions) {
+		const QPointer<Session> session = e.session;
+		runInThread(e.context, [session, message, alert]() {
+			if(session)
+				session->messageAll(message, alert);
+		});
 	}
 }
 
@@ -235,6 +759,11 @@ void SessionServer::addClient(ThinServerClient *client)
 {
 	client->setParent(this);
 	client->setConnectionTimeout(m_config->getConfigTime(config::ClientTimeout) * 1000);
+	client->setFlushDelay(m_config->getConfigInt(config::FlushDelay));
+	client->setUploadQueueLimits(
+		m_config->getConfigSize(config::UploadQueueSoftLimit),
+		m_config->getConfigSize(config::UploadQueueHardLimit)
+	);
 
 #ifndef NDEBUG
 	client->setRandomLag(m_randomlag);
@@ -243,7 +772,7 @@ void SessionServer::addClient(ThinServerClient *client)
 	m_clients.append(client);
 	connect(client, &Client::destroyed, this, &SessionServer::removeClient);
 
-	emit userCountChanged(m_clients.size());
+	emit userCountChanged(totalUsers());
 
 	auto *login = new LoginHandler(client, this, m_config);
 	connect(this, &SessionServer::sessionChanged, login, &LoginHandler::announceSession);
@@ -253,8 +782,11 @@ void SessionServer::addClient(ThinServerClient *client)
 
 void SessionServer::removeClient(QObject *client)
 {
-	m_clients.removeOne(static_cast<ThinServerClient*>(client));
-	emit userCountChanged(m_clients.size());
+	// Note: clients in worker threads no longer exist at this point.
+	// The pointer may only be used for comparison.
+	if(!m_clients.removeOne(static_cast<ThinServerClient*>(client)))
+		m_handedOverClients.remove(client);
+	emit userCountChanged(totalUsers());
 }
 
 /**
@@ -284,21 +816,256 @@ void SessionServer::onSessionAttributeChanged(Session *session)
 	if(delSession)
 		session->killSession();
 	else
-		emit sessionChanged(session->getDescription());
+		emit sessionChanged(publishSession(session));
+}
+
+QJsonObject SessionServer::publishSession(const Session *session)
+{
+	const QUuid id = session->id();
+	const QJsonObject description = session->getDescription();
+
+	SessionStats stats;
+	stats.historySize = session->history()->sizeInBytes();
+	stats.users = session->userCount();
+	for(const Client *c : session->clients())
+		stats.outboxes << c->uploadQueueBytes();
+
+	runInThread(this, [this, id, description, stats]() {
+		for(SessionEntry &e : m_sessions) {
+			if(e.id == id && !e.session.isNull()) {
+				e.description = description;
+				e.stats = stats;
+				break;
+			}
+		}
+	});
+
+	return description;
+}
+
+void SessionServer::refreshDescriptions()
+{
+	// Some attributes (like the history size) change without a notification.
+	// This also keeps the metrics snapshots up to date.
+	for(const SessionEntry &e : m_sessions) {
+		const QPointer<Session> s = e.session;
+		if(s.isNull() || !e.hibernated.isEmpty())
+			continue;
+
+		runInThread(e.context, [this, s]() {
+			if(s)
+				publishSession(s.data());
+		});
+	}
+}
+
+HistoryCache::Stats SessionServer::historyCacheStats() const
+{
+	return m_historyCache->stats();
 }
 
 void SessionServer::cleanupSessions()
 {
+	// Pick up changes to the cache budget
+	m_historyCache->setBudget(m_config->getConfigSize(config::HistoryCacheSize));
+
+	refreshDescriptions();
+
 	const qint64 expirationTime = m_config->getConfigTime(config::IdleTimeLimit) * 1000;
 
 	if(expirationTime>0) {
-		for(Session *s : m_sessions) {
-			if(s->lastEventTime() > expirationTime) {
-				s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Idle session expired."));
-				s->killSession();
+		// Hibernated sessions must be woken up so they can be terminated properly
+		const qint64 now = QDateTime::currentMSecsSinceEpoch();
+		QVector<QUuid> expired;
+		for(const SessionEntry &e : m_sessions) {
+			if(!e.hibernated.isEmpty() && now - e.idleSince > expirationTime)
+				expired << e.id;
+		}
+		for(const QUuid &id : expired) {
+			wakeSession(id, [this, id](Session *session) {
+				const SessionEntry *e = session ? findSession(id.toString()) : nullptr;
+				if(!e)
+					return;
+
+				const QPointer<Session> s = e->session;
+				runInThread(e->context, [s]() {
+					if(s) {
+						s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Idle session expired."));
+						s->killSession();
+					}
+				});
+			});
+		}
+
+		for(const SessionEntry &e : m_sessions) {
+			const QPointer<Session> s = e.session;
+			runInThread(e.context, [s, expirationTime]() {
+				if(s && s->lastEventTime() > expirationTime) {
+					s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Idle session expired."));
+					s->killSession();
+				}
+			});
+		}
+	}
+
+	const qint64 hibernationTime = m_config->getConfigTime(config::HibernationTime) * 1000;
+	if(hibernationTime>0 && m_useFiledSessions)
+		hibernateIdleSessions(hibernationTime);
+}
+
+/**
+ * @brief Unload persistent sessions that have been empty for too long
+ *
+ * Only a description of the session is kept in memory. The session is
+ * loaded from its files again when someone tries to join it.
+ */
+void SessionServer::hibernateIdleSessions(qint64 idleTime)
+{
+	// Sessions are checked in their own threads, one batch per thread.
+	// The results are handed back to this thread.
+	QHash<QObject*, QVector<QPointer<Session>>> sessionsByThread;
+	for(const SessionEntry &e : m_sessions) {
+		if(!e.session.isNull() && e.hibernated.isEmpty())
+			sessionsByThread[e.context] << e.session;
+	}
+
+	const qint64 now = QDateTime::currentMSecsSinceEpoch();
+	sessionlisting::Announcements *announcements = m_announcements;
+
+	for(auto i=sessionsByThread.constBegin();i!=sessionsByThread.constEnd();++i) {
+		const QVector<QPointer<Session>> sessions = i.value();
+		runInThread(i.key(), [this, sessions, announcements, idleTime, now]() {
+			for(const QPointer<Session> &session : sessions) {
+				Session *s = session.data();
+				if(
+					!s ||
+					s->userCount() > 0 ||
+					s->state() != Session::State::Running ||
+					!s->history()->hasFlag(SessionHistory::Persistent) ||
+					!qobject_cast<const FiledHistory*>(s->history()) ||
+					s->lastEventTime() < idleTime
+				)
+					continue;
+
+				s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Hibernating idle session."));
+
+				QJsonObject desc = s->getDescription();
+				desc["hibernating"] = true;
+
+				const QUuid id = s->id();
+				const qint64 idleSince = now - s->lastEventTime();
+
+				// The session stays listed while it's hibernating
+				const QSharedPointer<sessionlisting::Announcable> listing(
+					new HibernatedListing(id, s->getSessionAnnouncement())
+				);
+				announcements->transferSession(s, listing.data());
+
+				// This reaches the server's thread before the session's destroyed signal does
+				runInThread(this, [this, id, desc, idleSince, listing]() {
+					sessionHibernated(id, desc, idleSince, listing);
+				});
+
+				// The session is deleted right away (instead of with deleteLater)
+				// so its files are closed as soon as possible.
+				s->killSession(false);
+				delete s;
 			}
+		});
+	}
+}
+
+void SessionServer::sessionHibernated(const QUuid &id, const QJsonObject &description, qint64 idleSince, const QSharedPointer<sessionlisting::Announcable> &listing)
+{
+	for(SessionEntry &e : m_sessions) {
+		if(e.id == id && e.hibernated.isEmpty()) {
+			e.hibernated = description;
+			e.idleSince = idleSince;
+			e.listing = listing;
+
+			// The session may not have been deleted yet, so it can't be woken up until it has
+			m_hibernatingSessions.insert(id);
+			return;
 		}
 	}
+
+	// Shouldn't happen
+	m_announcements->unlistSession(listing.data());
+}
+
+/**
+ * @brief Load a hibernated session in the background
+ *
+ * The callback is called in this thread once the session is running again,
+ * or with a null pointer if it couldn't be loaded.
+ */
+void SessionServer::wakeSession(const QUuid &id, const std::function<void(Session*)> &callback)
+{
+	auto waiting = m_wakingSessions.find(id);
+	if(waiting != m_wakingSessions.end()) {
+		waiting->append(callback);
+		return;
+	}
+
+	m_wakingSessions.insert(id, { callback });
+
+	// If the session is still being unloaded, loading starts once it's gone
+	if(!m_hibernatingSessions.contains(id))
+		startWakingSession(id);
+}
+
+void SessionServer::startWakingSession(const QUuid &id)
+{
+	m_loadPool->start(new LoadHistoryAsyncTask(
+		m_sessiondir.absoluteFilePath(FiledHistory::journalFilename(id)),
+		this,
+		[this, id](FiledHistory *fh) {
+			Session *session = finishWakingSession(id, fh);
+			const auto callbacks = m_wakingSessions.take(id);
+			for(const auto &cb : callbacks)
+				cb(session);
+		}
+	));
+}
+
+/**
+ * @brief Start a woken up session in place of its hibernated entry
+ *
+ * Returns null if the session couldn't be loaded or its entry is gone.
+ */
+Session *SessionServer::finishWakingSession(const QUuid &id, FiledHistory *fh)
+{
+	bool found = false;
+	for(int i=0;i<m_sessions.size();++i) {
+		const SessionEntry &e = m_sessions.at(i);
+		if(e.id == id && !e.hibernated.isEmpty()) {
+			// The woken up session announces itself again
+			if(e.listing)
+				m_announcements->unlistSession(e.listing.data());
+			m_sessions.removeAt(i);
+			found = true;
+			break;
+		}
+	}
+
+	if(!found) {
+		delete fh;
+		return nullptr;
+	}
+
+	if(!fh) {
+		qWarning("Couldn't wake up hibernated session %s", qPrintable(id.toString()));
+		const QString idString = id.toString();
+		emit sessionEnded(idString.mid(1, idString.length()-2));
+		return nullptr;
+	}
+
+	configureHistory(fh);
+	Session *session = new ThinSession(fh, m_config, m_announcements, this);
+	initSession(session);
+	session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Woken up from hibernation."));
+
+	return session;
 }
 
 JsonApiResult SessionServer::callSessionJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request)
@@ -308,11 +1075,14 @@ JsonApiResult SessionServer::callSessionJsonApi(JsonApiMethod method, const QStr
 	std::tie(head, tail) = popApiPath(path);
 
 	if(!head.isEmpty()) {
-		Session *s = getSessionById(head, false);
-		if(s)
-			return s->callJsonApi(method, tail, request);
-		else
-			return JsonApiNotFound();
+		JsonApiResult result = JsonApiNotFound();
+		const bool called = callInSession(head, [&](Session *s) {
+			if(s)
+				result = s->callJsonApi(method, tail, request);
+		});
+		if(!called)
+			return JsonApiErrorResult(JsonApiResult::ServiceUnavailable, QStringLiteral("Session is busy or being loaded. Try again later."));
+		return result;
 	}
 
 	if(method == JsonApiMethod::Get) {
@@ -347,6 +1117,45 @@ JsonApiResult SessionServer::callUserJsonApi(JsonApiMethod method, const QString
 		for(const ThinServerClient *c : m_clients)
 			userlist << c->description();
 
+		// Users who have been handed over to worker threads.
+		// All workers are queried at once and a busy one is not waited for forever.
+		QHash<QObject*, QVector<QPointer<Session>>> sessionsByThread;
+		for(const SessionEntry &e : m_sessions) {
+			if(e.context != this && !e.session.isNull())
+				sessionsByThread[e.context] << e.session;
+		}
+
+		struct Gather {
+			QMutex mutex;
+			QJsonArray users;
+			QSemaphore done;
+		};
+		const QSharedPointer<Gather> gather(new Gather);
+
+		for(auto i=sessionsByThread.constBegin();i!=sessionsByThread.constEnd();++i) {
+			const QVector<QPointer<Session>> sessions = i.value();
+			runInThread(i.key(), [sessions, gather]() {
+				QJsonArray users;
+				for(const QPointer<Session> &s : sessions) {
+					if(s) {
+						for(const Client *c : s->clients())
+							users << c->description();
+					}
+				}
+				QMutexLocker lock(&gather->mutex);
+				for(const QJsonValue &u : users)
+					gather->users << u;
+				gather->done.release();
+			});
+		}
+
+		if(!gather->done.tryAcquire(sessionsByThread.size(), WORKER_TIMEOUT))
+			qWarning("Timed out while listing users: some worker threads are busy");
+
+		QMutexLocker lock(&gather->mutex);
+		for(const QJsonValue &u : gather->users)
+			userlist << u;
+
 		return {JsonApiResult::Ok, QJsonDocument(userlist)};
 
 	} else {
@@ -20,30 +20,107 @@
 #include "../libshared/net/protover.h"
 #include "jsonapi.h"
 #include "sessions.h"
+#include "historycache.h"
+#include "snapshotter.h"
+#include "metrics.h"
 
 #include <QObject>
 #include <QDir>
+#include <QPointer>
+#include <QUuid>
+#include <QSet>
+#include <QSharedPointer>
+#include <QJsonObject>
+
+class QThread;
+class QThreadPool;
 
 namespace sessionlisting {
 	class Announcements;
+	class Announcable;
 }
 
 namespace server {
 
 class Session;
 class SessionHistory;
+class FiledHistory;
 class ThinServerClient;
 class ServerConfig;
 class TemplateLoader;
+class WorkerThreads;
+class CredentialVerifier;
+class StallDetector;
 
 /**
  * @brief Session manager
  *
+ * Sessions can be spread across a pool of worker threads. A session
+ * and the clients who have joined it live in the session's worker thread.
+ * New clients are logged in in the session server's own thread and handed
+ * over to the worker when they join a session. Functions that access
+ * sessions from the outside marshal the call to the session's thread.
  */
 class SessionServer : public QObject, public Sessions {
 Q_OBJECT
 public:
 	SessionServer(ServerConfig *config, QObject *parent=nullptr);
+	~SessionServer();
+
+	/**
+	 * @brief Set the number of session worker threads
+	 *
+	 * If the count is zero, sessions are run in the session server's own thread.
+	 * This must be called before any sessions are created.
+	 */
+	void setWorkerThreads(int count);
+
+	//! Get the number of session worker threads
+	int workerThreads() const;
+
+	//! A function that creates a snapshotter that does its work in the given thread
+	typedef std::function<Snapshotter*(QThread*)> SnapshotterFactory;
+
+	/**
+	 * @brief Enable canvas snapshots
+	 *
+	 * When enabled, sessions keep an up to date snapshot of their canvas,
+	 * which is sent to new users in place of the older part of the history.
+	 * The snapshot interval is set by the SnapshotInterval setting. Changing
+	 * the setting only affects sessions started after the change.
+	 *
+	 * Snapshots are also used to autoreset sessions when no operator is
+	 * available to do it (see the ServerAutoreset setting.)
+	 *
+	 * Snapshots are drawn in a dedicated pool of threads.
+	 * This must be called before any sessions are created.
+	 *
+	 * @param factory function for creating snapshotters
+	 * @param threads number of snapshot threads
+	 */
+	void setSnapshotterFactory(const SnapshotterFactory &factory, int threads);
+
+	/**
+	 * @brief Set the number of password checking threads
+	 *
+	 * Passwords and auth tokens are checked in their own pool of threads,
+	 * so logins don't slow down the sessions. The pool is shared
+	 * with everything using this server's configuration.
+	 *
+	 * If the count is zero, passwords are checked in the calling thread
+	 * and login attempts are not rate limited.
+	 */
+	void setAuthThreads(int count);
+
+	/**
+	 * @brief Set the event loop stall threshold in milliseconds
+	 *
+	 * The event loops of the session server's thread and the session
+	 * worker threads are monitored. When one doesn't respond for longer
+	 * than the threshold, a warning describing what the thread was doing is logged.
+	 * Zero disables the warnings.
+	 */
+	void setStallThreshold(int threshold);
 
 	/**
 	 * @brief Enable file backed sessions
@@ -60,6 +137,9 @@ public:
 	/**
 	 * @brief Load new sessions from the directory
 	 *
+	 * The sessions are loaded in the background. Each one becomes
+	 * available once it has been loaded.
+	 *
 	 * If no session directory is set, this does nothing.
 	 */
 	void loadNewSessions();
@@ -103,28 +183,53 @@ public:
 
 	/**
 	 * @brief Get descriptions of all sessions
+	 *
+	 * The descriptions of sessions running in worker threads are cached,
+	 * so this never waits for a worker. The cache is updated whenever
+	 * a session's attributes change and refreshed periodically.
 	 */
 	QJsonArray sessionDescriptions() const override;
 
 	/**
 	 * @brief Get the session with the specified ID
 	 *
+	 * Note: the session may live in a worker thread. Use callInSession
+	 * to access it.
+	 *
+	 * A hibernated session is not returned. If load is set, it is woken up
+	 * in the background. Use enterSession to wait for it.
+	 *
 	 * @param id session ID
 	 * @param load load from template if not live?
 	 * @return session or null if not found
 	 */
 	Session *getSessionById(const QString &id, bool load) override;
 
+	bool callInSession(const QString &id, const std::function<void(Session*)> &func) override;
+	void enterSession(Client *client, const QString &id, const std::function<void(Session*)> &func) override;
+
 	/**
 	 * @brief Get the total number of connected users
 	 */
-	int totalUsers() const { return m_clients.size(); }
+	int totalUsers() const { return m_clients.size() + m_handedOverClients.size(); }
 
 	/**
 	 * @brief Get the number of active sessions
 	 */
 	int sessionCount() const { return m_sessions.size(); }
 
+	//! Get the memory usage and hit rate of the file backed sessions' message cache
+	HistoryCache::Stats historyCacheStats() const;
+
+	/**
+	 * @brief Write the session, user and event loop metrics
+	 *
+	 * This never waits for the worker threads: the per session metrics
+	 * come from snapshots the sessions publish whenever their attributes
+	 * change and when the descriptions are refreshed.
+	 */
+	void writeMetrics(metrics::Writer &writer) const;
+
 	/**
 	 * @brief Stop all running sessions
 	 */
@@ -185,21 +290,73 @@ signals:
 
 private slots:
 	void removeClient(QObject *client);
-	void onSessionAttributeChanged(Session *session);
 	void cleanupSessions();
 
 private:
+	// Session metrics that can't be read from other threads
+	struct SessionStats {
+		qint64 historySize = 0;
+		int users = 0;
+		QVector<int> outboxes;     // upload queue sizes of the session's users
+	};
+
+	struct SessionEntry {
+		QPointer<Session> session; // may only be dereferenced in the session's thread
+		QObject *context;          // context object of the session's thread
+		QUuid id;
+		QString alias;
+		QJsonObject description;   // latest description of a running session
+		QJsonObject hibernated;    // description of a hibernated session (session is null)
+		qint64 idleSince;          // when the hibernated session was last active (ms since epoch)
+		QSharedPointer<sessionlisting::Announcable> listing; // keeps a hibernated session's announcements alive
+		SessionStats stats;        // latest metrics of a running session
+		QSharedPointer<metrics::SessionTraffic> traffic; // shared with the session (atomic counters)
+		QSharedPointer<metrics::RelayLatency> latency;   // shared with the session (atomic counters)
+	};
+
 	SessionHistory *initHistory(const QUuid &id, const QString alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder);
+	void configureHistory(FiledHistory *history) const;
 	void initSession(Session *session);
+	const SessionEntry *findSession(const QString &id) const;
+
+	void hibernateIdleSessions(qint64 idleTime);
+	void sessionHibernated(const QUuid &id, const QJsonObject &description, qint64 idleSince, const QSharedPointer<sessionlisting::Announcable> &listing);
+	void wakeSession(const QUuid &id, const std::function<void(Session*)> &callback);
+	void startWakingSession(const QUuid &id);
+	Session *finishWakingSession(const QUuid &id, FiledHistory *history);
+	void startLoadedSession(FiledHistory *history);
+
+	// Note: this is called in the session's thread
+	void onSessionAttributeChanged(Session *session);
+
+	// Update the cached description and metrics of a session (called in the session's thread)
+	QJsonObject publishSession(const Session *session);
+	void refreshDescriptions();
+
+	struct HandedOverClient {
+		QPointer<QObject> client;  // may only be dereferenced in the client's thread
+		QObject *context;          // context object of the client's thread
+	};
 
 	sessionlisting::Announcements *m_announcements;
 	ServerConfig *m_config;
 	TemplateLoader *m_tpls;
+	WorkerThreads *m_workers;
+	WorkerThreads *m_snapshotWorkers;
+	SnapshotterFactory m_snapshotterFactory;
+	CredentialVerifier *m_verifier;
+	StallDetector *m_stallDetector;
+	QSharedPointer<HistoryCache> m_historyCache;
 	QDir m_sessiondir;
 	bool m_useFiledSessions;
 
-	QList<Session*> m_sessions;
-	QList<ThinServerClient*> m_clients;
+	QList<SessionEntry> m_sessions;
+	QList<ThinServerClient*> m_clients; // clients in this thread
+	QHash<QObject*, HandedOverClient> m_handedOverClients; // clients moved to session threads
+	QSet<QUuid> m_hibernatingSessions; // hibernated sessions that may not have been deleted yet
+	QHash<QUuid, QVector<std::function<void(Session*)>>> m_wakingSessions; // hibernated sessions being loaded
+	QSet<QString> m_loadingSessions; // paths of the session files being loaded
+	QThreadPool *m_loadPool; // loads file backed sessions in the background
 
 #ifndef NDEBUG
 	uint m_randomlag;
@@ -0,0 +1,79 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_SNAPSHOTTER_H
+#define DP_SERVER_SNAPSHOTTER_H
+
+#include "../libshared/net/message.h"
+
+#include <QByteArray>
+
+#include <functional>
+
+namespace server {
+
+/**
+ * @brief Interface for generating canvas snapshots of a session in the background
+ *
+ * The session feeds every message in its history to the snapshotter, in order.
+ * When a snapshot is requested, it is generated as soon as the snapshotter
+ * has processed all the messages up to the requested history index.
+ * The snapshot is a buffer of serialized messages that recreate the canvas
+ * as it was at that point.
+ *
+ * The thin server doesn't know how to draw, so the actual implementation
+ * lives outside the server library. All functions are called from
+ * the session's thread and must not block.
+ *
+ * Note: message reference counting is not thread safe. Messages passed to
+ * the snapshotter must be copied before they are used in another thread.
+ * For the same reason, the snapshot is handed over in its serialized form.
+ */
+class Snapshotter
+{
+public:
+	//! Function called in the snapshotter's own thread when a snapshot is ready
+	typedef std::function<void(int index, const QByteArray &snapshot)> Callback;
+
+	//! Set the function to call when a snapshot is ready
+	virtual void setCallback(const Callback &callback) = 0;
+
+	//! Clear the canvas. The next message will have the given history index
+	virtual void reset(int firstIndex) = 0;
+
+	//! Process the next message in the history
+	virtual void addMessage(const protocol::MessagePtr &msg) = 0;
+
+	//! Generate a snapshot once the message at the given index has been processed
+	virtual void requestSnapshot(int index) = 0;
+
+	/**
+	 * @brief Stop processing and delete the snapshotter
+	 *
+	 * The callback function will not be called after this returns.
+	 */
+	virtual void dispose() = 0;
+
+protected:
+	virtual ~Snapshotter() = default;
+};
+
+}
+
+#endif
@@ -0,0 +1,242 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "stalldetector.h"
+#include "workerthreads.h"
+
+#include <QThread>
+#include <QThreadStorage>
+#include <QTimer>
+
+namespace server {
+
+namespace detail {
+
+struct WatchedThread {
+	explicit WatchedThread(const QString &n)
+		: name(n), heartbeat(0), threshold(0), gone(0),
+		lastProbe(0), reported(0),
+		what(nullptr), user(0)
+	{ }
+
+	void probe();
+	void logStall(qint64 silence);
+
+	const QString name;
+	QAtomicInteger<qint64> heartbeat; // time of the latest probe (0 if not started yet)
+	QAtomicInt threshold;
+	QAtomicInt gone;
+
+	metrics::LatencyHistogram lag;
+	metrics::Counter stalls;
+
+	qint64 lastProbe; // only used in the watched thread
+	QAtomicInt reported; // set by the watchdog when it has logged the ongoing stall
+
+	// The current activity (protected by the mutex)
+	QMutex mutex;
+	const char *what;
+	QUuid session;
+	int user;
+};
+
+// The monitoring state of the current thread (if watched)
+static QThreadStorage<QSharedPointer<WatchedThread>> currentThread;
+
+void WatchedThread::probe()
+{
+	const qint64 now = metrics::now();
+	const qint64 delay = qMax(qint64(0), now - lastProbe - StallDetector::PROBE_INTERVAL * 1000);
+	const bool alreadyReported = reported.fetchAndStoreOrdered(0);
+	lastProbe = now;
+	heartbeat.store(now);
+	lag.observe(delay);
+
+	// Stalls the watchdog noticed while they were going on have been logged already
+	const int t = threshold.load();
+	if(t > 0 && delay > t * 1000LL) {
+		metrics::add(stalls);
+		if(!alreadyReported)
+			qWarning("%s stalled for %lld ms", qPrintable(name), delay / 1000);
+	}
+}
+
+void WatchedThread::logStall(qint64 silence)
+{
+	QMutexLocker lock(&mutex);
+	if(!what) {
+		qWarning("%s has been unresponsive for %lld ms", qPrintable(name), silence);
+		return;
+	}
+
+	QString activity = QString::fromLatin1(what);
+	if(user > 0)
+		activity += QStringLiteral(", user #%1").arg(user);
+	if(!session.isNull())
+		activity += QStringLiteral(", session %1").arg(session.toString());
+
+	qWarning("%s has been unresponsive for %lld ms (%s)", qPrintable(name), silence, qPrintable(activity));
+}
+
+}
+
+class StallDetector::Watchdog : public QThread
+{
+public:
+	explicit Watchdog(StallDetector *detector) : m_detector(detector) { }
+
+protected:
+	void run() override { m_detector->checkThreads(); }
+
+private:
+	StallDetector *m_detector;
+};
+
+StallDetector::StallDetector()
+	: m_threshold(0), m_stopping(false), m_watchdog(nullptr)
+{
+}
+
+StallDetector::~StallDetector()
+{
+	{
+		QMutexLocker lock(&m_mutex);
+		m_stopping = true;
+		m_wake.wakeAll();
+	}
+
+	if(m_watchdog) {
+		m_watchdog->wait();
+		delete m_watchdog;
+	}
+}
+
+void StallDetector::watch(QObject *context, const QString &name)
+{
+	QSharedPointer<detail::WatchedThread> thread(new detail::WatchedThread(name));
+	{
+		QMutexLocker lock(&m_mutex);
+		thread->threshold.store(m_threshold);
+		m_threads << thread;
+	}
+
+	runInThread(context, [thread, context]() {
+		detail::currentThread.setLocalData(thread);
+		thread->lastProbe = metrics::now();
+
+		QTimer *probe = new QTimer(context);
+		probe->setTimerType(Qt::PreciseTimer);
+		QObject::connect(probe, &QTimer::timeout, probe, [thread]() { thread->probe(); });
+		QObject::connect(probe, &QObject::destroyed, [thread]() { thread->gone.store(1); });
+		probe->start(PROBE_INTERVAL);
+	});
+}
+
+void StallDetector::setThreshold(int threshold)
+{
+	QMutexLocker lock(&m_mutex);
+	m_threshold = qMax(0, threshold);
+	for(const auto &thread : m_threads)
+		thread->threshold.store(m_threshold);
+
+	if(m_threshold > 0 && !m_watchdog) {
+		m_watchdog = new Watchdog(this);
+		m_watchdog->setObjectName(QStringLiteral("stall watchdog"));
+		m_watchdog->start();
+	}
+	m_wake.wakeAll();
+}
+
+void StallDetector::checkThreads()
+{
+	QMutexLocker lock(&m_mutex);
+	while(!m_stopping) {
+		if(m_threshold > 0)
+			m_wake.wait(&m_mutex, qMax(10, m_threshold / 4));
+		else
+			m_wake.wait(&m_mutex);
+
+		if(m_stopping || m_threshold <= 0)
+			continue;
+
+		const qint64 now = metrics::now();
+		for(int i=0;i<m_threads.size();) {
+			detail::WatchedThread *thread = m_threads.at(i).data();
+			if(thread->gone.load()) {
+				m_threads.remove(i);
+				continue;
+			}
+
+			// The probe is late by the stall duration so far.
+			// Threads are not checked before their event loop has started.
+			const qint64 heartbeat = thread->heartbeat.load();
+			const qint64 silence = (now - heartbeat) / 1000 - PROBE_INTERVAL;
+			// Log each stall only once, while it is still going on.
+			// The probe clears the flag when the thread recovers.
+			if(heartbeat > 0 && silence > m_threshold && thread->reported.testAndSetOrdered(0, 1))
+				thread->logStall(silence);
+			++i;
+		}
+	}
+}
+
+void StallDetector::writeMetrics(metrics::Writer &writer) const
+{
+	QMutexLocker lock(&m_mutex);
+
+	writer.family("drawpile_event_loop_lag_seconds", "histogram", "How late each thread's event loop processes its events");
+	for(const auto &thread : m_threads) {
+		if(!thread->gone.load())
+			writer.latency("drawpile_event_loop_lag_seconds", thread->lag, metrics::Writer::label("thread", thread->name));
+	}
+
+	writer.family("drawpile_event_loop_stalls_total", "counter", "Event loop delays longer than the stall threshold");
+	for(const auto &thread : m_threads) {
+		if(!thread->gone.load())
+			writer.sample("drawpile_event_loop_stalls_total", thread->stalls.load(), metrics::Writer::label("thread", thread->name));
+	}
+}
+
+StallDetector::Activity::Activity(const char *what, const QUuid &session, int user)
+	: m_thread(detail::currentThread.hasLocalData() ? detail::currentThread.localData().data() : nullptr),
+	m_prevWhat(nullptr), m_prevUser(0)
+{
+	if(m_thread) {
+		QMutexLocker lock(&m_thread->mutex);
+		m_prevWhat = m_thread->what;
+		m_prevSession = m_thread->session;
+		m_prevUser = m_thread->user;
+		m_thread->what = what;
+		m_thread->session = session;
+		m_thread->user = user;
+	}
+}
+
+StallDetector::Activity::~Activity()
+{
+	if(m_thread) {
+		QMutexLocker lock(&m_thread->mutex);
+		m_thread->what = m_prevWhat;
+		m_thread->session = m_prevSession;
+		m_thread->user = m_prevUser;
+	}
+}
+
+}
@@ -0,0 +1,113 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef DP_SERVER_STALLDETECTOR_H
+#define DP_SERVER_STALLDETECTOR_H
+
+#include "metrics.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSharedPointer>
+#include <QVector>
+#include <QUuid>
+
+class QObject;
+class QThread;
+
+namespace server {
+
+namespace detail {
+	struct WatchedThread;
+}
+
+/**
+ * @brief Event loop responsiveness monitor
+ *
+ * A probe timer in each watched thread measures how late the thread's
+ * events are processed. The delays are collected into a histogram
+ * per thread.
+ *
+ * When a stall threshold is set, a watchdog thread checks that every
+ * watched thread keeps processing its probe. If a thread stops responding
+ * for longer than the threshold, the watchdog logs what the thread was
+ * doing (see Activity) while the thread is still stuck. Stalls too short
+ * for the watchdog to notice are logged by the probe once the thread recovers.
+ */
+class StallDetector
+{
+public:
+	static const int PROBE_INTERVAL = 100; // milliseconds
+
+	StallDetector();
+	~StallDetector();
+
+	/**
+	 * @brief Start monitoring the thread the context object lives in
+	 *
+	 * Monitoring stops when the context object is deleted.
+	 */
+	void watch(QObject *context, const QString &name);
+
+	/**
+	 * @brief Set the stall threshold in milliseconds
+	 *
+	 * Zero disables stall logging. Lag is measured regardless.
+	 */
+	void setThreshold(int threshold);
+
+	//! Write per-thread event loop lag and stall counts
+	void writeMetrics(metrics::Writer &writer) const;
+
+	/**
+	 * @brief A description of what the current thread is doing
+	 *
+	 * Create one on the stack around work that may take a long time.
+	 * If the thread stalls, the innermost activity is included in the log.
+	 * This is cheap enough to do for every batch of messages.
+	 */
+	class Activity {
+	public:
+		explicit Activity(const char *what, const QUuid &session=QUuid(), int user=0);
+		~Activity();
+
+	private:
+		detail::WatchedThread *m_thread;
+		const char *m_prevWhat;
+		QUuid m_prevSession;
+		int m_prevUser;
+	};
+
+private:
+	class Watchdog;
+
+	void checkThreads();
+
+	mutable QMutex m_mutex;
+	QWaitCondition m_wake;
+	QVector<QSharedPointer<detail::WatchedThread>> m_threads;
+	int m_threshold;
+	bool m_stopping;
+	QThread *m_watchdog;
+};
+
+}
+
+#endif
@@ -0,0 +1,211 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "subnettrie.h"
+
+#include <QVector>
+#include <QVarLengthArray>
+
+#include <limits>
+
+namespace server {
+
+const qint64 SubnetTrie::NEVER = std::numeric_limits<qint64>::max();
+
+struct SubnetTrie::Node {
+	struct Ban {
+		int id;
+		qint64 expires;
+	};
+
+	std::unique_ptr<Node> child[2];
+	QVector<Ban> bans; // entries whose subnet ends at this node
+
+	bool isEmpty() const { return bans.isEmpty() && !child[0] && !child[1]; }
+};
+
+static inline int bitAt(const Q_IPV6ADDR &address, int bit)
+{
+	return (address[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+static bool toKey(const QHostAddress &address, int prefixLength, Q_IPV6ADDR &key, int &keyLength)
+{
+	switch(address.protocol()) {
+	case QAbstractSocket::IPv4Protocol: {
+		if(prefixLength == 0)
+			prefixLength = 32;
+		else if(prefixLength < 0 || prefixLength > 32)
+			return false;
+
+		// Stored as an IPv4 mapped address (::ffff:a.b.c.d)
+		const quint32 ipv4 = address.toIPv4Address();
+		for(int i=0;i<10;++i)
+			key[i] = 0;
+		key[10] = 0xff;
+		key[11] = 0xff;
+		key[12] = ipv4 >> 24;
+		key[13] = ipv4 >> 16;
+		key[14] = ipv4 >> 8;
+		key[15] = ipv4;
+		keyLength = 96 + prefixLength;
+		return true;
+	}
+
+	case QAbstractSocket::IPv6Protocol:
+		if(prefixLength == 0)
+			prefixLength = 128;
+		else if(prefixLength < 0 || prefixLength > 128)
+			return false;
+
+		key = address.toIPv6Address();
+		keyLength = prefixLength;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static qint64 toMsecs(const QDateTime &time, qint64 invalid)
+{
+	return time.isValid() ? time.toMSecsSinceEpoch() : invalid;
+}
+
+SubnetTrie::SubnetTrie()
+	: m_root(new Node), m_nextExpiration(NEVER)
+{
+}
+
+SubnetTrie::~SubnetTrie()
+{
+}
+
+bool SubnetTrie::add(int id, const QHostAddress &address, int prefixLength, const QDateTime &expires)
+{
+	Entry entry;
+	if(!toKey(address, prefixLength, entry.address, entry.prefixLength))
+		return false;
+	entry.expires = toMsecs(expires, NEVER);
+
+	remove(id);
+
+	Node *node = m_root.get();
+	for(int i=0;i<entry.prefixLength;++i) {
+		std::unique_ptr<Node> &next = node->child[bitAt(entry.address, i)];
+		if(!next)
+			next.reset(new Node);
+		node = next.get();
+	}
+
+	node->bans.append(Node::Ban { id, entry.expires });
+	m_entries.insert(id, entry);
+	m_nextExpiration = qMin(m_nextExpiration, entry.expires);
+
+	return true;
+}
+
+bool SubnetTrie::remove(int id)
+{
+	const auto entry = m_entries.find(id);
+	if(entry == m_entries.end())
+		return false;
+
+	removeEntry(id, *entry);
+	m_entries.erase(entry);
+	return true;
+}
+
+void SubnetTrie::removeEntry(int id, const Entry &entry)
+{
+	// Find the path to the entry's node so empty branches can be pruned
+	QVarLengthArray<Node*, 129> path;
+	path.append(m_root.get());
+	for(int i=0;i<entry.prefixLength;++i) {
+		Node *next = path.last()->child[bitAt(entry.address, i)].get();
+		Q_ASSERT(next);
+		if(!next)
+			return;
+		path.append(next);
+	}
+
+	QVector<Node::Ban> &bans = path.last()->bans;
+	for(int i=0;i<bans.size();++i) {
+		if(bans.at(i).id == id) {
+			bans.remove(i);
+			break;
+		}
+	}
+
+	for(int i=path.size()-1;i>0 && path.at(i)->isEmpty();--i)
+		path.at(i-1)->child[bitAt(entry.address, i-1)].reset();
+}
+
+void SubnetTrie::clear()
+{
+	m_root.reset(new Node);
+	m_entries.clear();
+	m_nextExpiration = NEVER;
+}
+
+void SubnetTrie::removeExpired(const QDateTime &now)
+{
+	const qint64 t = toMsecs(now, 0);
+	if(t < m_nextExpiration)
+		return;
+
+	m_nextExpiration = NEVER;
+	auto entry = m_entries.begin();
+	while(entry != m_entries.end()) {
+		if(entry->expires <= t) {
+			removeEntry(entry.key(), *entry);
+			entry = m_entries.erase(entry);
+		} else {
+			m_nextExpiration = qMin(m_nextExpiration, entry->expires);
+			++entry;
+		}
+	}
+}
+
+bool SubnetTrie::contains(const QHostAddress &address, const QDateTime &now) const
+{
+	Q_IPV6ADDR key;
+	int keyLength;
+	if(!toKey(address, 0, key, keyLength))
+		return false;
+
+	const qint64 t = toMsecs(now, std::numeric_limits<qint64>::min());
+
+	// Every node along the path is a subnet the address belongs to
+	const Node *node = m_root.get();
+	for(int i=0;node;++i) {
+		for(const Node::Ban &b : node->bans) {
+			if(b.expires > t)
+				return true;
+		}
+
+		if(i == keyLength)
+			break;
+		node = node->child[bitAt(key, i)].get();
+	}
+
+	return false;
+}
+
+}
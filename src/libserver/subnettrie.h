@@ -0,0 +1,117 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_SUBNETTRIE_H
+#define DP_SERVER_SUBNETTRIE_H
+
+#include <QHash>
+#include <QHostAddress>
+#include <QDateTime>
+
+#include <memory>
+
+namespace server {
+
+/**
+ * @brief A binary prefix trie of banned IP subnets
+ *
+ * Checking an address against the ban list takes at most 128 steps,
+ * no matter how many bans there are.
+ *
+ * IPv4 addresses are stored as IPv4 mapped IPv6 addresses, so IPv4
+ * and IPv6 bans live in the same trie and an IPv4 client connecting
+ * through a dual stack socket matches its IPv4 bans.
+ *
+ * Each ban is identified by a unique ID and may have an expiration time.
+ * Expired entries are pruned when the trie is next searched.
+ *
+ * This class is not thread safe.
+ */
+class SubnetTrie
+{
+public:
+	SubnetTrie();
+	~SubnetTrie();
+
+	SubnetTrie(const SubnetTrie&) = delete;
+	SubnetTrie &operator=(const SubnetTrie&) = delete;
+
+	/**
+	 * @brief Add a subnet
+	 *
+	 * As in the ban lists, a prefix length of zero means the address itself
+	 * (i.e. /32 for IPv4 and /128 for IPv6.)
+	 *
+	 * If an entry with the same ID exists already, it is replaced.
+	 *
+	 * @param id unique ID of the entry
+	 * @param address the subnet address
+	 * @param prefixLength subnet prefix length
+	 * @param expires expiration time (if invalid, the entry never expires)
+	 * @return false if the address was not valid
+	 */
+	bool add(int id, const QHostAddress &address, int prefixLength, const QDateTime &expires=QDateTime());
+
+	//! Remove the entry with the given ID. Returns false if not found
+	bool remove(int id);
+
+	//! Remove all entries
+	void clear();
+
+	/**
+	 * @brief Remove all entries that have expired by the given time
+	 *
+	 * This is cheap to call when nothing has expired yet.
+	 */
+	void removeExpired(const QDateTime &now);
+
+	/**
+	 * @brief Check if the address is in any of the subnets in the trie
+	 *
+	 * @param address the address to check
+	 * @param now entries that have expired by this time are ignored. If invalid, expiration times are not checked.
+	 */
+	bool contains(const QHostAddress &address, const QDateTime &now=QDateTime()) const;
+
+	//! Get the number of entries in the trie
+	int size() const { return m_entries.size(); }
+
+	//! Check if the trie is empty
+	bool isEmpty() const { return m_entries.isEmpty(); }
+
+private:
+	struct Node;
+	struct Entry {
+		Q_IPV6ADDR address;
+		int prefixLength;  // always in IPv6 terms
+		qint64 expires;    // ms since epoch
+	};
+
+	static const qint64 NEVER;
+
+	void removeEntry(int id, const Entry &entry);
+
+	std::unique_ptr<Node> m_root;
+	QHash<int, Entry> m_entries;
+	qint64 m_nextExpiration;
+};
+
+}
+
+#endif
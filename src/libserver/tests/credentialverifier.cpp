@@ -0,0 +1,104 @@
+#include "../credentialverifier.h"
+
+#include <QtTest/QtTest>
+
+using server::CredentialVerifier;
+
+class TestCredentialVerifier: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testVerify()
+	{
+		CredentialVerifier verifier(1, 10);
+		QObject receiver;
+
+		QThread *checkedIn = nullptr;
+		QThread *doneIn = nullptr;
+		int result = 0;
+
+		const auto status = verifier.verify(QHostAddress("192.168.0.1"), &receiver,
+			[&checkedIn]() { checkedIn = QThread::currentThread(); return 42; },
+			[&doneIn, &result](int r) { doneIn = QThread::currentThread(); result = r; }
+		);
+
+		QCOMPARE(status, CredentialVerifier::Queued);
+		QTRY_COMPARE(result, 42);
+		QVERIFY(checkedIn != QThread::currentThread());
+		QCOMPARE(doneIn, QThread::currentThread());
+		QTRY_COMPARE(verifier.pending(), 0);
+	}
+
+	void testDeletedReceiver()
+	{
+		CredentialVerifier verifier(1, 10);
+		QSemaphore checked;
+		bool called = false;
+
+		{
+			QObject receiver;
+			verifier.verify(QHostAddress("192.168.0.1"), &receiver,
+				[&checked]() { checked.release(); return true; },
+				[&called](bool) { called = true; }
+			);
+			checked.acquire();
+		}
+
+		QTRY_COMPARE(verifier.pending(), 0);
+		QCoreApplication::processEvents();
+		QCOMPARE(called, false);
+	}
+
+	void testRateLimit()
+	{
+		CredentialVerifier verifier(1, 100);
+		QObject receiver;
+		const QHostAddress addr("192.168.0.1");
+
+		for(int i=0;i<CredentialVerifier::BURST_ATTEMPTS;++i)
+			QCOMPARE(verifier.verify(addr, &receiver, []() { return true; }, [](bool) {}), CredentialVerifier::Queued);
+
+		QCOMPARE(verifier.verify(addr, &receiver, []() { return true; }, [](bool) {}), CredentialVerifier::RateLimited);
+
+		// Other addresses are not affected
+		QCOMPARE(verifier.verify(QHostAddress("192.168.0.2"), &receiver, []() { return true; }, [](bool) {}), CredentialVerifier::Queued);
+	}
+
+	void testQueueLimit()
+	{
+		CredentialVerifier verifier(1, 1);
+		QObject receiver;
+		QSemaphore blocker;
+
+		// One check running and one queued
+		QCOMPARE(verifier.verify(QHostAddress("10.0.0.1"), &receiver, [&blocker]() { blocker.acquire(); return true; }, [](bool) {}), CredentialVerifier::Queued);
+		QCOMPARE(verifier.verify(QHostAddress("10.0.0.2"), &receiver, []() { return true; }, [](bool) {}), CredentialVerifier::Queued);
+		QCOMPARE(verifier.verify(QHostAddress("10.0.0.3"), &receiver, []() { return true; }, [](bool) {}), CredentialVerifier::Busy);
+
+		blocker.release();
+		QTRY_COMPARE(verifier.pending(), 0);
+		QCOMPARE(verifier.verify(QHostAddress("10.0.0.3"), &receiver, []() { return true; }, [](bool) {}), CredentialVerifier::Queued);
+	}
+
+	void testBusyKeepsAttempts()
+	{
+		CredentialVerifier verifier(1, 0);
+		QObject receiver;
+		QSemaphore blocker;
+		const QHostAddress addr("10.0.0.1");
+
+		QCOMPARE(verifier.verify(QHostAddress("10.0.0.2"), &receiver, [&blocker]() { blocker.acquire(); return true; }, [](bool) {}), CredentialVerifier::Queued);
+
+		// Rejected checks don't use up the address's attempts
+		for(int i=0;i<CredentialVerifier::BURST_ATTEMPTS*2;++i)
+			QCOMPARE(verifier.verify(addr, &receiver, []() { return true; }, [](bool) {}), CredentialVerifier::Busy);
+
+		blocker.release();
+		QTRY_COMPARE(verifier.pending(), 0);
+		QCOMPARE(verifier.verify(addr, &receiver, []() { return true; }, [](bool) {}), CredentialVerifier::Queued);
+	}
+};
+
+
+QTEST_MAIN(TestCredentialVerifier)
+#include "credentialverifier.moc"
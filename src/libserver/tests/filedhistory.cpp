@@ -1,4 +1,5 @@
 #include "../filedhistory.h"
+#include "../historycache.h"
 #include "../../libshared/util/passwordhash.h"
 #include "../../libshared/net/meta.h"
 
@@ -274,6 +275,47 @@ private slots:
 		QCOMPARE(lastIdx, 5);
 	}
 
+	// Raw batches should contain the same messages as regular batches
+	void testRawBatch()
+	{
+		QString file = makeTestRecording();
+		std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(file)) };
+
+		auto testMsg = protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test4")));
+		fh->addMessage(testMsg);
+
+		QByteArray raw, rawTail;
+		int lastIdx, lastTailIdx;
+
+		// The open block is read straight from the file
+		std::tie(raw, lastIdx) = fh->getRawBatch(-1);
+		std::tie(rawTail, lastTailIdx) = fh->getRawBatch(1);
+
+		QCOMPARE(lastIdx, 3);
+		QCOMPARE(lastTailIdx, 3);
+		QCOMPARE(raw, serializedBatch(fh.get(), -1));
+		QCOMPARE(rawTail, serializedBatch(fh.get(), 1));
+
+		// New blocks are cached
+		fh->closeBlock();
+		fh->addMessage(testMsg);
+
+		std::tie(raw, lastIdx) = fh->getRawBatch(lastIdx);
+		QCOMPARE(lastIdx, 4);
+		QCOMPARE(raw, testMsg->serialized());
+
+		// A closed block that is no longer cached is read from the file
+		fh->cleanupBatches(5);
+		std::tie(raw, lastIdx) = fh->getRawBatch(2);
+		QCOMPARE(lastIdx, 3);
+		QCOMPARE(raw, testMsg->serialized());
+
+		// No more messages
+		std::tie(raw, lastIdx) = fh->getRawBatch(4);
+		QVERIFY(raw.isEmpty());
+		QCOMPARE(lastIdx, 4);
+	}
+
 	void testUserLeave()
 	{
 		QUuid id = QUuid::createUuid();
@@ -301,7 +343,354 @@ private slots:
 		}
 	}
 
+	void testDurability_data()
+	{
+		QTest::addColumn<int>("durability");
+		QTest::newRow("relaxed") << int(FiledHistory::Durability::Relaxed);
+		QTest::newRow("group") << int(FiledHistory::Durability::GroupCommit);
+		QTest::newRow("strict") << int(FiledHistory::Durability::Strict);
+	}
+
+	// The durability mode shouldn't affect what gets written
+	void testDurability()
+	{
+		QFETCH(int, durability);
+
+		QUuid id = QUuid::createUuid();
+		protocol::MessageList sent;
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, QString(), protocol::ProtocolVersion::current(), "test") };
+			fh->setDurability(FiledHistory::Durability(durability), 10, 100);
+
+			for(int i=0;i<50;++i) {
+				sent << protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray::number(i)));
+				fh->addMessage(sent.last());
+			}
+			fh->setTitle("durable");
+
+			// Give group commits a chance to run
+			QTest::qWait(50);
+		}
+
+		std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(FiledHistory::journalFilename(id))) };
+		QVERIFY(fh.get());
+		QCOMPARE(fh->title(), QString("durable"));
+
+		const protocol::MessageList msgs = allMessages(fh.get());
+		QCOMPARE(msgs.size(), sent.size());
+		for(int i=0;i<sent.size();++i)
+			QVERIFY(msgs.at(i).equals(sent.at(i)));
+	}
+
+	// Simulate crashes in the middle of writing the recording file
+	void testRecordingCrashRecovery()
+	{
+		QUuid id = QUuid::createUuid();
+		protocol::MessageList sent;
+		int contentLen = 0;
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, QString(), protocol::ProtocolVersion::current(), "test") };
+			for(int i=0;i<100;++i) {
+				sent << protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray(i % 37 + 1, 'a' + i % 26)));
+				contentLen += sent.last()->length();
+				fh->addMessage(sent.last());
+			}
+		}
+
+		const QString journalPath = m_dir.absoluteFilePath(FiledHistory::journalFilename(id));
+		QString recordingPath = journalPath;
+		recordingPath.replace(".session", ".dprec");
+
+		const QByteArray original = readFile(recordingPath);
+		const int headerLen = original.length() - contentLen;
+		QVERIFY(headerLen > 0);
+
+		const auto extra = protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("after crash")));
+
+		qsrand(39);
+		for(int round=0;round<20;++round) {
+			const int cut = headerLen + qrand() % (contentLen + 1);
+			writeFile(recordingPath, original.left(cut));
+
+			// The messages that were completely written before the crash
+			int complete = 0;
+			for(int pos=headerLen;complete<sent.size() && pos+sent.at(complete)->length() <= cut;++complete)
+				pos += sent.at(complete)->length();
+
+			{
+				std::unique_ptr<FiledHistory> fh { FiledHistory::load(journalPath) };
+				if(complete == 0) {
+					// Empty sessions are not loaded
+					QVERIFY(!fh.get());
+					continue;
+				}
+				QVERIFY(fh.get());
+
+				const protocol::MessageList msgs = allMessages(fh.get());
+				QCOMPARE(msgs.size(), complete);
+				for(int i=0;i<complete;++i)
+					QVERIFY(msgs.at(i).equals(sent.at(i)));
+
+				fh->addMessage(extra);
+			}
+
+			// New messages must not get mixed up with the remains of the partial message
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(journalPath) };
+			QVERIFY(fh.get());
+			const protocol::MessageList msgs = allMessages(fh.get());
+			QCOMPARE(msgs.size(), complete + 1);
+			QVERIFY(msgs.last().equals(extra));
+		}
+	}
+
+	// Simulate crashes in the middle of writing the journal file
+	void testJournalCrashRecovery()
+	{
+		QUuid id = QUuid::createUuid();
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, QString(), protocol::ProtocolVersion::current(), "test") };
+			for(int i=0;i<3;++i)
+				fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray::number(i))));
+			fh->setTitle("first");
+			fh->setMaxUsers(10);
+			fh->setPasswordHash(passwordhash::hash("pass"));
+			fh->setTitle("second");
+		}
+
+		const QString journalPath = m_dir.absoluteFilePath(FiledHistory::journalFilename(id));
+		const QByteArray original = readFile(journalPath);
+
+		// The session can't be loaded without knowing the recording file name
+		const int fileEntryEnd = original.indexOf('\n', original.indexOf("FILE ")) + 1;
+		QVERIFY(fileEntryEnd > 0);
+
+		qsrand(390);
+		for(int round=0;round<20;++round) {
+			const int cut = qrand() % (original.length() + 1);
+			writeFile(journalPath, original.left(cut));
+
+			{
+				std::unique_ptr<FiledHistory> fh { FiledHistory::load(journalPath) };
+				if(cut < fileEntryEnd) {
+					QVERIFY(!fh.get());
+					continue;
+				}
+				QVERIFY(fh.get());
+				QCOMPARE(allMessages(fh.get()).size(), 3);
+
+				fh->setTitle("recovered");
+			}
+
+			// The new entry must not get mixed up with the remains of the partial entry
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(journalPath) };
+			QVERIFY(fh.get());
+			QCOMPARE(fh->title(), QString("recovered"));
+		}
+	}
+
+	// Test that cached blocks are evicted across sessions when the budget is exceeded
+	void testCacheBudget()
+	{
+		QSharedPointer<HistoryCache> cache { new HistoryCache };
+
+		std::unique_ptr<FiledHistory> fh1 { FiledHistory::startNew(m_dir, QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test") };
+		std::unique_ptr<FiledHistory> fh2 { FiledHistory::startNew(m_dir, QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test") };
+		fh1->setCache(cache);
+		fh2->setCache(cache);
+
+		// Four blocks of 10 messages in each session
+		const auto msg = protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray(95, 'x')));
+		const int blockSize = msg->length() * 10;
+		for(int block=0;block<4;++block) {
+			for(int i=0;i<10;++i) {
+				fh1->addMessage(msg);
+				fh2->addMessage(msg);
+			}
+			// The open block is registered only when it is closed
+			QCOMPARE(cache->stats().blocks, block * 2);
+
+			fh1->closeBlock();
+			fh2->closeBlock();
+		}
+
+		HistoryCache::Stats stats = cache->stats();
+		QCOMPARE(stats.blocks, 8);
+		QCOMPARE(stats.size, qint64(blockSize * 8));
+
+		// Shrinking the budget evicts the least recently used blocks first
+		cache->setBudget(blockSize * 3);
+		QTest::qWait(10); // evictions are delivered via the event loop
+
+		stats = cache->stats();
+		QCOMPARE(stats.blocks, 3);
+		QCOMPARE(stats.evictions, quint64(5));
+
+		// Evicted blocks are reloaded when needed
+		QCOMPARE(allMessages(fh1.get()).size(), 40);
+		QCOMPARE(allMessages(fh2.get()).size(), 40);
+
+		stats = cache->stats();
+		QVERIFY(stats.misses > 0);
+		QVERIFY(stats.size <= blockSize * 3);
+
+		// A second read of the most recently used block is served from the cache
+		const quint64 hits = stats.hits;
+		protocol::MessageList batch;
+		int lastIdx;
+		std::tie(batch, lastIdx) = fh2->getBatch(29);
+		QCOMPARE(batch.size(), 10);
+		QCOMPARE(cache->stats().hits, hits + 1);
+
+		// Destroyed sessions release their blocks
+		fh1.reset();
+		fh2.reset();
+		QCOMPARE(cache->stats().blocks, 0);
+		QCOMPARE(cache->stats().size, qint64(0));
+	}
+
+	// Test that closed blocks are loaded from the index file
+	void testBlockIndex()
+	{
+		QUuid id = QUuid::createUuid();
+		protocol::MessageList sent;
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, QString(), protocol::ProtocolVersion::current(), "test") };
+			sent << protocol::MessagePtr(new protocol::UserJoin(1, 0, QByteArray("u1"), QByteArray()));
+			sent << protocol::MessagePtr(new protocol::UserJoin(2, 0, QByteArray("u2"), QByteArray()));
+			for(const protocol::MessagePtr &msg : sent)
+				fh->addMessage(msg);
+
+			for(int block=0;block<3;++block) {
+				for(int i=0;i<10;++i) {
+					sent << protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray::number(block * 10 + i)));
+					fh->addMessage(sent.last());
+				}
+				fh->closeBlock();
+			}
+
+			// Unindexed tail
+			sent << protocol::MessagePtr(new protocol::UserLeave(1));
+			fh->addMessage(sent.last());
+			for(int i=0;i<5;++i) {
+				sent << protocol::MessagePtr(new protocol::Chat(2, 0, 0, QByteArray::number(i)));
+				fh->addMessage(sent.last());
+			}
+		}
+
+		const QString journalPath = m_dir.absoluteFilePath(FiledHistory::journalFilename(id));
+		QString recordingPath = journalPath;
+		recordingPath.replace(".session", ".dprec");
+		QString indexPath;
+
+		int contentLength = 0;
+		for(const protocol::MessagePtr &msg : sent)
+			contentLength += msg->length();
+		const int headerLength = QFileInfo(recordingPath).size() - contentLength;
+		int firstBlockLength = 0;
+		for(int i=0;i<12;++i)
+			firstBlockLength += sent.at(i)->length();
+
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(journalPath) };
+			QVERIFY(fh.get());
+			indexPath = fh->indexFilename();
+			QVERIFY(QFile::exists(indexPath));
+
+			// Block boundaries come from the index
+			protocol::MessageList batch;
+			int lastIdx;
+			std::tie(batch, lastIdx) = fh->getBatch(-1);
+			QCOMPARE(batch.size(), 12);
+			QCOMPARE(lastIdx, 11);
+
+			// User 2 was still present at the end of the recording
+			const protocol::MessageList msgs = allMessages(fh.get());
+			QCOMPARE(msgs.size(), sent.size() + 1);
+			for(int i=0;i<sent.size();++i)
+				QVERIFY(msgs.at(i).equals(sent.at(i)));
+			QCOMPARE(msgs.last()->type(), protocol::MSG_USER_LEAVE);
+			QCOMPARE(msgs.last()->contextId(), uint8_t(2));
+		}
+
+		// A damaged entry only discards that entry and the ones after it
+		const QByteArray index = readFile(indexPath);
+		writeFile(indexPath, index.left(index.length() - 3));
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(journalPath) };
+			QVERIFY(fh.get());
+			QVERIFY(QFile::exists(indexPath));
+			QVERIFY(QFileInfo(indexPath).size() < index.length() - 3);
+
+			protocol::MessageList batch;
+			int lastIdx;
+			std::tie(batch, lastIdx) = fh->getBatch(-1);
+			QCOMPARE(batch.size(), 12);
+			QCOMPARE(allMessages(fh.get()).size(), sent.size() + 1);
+		}
+
+		// A corrupted index is discarded and the whole recording is scanned
+		writeFile(indexPath, "garbage");
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(journalPath) };
+			QVERIFY(fh.get());
+			QVERIFY(!QFile::exists(indexPath));
+			QCOMPARE(allMessages(fh.get()).size(), sent.size() + 1);
+			fh->closeBlock();
+			QVERIFY(QFile::exists(indexPath));
+		}
+
+		// An index that doesn't match the recording is not used
+		writeFile(recordingPath, readFile(recordingPath).left(headerLength + firstBlockLength));
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(journalPath) };
+			QVERIFY(fh.get());
+			const protocol::MessageList msgs = allMessages(fh.get());
+			QCOMPARE(msgs.size(), 12 + 2);
+			for(int i=0;i<12;++i)
+				QVERIFY(msgs.at(i).equals(sent.at(i)));
+		}
+	}
+
 private:
+	static protocol::MessageList allMessages(const FiledHistory *fh)
+	{
+		protocol::MessageList all, batch;
+		int lastIdx = -1;
+		while(lastIdx < fh->lastIndex()) {
+			std::tie(batch, lastIdx) = fh->getBatch(lastIdx);
+			all << batch;
+		}
+		return all;
+	}
+
+	static QByteArray readFile(const QString &path)
+	{
+		QFile f(path);
+		if(!f.open(QFile::ReadOnly))
+			return QByteArray();
+		return f.readAll();
+	}
+
+	static void writeFile(const QString &path, const QByteArray &content)
+	{
+		QFile f(path);
+		QVERIFY(f.open(QFile::WriteOnly | QFile::Truncate));
+		QCOMPARE(f.write(content), qint64(content.length()));
+	}
+
+	// Get the concatenated wire format of a regular batch
+	static QByteArray serializedBatch(const FiledHistory *fh, int after)
+	{
+		protocol::MessageList msgs;
+		int lastIdx;
+		std::tie(msgs, lastIdx) = fh->getBatch(after);
+
+		QByteArray data;
+		for(const protocol::MessagePtr &msg : msgs)
+			data.append(msg->serialized());
+		return data;
+	}
+
 	// Generate a test recording containing three messages.
 	QString makeTestRecording()
 	{
@@ -0,0 +1,118 @@
+#include "../inmemoryhistory.h"
+#include "../../libshared/net/meta.h"
+
+#include <QtTest/QtTest>
+
+using namespace server;
+
+class TestInMemoryHistory: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testBatches()
+	{
+		InMemoryHistory h(QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test");
+
+		for(int i=0;i<3;++i)
+			h.addMessage(chat(QString("test%1").arg(i)));
+
+		protocol::MessageList msgs;
+		int lastIdx;
+
+		std::tie(msgs, lastIdx) = h.getBatch(-1);
+		QCOMPARE(lastIdx, 2);
+		QCOMPARE(msgs.size(), 3);
+		QCOMPARE(msgs.at(0).cast<protocol::Chat>().message(), QString("test0"));
+		QCOMPARE(msgs.at(2).cast<protocol::Chat>().message(), QString("test2"));
+
+		std::tie(msgs, lastIdx) = h.getBatch(1);
+		QCOMPARE(lastIdx, 2);
+		QCOMPARE(msgs.size(), 1);
+		QCOMPARE(msgs.at(0).cast<protocol::Chat>().message(), QString("test2"));
+
+		std::tie(msgs, lastIdx) = h.getBatch(2);
+		QCOMPARE(lastIdx, 2);
+		QCOMPARE(msgs.size(), 0);
+	}
+
+	void testRawBatch()
+	{
+		InMemoryHistory h(QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test");
+
+		// Enough data for more than one raw batch
+		const QString text(60000, 'x');
+		for(int i=0;i<40;++i)
+			h.addMessage(chat(text + QString::number(i)));
+
+		QByteArray raw, all;
+		int lastIdx = -1, batches = 0;
+		while(lastIdx < h.lastIndex()) {
+			const int prevIdx = lastIdx;
+			std::tie(raw, lastIdx) = h.getRawBatch(lastIdx);
+			QVERIFY(lastIdx > prevIdx);
+			QCOMPARE(raw, serializedBatch(h, prevIdx, lastIdx));
+			all.append(raw);
+			++batches;
+		}
+
+		QVERIFY(batches > 1);
+		QCOMPARE(all, serializedBatch(h, -1, h.lastIndex()));
+
+		// No more messages
+		std::tie(raw, lastIdx) = h.getRawBatch(h.lastIndex());
+		QVERIFY(raw.isEmpty());
+		QCOMPARE(lastIdx, h.lastIndex());
+	}
+
+	void testReset()
+	{
+		InMemoryHistory h(QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test");
+
+		for(int i=0;i<3;++i)
+			h.addMessage(chat(QString("test%1").arg(i)));
+
+		const auto resetMsg = chat("reset");
+		QVERIFY(h.reset(protocol::MessageList() << resetMsg));
+		h.addMessage(chat("after"));
+
+		QCOMPARE(h.firstIndex(), 3);
+		QCOMPARE(h.lastIndex(), 4);
+		QCOMPARE(h.sizeInBytes(), uint(resetMsg->length() + chat("after")->length()));
+
+		protocol::MessageList msgs;
+		int lastIdx;
+		std::tie(msgs, lastIdx) = h.getBatch(-1);
+		QCOMPARE(lastIdx, 4);
+		QCOMPARE(msgs.size(), 2);
+		QVERIFY(msgs.at(0).equals(resetMsg));
+		QCOMPARE(msgs.at(1).cast<protocol::Chat>().message(), QString("after"));
+
+		QByteArray raw;
+		std::tie(raw, lastIdx) = h.getRawBatch(3);
+		QCOMPARE(lastIdx, 4);
+		QCOMPARE(raw, chat("after")->serialized());
+	}
+
+private:
+	static protocol::MessagePtr chat(const QString &text)
+	{
+		return protocol::MessagePtr(new protocol::Chat(1, 0, 0, text));
+	}
+
+	// Serialize messages (after, last] returned by getBatch
+	static QByteArray serializedBatch(const InMemoryHistory &h, int after, int last)
+	{
+		protocol::MessageList msgs;
+		int lastIdx;
+		std::tie(msgs, lastIdx) = h.getBatch(after);
+
+		QByteArray data;
+		for(int i=0;i<msgs.size() && after+1+i <= last;++i)
+			data.append(msgs.at(i)->serialized());
+		return data;
+	}
+};
+
+
+QTEST_MAIN(TestInMemoryHistory)
+#include "inmemoryhistory.moc"
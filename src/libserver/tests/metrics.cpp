@@ -0,0 +1,137 @@
+#include "../metrics.h"
+#include "../../libshared/net/meta.h"
+#include "../../libshared/net/meta2.h"
+
+#include <QtTest/QtTest>
+
+using namespace server::metrics;
+
+class TestMetrics: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testTrafficBatch()
+	{
+		const protocol::MessagePtr chat(new protocol::Chat(1, 0, 0, "hello"));
+		const protocol::MessagePtr layer(new protocol::DefaultLayer(1, 2));
+
+		const QByteArray batch = chat->serialized() + layer->serialized() + chat->serialized();
+
+		Traffic traffic;
+		traffic.countBatch(batch);
+
+		QCOMPARE(traffic.messages[protocol::MSG_CHAT].load(), quint64(2));
+		QCOMPARE(traffic.bytes[protocol::MSG_CHAT].load(), quint64(2 * chat->length()));
+		QCOMPARE(traffic.messages[protocol::MSG_LAYER_DEFAULT].load(), quint64(1));
+		QCOMPARE(traffic.bytes[protocol::MSG_LAYER_DEFAULT].load(), quint64(layer->length()));
+	}
+
+	void testHistogram()
+	{
+		Histogram h({1, 5, 10});
+		h.observe(0.5);
+		h.observe(1);
+		h.observe(7);
+		h.observe(100);
+
+		QCOMPARE(h.bucketCount(), 3);
+		QCOMPARE(h.cumulativeCount(0), quint64(2));
+		QCOMPARE(h.cumulativeCount(1), quint64(2));
+		QCOMPARE(h.cumulativeCount(2), quint64(3));
+		QCOMPARE(h.count(), quint64(4));
+		QCOMPARE(h.sum(), 108.5);
+	}
+
+	void testLatencyBuckets()
+	{
+		QCOMPARE(LatencyHistogram::bucket(0), 0);
+		QCOMPARE(LatencyHistogram::bucket(7), 7);
+		QCOMPARE(LatencyHistogram::bucket(qint64(1) << 50), LatencyHistogram::BUCKETS - 1);
+
+		// Every value is in the first bucket that can hold it, with 1/8 precision
+		for(qint64 v=1;v<100000;++v) {
+			const int b = LatencyHistogram::bucket(v);
+			QVERIFY(LatencyHistogram::bucketMax(b) >= v);
+			QVERIFY(LatencyHistogram::bucketMax(b-1) < v);
+			QVERIFY(LatencyHistogram::bucketMax(b) - v <= v / LatencyHistogram::SUB_BUCKETS);
+		}
+	}
+
+	void testLatencyQuantiles()
+	{
+		LatencyHistogram h;
+		QCOMPARE(h.quantile(0.5), qint64(0));
+
+		for(int i=1;i<=1000;++i)
+			h.observe(i);
+
+		QCOMPARE(h.count(), quint64(1000));
+		QCOMPARE(h.max(), qint64(1000));
+		QCOMPARE(h.sum(), 0.5005);
+
+		const qint64 median = h.quantile(0.5);
+		QVERIFY(median >= 500 && median <= 500 + 500 / LatencyHistogram::SUB_BUCKETS);
+
+		const qint64 p99 = h.quantile(0.99);
+		QVERIFY(p99 >= 990 && p99 <= 1000);
+
+		QCOMPARE(h.quantile(1.0), qint64(1000));
+	}
+
+	void testWriter()
+	{
+		Histogram h({1});
+		h.observe(0.5);
+		h.observe(2);
+
+		Writer w;
+		w.family("test_total", "counter", "A test");
+		w.sample("test_total", 3, Writer::label("name", "a\"b"));
+		w.family("test_seconds", "histogram", "A histogram");
+		w.histogram("test_seconds", h);
+
+		QCOMPARE(w.data(), QByteArray(
+			"# HELP test_total A test\n"
+			"# TYPE test_total counter\n"
+			"test_total{name=\"a\\\"b\"} 3\n"
+			"# HELP test_seconds A histogram\n"
+			"# TYPE test_seconds histogram\n"
+			"test_seconds_bucket{le=\"1\"} 1\n"
+			"test_seconds_bucket{le=\"+Inf\"} 2\n"
+			"test_seconds_sum 2.5\n"
+			"test_seconds_count 2\n"
+		));
+	}
+
+	void testLatencyWriter()
+	{
+		LatencyHistogram h;
+		h.observe(100);     // 100us
+		h.observe(1000);    // 1ms
+		h.observe(100000);  // 100ms
+		h.observe(qint64(1) << 30); // about 18 minutes
+
+		Writer w;
+		w.latency("test_seconds", h, Writer::label("stage", "x"));
+		const QList<QByteArray> lines = w.data().split('\n');
+
+		// Cumulative counts at power of two boundaries
+		QVERIFY(lines.contains("test_seconds_bucket{stage=\"x\",le=\"0.000127\"} 1"));
+		QVERIFY(lines.contains("test_seconds_bucket{stage=\"x\",le=\"0.001023\"} 2"));
+		QVERIFY(lines.contains("test_seconds_bucket{stage=\"x\",le=\"0.131071\"} 3"));
+		QVERIFY(lines.contains("test_seconds_bucket{stage=\"x\",le=\"67.108863\"} 3"));
+		QVERIFY(lines.contains("test_seconds_bucket{stage=\"x\",le=\"+Inf\"} 4"));
+		QVERIFY(lines.contains("test_seconds_count{stage=\"x\"} 4"));
+
+		int buckets = 0;
+		for(const QByteArray &line : lines) {
+			if(line.startsWith("test_seconds_bucket"))
+				++buckets;
+		}
+		QCOMPARE(buckets, 21);
+	}
+};
+
+
+QTEST_MAIN(TestMetrics)
+#include "metrics.moc"
@@ -0,0 +1,68 @@
+#include "../stalldetector.h"
+
+#include <QtTest/QtTest>
+
+using server::StallDetector;
+
+static int probeWarnings = 0;
+
+static void countProbeWarnings(QtMsgType, const QMessageLogContext &, const QString &msg)
+{
+	if(msg.contains("stalled for"))
+		++probeWarnings;
+}
+
+class TestStallDetector: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testStall()
+	{
+		QObject context;
+		StallDetector detector;
+		detector.watch(&context, "test");
+		detector.setThreshold(200);
+
+		// Let the probe start
+		QTest::qWait(300);
+
+		// The watchdog notices the stall while it is still going on
+		QTest::ignoreMessage(QtWarningMsg, QRegularExpression("^test has been unresponsive for \\d+ ms \\(testing, user #3\\)$"));
+		{
+			const StallDetector::Activity activity("testing", QUuid(), 3);
+			QThread::msleep(1000);
+		}
+
+		// The probe measures the stall when the thread recovers, but doesn't log it again
+		probeWarnings = 0;
+		const QtMessageHandler previousHandler = qInstallMessageHandler(countProbeWarnings);
+		QTest::qWait(300);
+		qInstallMessageHandler(previousHandler);
+		QCOMPARE(probeWarnings, 0);
+
+		server::metrics::Writer writer;
+		detector.writeMetrics(writer);
+		QVERIFY(writer.data().contains("drawpile_event_loop_lag_seconds_count{thread=\"test\"}"));
+		QVERIFY(writer.data().contains("drawpile_event_loop_stalls_total{thread=\"test\"}"));
+		QVERIFY(!writer.data().contains("drawpile_event_loop_stalls_total{thread=\"test\"} 0\n"));
+	}
+
+	void testContextDeleted()
+	{
+		StallDetector detector;
+		{
+			QObject context;
+			detector.watch(&context, "test");
+			QTest::qWait(200);
+		}
+
+		// Threads are no longer reported after their context object is gone
+		server::metrics::Writer writer;
+		detector.writeMetrics(writer);
+		QVERIFY(!writer.data().contains("thread=\"test\""));
+	}
+};
+
+
+QTEST_MAIN(TestStallDetector)
+#include "stalldetector.moc"
@@ -0,0 +1,108 @@
+#include "../subnettrie.h"
+
+#include <QtTest/QtTest>
+
+using server::SubnetTrie;
+
+class TestSubnetTrie: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testIpv4()
+	{
+		SubnetTrie trie;
+		QVERIFY(trie.add(1, QHostAddress("192.168.1.1"), 0));
+		QVERIFY(trie.add(2, QHostAddress("10.0.0.0"), 8));
+
+		QCOMPARE(trie.contains(QHostAddress("192.168.1.1")), true);
+		QCOMPARE(trie.contains(QHostAddress("192.168.1.2")), false);
+		QCOMPARE(trie.contains(QHostAddress("10.0.0.1")), true);
+		QCOMPARE(trie.contains(QHostAddress("10.255.255.255")), true);
+		QCOMPARE(trie.contains(QHostAddress("11.0.0.1")), false);
+
+		// IPv4 mapped addresses match IPv4 bans
+		QCOMPARE(trie.contains(QHostAddress("::ffff:10.1.2.3")), true);
+		QCOMPARE(trie.contains(QHostAddress("::ffff:11.1.2.3")), false);
+	}
+
+	void testIpv6()
+	{
+		SubnetTrie trie;
+		QVERIFY(trie.add(1, QHostAddress("2001:db8::"), 32));
+		QVERIFY(trie.add(2, QHostAddress("fe80::1"), 0));
+
+		QCOMPARE(trie.contains(QHostAddress("2001:db8::1")), true);
+		QCOMPARE(trie.contains(QHostAddress("2001:db8:ffff::1")), true);
+		QCOMPARE(trie.contains(QHostAddress("2001:db9::1")), false);
+		QCOMPARE(trie.contains(QHostAddress("fe80::1")), true);
+		QCOMPARE(trie.contains(QHostAddress("fe80::2")), false);
+		QCOMPARE(trie.contains(QHostAddress("10.0.0.1")), false);
+	}
+
+	void testInvalid()
+	{
+		SubnetTrie trie;
+		QCOMPARE(trie.add(1, QHostAddress(), 0), false);
+		QCOMPARE(trie.add(2, QHostAddress("10.0.0.0"), 33), false);
+		QCOMPARE(trie.add(3, QHostAddress("::1"), 129), false);
+		QVERIFY(trie.isEmpty());
+		QCOMPARE(trie.contains(QHostAddress()), false);
+	}
+
+	void testRemove()
+	{
+		SubnetTrie trie;
+		trie.add(1, QHostAddress("10.0.0.0"), 8);
+		trie.add(2, QHostAddress("10.1.0.0"), 16);
+		trie.add(3, QHostAddress("10.1.0.0"), 16);
+		QCOMPARE(trie.size(), 3);
+
+		QVERIFY(trie.remove(1));
+		QCOMPARE(trie.remove(1), false);
+		QCOMPARE(trie.contains(QHostAddress("10.2.0.1")), false);
+		QCOMPARE(trie.contains(QHostAddress("10.1.0.1")), true);
+
+		// Overlapping entries are independent
+		QVERIFY(trie.remove(2));
+		QCOMPARE(trie.contains(QHostAddress("10.1.0.1")), true);
+		QVERIFY(trie.remove(3));
+		QCOMPARE(trie.contains(QHostAddress("10.1.0.1")), false);
+		QVERIFY(trie.isEmpty());
+
+		// Adding with an existing ID replaces the old entry
+		trie.add(1, QHostAddress("10.0.0.0"), 8);
+		trie.add(1, QHostAddress("192.168.0.0"), 16);
+		QCOMPARE(trie.size(), 1);
+		QCOMPARE(trie.contains(QHostAddress("10.0.0.1")), false);
+		QCOMPARE(trie.contains(QHostAddress("192.168.0.1")), true);
+	}
+
+	void testExpiration()
+	{
+		const QDateTime now = QDateTime::currentDateTimeUtc();
+
+		SubnetTrie trie;
+		trie.add(1, QHostAddress("10.0.0.1"), 0, now.addSecs(60));
+		trie.add(2, QHostAddress("10.0.0.2"), 0, now.addSecs(120));
+		trie.add(3, QHostAddress("10.0.0.3"), 0);
+
+		QCOMPARE(trie.contains(QHostAddress("10.0.0.1"), now), true);
+		QCOMPARE(trie.contains(QHostAddress("10.0.0.1"), now.addSecs(60)), false);
+
+		trie.removeExpired(now);
+		QCOMPARE(trie.size(), 3);
+
+		trie.removeExpired(now.addSecs(90));
+		QCOMPARE(trie.size(), 2);
+		QCOMPARE(trie.contains(QHostAddress("10.0.0.1")), false);
+		QCOMPARE(trie.contains(QHostAddress("10.0.0.2")), true);
+
+		trie.removeExpired(now.addYears(100));
+		QCOMPARE(trie.size(), 1);
+		QCOMPARE(trie.contains(QHostAddress("10.0.0.3"), now.addYears(100)), true);
+	}
+};
+
+
+QTEST_MAIN(TestSubnetTrie)
+#include "subnettrie.moc"
@@ -0,0 +1,100 @@
+#include "../thinsession.h"
+#include "../inmemoryhistory.h"
+#include "../inmemoryconfig.h"
+#include "../announcements.h"
+#include "../../libshared/net/meta.h"
+#include "../../libshared/net/undo.h"
+#include "../../libshared/net/opaque.h"
+
+#include <QtTest/QtTest>
+
+using namespace server;
+
+// Exposes the history entry point normally reached through handleClientMessage
+class TestableSession : public ThinSession
+{
+public:
+	using ThinSession::ThinSession;
+	using ThinSession::addToHistory;
+	using ThinSession::trackUndo;
+	using ThinSession::UndoCounts;
+};
+
+class TestThinSession: public QObject
+{
+	Q_OBJECT
+private slots:
+	// Idle users fetch new messages as soon as the history announces them,
+	// so the receive time must already be known at that point.
+	void testReceiveTimeKnownToIdleRecipients()
+	{
+		InMemoryConfig config;
+		sessionlisting::Announcements announcements(&config);
+
+		// A non-empty history skips the initialization state
+		auto *history = new InMemoryHistory(QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test");
+		history->addMessage(chat("first"));
+
+		TestableSession session(history, &config, &announcements);
+
+		QVector<qint64> seen;
+		connect(history, &SessionHistory::newMessagesAvailable, this, [&]() {
+			seen << session.receiveTime(history->lastIndex());
+		});
+
+		session.addToHistory(chat("second"));
+		session.addToHistory(chat("third"));
+
+		QCOMPARE(seen.size(), 2);
+		QVERIFY(seen.at(0) > 0);
+		QVERIFY(seen.at(1) >= seen.at(0));
+		QCOMPARE(session.receiveTime(history->lastIndex()), seen.at(1));
+	}
+
+	// Undos and redos must not reach past a join snapshot
+	void testTrackUndo()
+	{
+		using protocol::UndoPoint;
+		using protocol::Undo;
+
+		TestableSession::UndoCounts counts;
+
+		// Nothing after the snapshot to undo or redo
+		QVERIFY(!TestableSession::trackUndo(counts, Undo(1, 0, false)));
+		QVERIFY(!TestableSession::trackUndo(counts, Undo(1, 0, true)));
+
+		// Other users' actions don't count
+		QVERIFY(TestableSession::trackUndo(counts, UndoPoint(2)));
+		QVERIFY(!TestableSession::trackUndo(counts, Undo(1, 0, false)));
+
+		// Two undo points can be undone, but not a third time
+		QVERIFY(TestableSession::trackUndo(counts, UndoPoint(1)));
+		QVERIFY(TestableSession::trackUndo(counts, UndoPoint(1)));
+		QVERIFY(TestableSession::trackUndo(counts, Undo(1, 0, true)));
+		QVERIFY(TestableSession::trackUndo(counts, Undo(1, 0, false)));
+		QVERIFY(TestableSession::trackUndo(counts, Undo(1, 0, false)));
+		QVERIFY(!TestableSession::trackUndo(counts, Undo(1, 0, false)));
+
+		// With everything after the snapshot undone, a redo could reach past it
+		QVERIFY(!TestableSession::trackUndo(counts, Undo(1, 0, true)));
+
+		// Operators undo on behalf of others
+		QVERIFY(TestableSession::trackUndo(counts, Undo(3, 2, false)));
+		QVERIFY(!TestableSession::trackUndo(counts, Undo(3, 2, false)));
+
+		// Opaque messages, as received by the server
+		const QByteArray wire = Undo(2, 0, true).serialized();
+		const protocol::OpaqueMessage opaque(wire, 0);
+		QVERIFY(!TestableSession::trackUndo(counts, opaque));
+	}
+
+private:
+	static protocol::MessagePtr chat(const QString &text)
+	{
+		return protocol::MessagePtr(new protocol::Chat(1, 0, 0, text));
+	}
+};
+
+
+QTEST_MAIN(TestThinSession)
+#include "thinsession.moc"
@@ -0,0 +1,87 @@
+#include "../workerthreads.h"
+
+#include <QtTest/QtTest>
+
+using server::WorkerThreads;
+
+class TestWorkerThreads: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testLoadBalancing()
+	{
+		WorkerThreads workers(2);
+		QCOMPARE(workers.count(), 2);
+
+		QObject *first = workers.acquire();
+		QObject *second = workers.acquire();
+		QVERIFY(first != second);
+		QVERIFY(first->thread() != second->thread());
+
+		// Both workers have the same load: the first one is picked
+		QCOMPARE(workers.acquire(), first);
+
+		// Second worker is now the least loaded
+		QCOMPARE(workers.acquire(), second);
+
+		// Released workers are picked again
+		workers.release(first);
+		workers.release(first);
+		QCOMPARE(workers.acquire(), first);
+	}
+
+	void testBlockingCall()
+	{
+		WorkerThreads workers(1);
+		QObject *context = workers.acquire();
+
+		QThread *calledIn = nullptr;
+		server::runInThreadBlocking(context, [&calledIn]() {
+			calledIn = QThread::currentThread();
+		});
+
+		QCOMPARE(calledIn, context->thread());
+		QVERIFY(calledIn != QThread::currentThread());
+
+		// Calls in the current thread are made directly
+		QObject local;
+		bool called = false;
+		server::runInThreadBlocking(&local, [&called]() { called = true; });
+		QVERIFY(called);
+	}
+
+	void testBlockingCallTimeout()
+	{
+		WorkerThreads workers(1);
+		QObject *context = workers.acquire();
+
+		// Keep the worker busy
+		QSemaphore busy;
+		server::runInThread(context, [&busy]() { busy.acquire(); });
+
+		bool called = false;
+		QVERIFY(!server::runInThreadBlocking(context, [&called]() { called = true; }, 10));
+
+		// A cancelled call is never made, even once the worker is free again
+		busy.release();
+		QVERIFY(server::runInThreadBlocking(context, []() { }, 5000));
+		QVERIFY(!called);
+	}
+
+	void testAsyncCall()
+	{
+		WorkerThreads workers(1);
+		QObject *context = workers.acquire();
+
+		QAtomicPointer<QThread> calledIn;
+		server::runInThread(context, [&calledIn]() {
+			calledIn.store(QThread::currentThread());
+		});
+
+		QTRY_COMPARE(calledIn.load(), context->thread());
+	}
+};
+
+
+QTEST_MAIN(TestWorkerThreads)
+#include "workerthreads.moc"
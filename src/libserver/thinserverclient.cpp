@@ -20,30 +20,76 @@
 #include "thinserverclient.h"
 #include "../libshared/net/messagequeue.h"
 #include "thinsession.h"
+#include "stalldetector.h"
 
 namespace server {
 
 ThinServerClient::ThinServerClient(QTcpSocket *socket, ServerLog *logger, QObject *parent)
 	: Client(socket, logger, parent)
 	, m_historyPosition(-1)
+	, m_joinTime(0)
+	, m_batchReceived(0)
 {
 	connect(messageQueue(), &protocol::MessageQueue::allSent,
 		this, &ThinServerClient::sendNextHistoryBatch);
 }
 
+void ThinServerClient::sendSnapshot(const protocol::MessageList &snapshot, int historyPosition)
+{
+	m_snapshot = snapshot;
+	m_historyPosition = historyPosition;
+	sendNextHistoryBatch();
+}
+
 void ThinServerClient::sendNextHistoryBatch()
 {
+	if(session() == nullptr)
+		return;
+
+	// The previous batch has been written once the upload queue is empty
+	if(m_batchReceived > 0 && !messageQueue()->isUploading()) {
+		session()->latency()->written.observe(metrics::now() - m_batchReceived);
+		m_batchReceived = 0;
+	}
+
 	// Only enqueue messages for uploading when upload queue is empty
 	// and session is in a normal running state.
 	// (We'll get another messagesAvailable signal when ready)
-	if(session() == nullptr || messageQueue()->isUploading() || session()->state() != Session::State::Running)
+	if(messageQueue()->isUploading() || session()->state() != Session::State::Running)
 		return;
 
-	protocol::MessageList batch;
+	// The snapshot a new user got instead of the history comes first
+	if(!m_snapshot.isEmpty()) {
+		int count = 0, size = 0;
+		while(count < m_snapshot.size() && (count == 0 || size < SessionHistory::MAX_RAW_BATCH))
+			size += m_snapshot.at(count++)->length();
+
+		sendDirectMessage(m_snapshot.mid(0, count));
+		m_snapshot = m_snapshot.mid(count);
+		return;
+	}
+
+	const StallDetector::Activity activity("reading history", session()->id(), id());
+
+	// The history is relayed in its wire format, without deserializing the messages
+	QByteArray batch;
 	int batchLast;
-	std::tie(batch, batchLast) = session()->history()->getBatch(m_historyPosition);
+	const int batchFirst = m_historyPosition + 1;
+	std::tie(batch, batchLast) = session()->history()->getRawBatch(m_historyPosition);
 	m_historyPosition = batchLast;
-	messageQueue()->send(batch);
+
+	// The batch is timed by its oldest message. The history this user
+	// is catching up on after joining is not counted.
+	if(!batch.isEmpty()) {
+		const qint64 received = static_cast<ThinSession*>(session())->receiveTime(batchFirst);
+		if(received > 0 && received >= m_joinTime) {
+			session()->latency()->dequeue.observe(metrics::now() - received);
+			m_batchReceived = received;
+		}
+	}
+
+	countSentBatch(batch);
+	messageQueue()->sendRaw(batch);
 
 	static_cast<ThinSession*>(session())->cleanupHistoryCache();
 }
@@ -38,11 +38,34 @@ public:
 
 	void setHistoryPosition(int pos) { m_historyPosition = pos; }
 
+	/**
+	 * @brief Set the time this client joined the session
+	 *
+	 * Messages received before this are part of the history catch-up
+	 * and are not included in the session's relay latency.
+	 */
+	void setJoinTime(qint64 time) { m_joinTime = time; }
+
+	/**
+	 * @brief Send a canvas snapshot instead of the history up to the given index
+	 *
+	 * The snapshot is sent in batches, just like the history, so it doesn't
+	 * fill the upload queue all at once. The history following the snapshot
+	 * is sent once the whole snapshot has been sent.
+	 */
+	void sendSnapshot(const protocol::MessageList &snapshot, int historyPosition);
+
+	//! Drop the part of the snapshot not sent yet (the session was reset)
+	void discardSnapshot() { m_snapshot.clear(); }
+
 public slots:
 	void sendNextHistoryBatch();
 
 private:
 	int m_historyPosition;
+	protocol::MessageList m_snapshot; // the part of the snapshot not sent yet
+	qint64 m_joinTime;
+	qint64 m_batchReceived; // receive time of the oldest message in the batch being written
 };
 
 }
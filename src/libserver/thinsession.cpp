@@ -21,30 +21,220 @@
 #include "thinserverclient.h"
 #include "serverlog.h"
 #include "serverconfig.h"
+#include "snapshotter.h"
 
 #include "../libshared/net/control.h"
+#include "../libshared/net/meta.h"
+#include "../libshared/net/opaque.h"
+
+#include <QTimer>
 
 namespace server {
 
+// How long to wait for an operator to respond to an autoreset request before the server does it
+static const int AUTORESET_RESPONSE_TIMEOUT = 30 * 1000;
+
+namespace {
+
+/**
+ * Split a serialized snapshot back into messages.
+ * Opaque messages just reference the snapshot buffer.
+ *
+ * Returns an empty list if the snapshot contains invalid messages.
+ */
+protocol::MessageList deserializeSnapshot(const QByteArray &data)
+{
+	protocol::MessageList msgs;
+	int pos = 0;
+	while(data.length() - pos >= protocol::Message::HEADER_LEN) {
+		const uchar *ptr = reinterpret_cast<const uchar*>(data.constData()) + pos;
+		const int len = protocol::Message::sniffLength(data.constData() + pos);
+		if(len > data.length() - pos)
+			break;
+
+		protocol::NullableMessageRef msg;
+		if(ptr[2] >= 64)
+			msg = protocol::NullableMessageRef(new protocol::OpaqueMessage(data, pos));
+		else
+			msg = protocol::Message::deserialize(ptr, len, false);
+
+		if(msg.isNull())
+			return protocol::MessageList();
+
+		msgs << protocol::MessagePtr::fromNullable(msg);
+		pos += len;
+	}
+
+	if(pos != data.length())
+		return protocol::MessageList();
+
+	return msgs;
+}
+
+}
+
 ThinSession::ThinSession(SessionHistory *history, ServerConfig *config, sessionlisting::Announcements *announcements, QObject *parent)
-	: Session(history, config, announcements, parent)
+	: Session(history, config, announcements, parent),
+	m_relayTimes(RELAY_TIMES, RelayTime { -1, 0 })
 {
 	history->setSizeLimit(config->getConfigSize(config::SessionSizeLimit));
 	history->setAutoResetThreshold(config->getConfigSize(config::AutoresetThreshold));
 	m_lastStatusUpdate.start();
 }
 
+ThinSession::~ThinSession()
+{
+	if(m_snapshotter)
+		m_snapshotter->dispose();
+}
+
+void ThinSession::setSnapshotter(Snapshotter *snapshotter, uint interval)
+{
+	Q_ASSERT(!m_snapshotter);
+	m_snapshotter = snapshotter;
+	m_snapshotInterval = interval;
+
+	// The callback is called in the snapshotter's thread
+	m_snapshotter->setCallback([this](int index, const QByteArray &snapshot) {
+		QTimer::singleShot(0, this, [this, index, snapshot]() {
+			snapshotReady(index, snapshot);
+		});
+	});
+
+	m_snapshotter->reset(history()->firstIndex());
+	m_snapshotterPosition = history()->firstIndex() - 1;
+	m_snapshotRequestSize = history()->sizeInBytes();
+	feedSnapshotter();
+}
+
+void ThinSession::feedSnapshotter()
+{
+	// Catch up with the existing history one batch per event loop iteration.
+	// Once caught up, new messages are fed to the snapshotter as they are added.
+	m_snapshotterFeedQueued = false;
+	if(!m_snapshotter || m_snapshotterPosition >= history()->lastIndex())
+		return;
+
+	protocol::MessageList msgs;
+	int lastIndex;
+	std::tie(msgs, lastIndex) = history()->getBatch(m_snapshotterPosition);
+
+	for(const protocol::MessagePtr &msg : msgs)
+		m_snapshotter->addMessage(msg);
+	m_snapshotterPosition = lastIndex;
+
+	if(m_snapshotterPosition < history()->lastIndex()) {
+		m_snapshotterFeedQueued = true;
+		QTimer::singleShot(0, this, &ThinSession::feedSnapshotter);
+	}
+}
+
+void ThinSession::requestSnapshot()
+{
+	// No undo barrier is added here, as that would affect every user.
+	// Instead, undo activity after this point is tracked (see trackUndo)
+	m_snapshotRequestSize = history()->sizeInBytes();
+	m_snapshotRequestIndex = history()->lastIndex();
+	m_snapshotRequestUndo.clear();
+	m_snapshotter->requestSnapshot(m_snapshotRequestIndex);
+}
+
+/**
+ * A new user who got a snapshot doesn't have the history that precedes it,
+ * so undoing or redoing anything from before the snapshot would do nothing
+ * for them. This checks whether an undo or redo can only affect actions
+ * made after the snapshot.
+ *
+ * An undo reaches past the snapshot only if the user has no undo point after
+ * it that has not been undone. Likewise, a redo stops at the user's latest
+ * undo point that has not been undone. Each undo undoes at most one point,
+ * so the user has at least (points - undos) such undo points left.
+ * Redos are not counted, which errs on the safe side.
+ *
+ * @param counts undo activity after the snapshot (updated)
+ * @param msg the message just added to the history
+ * @return false if the message could undo or redo something before the snapshot
+ */
+bool ThinSession::trackUndo(UndoCounts &counts, const protocol::Message &msg)
+{
+	if(msg.type() == protocol::MSG_UNDOPOINT) {
+		++counts[msg.contextId()].points;
+
+	} else if(msg.type() == protocol::MSG_UNDO) {
+		// The message is usually opaque, so the payload is read directly
+		const QByteArray wire = msg.serialized();
+		if(wire.length() != protocol::Message::HEADER_LEN + 2)
+			return true; // invalid messages are ignored by the clients
+
+		const uint8_t overrideId = wire.at(protocol::Message::HEADER_LEN);
+		const bool redo = wire.at(protocol::Message::HEADER_LEN + 1);
+
+		UndoCount &count = counts[overrideId ? overrideId : msg.contextId()];
+		if(count.points - count.undos < 1)
+			return false;
+
+		if(!redo)
+			++count.undos;
+	}
+
+	return true;
+}
+
+void ThinSession::snapshotReady(int index, const QByteArray &data)
+{
+	// Ignore snapshots made before a reset and ones that have been superseded
+	if(index < history()->firstIndex() || index != m_snapshotRequestIndex)
+		return;
+
+	const protocol::MessageList snapshot = deserializeSnapshot(data);
+	if(snapshot.isEmpty()) {
+		log(Log().about(Log::Level::Error, Log::Topic::Status).message("Invalid canvas snapshot!"));
+		return;
+	}
+
+	if(m_autoResetRequestStatus == AutoResetState::ServerReset) {
+		serverAutoReset(index, snapshot);
+		return;
+	}
+
+	uint size = 0;
+	for(const protocol::MessagePtr &msg : snapshot)
+		size += msg->length();
+
+	m_snapshot.index = index;
+	m_snapshot.messages = snapshot;
+	m_snapshot.size = size;
+	m_snapshot.historySize = m_snapshotRequestSize;
+	m_snapshot.undoCounts = m_snapshotRequestUndo;
+
+	log(Log().about(Log::Level::Debug, Log::Topic::Status).message(
+		QStringLiteral("Canvas snapshot ready (%1 MB, history %2 MB)")
+			.arg(size / (1024.0*1024.0), 0, 'f', 2)
+			.arg(m_snapshotRequestSize / (1024.0*1024.0), 0, 'f', 2)
+	));
+}
+
 void ThinSession::addToHistory(protocol::MessagePtr msg)
 {
 	if(state() == State::Shutdown)
 		return;
 
+	// Remember when the message was received so its delivery to each user can be timed.
+	// This must be done before the message is added, since idle users fetch it right away.
+	const int index = history()->lastIndex() + 1;
+	const qint64 received = relayStart() > 0 ? relayStart() : metrics::now();
+	m_relayTimes[index % RELAY_TIMES] = RelayTime { index, received };
+
 	// Add message to history (if there is space)
 	if(!history()->addMessage(msg)) {
+		m_relayTimes[index % RELAY_TIMES] = RelayTime { -1, 0 };
 		messageAll("History size limit reached! Session must be reset to continue.", false);
+		startServerAutoReset();
 		return;
 	}
 
+	latency()->history.observe(metrics::now() - received);
+
 	// The hosting user must skip the history uploaded during initialization
 	// (since they originated it), but we still want to send them notifications.
 	if(state() == State::Initialization) {
@@ -59,6 +249,29 @@ void ThinSession::addToHistory(protocol::MessagePtr msg)
 
 	addedToHistory(msg);
 
+	// Drop snapshots new users couldn't undo or redo consistently with
+	// everyone else. (A server-side autoreset has a reset point before it.)
+	if(m_snapshotRequestIndex >= 0 && m_autoResetRequestStatus != AutoResetState::ServerReset && !trackUndo(m_snapshotRequestUndo, *msg))
+		m_snapshotRequestIndex = -1;
+
+	if(m_snapshot.index >= 0 && !trackUndo(m_snapshot.undoCounts, *msg)) {
+		log(Log().about(Log::Level::Debug, Log::Topic::Status).message("Canvas snapshot dropped: an undo reached past it."));
+		m_snapshot = Snapshot();
+	}
+
+	// Feed the snapshotter directly, unless it is still catching up
+	if(m_snapshotter && !m_snapshotterFeedQueued && m_snapshotterPosition == history()->lastIndex() - 1) {
+		m_snapshotter->addMessage(msg);
+		m_snapshotterPosition = history()->lastIndex();
+
+		if(
+			m_snapshotInterval > 0 &&
+			state() == State::Running &&
+			history()->sizeInBytes() >= m_snapshotRequestSize + m_snapshotInterval
+		)
+			requestSnapshot();
+	}
+
 	// Request auto-reset when threshold is crossed.
 	const uint autoResetThreshold = history()->effectiveAutoResetThreshold();
 	if(autoResetThreshold>0 && m_autoResetRequestStatus == AutoResetState::NotSent && history()->sizeInBytes() > autoResetThreshold) {
@@ -85,12 +298,27 @@ void ThinSession::addToHistory(protocol::MessagePtr msg)
 		resetRequest.reply["query"] = true;
 		protocol::MessagePtr reqMsg { new protocol::Command(0, resetRequest )};
 
+		bool operatorsPresent = false;
 		for(Client *c : clients()) {
-			if(c->isOperator())
+			if(c->isOperator()) {
 				c->sendDirectMessage(reqMsg);
+				operatorsPresent = true;
+			}
 		}
 
 		m_autoResetRequestStatus = AutoResetState::Queried;
+
+		// If nobody can do the reset, the server does it by itself
+		if(!operatorsPresent) {
+			startServerAutoReset();
+
+		} else if(canServerAutoReset()) {
+			m_autoResetQueryTime.start();
+			QTimer::singleShot(AUTORESET_RESPONSE_TIMEOUT, this, [this]() {
+				if(m_autoResetRequestStatus == AutoResetState::Queried && m_autoResetQueryTime.elapsed() >= AUTORESET_RESPONSE_TIMEOUT)
+					startServerAutoReset();
+			});
+		}
 	}
 
 	// Regular history size status updates
@@ -103,6 +331,85 @@ void ThinSession::addToHistory(protocol::MessagePtr msg)
 	}
 }
 
+bool ThinSession::canServerAutoReset() const
+{
+	return m_snapshotter && config()->getConfigBool(config::ServerAutoreset);
+}
+
+void ThinSession::startServerAutoReset()
+{
+	if(
+		!canServerAutoReset() ||
+		state() != State::Running ||
+		m_autoResetRequestStatus == AutoResetState::ServerReset ||
+		m_autoResetRequestStatus == AutoResetState::Requested
+	)
+		return;
+
+	log(Log().about(Log::Level::Info, Log::Topic::Status).message("No operator available to autoreset. Generating a reset image on the server."));
+
+	// The reset image is generated in the background. Messages that are added
+	// to the history in the mean time are appended to the image.
+	m_autoResetRequestStatus = AutoResetState::ServerReset;
+
+	// The soft reset point is an undo barrier, so undos appended to the image
+	// can't target anything flattened into it. (If the history is full,
+	// nothing more can be appended anyway.)
+	if(!history()->isOutOfSpace())
+		addToHistory(protocol::MessagePtr(new protocol::SoftResetPoint(0)));
+
+	m_snapshotRequestIndex = history()->lastIndex();
+	m_snapshotRequestSize = history()->sizeInBytes();
+	m_snapshotter->requestSnapshot(m_snapshotRequestIndex);
+}
+
+void ThinSession::serverAutoReset(int index, const protocol::MessageList &snapshot)
+{
+	// An operator may have started a reset of their own in the mean time
+	if(state() != State::Running) {
+		m_autoResetRequestStatus = AutoResetState::NotSent;
+		return;
+	}
+
+	protocol::MessageList resetImage = snapshot;
+	uint resetImageSize = 0;
+	for(const protocol::MessagePtr &msg : snapshot)
+		resetImageSize += msg->length();
+
+	int position = index;
+	while(position < history()->lastIndex()) {
+		protocol::MessageList batch;
+		std::tie(batch, position) = history()->getBatch(position);
+		if(batch.isEmpty())
+			break;
+
+		for(const protocol::MessagePtr &msg : batch)
+			resetImageSize += msg->length();
+		resetImage += batch;
+	}
+
+	// Resetting would be pointless if the image isn't smaller than the history.
+	// The status is left as Requested, so the autoreset is not attempted again
+	// until someone resets the session.
+	if(resetImageSize >= history()->sizeInBytes()) {
+		log(Log().about(Log::Level::Warn, Log::Topic::Status).message(
+			QStringLiteral("Server-side autoreset image (%1 MB) is not smaller than the history.")
+				.arg(resetImageSize / (1024.0*1024.0), 0, 'f', 2)
+		));
+		m_autoResetRequestStatus = AutoResetState::Requested;
+		return;
+	}
+
+	if(resetHistory(resetImage)) {
+		log(Log().about(Log::Level::Info, Log::Topic::Status).message(
+			QStringLiteral("Performed server-side autoreset. History size is now %1 MB")
+				.arg(history()->sizeInBytes() / (1024.0*1024.0), 0, 'f', 2)
+		));
+	} else {
+		m_autoResetRequestStatus = AutoResetState::Requested;
+	}
+}
+
 void ThinSession::cleanupHistoryCache()
 {
 	int minIdx = history()->lastIndex();
@@ -153,20 +460,67 @@ void ThinSession::onSessionReset()
 	directToAll(protocol::MessagePtr(new protocol::Command(0, catchup)));
 
 	m_autoResetRequestStatus = AutoResetState::NotSent;
+
+	// The new history replaces any snapshot still being sent
+	for(Client *c : clients())
+		static_cast<ThinServerClient*>(c)->discardSnapshot();
+
+	if(m_snapshotter) {
+		m_snapshotter->reset(history()->firstIndex());
+		m_snapshotterPosition = history()->firstIndex() - 1;
+		m_snapshotRequestSize = history()->sizeInBytes();
+		m_snapshotRequestIndex = -1;
+		m_snapshot = Snapshot();
+		if(!m_snapshotterFeedQueued)
+			feedSnapshotter();
+	}
+}
+
+qint64 ThinSession::receiveTime(int index) const
+{
+	if(index < 0)
+		return 0;
+	const RelayTime &t = m_relayTimes.at(index % RELAY_TIMES);
+	return t.index == index ? t.received : 0;
 }
 
 void ThinSession::onClientJoin(Client *client, bool host)
 {
+	// Messages received before joining are part of the user's catch-up
+	static_cast<ThinServerClient*>(client)->setJoinTime(metrics::now());
+
 	connect(history(), &SessionHistory::newMessagesAvailable,
 		static_cast<ThinServerClient*>(client), &ThinServerClient::sendNextHistoryBatch);
 
 	if(!host) {
+		// Send a snapshot of the canvas instead of the history that precedes it, when it's smaller
+		const bool useSnapshot =
+			state() == State::Running &&
+			m_snapshot.index >= history()->firstIndex() &&
+			m_snapshot.size < m_snapshot.historySize;
+
+		protocol::MessageList snapshot;
+		if(useSnapshot) {
+			// The user's own join message will be added to the history right after this
+			for(const protocol::MessagePtr &msg : serverSideStateMessages()) {
+				if(msg->type() != protocol::MSG_USER_JOIN || msg->contextId() != client->id())
+					snapshot << msg;
+			}
+			snapshot += m_snapshot.messages;
+		}
+
 		// Notify the client how many messages to expect (at least)
 		// The client can use this information to display a progress bar during the login phase
 		protocol::ServerReply catchup;
 		catchup.type = protocol::ServerReply::CATCHUP;
-		catchup.reply["count"] = history()->lastIndex() - history()->firstIndex();
+		if(useSnapshot)
+			catchup.reply["count"] = snapshot.size() + history()->lastIndex() - m_snapshot.index;
+		else
+			catchup.reply["count"] = history()->lastIndex() - history()->firstIndex();
 		client->sendDirectMessage(protocol::MessagePtr(new protocol::Command(0, catchup)));
+
+		if(useSnapshot)
+			static_cast<ThinServerClient*>(client)->sendSnapshot(snapshot, m_snapshot.index);
 	}
 }
 
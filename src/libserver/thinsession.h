@@ -24,6 +24,8 @@
 
 namespace server {
 
+class Snapshotter;
+
 /**
  * The (thin) serverside session state.
  */
@@ -31,24 +33,100 @@ class ThinSession : public Session {
 	Q_OBJECT
 public:
 	ThinSession(SessionHistory *history, ServerConfig *config, sessionlisting::Announcements *announcements, QObject *parent=nullptr);
+	~ThinSession();
+
+	/**
+	 * @brief Send new users a canvas snapshot instead of the full history
+	 *
+	 * Every time the history has grown by the given number of bytes, the
+	 * snapshotter is asked to generate a snapshot of the canvas at that point.
+	 * New users then get the snapshot and the part of the history that comes
+	 * after it.
+	 *
+	 * No undo barrier is added. Instead, a snapshot is dropped as soon as
+	 * someone might undo or redo something that precedes it, since a new
+	 * user would not have those actions in their history.
+	 *
+	 * The snapshotter is also used to autoreset the session when no operator
+	 * is available to do it (see the ServerAutoreset setting.)
+	 *
+	 * The session takes ownership of the snapshotter.
+	 *
+	 * @param snapshotter the snapshot generator
+	 * @param interval how much the history must grow between snapshots (in bytes, 0 to disable join snapshots)
+	 */
+	void setSnapshotter(Snapshotter *snapshotter, uint interval);
 
 	void readyToAutoReset(int ctxId) override;
 
 	void cleanupHistoryCache();
 
+	/**
+	 * @brief Get the time the message at the given history index was received
+	 *
+	 * Only the receive times of the latest RELAY_TIMES messages are kept.
+	 *
+	 * @return time (see metrics::now()) or 0 if not known
+	 */
+	qint64 receiveTime(int index) const;
+
 	bool supportsAutoReset() const override { return true; }
 
 protected:
+	// Undo points and undos made by a user after a snapshot
+	struct UndoCount {
+		int points = 0;
+		int undos = 0;
+	};
+	typedef QHash<uint8_t, UndoCount> UndoCounts;
+
+	static bool trackUndo(UndoCounts &counts, const protocol::Message &msg);
+
 	void addToHistory(protocol::MessagePtr msg) override;
 	void onSessionReset() override;
 	void onClientJoin(Client *client, bool host) override;
 
 private:
-	enum class AutoResetState { NotSent, Queried, Requested};
+	enum class AutoResetState { NotSent, Queried, Requested, ServerReset };
+
+	static const int RELAY_TIMES = 1024;
+
+	struct RelayTime {
+		int index;
+		qint64 received;
+	};
+
+	struct Snapshot {
+		int index = -1;              // history index the snapshot was taken at
+		protocol::MessageList messages;
+		uint size = 0;               // size of the snapshot in bytes
+		uint historySize = 0;        // size of the history the snapshot replaces
+		UndoCounts undoCounts;       // undo activity after the snapshot
+	};
+
+	void feedSnapshotter();
+	void requestSnapshot();
+	void snapshotReady(int index, const QByteArray &data);
+
+	bool canServerAutoReset() const;
+	void startServerAutoReset();
+	void serverAutoReset(int index, const protocol::MessageList &snapshot);
 
 	QElapsedTimer m_lastStatusUpdate;
 
 	AutoResetState m_autoResetRequestStatus = AutoResetState::NotSent;
+	QElapsedTimer m_autoResetQueryTime;
+
+	Snapshotter *m_snapshotter = nullptr;
+	uint m_snapshotInterval = 0;
+	int m_snapshotterPosition = -1;    // index of the last message fed to the snapshotter
+	bool m_snapshotterFeedQueued = false;
+	int m_snapshotRequestIndex = -1;   // history index of the last snapshot request
+	uint m_snapshotRequestSize = 0;    // history size at the last snapshot request
+	UndoCounts m_snapshotRequestUndo; // undo activity after the last snapshot request
+	Snapshot m_snapshot;               // latest ready snapshot
+
+	QVector<RelayTime> m_relayTimes;   // receive times of recent messages (ring buffer)
 };
 
 }
@@ -0,0 +1,87 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "workerthreads.h"
+
+namespace server {
+
+WorkerThreads::WorkerThreads(int count)
+{
+	Q_ASSERT(count > 0);
+	m_workers.reserve(count);
+
+	for(int i=0;i<count;++i) {
+		QThread *thread = new QThread;
+		thread->setObjectName(QStringLiteral("session worker %1").arg(i+1));
+
+		QObject *context = new QObject;
+		context->moveToThread(thread);
+		QObject::connect(thread, &QThread::finished, context, &QObject::deleteLater);
+
+		thread->start();
+		m_workers << Worker { thread, context, 0 };
+	}
+}
+
+WorkerThreads::~WorkerThreads()
+{
+	for(const Worker &w : m_workers)
+		w.thread->quit();
+
+	for(const Worker &w : m_workers) {
+		w.thread->wait();
+		delete w.thread;
+	}
+}
+
+QObject *WorkerThreads::acquire()
+{
+	Q_ASSERT(!m_workers.isEmpty());
+
+	Worker *best = &m_workers[0];
+	for(Worker &w : m_workers) {
+		if(w.load < best->load)
+			best = &w;
+	}
+
+	++best->load;
+	return best->context;
+}
+
+void WorkerThreads::release(QObject *context)
+{
+	for(Worker &w : m_workers) {
+		if(w.context == context) {
+			Q_ASSERT(w.load > 0);
+			--w.load;
+			return;
+		}
+	}
+}
+
+QVector<QObject*> WorkerThreads::contexts() const
+{
+	QVector<QObject*> list;
+	list.reserve(m_workers.size());
+	for(const Worker &w : m_workers)
+		list << w.context;
+	return list;
+}
+
+}
@@ -0,0 +1,146 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_WORKERTHREADS_H
+#define DP_SERVER_WORKERTHREADS_H
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <QSemaphore>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QVector>
+
+namespace server {
+
+/**
+ * @brief A fixed size pool of event loop threads that sessions can be assigned to
+ *
+ * Each worker thread has a context object that lives in that thread
+ * for the whole lifetime of the pool. Functions can be dispatched to a worker
+ * by using its context object with runInThread() and runInThreadBlocking().
+ */
+class WorkerThreads
+{
+public:
+	//! Start the given number of worker threads
+	explicit WorkerThreads(int count);
+
+	//! Stop all threads and wait for them to finish
+	~WorkerThreads();
+
+	//! Get the number of worker threads
+	int count() const { return m_workers.size(); }
+
+	/**
+	 * @brief Pick the least loaded worker
+	 *
+	 * The worker's load counter is incremented. Call release() when
+	 * the worker is no longer used.
+	 *
+	 * @return the context object of the chosen worker
+	 */
+	QObject *acquire();
+
+	//! Decrement the load counter of the worker owning the given context object
+	void release(QObject *context);
+
+	//! Get the context objects of all workers
+	QVector<QObject*> contexts() const;
+
+private:
+	struct Worker {
+		QThread *thread;
+		QObject *context;
+		int load;
+	};
+
+	QVector<Worker> m_workers;
+};
+
+/**
+ * @brief Call the function in the context object's thread
+ *
+ * The function is called immediately if the context object lives in the
+ * calling thread. Otherwise, it is queued in the context object's event loop.
+ */
+template<typename Func>
+void runInThread(QObject *context, Func func)
+{
+	if(context->thread() == QThread::currentThread())
+		func();
+	else
+		QTimer::singleShot(0, context, func);
+}
+
+/**
+ * @brief Call the function in the context object's thread and wait for it to finish
+ *
+ * If the function has not started by the time the timeout expires, it is
+ * cancelled and will not be called at all. A function that has already
+ * started is always waited for. This makes it safe for the function
+ * to reference the caller's local variables.
+ *
+ * To avoid deadlocks, this must never be used by a worker thread to wait for
+ * the main thread. The main thread may wait for the workers.
+ *
+ * @param context the context object whose thread to call the function in
+ * @param func the function to call
+ * @param timeout maximum time to wait in milliseconds (negative to wait forever)
+ * @return false if the function was cancelled
+ */
+template<typename Func>
+bool runInThreadBlocking(QObject *context, Func func, int timeout=-1)
+{
+	if(context->thread() == QThread::currentThread()) {
+		func();
+		return true;
+	}
+
+	struct Call {
+		QMutex mutex;
+		QSemaphore done;
+		bool cancelled = false;
+	};
+	const QSharedPointer<Call> call(new Call);
+
+	QTimer::singleShot(0, context, [&func, call]() {
+		QMutexLocker lock(&call->mutex);
+		if(call->cancelled)
+			return;
+		func();
+		call->done.release();
+	});
+
+	if(call->done.tryAcquire(1, timeout))
+		return true;
+
+	// The function may have started just now, in which case it is waited for
+	QMutexLocker lock(&call->mutex);
+	if(call->done.tryAcquire())
+		return true;
+
+	call->cancelled = true;
+	return false;
+}
+
+}
+
+#endif
@@ -0,0 +1,126 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "compression.h"
+
+#include <QtGlobal>
+
+#include <zlib.h>
+#include <cstring>
+
+namespace protocol {
+
+StreamCompressor::StreamCompressor()
+	: m_stream(new z_stream)
+{
+	memset(m_stream, 0, sizeof(z_stream));
+	const int ret = deflateInit(m_stream, Z_DEFAULT_COMPRESSION);
+	if(ret != Z_OK)
+		qFatal("deflateInit failed: %d", ret);
+}
+
+StreamCompressor::~StreamCompressor()
+{
+	deflateEnd(m_stream);
+	delete m_stream;
+}
+
+QByteArray StreamCompressor::compress(const QByteArray &data)
+{
+	// Some room is reserved for the sync flush marker
+	QByteArray out(int(deflateBound(m_stream, data.length())) + 16, Qt::Uninitialized);
+	int produced = 0;
+
+	m_stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+	m_stream->avail_in = data.length();
+
+	do {
+		if(produced == out.length())
+			out.resize(out.length() * 2);
+
+		m_stream->next_out = reinterpret_cast<Bytef*>(out.data() + produced);
+		m_stream->avail_out = out.length() - produced;
+
+		const int ret = deflate(m_stream, Z_SYNC_FLUSH);
+		Q_ASSERT(ret == Z_OK || ret == Z_BUF_ERROR);
+		Q_UNUSED(ret);
+
+		produced = out.length() - m_stream->avail_out;
+
+		// If the output buffer was filled, there may be more output pending
+	} while(m_stream->avail_out == 0);
+
+	out.truncate(produced);
+	return out;
+}
+
+StreamDecompressor::StreamDecompressor()
+	: m_stream(new z_stream), m_outputFull(false)
+{
+	memset(m_stream, 0, sizeof(z_stream));
+	const int ret = inflateInit(m_stream);
+	if(ret != Z_OK)
+		qFatal("inflateInit failed: %d", ret);
+}
+
+StreamDecompressor::~StreamDecompressor()
+{
+	inflateEnd(m_stream);
+	delete m_stream;
+}
+
+void StreamDecompressor::setInput(const QByteArray &data)
+{
+	Q_ASSERT(m_stream->avail_in == 0);
+	m_input = data;
+	m_stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(m_input.constData()));
+	m_stream->avail_in = m_input.length();
+}
+
+bool StreamDecompressor::hasInput() const
+{
+	return m_stream->avail_in > 0 || m_outputFull;
+}
+
+int StreamDecompressor::decompress(char *out, int maxlen)
+{
+	Q_ASSERT(maxlen > 0);
+	m_stream->next_out = reinterpret_cast<Bytef*>(out);
+	m_stream->avail_out = maxlen;
+
+	const int ret = inflate(m_stream, Z_SYNC_FLUSH);
+
+	// Z_BUF_ERROR just means no progress was possible. That's only
+	// an error if there was input left and room for the output.
+	// The peer never ends the stream, so Z_STREAM_END is an error too.
+	if(ret != Z_OK && ret != Z_BUF_ERROR)
+		return -1;
+
+	const int produced = maxlen - m_stream->avail_out;
+	if(ret == Z_BUF_ERROR && produced == 0 && m_stream->avail_in > 0)
+		return -1;
+
+	m_outputFull = m_stream->avail_out == 0;
+	if(m_stream->avail_in == 0)
+		m_input = QByteArray();
+
+	return produced;
+}
+
+}
@@ -0,0 +1,96 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_COMPRESSION_H
+#define DP_NET_COMPRESSION_H
+
+#include <QByteArray>
+
+struct z_stream_s;
+
+namespace protocol {
+
+/**
+ * @brief Compressor side of a streaming deflate connection
+ *
+ * The compression context is kept over the whole connection, so
+ * the repetitive small messages typical of a drawing session
+ * compress well even though they are sent in small batches.
+ */
+class StreamCompressor {
+public:
+	StreamCompressor();
+	~StreamCompressor();
+	StreamCompressor(const StreamCompressor&) = delete;
+	StreamCompressor &operator=(const StreamCompressor&) = delete;
+
+	/**
+	 * @brief Compress a chunk of data
+	 *
+	 * The stream is flushed after each chunk, so the receiver can
+	 * decode all of it without waiting for more data.
+	 *
+	 * @param data the data to compress
+	 * @return compressed data
+	 */
+	QByteArray compress(const QByteArray &data);
+
+private:
+	z_stream_s *m_stream;
+};
+
+/**
+ * @brief Decompressor side of a streaming deflate connection
+ */
+class StreamDecompressor {
+public:
+	StreamDecompressor();
+	~StreamDecompressor();
+	StreamDecompressor(const StreamDecompressor&) = delete;
+	StreamDecompressor &operator=(const StreamDecompressor&) = delete;
+
+	/**
+	 * @brief Set the compressed data to decode next
+	 *
+	 * Any previous input should have been consumed before calling this.
+	 */
+	void setInput(const QByteArray &data);
+
+	/**
+	 * @brief Is there still input (or buffered output) left to decompress?
+	 */
+	bool hasInput() const;
+
+	/**
+	 * @brief Decompress as much of the input as fits in the given buffer
+	 *
+	 * @param out output buffer
+	 * @param maxlen length of the output buffer
+	 * @return number of bytes written or -1 if the input is not a valid stream
+	 */
+	int decompress(char *out, int maxlen);
+
+private:
+	z_stream_s *m_stream;
+	QByteArray m_input;
+	bool m_outputFull;
+};
+
+}
+
+#endif
@@ -177,6 +177,24 @@ private:
 	bool m_isPong;
 };
 
+/**
+ * @brief Stream compression marker
+ *
+ * Everything the sender sends after this message is a deflate
+ * compressed stream. The marker tells the receiver the exact point
+ * where compression starts, so no further synchronization is needed.
+ *
+ * This may only be sent to peers that have announced support for it.
+ * (The server announces it with the DEFLATE login flag. The server starts
+ * compressing once it has received this message from the client.)
+ */
+class Compress : public ZeroLengthMessage<Compress> {
+public:
+	explicit Compress(uint8_t ctx) : ZeroLengthMessage(MSG_COMPRESS, ctx) { }
+
+	QString messageName() const override { return QStringLiteral("compress"); }
+};
+
 }
 
 #endif
@@ -26,6 +26,8 @@
 #include <QtEndian>
 #include <QRegExp>
 
+#include <cstring>
+
 namespace protocol {
 
 int Message::sniffLength(const char *data)
@@ -39,6 +41,11 @@ int Message::sniffLength(const char *data)
 
 int Message::serialize(char *data) const
 {
+	if(!m_wire.isEmpty()) {
+		memcpy(data, m_wire.constData(), m_wire.length());
+		return m_wire.length();
+	}
+
 	// Fixed header: payload length + message type + context ID
 	qToBigEndian(quint16(payloadLength()), (uchar*)data); data += 2;
 	*(data++) = m_type;
@@ -52,6 +59,28 @@ int Message::serialize(char *data) const
 	return HEADER_LEN + written;
 }
 
+QByteArray Message::serialized() const
+{
+	if(!m_wire.isEmpty())
+		return m_wire;
+
+	QByteArray wire(length(), Qt::Uninitialized);
+	serialize(wire.data());
+	return wire;
+}
+
+void Message::cacheSerialized() const
+{
+	if(m_wire.isEmpty())
+		m_wire = serialized();
+}
+
+void Message::releaseSerialized() const
+{
+	if(!m_wireIsContent)
+		m_wire = QByteArray();
+}
+
 bool Message::equals(const Message &m) const
 {
 	if(type() != m.type() || contextId() != m.contextId())
@@ -101,6 +130,7 @@ NullableMessageRef Message::deserialize(const uchar *data, int buflen, bool deco
 	case MSG_COMMAND: msg = Command::deserialize(ctx, data, len); break;
 	case MSG_DISCONNECT: msg = Disconnect::deserialize(ctx, data, len); break;
 	case MSG_PING: msg = Ping::deserialize(ctx, data, len); break;
+	case MSG_COMPRESS: msg = Compress::deserialize(ctx, data, len); break;
 	case MSG_INTERNAL:
 	   qWarning("Tried to deserialize MSG_INTERVAL");
 	   return NullableMessageRef();
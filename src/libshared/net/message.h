@@ -23,6 +23,7 @@
 #include <QMap>
 #include <QString>
 #include <QList>
+#include <QByteArray>
 
 namespace protocol {
 
@@ -34,6 +35,7 @@ enum MessageType {
 	MSG_COMMAND=0,
 	MSG_DISCONNECT,
 	MSG_PING,
+	MSG_COMPRESS,
 
 	// Reserved ID for internal use (not serializable)
 	MSG_INTERNAL=31,
@@ -106,7 +108,7 @@ public:
 	//! Length of the fixed message header
 	static const int HEADER_LEN = 4;
 
-	Message(MessageType type, uint8_t ctx): m_type(type), _undone(DONE), m_refcount(0), m_contextid(ctx) {}
+	Message(MessageType type, uint8_t ctx): m_type(type), _undone(DONE), m_refcount(0), m_contextid(ctx), m_wireIsContent(false) {}
 	virtual ~Message() {}
 	
 	/**
@@ -176,7 +178,13 @@ public:
 	 *
 	 * @param userid the new user id
 	 */
-	void setContextId(uint8_t userid) { m_contextid = userid; }
+	void setContextId(uint8_t userid) {
+		if(userid != m_contextid) {
+			m_contextid = userid;
+			if(!m_wire.isEmpty())
+				m_wire[3] = char(userid);
+		}
+	}
 
 	/**
 	 * @brief Get the ID of the layer this command affects
@@ -229,6 +237,38 @@ public:
 	 */
 	int serialize(char *data) const;
 
+	/**
+	 * @brief Get the wire encoding of this message
+	 *
+	 * If the encoding is cached (see cacheSerialized()), the cached buffer
+	 * is returned. It is implicitly shared: the connections merely hold
+	 * references to it. Otherwise, the message is serialized into a new buffer.
+	 *
+	 * For opaque messages, this is the message exactly as it was received.
+	 * Note that in that case the returned array may reference the receive
+	 * buffer without owning it, so it must not outlive the message.
+	 *
+	 * @return message bytes, header included
+	 */
+	QByteArray serialized() const;
+
+	/**
+	 * @brief Cache the wire encoding for a broadcast
+	 *
+	 * Stored messages don't keep their encoding around, since that would
+	 * double their memory use. Call this before sending the message to several
+	 * connections, so it is serialized only once, and releaseSerialized()
+	 * once it has been queued everywhere. The queued buffers stay valid.
+	 */
+	void cacheSerialized() const;
+
+	/**
+	 * @brief Drop the encoding cached by cacheSerialized()
+	 *
+	 * Messages whose content is kept only in the wire form are not affected.
+	 */
+	void releaseSerialized() const;
+
 	/**
 	 * @brief get the length of the message from the given data
 	 *
@@ -313,11 +353,33 @@ protected:
 	 */
 	virtual Kwargs kwargs() const = 0;
 
+	/**
+	 * @brief Discard the cached wire encoding
+	 *
+	 * Subclasses must call this whenever they change the message content.
+	 */
+	void invalidateSerialized() { m_wire = QByteArray(); }
+
+	/**
+	 * @brief Set the wire encoding
+	 *
+	 * This is used when the message is constructed from its serialized form.
+	 * The encoding is then kept for the lifetime of the message.
+	 * A subclass that keeps its content only in the wire form must never
+	 * call invalidateSerialized().
+	 */
+	void setSerialized(const QByteArray &wire) { m_wire = wire; m_wireIsContent = true; }
+
+	//! Get the cached wire encoding (may be empty)
+	const QByteArray &cachedSerialization() const { return m_wire; }
+
 private:
 	const MessageType m_type;
 	MessageUndoState _undone;
 	int m_refcount;
 	uint8_t m_contextid;
+	mutable QByteArray m_wire;
+	bool m_wireIsContent;
 };
 
 typedef QList<MessagePtr> MessageList;
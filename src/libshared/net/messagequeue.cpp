@@ -19,6 +19,8 @@
 
 #include "messagequeue.h"
 #include "control.h"
+#include "opaque.h"
+#include "compression.h"
 
 #include <QTcpSocket>
 #include <QDateTime>
@@ -34,13 +36,22 @@ namespace protocol {
 // Reserve enough buffer space for one complete message
 static const int MAX_BUF_LEN = 1024*64 + protocol::Message::HEADER_LEN;
 
+// Maximum number of bytes to read from the socket in one go
+static const int MAX_READ_BLOCK = 1024*1024;
+
+// Queued messages are packed into batches of up to this many bytes
+static const int MAX_WRITE_BATCH = 1024*256;
+
 MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 	: QObject(parent), m_socket(socket),
-	  m_pingTimer(nullptr),
+	  m_outboxBytes(0), m_outboxPeak(0), m_outboxHead(0),
+	  m_softLimit(0), m_hardLimit(0), m_coalesced(0), m_overflowed(false),
+	  m_pingTimer(nullptr), m_flushTimer(nullptr),
 	  m_lastRecvTime(0),
 	  m_idleTimeout(0), m_pingSent(0), m_closeWhenReady(false),
 	  m_ignoreIncoming(false),
-	  m_decodeOpaque(false)
+	  m_decodeOpaque(false),
+	  m_compressionStarted(false)
 {
 	connect(socket, SIGNAL(readyRead()), this, SLOT(readData()));
 	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(dataWritten(qint64)));
@@ -49,11 +60,9 @@ MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 		connect(socket, SIGNAL(encrypted()), this, SLOT(sslEncrypted()));
 	}
 
-	m_recvbuffer = new char[MAX_BUF_LEN];
-	m_sendbuffer = new char[MAX_BUF_LEN];
 	m_recvbytes = 0;
+	m_recvpos = 0;
 	m_sentbytes = 0;
-	m_sendbuflen = 0;
 
 	m_idleTimer = new QTimer(this);
 	connect(m_idleTimer, &QTimer::timeout, this, &MessageQueue::checkIdleTimeout);
@@ -100,10 +109,38 @@ void MessageQueue::setPingInterval(int msecs)
 	m_pingTimer->start(msecs);
 }
 
+void MessageQueue::setFlushDelay(int msecs)
+{
+	if(msecs <= 0) {
+		delete m_flushTimer;
+		m_flushTimer = nullptr;
+		return;
+	}
+
+	if(!m_flushTimer) {
+		m_flushTimer = new QTimer(this);
+		m_flushTimer->setSingleShot(true);
+		connect(m_flushTimer, &QTimer::timeout, this, &MessageQueue::writeData);
+	}
+	m_flushTimer->setInterval(msecs);
+}
+
+void MessageQueue::setOutboxLimits(int softLimit, int hardLimit)
+{
+	m_softLimit = qMax(0, softLimit);
+	m_hardLimit = qMax(0, hardLimit);
+}
+
+void MessageQueue::startCompression()
+{
+	if(!m_compressionStarted) {
+		send(MessagePtr(new Compress(0)));
+		m_compressionStarted = true;
+	}
+}
+
 MessageQueue::~MessageQueue()
 {
-	delete [] m_recvbuffer;
-	delete [] m_sendbuffer;
 }
 
 bool MessageQueue::isPending() const
@@ -119,35 +156,130 @@ MessagePtr MessageQueue::getPending()
 void MessageQueue::send(const MessagePtr &message)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.enqueue(message);
-		if(m_sendbuflen==0)
-			writeData();
+		enqueue(message);
+		checkOutboxLimit();
+		flush();
 	}
 }
 
 void MessageQueue::send(const MessageList &messages)
 {
 	if(!m_closeWhenReady) {
-		m_outbox << messages;
-		if(m_sendbuflen==0)
-			writeData();
+		for(const MessagePtr &msg : messages)
+			enqueue(msg);
+		checkOutboxLimit();
+		flush();
+	}
+}
+
+void MessageQueue::sendRaw(const QByteArray &messages)
+{
+	if(!m_closeWhenReady && !messages.isEmpty()) {
+		m_outbox.enqueue(Outgoing { nullptr, messages });
+		m_outboxBytes += messages.length();
+		checkOutboxLimit();
+		flush();
 	}
 }
 
 void MessageQueue::sendNow(MessagePtr msg)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.prepend(msg);
-		if(m_sendbuflen==0)
+		m_outbox.prepend(Outgoing { msg, msg->serialized() });
+		m_outboxBytes += msg->length();
+		--m_outboxHead;
+		if(m_sendbuffer.isEmpty() && m_socket->bytesToWrite()==0)
 			writeData();
 	}
 }
 
+void MessageQueue::enqueue(const MessagePtr &msg)
+{
+	if(msg->type() == MSG_MOVEPOINTER || msg->type() == MSG_LASERTRAIL) {
+		if(isLagging() && coalesce(msg))
+			return;
+		m_lastPointerMsg[msg->contextId()] = m_outboxHead + m_outbox.size();
+	}
+
+	m_outbox.enqueue(Outgoing { msg, msg->serialized() });
+	m_outboxBytes += msg->length();
+}
+
+bool MessageQueue::coalesce(const MessagePtr &msg)
+{
+	// Only the user's latest pointer message can be replaced, and only
+	// by one of the same type, so laser trail segments stay in order.
+	const auto last = m_lastPointerMsg.constFind(msg->contextId());
+	if(last == m_lastPointerMsg.constEnd())
+		return false;
+
+	const qint64 pos = last.value() - m_outboxHead;
+	if(pos < 0 || pos >= m_outbox.size())
+		return false; // already sent
+
+	Outgoing &queued = m_outbox[int(pos)];
+	if(queued.msg.isNull() || queued.msg->type() != msg->type())
+		return false;
+
+	m_outboxBytes += msg->length() - queued.wire.length();
+	queued = Outgoing { msg, msg->serialized() };
+	++m_coalesced;
+	return true;
+}
+
+MessageQueue::Outgoing MessageQueue::dequeue()
+{
+	const Outgoing out = m_outbox.dequeue();
+	m_outboxBytes -= out.wire.length();
+	++m_outboxHead;
+	return out;
+}
+
+void MessageQueue::clearOutbox()
+{
+	m_outboxHead += m_outbox.size();
+	m_outbox.clear();
+	m_outboxBytes = 0;
+	m_lastPointerMsg.clear();
+}
+
+void MessageQueue::checkOutboxLimit()
+{
+	const int queued = uploadQueueBytes();
+	if(queued > m_outboxPeak)
+		m_outboxPeak = queued;
+
+	if(m_hardLimit > 0 && queued > m_hardLimit && !m_overflowed) {
+		// The peer is so far behind it's not going to catch up.
+		// The message currently being written is still finished, so that
+		// there is room for a disconnect notification.
+		m_overflowed = true;
+		clearOutbox();
+		emit outboxOverflow();
+	}
+}
+
+void MessageQueue::flush()
+{
+	// If the socket is still busy, the queued messages will be written
+	// in one batch once the previous batch is out. (See dataWritten)
+	if(!m_sendbuffer.isEmpty() || m_socket->bytesToWrite()>0)
+		return;
+
+	if(m_flushTimer) {
+		if(!m_flushTimer->isActive())
+			m_flushTimer->start();
+	} else {
+		writeData();
+	}
+}
+
 void MessageQueue::sendDisconnect(int reason, const QString &message)
 {
 	send(MessagePtr(new protocol::Disconnect(0, protocol::Disconnect::Reason(reason), message)));
 	m_ignoreIncoming = true;
 	m_recvbytes = 0;
+	m_recvpos = 0;
 }
 
 void MessageQueue::sendPing()
@@ -164,15 +296,12 @@ void MessageQueue::sendPing()
 
 int MessageQueue::uploadQueueBytes() const
 {
-	int total = m_socket->bytesToWrite() + m_sendbuflen - m_sentbytes;
-	for(const MessagePtr msg : m_outbox)
-		total += msg->length();
-	return total;
+	return m_socket->bytesToWrite() + m_sendbuffer.length() - m_sentbytes + m_outboxBytes;
 }
 
 bool MessageQueue::isUploading() const
 {
-	return m_sendbuflen > 0 || m_socket->bytesToWrite() > 0;
+	return !m_sendbuffer.isEmpty() || !m_outbox.isEmpty() || m_socket->bytesToWrite() > 0;
 }
 
 qint64 MessageQueue::idleTime() const
@@ -180,16 +309,98 @@ qint64 MessageQueue::idleTime() const
 	return QDateTime::currentMSecsSinceEpoch() - m_lastRecvTime;
 }
 
+int MessageQueue::prepareRecvBuffer()
+{
+	int available = int(qMin(m_socket->bytesAvailable(), qint64(MAX_READ_BLOCK)));
+	if(m_decompressor) {
+		// The decompressed length is not known in advance, so this is just a guess
+		if(available <= 0 && !m_decompressor->hasInput())
+			return 0;
+		available = qBound(MAX_BUF_LEN / 16, available * 4, MAX_READ_BLOCK);
+	}
+
+	if(available <= 0)
+		return 0;
+
+	const int leftover = m_recvbytes - m_recvpos;
+	int needed = leftover + available;
+	if(leftover >= Message::HEADER_LEN)
+		needed = qMax(needed, Message::sniffLength(m_recvbuffer.constData() + m_recvpos));
+
+	// Complete messages are consumed in place, so at most one partial
+	// message needs to be moved when making room for more data.
+	if(!m_recvbuffer.isDetached() || m_recvbuffer.length() < needed) {
+		// The buffer is too small or received opaque messages still reference it.
+		// The new buffer is sized to fit the available data, so that messages
+		// kept in the session history don't hold on to unused memory.
+		QByteArray buffer(needed, Qt::Uninitialized);
+		if(leftover > 0)
+			memcpy(buffer.data(), m_recvbuffer.constData() + m_recvpos, leftover);
+		m_recvbuffer = buffer;
+
+	} else if(m_recvbuffer.length() - m_recvpos < needed) {
+		// The buffer can be reused, but there is not enough room at the end
+		if(leftover > 0)
+			memmove(m_recvbuffer.data(), m_recvbuffer.constData() + m_recvpos, leftover);
+
+	} else {
+		return m_recvbuffer.length() - m_recvbytes;
+	}
+
+	m_recvpos = 0;
+	m_recvbytes = leftover;
+	return m_recvbuffer.length() - m_recvbytes;
+}
+
+int MessageQueue::readCompressed(int maxlen, int &wirebytes)
+{
+	int produced = 0;
+	while(produced < maxlen) {
+		if(!m_decompressor->hasInput()) {
+			const QByteArray input = m_socket->read(MAX_READ_BLOCK);
+			if(input.isEmpty())
+				break;
+			wirebytes += input.length();
+			m_decompressor->setInput(input);
+		}
+
+		const int out = m_decompressor->decompress(m_recvbuffer.data() + m_recvbytes + produced, maxlen - produced);
+		if(out<0)
+			return -1;
+		produced += out;
+	}
+
+	return produced;
+}
+
 void MessageQueue::readData() {
 	bool gotmessage = false;
 	int read, totalread=0;
 	do {
 		// Read as much as fits in to the deserialization buffer
-		read = m_socket->read(m_recvbuffer+m_recvbytes, MAX_BUF_LEN-m_recvbytes);
+		const int room = prepareRecvBuffer();
+		int wirebytes = 0;
+		if(room <= 0) {
+			read = 0;
+
+		} else if(m_decompressor) {
+			read = readCompressed(room, wirebytes);
+			if(read<0) {
+				emit socketError(QStringLiteral("Invalid compressed data received"));
+				m_socket->abort();
+				return;
+			}
+
+		} else {
+			read = m_socket->read(m_recvbuffer.data()+m_recvbytes, room);
+			wirebytes = read;
+		}
+
 		if(read<0) {
 			emit socketError(m_socket->errorString());
 			return;
 		}
+		totalread += wirebytes;
 
 		if(m_ignoreIncoming) {
 			// Ignore incoming data mode is used when we're shutting down the connection
@@ -204,14 +415,33 @@ void MessageQueue::readData() {
 
 		// Extract all complete messages
 		int len;
-		while(m_recvbytes >= Message::HEADER_LEN && m_recvbytes >= (len=Message::sniffLength(m_recvbuffer))) {
+		while(m_recvbytes-m_recvpos >= Message::HEADER_LEN && m_recvbytes-m_recvpos >= (len=Message::sniffLength(m_recvbuffer.constData()+m_recvpos))) {
 			// Whole message received!
-			NullableMessageRef msg = Message::deserialize((const uchar*)m_recvbuffer, m_recvbytes, m_decodeOpaque);
+			const uchar *data = reinterpret_cast<const uchar*>(m_recvbuffer.constData()) + m_recvpos;
+			NullableMessageRef msg;
+			if(!m_decodeOpaque && data[2] >= 64) {
+				// Opaque messages just reference the receive buffer
+				msg = NullableMessageRef(new OpaqueMessage(m_recvbuffer, m_recvpos));
+			} else {
+				msg = Message::deserialize(data, len, m_decodeOpaque);
+			}
+
 			if(msg.isNull()) {
-				emit badData(len, (unsigned char)m_recvbuffer[2], (unsigned char)m_recvbuffer[3]);
+				emit badData(len, data[2], data[3]);
 
 			} else {
-				 if(msg->type() == MSG_PING) {
+				if(msg->type() == MSG_COMPRESS) {
+					// Everything after this message is compressed
+					if(!m_decompressor) {
+						m_decompressor.reset(new StreamDecompressor);
+						const int end = m_recvpos + len;
+						if(end < m_recvbytes) {
+							m_decompressor->setInput(QByteArray(m_recvbuffer.constData() + end, m_recvbytes - end));
+							m_recvbytes = end;
+						}
+					}
+
+				} else if(msg->type() == MSG_PING) {
 					// Special handling for Ping messages
 					bool isPong = msg.cast<Ping>().isPong();
 
@@ -234,16 +464,11 @@ void MessageQueue::readData() {
 				}
 			}
 
-			if(len < m_recvbytes) {
-				// Buffer contains more than one message
-				memmove(m_recvbuffer, m_recvbuffer+len, m_recvbytes-len);
-			}
-			m_recvbytes -= len;
+			m_recvpos += len;
 		}
 
 		// All messages extracted from buffer (if there were any):
 		// see if there are more bytes in the socket buffer
-		totalread += read;
 	} while(read>0);
 
 	if(totalread) {
@@ -261,7 +486,7 @@ void MessageQueue::dataWritten(qint64 bytes)
 
 	// Write more once the buffer is empty
 	if(m_socket->bytesToWrite()==0) {
-		if(m_sendbuflen==0 && m_outbox.isEmpty())
+		if(m_sendbuffer.isEmpty() && m_outbox.isEmpty())
 			emit allSent();
 		else
 			writeData();
@@ -269,28 +494,67 @@ void MessageQueue::dataWritten(qint64 bytes)
 }
 
 void MessageQueue::writeData() {
+	if(m_flushTimer)
+		m_flushTimer->stop();
+
 	int sentBatch = 0;
 	bool sendMore = true;
 
-	while(sendMore && sentBatch < 1024*64) {
+	while(sendMore && sentBatch < MAX_WRITE_BATCH) {
 		sendMore = false;
-		if(m_sendbuflen==0 && !m_outbox.isEmpty()) {
-			// Upload buffer is empty, but there are messages in the outbox
+		if(m_sendbuffer.isEmpty() && !m_outbox.isEmpty()) {
+			// Upload buffer is empty, but there are messages in the outbox.
+			// A lone message's (or raw data block's) wire encoding is shared
+			// by all the connections it is sent to, so this doesn't copy or
+			// reserialize anything.
+			// When there are more messages queued, as many as fit are packed
+			// into a single buffer, so they can be written with a single call.
 			Q_ASSERT(m_sentbytes == 0);
 
-			MessagePtr msg = m_outbox.dequeue();
-			m_sendbuflen = msg->serialize(m_sendbuffer);
-			Q_ASSERT(m_sendbuflen>0);
-			Q_ASSERT(m_sendbuflen <= MAX_BUF_LEN);
+			bool startCompressing = false;
+			while(!m_outbox.isEmpty()) {
+				const Outgoing &next = m_outbox.head();
+				Q_ASSERT(!next.wire.isEmpty());
+				Q_ASSERT(next.msg.isNull() || next.wire.length() <= MAX_BUF_LEN);
+
+				if(m_sendbuffer.isEmpty()) {
+					// The encoding may reference the message's receive buffer,
+					// so the message must be kept alive until it has been written
+					m_sendbuffer = next.wire;
+					m_sendmsg = next.msg;
+				} else if(m_sendbuffer.length() + next.wire.length() <= MAX_WRITE_BATCH) {
+					m_sendbuffer.append(next.wire);
+				} else {
+					break;
+				}
+
+				const NullableMessageRef msg = dequeue().msg;
+				if(msg.isNull())
+					continue;
 
-			if(msg->type() == protocol::MSG_DISCONNECT) {
-				// Automatically disconnect after Disconnect notification is sent
-				m_closeWhenReady = true;
-				m_outbox.clear();
+				if(msg->type() == protocol::MSG_DISCONNECT) {
+					// Automatically disconnect after Disconnect notification is sent
+					m_closeWhenReady = true;
+					clearOutbox();
+
+				} else if(msg->type() == protocol::MSG_COMPRESS) {
+					// The compression marker itself is sent uncompressed
+					// and everything after it is compressed
+					startCompressing = true;
+					break;
+				}
 			}
+
+			if(m_compressor) {
+				m_sendbuffer = m_compressor->compress(m_sendbuffer);
+				m_sendmsg = nullptr;
+			}
+
+			if(startCompressing && !m_compressor)
+				m_compressor.reset(new StreamCompressor);
 		}
 
-		if(m_sentbytes < m_sendbuflen) {
+		if(m_sentbytes < m_sendbuffer.length()) {
 #ifndef NDEBUG
 			// Debugging tool: simulate bad network connections by sleeping at odd times
 			if(m_randomlag>0) {
@@ -298,7 +562,7 @@ void MessageQueue::writeData() {
 			}
 #endif
 
-			const int sent = m_socket->write(m_sendbuffer+m_sentbytes, m_sendbuflen-m_sentbytes);
+			const int sent = m_socket->write(m_sendbuffer.constData()+m_sentbytes, m_sendbuffer.length()-m_sentbytes);
 			if(sent<0) {
 				// Error
 				emit socketError(m_socket->errorString());
@@ -307,10 +571,11 @@ void MessageQueue::writeData() {
 			m_sentbytes += sent;
 			sentBatch += sent;
 
-			Q_ASSERT(m_sentbytes <= m_sendbuflen);
-			if(m_sentbytes >= m_sendbuflen) {
-				// Complete message sent
-				m_sendbuflen=0;
+			Q_ASSERT(m_sentbytes <= m_sendbuffer.length());
+			if(m_sentbytes >= m_sendbuffer.length()) {
+				// Complete batch sent
+				m_sendbuffer = QByteArray();
+				m_sendmsg = nullptr;
 				m_sentbytes=0;
 				if(m_closeWhenReady) {
 					m_socket->disconnectFromHost();
@@ -23,13 +23,18 @@
 #include "message.h"
 
 #include <QQueue>
+#include <QHash>
 #include <QObject>
+#include <QScopedPointer>
 
 class QTcpSocket;
 class QTimer;
 
 namespace protocol {
 
+class StreamCompressor;
+class StreamDecompressor;
+
 /**
  * A wrapper for an IO device for sending and receiving messages.
  */
@@ -71,6 +76,17 @@ public:
 	void send(const MessagePtr &message);
 	void send(const MessageList &messages);
 
+	/**
+	 * @brief Enqueue already serialized messages for sending
+	 *
+	 * The data must consist of complete messages in their wire format.
+	 * It is sent as is, without being split into message objects.
+	 * This is used to relay session history straight from storage.
+	 *
+	 * @param messages the wire format of zero or more messages
+	 */
+	void sendRaw(const QByteArray &messages);
+
 	/**
 	 * @brief Gracefully disconnect
 	 *
@@ -94,6 +110,33 @@ public:
 	 */
 	bool isUploading() const;
 
+	/**
+	 * @brief Set the upload queue size limits
+	 *
+	 * When the upload queue is longer than the soft limit, the peer is
+	 * falling behind. While lagging, a new MovePointer or LaserTrail message
+	 * replaces the previous one of the same type from the same user, if it
+	 * is still queued and no other such message from that user is queued after it.
+	 *
+	 * If the upload queue grows past the hard limit, the queued messages
+	 * are discarded and outboxOverflow() is emitted.
+	 *
+	 * A limit of zero means no limit. By default, there are no limits.
+	 *
+	 * @param softLimit the length (in bytes) after which pointer messages are coalesced
+	 * @param hardLimit the maximum length of the upload queue in bytes
+	 */
+	void setOutboxLimits(int softLimit, int hardLimit);
+
+	//! Is the upload queue longer than the soft limit?
+	bool isLagging() const { return m_softLimit > 0 && uploadQueueBytes() > m_softLimit; }
+
+	//! Get the largest upload queue length (in bytes) seen so far
+	int uploadQueuePeak() const { return m_outboxPeak; }
+
+	//! Get the number of messages that have been replaced by newer ones while lagging
+	int coalescedCount() const { return m_coalesced; }
+
 	/**
 	 * @brief Get the number of milliseconds since the last message sent by the remote end
 	 */
@@ -121,6 +164,38 @@ public:
 	 */
 	void setPingInterval(int msecs);
 
+	/**
+	 * @brief Set the maximum time outgoing messages may be held back
+	 *
+	 * When greater than zero, messages sent while the connection is idle
+	 * are not written immediately, but collected for up to this many milliseconds
+	 * so that they can be written to the socket in one batch.
+	 * Ping messages are never delayed.
+	 *
+	 * The default is zero (write immediately.)
+	 *
+	 * @param msecs flush delay in milliseconds
+	 */
+	void setFlushDelay(int msecs);
+
+	/**
+	 * @brief Start compressing the outgoing data
+	 *
+	 * A compression marker is queued, after which everything is sent
+	 * as a single deflate stream. This should only be called when the
+	 * peer is known to support compression.
+	 *
+	 * Decompression of incoming data starts automatically when
+	 * the peer's compression marker is received.
+	 */
+	void startCompression();
+
+	//! Has compression of outgoing data been started?
+	bool isSendingCompressed() const { return m_compressionStarted; }
+
+	//! Has the peer started sending compressed data?
+	bool isReceivingCompressed() const { return !m_decompressor.isNull(); }
+
 #ifndef NDEBUG
 	void setRandomLag(uint lag) { m_randomlag = lag; }
 #endif
@@ -168,6 +243,15 @@ signals:
 
 	void socketError(const QString &errorstring);
 
+	/**
+	 * @brief The upload queue grew past the hard limit
+	 *
+	 * The queued messages have already been discarded when this is emitted.
+	 * The connection should be closed, as the peer will not receive the
+	 * rest of the message stream.
+	 */
+	void outboxOverflow();
+
 	/**
 	 * @brief A reply to our Ping was just received
 	 * @param roundtripTime time now - ping sent time
@@ -182,22 +266,46 @@ private slots:
 
 private:
 	void sendNow(MessagePtr msg);
-
+	// An outbox entry: a message or a run of pre-serialized messages
+	struct Outgoing {
+		NullableMessageRef msg; // null if this entry is raw data
+		QByteArray wire;        // the wire format of the message(s)
+	};
+
+	void enqueue(const MessagePtr &msg);
+	bool coalesce(const MessagePtr &msg);
+	Outgoing dequeue();
+	void clearOutbox();
+	void checkOutboxLimit();
+
+	void flush();
 	void writeData();
+	int prepareRecvBuffer();
+	int readCompressed(int maxlen, int &wirebytes);
 
 	QTcpSocket *m_socket;
 
-	char *m_recvbuffer; // raw message reception buffer
-	char *m_sendbuffer; // raw message upload buffer
-	int m_recvbytes;    // number of bytes in reception buffer
-	int m_sentbytes;    // number of bytes in upload buffer already sent
-	int m_sendbuflen;   // length of the data in the upload buffer
+	QByteArray m_recvbuffer; // raw message reception buffer (may be shared with received opaque messages)
+	QByteArray m_sendbuffer; // wire encoding of the message(s) being uploaded
+	NullableMessageRef m_sendmsg; // the message whose encoding is being uploaded as is
+	int m_recvbytes;         // number of bytes in reception buffer
+	int m_recvpos;           // start of the first unprocessed message in the reception buffer
+	int m_sentbytes;         // number of bytes in upload buffer already sent
 
 	QQueue<MessagePtr> m_inbox;  // pending messages
-	QQueue<MessagePtr> m_outbox; // messages to be sent
+	QQueue<Outgoing> m_outbox;   // messages to be sent
+	int m_outboxBytes;           // total length of the messages in the outbox
+	int m_outboxPeak;            // largest upload queue length seen
+	qint64 m_outboxHead;         // sequence number of the first message in the outbox
+	QHash<int, qint64> m_lastPointerMsg; // user ID -> sequence number of the user's latest queued pointer message
+	int m_softLimit;
+	int m_hardLimit;
+	int m_coalesced;
+	bool m_overflowed;
 
 	QTimer *m_idleTimer;
 	QTimer *m_pingTimer;
+	QTimer *m_flushTimer;
 	qint64 m_lastRecvTime;
 	qint64 m_idleTimeout;
 	qint64 m_pingSent;
@@ -206,6 +314,10 @@ private:
 	bool m_ignoreIncoming;
 
 	bool m_decodeOpaque;
+	bool m_compressionStarted;
+
+	QScopedPointer<StreamCompressor> m_compressor;
+	QScopedPointer<StreamDecompressor> m_decompressor;
 
 #ifndef NDEBUG
 	uint m_randomlag;
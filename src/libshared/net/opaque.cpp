@@ -27,25 +27,38 @@
 #include "undo.h"
 #include "recording.h"
 
+#include <QtEndian>
+
 #include <cstring>
 
 namespace protocol {
 
 OpaqueMessage::OpaqueMessage(MessageType type, uint8_t ctx, const uchar *payload, int payloadLen)
-	: Message(type, ctx), m_length(payloadLen)
+	: Message(type, ctx)
 {
 	Q_ASSERT(type >= 64);
-	if(payloadLen>0) {
-		m_payload = new uchar[payloadLen];
-		memcpy(m_payload, payload, payloadLen);
-	} else {
-		m_payload = nullptr;
-	}
+	Q_ASSERT(payloadLen <= 0xffff);
+
+	// Keep the message in its wire format, so it can be relayed as is
+	QByteArray wire(HEADER_LEN + payloadLen, Qt::Uninitialized);
+	uchar *data = reinterpret_cast<uchar*>(wire.data());
+	qToBigEndian(quint16(payloadLen), data);
+	data[2] = type;
+	data[3] = ctx;
+	if(payloadLen>0)
+		memcpy(data+HEADER_LEN, payload, payloadLen);
+
+	setSerialized(wire);
 }
 
-OpaqueMessage::~OpaqueMessage()
+OpaqueMessage::OpaqueMessage(const QByteArray &buffer, int offset)
+	: Message(MessageType(uchar(buffer.at(offset+2))), uchar(buffer.at(offset+3))), m_buffer(buffer)
 {
-	delete []m_payload;
+	Q_ASSERT(type() >= 64);
+	const int len = sniffLength(buffer.constData() + offset);
+	Q_ASSERT(offset + len <= buffer.length());
+
+	setSerialized(QByteArray::fromRawData(buffer.constData() + offset, len));
 }
 
 NullableMessageRef OpaqueMessage::decode(MessageType type, uint8_t ctx, const uchar *data, uint len)
@@ -95,27 +108,28 @@ NullableMessageRef OpaqueMessage::decode(MessageType type, uint8_t ctx, const uc
 
 NullableMessageRef OpaqueMessage::decode() const
 {
-	return decode(type(), contextId(), m_payload, m_length);
+	return decode(type(), contextId(), payload(), payloadLength());
 }
 
 int OpaqueMessage::payloadLength() const
 {
-	return m_length;
+	return cachedSerialization().length() - HEADER_LEN;
 }
 
 int OpaqueMessage::serializePayload(uchar *data) const
 {
-	memcpy(data, m_payload, m_length);
-	return m_length;
+	const int len = payloadLength();
+	memcpy(data, payload(), len);
+	return len;
 }
 
 bool OpaqueMessage::payloadEquals(const Message &m) const
 {
 	const OpaqueMessage &om = static_cast<const OpaqueMessage&>(m);
-	if(m_length != om.m_length)
+	if(payloadLength() != om.payloadLength())
 		return false;
 
-	return memcmp(m_payload, om.m_payload, m_length) == 0;
+	return memcmp(payload(), om.payload(), payloadLength()) == 0;
 }
 
 }
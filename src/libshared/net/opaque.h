@@ -36,7 +36,17 @@ class OpaqueMessage : public Message
 {
 public:
 	OpaqueMessage(MessageType type, uint8_t ctx, const uchar *payload, int payloadLen);
-	~OpaqueMessage();
+
+	/**
+	 * @brief Construct an opaque message that references a slice of a receive buffer
+	 *
+	 * The message data is not copied. Instead, the message keeps a reference
+	 * to the buffer.
+	 *
+	 * @param buffer the buffer the message was received in
+	 * @param offset the offset of the complete message in the buffer
+	 */
+	OpaqueMessage(const QByteArray &buffer, int offset);
 	OpaqueMessage(const OpaqueMessage &m) = delete;
 	OpaqueMessage &operator=(const OpaqueMessage &m) = delete;
 
@@ -57,8 +67,11 @@ protected:
 	Kwargs kwargs() const override { return Kwargs(); }
 
 private:
-	uchar *m_payload;
-	int m_length;
+	// The message is stored only in its wire format, header included
+	const uchar *payload() const { return reinterpret_cast<const uchar*>(cachedSerialization().constData()) + HEADER_LEN; }
+
+	// The receive buffer the message data lives in (if not copied)
+	QByteArray m_buffer;
 };
 
 }
@@ -1,5 +1,7 @@
 #include "../net/messagequeue.h"
 #include "../net/meta.h"
+#include "../net/layer.h"
+#include "../net/meta2.h"
 
 #include <QtTest/QtTest>
 #include <QTcpSocket>
@@ -137,9 +139,18 @@ private slots:
 		loopUntil(messageReceived);
 	}
 
+	void testMultiSend_data()
+	{
+		QTest::addColumn<int>("flushDelay");
+		QTest::newRow("immediate") << 0;
+		QTest::newRow("delayed") << 10;
+	}
+
 	void testMultiSend()
 	{
+		QFETCH(int, flushDelay);
 		auto mq = getMsgQueue();
+		mq->setFlushDelay(flushDelay);
 
 		const int sendCount = 100;
 
@@ -171,6 +182,175 @@ private slots:
 		loopUntil(allReceived);
 	}
 
+	void testCompression()
+	{
+		auto mq = getMsgQueue();
+
+		// The echo server sends our compressed stream back as is,
+		// so this tests both compression and decompression.
+		const int sendCount = 100;
+		int countReceived = 0;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, &countReceived, &allReceived]() {
+			while(mq->isPending()) {
+				MessagePtr got = mq->getPending();
+				QCOMPARE(got->type(), MSG_CHAT);
+				QCOMPARE(got.cast<Chat>().message(), QString::number(countReceived));
+				if(++countReceived == sendCount)
+					allReceived = true;
+			}
+		});
+
+		mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray::number(0))));
+		mq->startCompression();
+		QVERIFY(mq->isSendingCompressed());
+
+		for(int i=1;i<sendCount;++i)
+			mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray::number(i))));
+
+		loopUntil(allReceived);
+		QVERIFY(mq->isReceivingCompressed());
+	}
+
+	void testOpaqueReceive()
+	{
+		auto mq = getMsgQueue();
+
+		// Received opaque messages reference the receive buffer: make sure
+		// they stay intact while more data is received
+		const int sendCount = 1000;
+		MessageList received;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, &received, &allReceived]() {
+			while(mq->isPending())
+				received << mq->getPending();
+			allReceived = received.size() >= sendCount;
+		});
+
+		MessageList sent;
+		for(int i=0;i<sendCount;++i) {
+			MessagePtr msg(new CanvasResize(1, i, -i, i*2, -i*2));
+			sent << msg;
+			mq->send(msg);
+		}
+
+		loopUntil(allReceived);
+
+		QCOMPARE(received.size(), sendCount);
+		for(int i=0;i<sendCount;++i) {
+			QCOMPARE(received.at(i)->type(), MSG_CANVAS_RESIZE);
+			QCOMPARE(received.at(i)->serialized(), sent.at(i)->serialized());
+		}
+	}
+
+	void testSendRaw()
+	{
+		auto mq = getMsgQueue();
+
+		MessageList sent;
+		QByteArray raw;
+		for(int i=0;i<10;++i) {
+			MessagePtr msg(new Chat(0, 0, 0, QByteArray::number(i)));
+			sent << msg;
+			raw.append(msg->serialized());
+		}
+
+		MessageList received;
+		bool allReceived = false;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, &received, &allReceived]() {
+			while(mq->isPending())
+				received << mq->getPending();
+			allReceived = received.size() >= 12;
+		});
+
+		// Pre-serialized messages should be sent as is and in order with regular messages
+		mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray("before"))));
+		mq->sendRaw(raw);
+		mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray("after"))));
+
+		loopUntil(allReceived);
+
+		QCOMPARE(received.size(), 12);
+		QCOMPARE(received.first().cast<Chat>().message(), QString("before"));
+		for(int i=0;i<sent.size();++i)
+			QVERIFY(received.at(i+1).equals(sent.at(i)));
+		QCOMPARE(received.last().cast<Chat>().message(), QString("after"));
+	}
+
+	void testCoalescing()
+	{
+		auto mq = getMsgQueue();
+
+		// Hold the messages back so the queue stays backed up
+		mq->setFlushDelay(500);
+		mq->setOutboxLimits(1, 0);
+
+		const MessageList sent {
+			MessagePtr(new Chat(0, 0, 0, QByteArray("Hello"))),
+			MessagePtr(new MovePointer(1, 0, 0)),
+			MessagePtr(new MovePointer(1, 1, 1)),
+			MessagePtr(new MovePointer(2, 2, 2)),
+			MessagePtr(new MovePointer(1, 3, 3)),
+			MessagePtr(new LaserTrail(1, 0xffff0000, 10)),
+			MessagePtr(new MovePointer(1, 4, 4)),
+			MessagePtr(new LaserTrail(1, 0xffff0000, 0)),
+			MessagePtr(new LaserTrail(1, 0xff00ff00, 0)),
+		};
+
+		// The latest pointer messages replace the queued ones, but a laser trail
+		// message keeps the pointer movements before and after it apart
+		const MessageList expected {
+			sent.at(0), sent.at(4), sent.at(3), sent.at(5), sent.at(6), sent.at(8)
+		};
+
+		int expectedBytes = 0;
+		for(const MessagePtr &msg : expected)
+			expectedBytes += msg->length();
+
+		MessageList received;
+		bool allReceived = false;
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, &received, &allReceived, &expected]() {
+			while(mq->isPending())
+				received << mq->getPending();
+			allReceived = received.size() >= expected.size();
+		});
+
+		for(const MessagePtr &msg : sent)
+			mq->send(msg);
+
+		QVERIFY(mq->isLagging());
+		QCOMPARE(mq->coalescedCount(), 3);
+		QCOMPARE(mq->uploadQueueBytes(), expectedBytes);
+
+		loopUntil(allReceived);
+
+		QCOMPARE(received.size(), expected.size());
+		for(int i=0;i<expected.size();++i)
+			QCOMPARE(received.at(i)->serialized(), expected.at(i)->serialized());
+	}
+
+	void testOutboxOverflow()
+	{
+		auto mq = getMsgQueue();
+		mq->setFlushDelay(500);
+		mq->setOutboxLimits(0, 1000);
+
+		bool overflowed = false;
+		connect(mq.get(), &MessageQueue::outboxOverflow, [&overflowed]() {
+			overflowed = true;
+		});
+
+		int i=0;
+		while(!overflowed && i < 1000)
+			mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray::number(i++))));
+
+		QVERIFY(overflowed);
+		QCOMPARE(mq->uploadQueueBytes(), 0);
+		QVERIFY(mq->uploadQueuePeak() > 1000);
+	}
+
 	void testSendDisconnect()
 	{
 		auto s = getConnection();
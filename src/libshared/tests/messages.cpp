@@ -27,6 +27,7 @@ private slots:
 		QTest::newRow("command") << (Message*)new Command(0, QByteArray("testing..."));
 		QTest::newRow("disconnect") << (Message*)new Disconnect(1, Disconnect::KICK, "hello");
 		QTest::newRow("ping") << (Message*)new Ping(2, true);
+		QTest::newRow("compress") << (Message*)new Compress(3);
 
 		QTest::newRow("userjoin") << (Message*)new UserJoin(4, 0x03, QString("Test"), "asd");
 		QTest::newRow("userjoin(no hash)") << (Message*)new UserJoin(4, 0x03, QString("Test"), QByteArray());
@@ -88,6 +89,17 @@ private slots:
 
 		QVERIFY(msg->equals(*msg2));
 
+		// The cached wire encoding should be identical to the serialized message
+		QCOMPARE(msg->serialized(), buffer);
+		QCOMPARE(msg2->serialized(), buffer);
+
+		// Opaque messages should be kept in their wire format as is
+		if(msg->isOpaque()) {
+			NullableMessageRef opaque = Message::deserialize(reinterpret_cast<const uchar*>(buffer.constData()), buffer.size(), false);
+			QVERIFY(!opaque.isNull());
+			QCOMPARE(opaque->serialized(), buffer);
+		}
+
 		// Test text serialization (only valid for recordable types)
 		if(msg->isRecordable()) {
 			QStringList text = msg->toString().split('\n');
@@ -128,6 +140,39 @@ private slots:
 		QVERIFY(unwrapped->equals(*original));
 	}
 
+	void testSerializationCache()
+	{
+		// Changing the context ID should update the cached encoding
+		const QByteArray original = CanvasResize(1, 2, 3, 4, 5).serialized();
+		MessagePtr opaque = MessagePtr::fromNullable(Message::deserialize(
+			reinterpret_cast<const uchar*>(original.constData()), original.length(), false));
+
+		const QByteArray shared = opaque->serialized();
+		opaque->setContextId(10);
+		QCOMPARE(opaque->serialized(), CanvasResize(10, 2, 3, 4, 5).serialized());
+		QCOMPARE(shared, original);
+
+		// Modifying a message should invalidate the cache
+		DrawDabsPixel dabs(DabShape::Round, 1, 0x1122, 100, -100, 0xff223344, 0x10, PixelBrushDabVector() << PixelBrushDab {1, 2, 3, 4});
+		const int len = dabs.serialized().length();
+		dabs.dabs() << PixelBrushDab {10, 20, 30, 40};
+		QCOMPARE(dabs.serialized().length(), dabs.length());
+		QVERIFY(dabs.serialized().length() > len);
+
+		// Decoded messages only keep their encoding while it is being broadcast
+		QVERIFY(dabs.serialized().constData() != dabs.serialized().constData());
+		dabs.cacheSerialized();
+		const QByteArray cached = dabs.serialized();
+		QCOMPARE(dabs.serialized().constData(), cached.constData());
+		dabs.releaseSerialized();
+		QVERIFY(dabs.serialized().constData() != cached.constData());
+		QCOMPARE(dabs.serialized(), cached);
+
+		// Opaque messages are kept in their wire format
+		opaque->releaseSerialized();
+		QCOMPARE(opaque->serialized().constData(), opaque->serialized().constData());
+	}
+
 	void testLayerOrderSanitation_data()
 	{
 		QTest::addColumn<IdList>("reorder");
@@ -144,6 +144,7 @@ void BuiltinServer::newClient()
 
 	client->setParent(this);
 	client->setConnectionTimeout(m_config->getConfigTime(config::ClientTimeout) * 1000);
+	client->applyUploadQueueLimits(m_config);
 
 	m_clients.append(client);
 	connect(client, &QObject::destroyed, this, &BuiltinServer::removeClient);
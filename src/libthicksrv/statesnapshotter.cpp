@@ -0,0 +1,219 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "statesnapshotter.h"
+
+#include "../libshared/net/meta.h"
+
+#include "../libclient/canvas/aclfilter.h"
+#include "../libclient/canvas/statetracker.h"
+#include "../libclient/canvas/layerlist.h"
+#include "../libclient/canvas/loader.h"
+#include "../libclient/core/layerstack.h"
+#include "../libclient/core/tilevector.h"
+#include "../libclient/net/internalmsg.h"
+
+#include <QThread>
+#include <QTimer>
+
+namespace server {
+
+StateSnapshotter::StateSnapshotter(QThread *thread)
+	: QObject()
+{
+	// The canvas is created in the snapshotter's thread when the session resets it
+	moveToThread(thread);
+}
+
+StateSnapshotter::~StateSnapshotter()
+{
+}
+
+void StateSnapshotter::setCallback(const Callback &callback)
+{
+	QMutexLocker lock(&m_mutex);
+	m_callback = callback;
+}
+
+void StateSnapshotter::reset(int firstIndex)
+{
+	enqueue(Item { Item::Reset, QByteArray(), firstIndex });
+}
+
+void StateSnapshotter::addMessage(const protocol::MessagePtr &msg)
+{
+	// Message reference counting is not thread safe, so we pass the message
+	// to the other thread in its serialized form. The serialization may be
+	// a view into a receive buffer that is freed along with the message,
+	// so an actual copy of the data must be made.
+	const QByteArray wire = msg->serialized();
+	enqueue(Item { Item::Message, QByteArray(wire.constData(), wire.length()), 0 });
+}
+
+void StateSnapshotter::requestSnapshot(int index)
+{
+	enqueue(Item { Item::Snapshot, QByteArray(), index });
+}
+
+void StateSnapshotter::dispose()
+{
+	{
+		QMutexLocker lock(&m_mutex);
+		m_callback = Callback();
+		m_queue.clear();
+	}
+	deleteLater();
+}
+
+void StateSnapshotter::enqueue(const Item &item)
+{
+	QMutexLocker lock(&m_mutex);
+	m_queue << item;
+	if(!m_processing) {
+		m_processing = true;
+		QTimer::singleShot(0, this, &StateSnapshotter::processQueue);
+	}
+}
+
+void StateSnapshotter::processQueue()
+{
+	QVector<Item> items;
+	{
+		QMutexLocker lock(&m_mutex);
+		items.swap(m_queue);
+		m_processing = false;
+	}
+
+	for(const Item &item : items) {
+		switch(item.type) {
+		case Item::Reset:
+			resetCanvas(item.index);
+			break;
+
+		case Item::Message: {
+			const protocol::NullableMessageRef msg = protocol::Message::deserialize(
+				reinterpret_cast<const uchar*>(item.msg.constData()),
+				item.msg.length(),
+				true
+				);
+
+			if(msg.isNull())
+				qWarning("Snapshotter: couldn't deserialize message at index %d", m_nextIndex);
+			else if(m_statetracker)
+				drawMessage(protocol::MessagePtr::fromNullable(msg));
+
+			if(m_nextIndex++ == m_requestedIndex)
+				makeSnapshot();
+			break;
+		}
+
+		case Item::Snapshot:
+			m_requestedIndex = item.index;
+			if(m_requestedIndex < m_nextIndex)
+				makeSnapshot();
+			break;
+		}
+	}
+}
+
+void StateSnapshotter::resetCanvas(int firstIndex)
+{
+	delete m_statetracker;
+
+	auto *layers = new paintcore::LayerStack;
+	auto *layerlist = new canvas::LayerListModel;
+	m_statetracker = new canvas::StateTracker(layers, layerlist, 0, this);
+	layers->setParent(m_statetracker);
+	layerlist->setParent(m_statetracker);
+
+	if(!m_aclfilter)
+		m_aclfilter = new canvas::AclFilter(this);
+	m_aclfilter->reset(0, false);
+
+	m_compressor.reset(new paintcore::TileCompressor);
+
+	m_nextIndex = firstIndex;
+	m_requestedIndex = -1;
+	m_defaultLayer = 0;
+	m_pinnedMessage = QString();
+}
+
+void StateSnapshotter::drawMessage(const protocol::MessagePtr &msg)
+{
+	if(!m_aclfilter->filterMessage(*msg))
+		return;
+
+	switch(msg->type()) {
+	case protocol::MSG_CHAT: {
+		const auto &chat = msg.cast<protocol::Chat>();
+		if(chat.isPin()) {
+			m_pinnedMessage = chat.message();
+			if(m_pinnedMessage == "-")
+				m_pinnedMessage = QString();
+		}
+		break;
+	}
+	case protocol::MSG_LAYER_DEFAULT:
+		m_defaultLayer = msg->layer();
+		break;
+	case protocol::MSG_SOFTRESET:
+		// Nothing before a soft reset point can be undone, so the undo history can go
+		m_statetracker->receiveCommand(protocol::ClientInternal::makeTruncatePoint());
+		break;
+	default: break;
+	}
+
+	if(msg->isCommand())
+		m_statetracker->receiveCommand(msg);
+}
+
+void StateSnapshotter::makeSnapshot()
+{
+	m_requestedIndex = -1;
+	if(!m_statetracker)
+		return;
+
+	auto loader = canvas::SnapshotLoader(0, m_statetracker->image(), m_aclfilter);
+	loader.setDefaultLayer(m_defaultLayer);
+	loader.setPinnedMessage(m_pinnedMessage);
+	loader.setTileCompressor(m_compressor.data());
+
+	// The snapshot is handed over in serialized form, so no references to
+	// the messages (which are not thread safe) leave this thread.
+	QByteArray snapshot;
+	{
+		const protocol::MessageList msgs = loader.loadInitCommands();
+
+		int len = 0;
+		for(const protocol::MessagePtr &msg : msgs)
+			len += msg->length();
+
+		snapshot = QByteArray(len, Qt::Uninitialized);
+		char *ptr = snapshot.data();
+		for(const protocol::MessagePtr &msg : msgs)
+			ptr += msg->serialize(ptr);
+	}
+	const int index = m_nextIndex - 1;
+
+	QMutexLocker lock(&m_mutex);
+	if(m_callback)
+		m_callback(index, snapshot);
+}
+
+}
@@ -0,0 +1,97 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_STATESNAPSHOTTER_H
+#define DP_SERVER_STATESNAPSHOTTER_H
+
+#include "../libserver/snapshotter.h"
+
+#include <QObject>
+#include <QMutex>
+#include <QVector>
+#include <QByteArray>
+#include <QScopedPointer>
+
+class QThread;
+
+namespace canvas {
+	class AclFilter;
+	class StateTracker;
+}
+
+namespace paintcore {
+	class TileCompressor;
+}
+
+namespace server {
+
+/**
+ * @brief A snapshotter that draws the session's canvas in a background thread
+ *
+ * This lets a thin server session give new users a snapshot of the canvas,
+ * just like a thick server would. The messages are queued and drawn
+ * in the snapshotter's own thread, so the session is never slowed down.
+ */
+class StateSnapshotter : public QObject, public Snapshotter
+{
+	Q_OBJECT
+public:
+	//! Create a snapshotter that does its work in the given thread
+	explicit StateSnapshotter(QThread *thread);
+	~StateSnapshotter();
+
+	void setCallback(const Callback &callback) override;
+	void reset(int firstIndex) override;
+	void addMessage(const protocol::MessagePtr &msg) override;
+	void requestSnapshot(int index) override;
+	void dispose() override;
+
+private:
+	struct Item {
+		enum { Message, Reset, Snapshot } type;
+		QByteArray msg; // a serialized copy of the message
+		int index;
+	};
+
+	void enqueue(const Item &item);
+	void processQueue();
+
+	void resetCanvas(int firstIndex);
+	void drawMessage(const protocol::MessagePtr &msg);
+	void makeSnapshot();
+
+	// Shared state (protected by the mutex)
+	QMutex m_mutex;
+	QVector<Item> m_queue;
+	Callback m_callback;
+	bool m_processing = false;
+
+	// These are only used in the snapshotter's thread
+	canvas::StateTracker *m_statetracker = nullptr;
+	canvas::AclFilter *m_aclfilter = nullptr;
+	QScopedPointer<paintcore::TileCompressor> m_compressor;
+	int m_nextIndex = 0;        // history index of the next message
+	int m_requestedIndex = -1;  // take a snapshot after drawing this message
+	int m_defaultLayer = 0;
+	QString m_pinnedMessage;
+};
+
+}
+
+#endif
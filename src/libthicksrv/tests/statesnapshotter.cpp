@@ -0,0 +1,66 @@
+#include "../statesnapshotter.h"
+#include "../../libshared/net/opaque.h"
+#include "../../libshared/net/layer.h"
+
+#include <QtTest/QtTest>
+#include <QThread>
+#include <QSemaphore>
+
+using namespace protocol;
+using server::StateSnapshotter;
+
+class TestStateSnapshotter: public QObject
+{
+	Q_OBJECT
+private slots:
+	// Test that messages still referencing their receive buffer are copied
+	void testReceiveBufferFreed()
+	{
+		QThread thread;
+		StateSnapshotter *snapshotter = new StateSnapshotter(&thread);
+
+		QSemaphore ready;
+		int snapshotIndex = -1;
+		QByteArray snapshot;
+		snapshotter->setCallback([&](int index, const QByteArray &data) {
+			snapshotIndex = index;
+			snapshot = data;
+			ready.release();
+		});
+
+		// The snapshotter's thread is not running yet, so nothing is processed
+		snapshotter->reset(0);
+
+		QByteArray buffer = CanvasResize(1, 0, 64, 32, 0).serialized();
+		{
+			MessagePtr msg(new OpaqueMessage(buffer, 0));
+			snapshotter->addMessage(msg);
+			snapshotter->requestSnapshot(0);
+		}
+
+		// The message is gone: scribble over the receive buffer it referenced
+		buffer.fill('\0');
+
+		thread.start();
+		QVERIFY(ready.tryAcquire(1, 5000));
+
+		QCOMPARE(snapshotIndex, 0);
+		QVERIFY(snapshot.length() >= Message::HEADER_LEN);
+
+		// The snapshot is serialized: the first message should be the canvas size
+		const NullableMessageRef first = Message::deserialize(
+			reinterpret_cast<const uchar*>(snapshot.constData()), snapshot.length(), true);
+		QVERIFY(!first.isNull());
+		QCOMPARE(first->type(), MSG_CANVAS_RESIZE);
+		QCOMPARE(first.cast<CanvasResize>().right(), 64);
+		QCOMPARE(first.cast<CanvasResize>().bottom(), 32);
+
+		snapshotter->dispose();
+		thread.quit();
+		thread.wait();
+	}
+};
+
+
+QTEST_MAIN(TestStateSnapshotter)
+#include "statesnapshotter.moc"
@@ -184,6 +184,7 @@ void ThickServer::newClient()
 	} else {
 		client->setParent(this);
 		client->setConnectionTimeout(m_config->getConfigTime(config::ClientTimeout) * 1000);
+		client->applyUploadQueueLimits(m_config);
 
 		m_clients.append(client);
 		connect(client, &ThickServerClient::destroyed, this, &ThickServer::removeClient);
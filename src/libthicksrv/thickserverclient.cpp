@@ -18,8 +18,11 @@
 */
 
 #include "thickserverclient.h"
+#include "../libserver/serverconfig.h"
 #include "../libshared/net/messagequeue.h"
 
+#include <limits>
+
 namespace server {
 
 ThickServerClient::ThickServerClient(QTcpSocket *socket, ServerLog *logger, QObject *parent)
@@ -28,4 +31,18 @@ ThickServerClient::ThickServerClient(QTcpSocket *socket, ServerLog *logger, QObj
 	messageQueue()->setDecodeOpaque(true);
 }
 
+void ThickServerClient::applyUploadQueueLimits(const ServerConfig *config)
+{
+	const int sizeLimit = config->getConfigSize(config::SessionSizeLimit);
+	const int hardLimit = config->getConfigSize(config::UploadQueueHardLimit);
+
+	qint64 limit = 0;
+	if(hardLimit > 0) {
+		const qint64 room = sizeLimit > 0 ? qint64(sizeLimit) : qint64(MAX_JOIN_BURST);
+		limit = qMin<qint64>(hardLimit + room, std::numeric_limits<int>::max());
+	}
+
+	setUploadQueueLimits(config->getConfigSize(config::UploadQueueSoftLimit), int(limit));
+}
+
 }
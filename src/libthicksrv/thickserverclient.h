@@ -24,10 +24,25 @@
 
 namespace server {
 
+class ServerConfig;
+
 class ThickServerClient : public Client
 {
 public:
 	ThickServerClient(QTcpSocket *socket, ServerLog *logger, QObject *parent=nullptr);
+
+	/**
+	 * @brief Set the upload queue limits from the server configuration
+	 *
+	 * The whole session history is queued at once when joining a thick
+	 * session, so the hard limit leaves room for a full sized history.
+	 * If the session size is unlimited, room for MAX_JOIN_BURST bytes is left.
+	 * A hard limit of zero means no limit.
+	 */
+	void applyUploadQueueLimits(const ServerConfig *config);
+
+	//! Room left in the upload queue for joining sessions without a size limit
+	static const int MAX_JOIN_BURST = 1024 * 1024 * 1024;
 };
 
 }
@@ -97,6 +97,9 @@ void ThickSession::addToHistory(protocol::MessagePtr msg)
 
 	addedToHistory(msg);
 
+	// Serialize once for all the recipients
+	msg->cacheSerialized();
+
 	if(state() == State::Initialization) {
 		// Send to everyone except the initializing user
 		for(Client *client : clients()) {
@@ -108,6 +111,8 @@ void ThickSession::addToHistory(protocol::MessagePtr msg)
 		for(Client *client : clients())
 			client->sendDirectMessage(msg);
 	}
+
+	msg->releaseSerialized();
 }
 
 void ThickSession::onSessionReset()
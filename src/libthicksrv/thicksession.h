@@ -59,9 +59,6 @@ private:
 	canvas::StateTracker *m_statetracker;
 	canvas::AclFilter *m_aclfilter;
 
-	protocol::MessageList m_resetImage;
-	uint m_resetImageSize = 0;
-
 	QString m_pinnedMessage;
 	int m_defaultLayer = 0;
 };
@@ -19,9 +19,11 @@
 
 #include "database.h"
 #include "dblog.h"
+#include "threadeddatabase.h"
 #include "../libshared/util/passwordhash.h"
 #include "../libshared/util/validators.h"
 #include "../libserver/serverlog.h"
+#include "../libserver/subnettrie.h"
 
 #include <QSqlDatabase>
 #include <QSqlQuery>
@@ -33,15 +35,29 @@
 #include <QHostAddress>
 #include <QJsonObject>
 #include <QJsonArray>
-#include <QTimer>
+#include <QMutex>
 
 namespace server {
 
+static const QString BAN_DATE_FORMAT = QStringLiteral("yyyy-MM-dd HH:mm:ss");
+
 struct Database::Private {
-	QSqlDatabase db;
+	ThreadedDatabase db;
 	ServerLog *logger;
+
+	// In-memory copy of the ban table. Bans are checked from all session threads.
+	QMutex banMutex;
+	SubnetTrie ipbans;
 };
 
+static QDateTime banExpiration(const QString &expires)
+{
+	// Expiration times are compared against SQLite's datetime('now'), which is UTC
+	QDateTime dt = QDateTime::fromString(expires, BAN_DATE_FORMAT);
+	dt.setTimeSpec(Qt::UTC);
+	return dt;
+}
+
 static bool initDatabase(QSqlDatabase db)
 {
 	QSqlQuery q(db);
@@ -83,14 +99,6 @@ Database::Database(QObject *parent)
 {
 	// Temporary logger until DB log is ready
 	d->logger = new InMemoryLog;
-
-	// Periodic task scheduler
-	QTimer *dailyTimer = new QTimer(this);
-	dailyTimer->setTimerType(Qt::VeryCoarseTimer);
-	dailyTimer->setSingleShot(false);
-	dailyTimer->setInterval(24 * 60 * 60 * 1000);
-	connect(dailyTimer, &QTimer::timeout, this, &Database::dailyTasks);
-	dailyTimer->start();
 }
 
 Database::~Database()
@@ -101,19 +109,23 @@ Database::~Database()
 
 bool Database::openFile(const QString &path)
 {
-	d->db = QSqlDatabase::addDatabase("QSQLITE");
-	d->db.setDatabaseName(path);
-	if(!d->db.open()) {
+	QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE");
+	db.setDatabaseName(path);
+	db.setConnectOptions(QStringLiteral("QSQLITE_BUSY_TIMEOUT=%1").arg(ThreadedDatabase::BUSY_TIMEOUT));
+	if(!db.open()) {
 		qCritical("Unable to open database: %s", qPrintable(path));
 		return false;
 	}
 
-	if(!initDatabase(d->db)) {
+	if(!initDatabase(db)) {
 		qCritical("Database initialization failed: %s", qPrintable(path));
 		return false;
 	}
 
-	DbLog *dblog = new DbLog(d->db);
+	// Sessions running in worker threads get their own connections
+	d->db = ThreadedDatabase(db);
+
+	DbLog *dblog = new DbLog(db);
 	if(!dblog->initDb()) {
 		qWarning("Couldn't initialize database log!");
 		delete dblog;
@@ -122,26 +134,31 @@ bool Database::openFile(const QString &path)
 		d->logger = dblog;
 	}
 
+	loadBanlist();
+
 	qDebug("Opened configuration database: %s", qPrintable(path));
 
-	// Purge old log entries on startup
-	dailyTasks();
+	// Purge old log entries on startup (and periodically after that)
+	updateLogRetention();
 
 	return true;
 }
 
 void Database::setConfigValue(ConfigKey key, const QString &value)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.prepare("INSERT OR REPLACE INTO settings VALUES (?, ?)");
 	q.bindValue(0, key.name);
 	q.bindValue(1, value);
 	q.exec();
+
+	if(key.index == config::LogPurgeDays.index || key.index == config::LogMaxEntries.index)
+		updateLogRetention();
 }
 
 QString Database::getConfigValue(const ConfigKey key, bool &found) const
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.prepare("SELECT value FROM settings WHERE key=?");
 	q.bindValue(0, key.name);
 	q.exec();
@@ -165,7 +182,7 @@ bool Database::isAllowedAnnouncementUrl(const QUrl &url) const
 
 	const QString urlStr = url.toString();
 
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.exec("SELECT url FROM listingservers");
 	while(q.next()) {
 		const QString serverUrl = q.value(0).toString();
@@ -181,27 +198,28 @@ bool Database::isAllowedAnnouncementUrl(const QUrl &url) const
 	return false;
 }
 
-bool Database::isAddressBanned(const QHostAddress &addr) const
+void Database::loadBanlist()
 {
-	QSqlQuery q(d->db);
-	q.exec("SELECT ip, subnet FROM ipbans WHERE expires > datetime('now')");
+	QMutexLocker lock(&d->banMutex);
+	d->ipbans.clear();
 
-	while(q.next()) {
-		const QHostAddress a(q.value(0).toString());
-		int subnet = q.value(1).toInt();
-		if(subnet==0) {
-			switch(a.protocol()) {
-			case QAbstractSocket::IPv4Protocol: subnet=32; break;
-			case QAbstractSocket::IPv6Protocol: subnet=128; break;
-			default: break;
-			}
-		}
+	QSqlQuery q(d->db.connection());
+	q.exec("SELECT rowid, ip, subnet, expires FROM ipbans WHERE expires > datetime('now')");
 
-		if(addr.isInSubnet(a, subnet))
-			return true;
+	while(q.next()) {
+		const QHostAddress ip(q.value(1).toString());
+		if(!d->ipbans.add(q.value(0).toInt(), ip, q.value(2).toInt(), banExpiration(q.value(3).toString())))
+			qWarning("Invalid IP ban entry: %s/%d", qPrintable(q.value(1).toString()), q.value(2).toInt());
 	}
+}
 
-	return false;
+bool Database::isAddressBanned(const QHostAddress &addr) const
+{
+	const QDateTime now = QDateTime::currentDateTimeUtc();
+
+	QMutexLocker lock(&d->banMutex);
+	d->ipbans.removeExpired(now);
+	return d->ipbans.contains(addr, now);
 }
 
 static QJsonObject banResultToJson(const QSqlQuery &q)
@@ -219,7 +237,7 @@ static QJsonObject banResultToJson(const QSqlQuery &q)
 QJsonArray Database::getBanlist() const
 {
 	QJsonArray result;
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.exec("SELECT rowid, ip, subnet, expires, comment, added FROM ipbans");
 
 	while(q.next()) {
@@ -230,7 +248,7 @@ QJsonArray Database::getBanlist() const
 
 QJsonObject Database::addBan(const QHostAddress &ip, int subnet, const QDateTime &expiration, const QString &comment)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.prepare("SELECT rowid, ip, subnet, expires, comment, added FROM ipbans WHERE ip=? AND subnet=?");
 	q.bindValue(0, ip.toString());
 	q.bindValue(1, subnet);
@@ -239,9 +257,8 @@ QJsonObject Database::addBan(const QHostAddress &ip, int subnet, const QDateTime
 		// Matching entry already in database
 		return banResultToJson(q);
 	} else {
-		const QString datefmt = "yyyy-MM-dd HH:mm:ss";
-		QString datestr = expiration.toString(datefmt);
-		QString now = QDateTime::currentDateTime().toString(datefmt);
+		QString datestr = expiration.toString(BAN_DATE_FORMAT);
+		QString now = QDateTime::currentDateTime().toString(BAN_DATE_FORMAT);
 
 		q.prepare("INSERT INTO ipbans (ip, subnet, expires, comment, added) VALUES (?, ?, ?, ?, ?)");
 		q.bindValue(0, ip.toString());
@@ -251,8 +268,14 @@ QJsonObject Database::addBan(const QHostAddress &ip, int subnet, const QDateTime
 		q.bindValue(4, now);
 		q.exec();
 
+		const int id = q.lastInsertId().toInt();
+		{
+			QMutexLocker lock(&d->banMutex);
+			d->ipbans.add(id, ip, subnet, banExpiration(datestr));
+		}
+
 		QJsonObject b;
-		b["id"] = q.lastInsertId().toInt();
+		b["id"] = id;
 		b["ip"] = ip.toString();
 		b["subnet"] = subnet;
 		b["expires"] = datestr;
@@ -264,10 +287,16 @@ QJsonObject Database::addBan(const QHostAddress &ip, int subnet, const QDateTime
 
 bool Database::deleteBan(int entryId)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.prepare("DELETE FROM ipbans WHERE rowid=?");
 	q.bindValue(0, entryId);
 	q.exec();
+
+	{
+		QMutexLocker lock(&d->banMutex);
+		d->ipbans.remove(entryId);
+	}
+
 	return q.numRowsAffected()>0;
 }
 
@@ -278,7 +307,7 @@ ServerLog *Database::logger() const
 
 RegisteredUser Database::getUserAccount(const QString &username, const QString &password) const
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.prepare("SELECT rowid, password, locked, flags FROM users WHERE username=?");
 	q.bindValue(0, username);
 	q.exec();
@@ -335,7 +364,7 @@ static QJsonObject userQueryToJson(const QSqlQuery &q)
 QJsonArray Database::getAccountList() const
 {
 	QJsonArray list;
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.exec("SELECT rowid, username, locked, flags FROM users");
 	while(q.next()) {
 		list << userQueryToJson(q);
@@ -348,7 +377,7 @@ QJsonObject Database::addAccount(const QString &username, const QString &passwor
 	if(!validateUsername(username))
 		return QJsonObject();
 
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.prepare("INSERT INTO users (username, password, locked, flags) VALUES (?, ?, ?, ?)");
 	q.bindValue(0, username);
 	q.bindValue(1, passwordhash::hash(password));
@@ -388,7 +417,7 @@ QJsonObject Database::updateAccount(int id, const QJsonObject &update)
 		params << update["flags"].toString();
 	}
 
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 
 	if(!updates.isEmpty()) {
 		QString sql = QString("UPDATE users SET %1 WHERE rowid=?").arg(updates.join(','));
@@ -411,22 +440,19 @@ QJsonObject Database::updateAccount(int id, const QJsonObject &update)
 
 bool Database::deleteAccount(int userId)
 {
-	QSqlQuery q(d->db);
+	QSqlQuery q(d->db.connection());
 	q.prepare("DELETE FROM users WHERE rowid=?");
 	q.bindValue(0, userId);
 	q.exec();
 	return q.numRowsAffected()>0;
 }
 
-void Database::dailyTasks()
+void Database::updateLogRetention()
 {
-	// Purge old Database log entries
+	// The DB log purges old entries in the background
 	DbLog *dblog = dynamic_cast<DbLog*>(d->logger);
-	if(dblog) {
-		const int purged = dblog->purgeLogs(getConfigInt(config::LogPurgeDays));
-		if(purged > 0)
-			qInfo("Purged %d old log entries", purged);
-	}
+	if(dblog)
+		dblog->setRetention(getConfigInt(config::LogPurgeDays), getConfigInt(config::LogMaxEntries));
 }
 
 }
@@ -54,14 +54,14 @@ public:
 	QJsonObject updateAccount(int id, const QJsonObject &update);
 	bool deleteAccount(int id);
 
-private slots:
-	void dailyTasks();
-
 protected:
 	QString getConfigValue(const ConfigKey key, bool &found) const override;
 	void setConfigValue(ConfigKey key, const QString &value) override;
 
 private:
+	void updateLogRetention();
+	void loadBanlist();
+
 	struct Private;
 	Private *d;
 };
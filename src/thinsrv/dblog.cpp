@@ -22,34 +22,114 @@
 #include <QSqlQuery>
 #include <QMetaEnum>
 #include <QSqlError>
+#include <QThread>
+#include <QElapsedTimer>
 
 namespace server {
 
+// How often the writer thread commits queued entries (milliseconds)
+static const int BATCH_INTERVAL = 250;
+
+// How often the retention policy is enforced (milliseconds)
+static const int RETENTION_INTERVAL = 60 * 60 * 1000;
+
+// How long a query waits for the queued entries to be written (milliseconds)
+static const int QUERY_FLUSH_TIMEOUT = 1000;
+
+class DbLog::Writer : public QThread
+{
+public:
+	explicit Writer(DbLog *log) : m_log(log) { setObjectName("log writer"); }
+
+protected:
+	void run() override { m_log->writerLoop(); }
+
+private:
+	DbLog *m_log;
+};
+
 DbLog::DbLog(const QSqlDatabase &db)
-	: m_db(db)
+	: m_db(db), m_queue(nullptr), m_writer(nullptr),
+	  m_flushRequested(0), m_flushed(0), m_stop(false), m_retentionChanged(false),
+	  m_retentionDays(0), m_retentionEntries(0)
 {
 }
 
+DbLog::~DbLog()
+{
+	if(m_writer) {
+		{
+			QMutexLocker lock(&m_mutex);
+			m_stop = true;
+			m_wakeWriter.wakeOne();
+		}
+		m_writer->wait();
+		delete m_writer;
+		m_writer = nullptr;
+
+		// Something may have been logged after the writer's last batch
+		const QList<Log> entries = takeQueued();
+		if(!entries.isEmpty())
+			writeEntries(entries);
+	}
+}
+
 bool DbLog::initDb()
 {
-	QSqlQuery q(m_db);
-	return q.exec(
+	QSqlDatabase db = m_db.connection();
+	QSqlQuery q(db);
+	if(!q.exec(
 		"CREATE TABLE IF NOT EXISTS serverlog ("
 			"timestamp, level, topic, user, session, message"
 		");"
-	);
+	))
+		return false;
+
+	// Log queries are ordered by rowid. An index on the session column alone
+	// keeps the entries of each session in rowid order, so a session's log can
+	// be paged through without sorting. The timestamp index is for purging.
+	// Level filters are cheap to check while scanning, so they get no index.
+	if(
+		!q.exec("DROP INDEX IF EXISTS serverlog_level;") ||
+		!q.exec("DROP INDEX IF EXISTS serverlog_session;") ||
+		!q.exec("CREATE INDEX IF NOT EXISTS serverlog_session_id ON serverlog (session);") ||
+		!q.exec("CREATE INDEX IF NOT EXISTS serverlog_timestamp ON serverlog (timestamp);")
+	)
+		return false;
+
+	// An in-memory database exists only in this connection,
+	// so the writer thread couldn't see it.
+	const QString dbName = db.databaseName();
+	if(dbName.isEmpty() || dbName == ":memory:" || dbName.contains("mode=memory"))
+		return true;
+
+	// With write-ahead logging, the writer thread does not block readers
+	if(!q.exec("PRAGMA journal_mode=WAL;"))
+		qWarning("Couldn't enable write-ahead logging: %s", qPrintable(q.lastError().text()));
+
+	m_writer = new Writer(this);
+	m_writer->start();
+
+	return true;
 }
 
-QList<Log> DbLog::getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const
+QList<Log> DbLog::getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, qint64 before, int offset, int limit) const
 {
-	QString sql = "SELECT timestamp, session, user, level, topic, message FROM serverlog WHERE 1=1";
+	// Normally, this returns as soon as the current batch is committed.
+	// If the writer is stuck, whatever has been committed so far is returned.
+	if(!flush(QUERY_FLUSH_TIMEOUT))
+		qWarning("Log writer is lagging: latest entries may be missing from the query results");
+
+	QString sql = "SELECT rowid, timestamp, session, user, level, topic, message FROM serverlog WHERE 1=1";
 	QVariantList params;
 	if(!session.isNull()) {
 		sql += " AND session=?";
 		params << session.toString();
 	}
+	// The unary plus keeps the timestamp index from being used here:
+	// scanning in rowid order is what lets the LIMIT stop the query early.
 	if(after.isValid()) {
-		sql += " AND timestamp>=?";
+		sql += " AND +timestamp>=?";
 		params << after.addMSecs(1000).toString(Qt::ISODate);
 	}
 
@@ -58,18 +138,26 @@ QList<Log> DbLog::getLogEntries(const QUuid &session, const QDateTime &after, Lo
 		params << int(atleast);
 	}
 
-	sql += " ORDER BY timestamp DESC, rowid DESC";
+	if(before > 0) {
+		sql += " AND rowid<?";
+		params << before;
+	}
+
+	// Entries are written in the order they were logged
+	sql += " ORDER BY rowid DESC";
 
 	if(limit>0) {
 		sql += " LIMIT ?";
 		params << limit;
 	}
 	if(offset>0) {
+		if(limit<=0)
+			sql += " LIMIT -1";
 		sql += " OFFSET ?";
 		params << offset;
 	}
 
-	QSqlQuery q(m_db);
+	QSqlQuery q(m_db.connection());
 	q.prepare(sql);
 	for(int i=0;i<params.size();++i)
 		q.bindValue(i, params.at(i));
@@ -82,28 +170,153 @@ QList<Log> DbLog::getLogEntries(const QUuid &session, const QDateTime &after, Lo
 	QList<Log> results;
 	while(q.next()) {
 		results << Log(
-			q.value(0).toDateTime(),
-			QUuid(q.value(1).toString()),
-			q.value(2).toString(),
-			Log::Level(q.value(3).toInt()),
-			Log::Topic(QMetaEnum::fromType<Log::Topic>().keyToValue(q.value(4).toString().toLocal8Bit().constData())),
-			q.value(5).toString()
-		);
+			q.value(1).toDateTime(),
+			QUuid(q.value(2).toString()),
+			q.value(3).toString(),
+			Log::Level(q.value(4).toInt()),
+			Log::Topic(QMetaEnum::fromType<Log::Topic>().keyToValue(q.value(5).toString().toLocal8Bit().constData())),
+			q.value(6).toString()
+		).id(q.value(0).toLongLong());
 	}
 	return results;
 }
 
 void DbLog::storeMessage(const Log &entry)
 {
-	QSqlQuery q(m_db);
+	if(!m_writer) {
+		writeEntries(QList<Log>() << entry);
+		return;
+	}
+
+	Node *node = new Node { entry, nullptr };
+	Node *head;
+	do {
+		head = m_queue.loadAcquire();
+		node->next = head;
+	} while(!m_queue.testAndSetRelease(head, node));
+}
+
+QList<Log> DbLog::takeQueued()
+{
+	// The queue is a stack, so the entries are taken out in reverse order
+	QList<Log> entries;
+	Node *n = m_queue.fetchAndStoreAcquire(nullptr);
+	while(n) {
+		entries.prepend(n->entry);
+		Node *next = n->next;
+		delete n;
+		n = next;
+	}
+	return entries;
+}
+
+void DbLog::writeEntries(const QList<Log> &entries)
+{
+	QSqlDatabase db = m_db.connection();
+	db.transaction();
+
+	QSqlQuery q(db);
 	q.prepare("INSERT INTO serverlog (timestamp, level, topic, user, session, message) VALUES (?, ?, ?, ?, ?, ?)");
-	q.bindValue(0, entry.timestamp().toString(Qt::ISODate));
-	q.bindValue(1, int(entry.level()));
-	q.bindValue(2, QMetaEnum::fromType<Log::Topic>().valueToKey(int(entry.topic())));
-	q.bindValue(3, entry.user());
-	q.bindValue(4, entry.session().toString());
-	q.bindValue(5, entry.message());
-	q.exec();
+	for(const Log &entry : entries) {
+		q.bindValue(0, entry.timestamp().toString(Qt::ISODate));
+		q.bindValue(1, int(entry.level()));
+		q.bindValue(2, QMetaEnum::fromType<Log::Topic>().valueToKey(int(entry.topic())));
+		q.bindValue(3, entry.user());
+		q.bindValue(4, entry.session().toString());
+		q.bindValue(5, entry.message());
+		if(!q.exec())
+			qWarning("Couldn't write log entry: %s", qPrintable(q.lastError().text()));
+	}
+
+	if(!db.commit())
+		qWarning("Couldn't commit log entries: %s", qPrintable(db.lastError().text()));
+}
+
+void DbLog::writerLoop()
+{
+	{
+		// Safe with write-ahead logging: a crash can only lose the latest batches
+		QSqlQuery q(m_db.connection());
+		q.exec("PRAGMA synchronous=NORMAL;");
+	}
+
+	QElapsedTimer sinceRetention;
+	sinceRetention.start();
+	bool retention = true;
+
+	QMutexLocker lock(&m_mutex);
+	forever {
+		if(!m_stop && !m_retentionChanged && m_flushRequested == m_flushed)
+			m_wakeWriter.wait(&m_mutex, BATCH_INTERVAL);
+
+		const quint64 flushRequest = m_flushRequested;
+		const bool stop = m_stop;
+		retention |= m_retentionChanged || sinceRetention.hasExpired(RETENTION_INTERVAL);
+		m_retentionChanged = false;
+		lock.unlock();
+
+		const QList<Log> entries = takeQueued();
+		if(!entries.isEmpty())
+			writeEntries(entries);
+
+		if(retention) {
+			enforceRetention();
+			sinceRetention.restart();
+			retention = false;
+		}
+
+		lock.relock();
+		m_flushed = flushRequest;
+		m_batchWritten.wakeAll();
+
+		if(stop)
+			break;
+	}
+}
+
+bool DbLog::flush(int timeout) const
+{
+	if(!m_writer || QThread::currentThread() == m_writer)
+		return true;
+
+	QElapsedTimer elapsed;
+	elapsed.start();
+
+	QMutexLocker lock(&m_mutex);
+	const quint64 request = ++m_flushRequested;
+	m_wakeWriter.wakeOne();
+	while(m_flushed < request) {
+		if(timeout < 0) {
+			m_batchWritten.wait(&m_mutex);
+		} else {
+			const qint64 remaining = timeout - elapsed.elapsed();
+			if(remaining <= 0 || !m_batchWritten.wait(&m_mutex, remaining))
+				return m_flushed >= request;
+		}
+	}
+	return true;
+}
+
+void DbLog::setRetention(int days, int maxEntries)
+{
+	m_retentionDays.store(days);
+	m_retentionEntries.store(maxEntries);
+
+	if(m_writer) {
+		QMutexLocker lock(&m_mutex);
+		m_retentionChanged = true;
+		m_wakeWriter.wakeOne();
+	} else {
+		enforceRetention();
+	}
+}
+
+void DbLog::enforceRetention()
+{
+	int purged = purgeLogs(m_retentionDays.load());
+	purged += purgeExcessLogs(m_retentionEntries.load());
+	if(purged > 0)
+		qInfo("Purged %d old log entries", purged);
 }
 
 int DbLog::purgeLogs(int olderThanDays)
@@ -111,7 +324,9 @@ int DbLog::purgeLogs(int olderThanDays)
 	if(olderThanDays<=0)
 		return 0;
 
-	QSqlQuery q(m_db);
+	// Queued entries are newer than anything being purged, so there's no need to wait for them
+
+	QSqlQuery q(m_db.connection());
 	q.prepare("DELETE FROM serverlog WHERE timestamp < DATE('now', ?)");
 	q.bindValue(0, QStringLiteral("-%1 days").arg(olderThanDays));
 	if(!q.exec())
@@ -119,4 +334,20 @@ int DbLog::purgeLogs(int olderThanDays)
 	return q.numRowsAffected();
 }
 
+int DbLog::purgeExcessLogs(int maxEntries)
+{
+	if(maxEntries<=0)
+		return 0;
+
+	// Only committed entries are counted. The queued ones are at most
+	// a batch interval's worth, so it doesn't matter if they are left out.
+
+	QSqlQuery q(m_db.connection());
+	q.prepare("DELETE FROM serverlog WHERE rowid <= (SELECT rowid FROM serverlog ORDER BY rowid DESC LIMIT 1 OFFSET ?)");
+	q.bindValue(0, maxEntries);
+	if(!q.exec())
+		qWarning("Couldn't purge log entries: %s", qPrintable(q.lastError().databaseText()));
+	return q.numRowsAffected();
+}
+
 }
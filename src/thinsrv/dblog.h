@@ -21,19 +21,36 @@
 #define DBLOG_H
 
 #include "../libserver/serverlog.h"
+#include "threadeddatabase.h"
 
-#include <QSqlDatabase>
+#include <QAtomicPointer>
+#include <QAtomicInt>
+#include <QWaitCondition>
 
 namespace server {
 
+/**
+ * @brief A server log that stores the entries in the configuration database
+ *
+ * Logging a message never waits for the database: new entries are pushed
+ * to a lock-free queue and written by a background thread in batched
+ * transactions. Queries wait a limited time for the queued entries to be
+ * written first, so they normally see the latest entries. Purging doesn't
+ * wait at all.
+ *
+ * In-memory databases can't be shared between threads, so entries are
+ * written immediately when the database is in memory.
+ */
 class DbLog : public ServerLog
 {
 public:
 	explicit DbLog(const QSqlDatabase &db);
+	~DbLog();
 
+	//! Create the log table and start the writer thread
 	bool initDb();
 
-	QList<Log> getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const override;
+	QList<Log> getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, qint64 before, int offset, int limit) const override;
 
 	/**
 	 * @brief Delete all log entries older than the given number of days
@@ -42,11 +59,65 @@ public:
 	 */
 	int purgeLogs(int olderThanDays);
 
+	/**
+	 * @brief Delete the oldest log entries so that at most the given number of entries remain
+	 * @param maxEntries
+	 * @return number of entries deleted
+	 */
+	int purgeExcessLogs(int maxEntries);
+
+	/**
+	 * @brief Set the log retention policy
+	 *
+	 * The policy is enforced right away and then periodically in the background.
+	 *
+	 * @param days delete entries older than this many days (0 to keep all)
+	 * @param maxEntries keep at most this many entries (0 for no limit)
+	 */
+	void setRetention(int days, int maxEntries);
+
+	/**
+	 * @brief Wait until all queued entries have been written
+	 *
+	 * @param timeout maximum time to wait in milliseconds (negative to wait forever)
+	 * @return false if the timeout expired before the entries were written
+	 */
+	bool flush(int timeout=-1) const;
+
 protected:
 	void storeMessage(const Log &entry) override;
 
 private:
-	QSqlDatabase m_db;
+	class Writer;
+	friend class Writer;
+
+	struct Node {
+		Log entry;
+		Node *next;
+	};
+
+	void writerLoop();
+	QList<Log> takeQueued();
+	void writeEntries(const QList<Log> &entries);
+	void enforceRetention();
+
+	ThreadedDatabase m_db;
+
+	// Pending entries, newest first
+	QAtomicPointer<Node> m_queue;
+
+	// Writer thread state
+	Writer *m_writer;
+	mutable QMutex m_mutex;
+	mutable QWaitCondition m_wakeWriter;
+	mutable QWaitCondition m_batchWritten;
+	mutable quint64 m_flushRequested;
+	quint64 m_flushed;
+	bool m_stop;
+	bool m_retentionChanged;
+
+	QAtomicInt m_retentionDays;
+	QAtomicInt m_retentionEntries;
 };
 
 }
@@ -82,6 +82,7 @@ void RemoteServer::makeApiRequest(const QString &requestId, JsonApiMethod method
 			switch(reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()) {
 			case 400: status = JsonApiResult::BadRequest; break;
 			case 404: status = JsonApiResult::NotFound; break;
+			case 503: status = JsonApiResult::ServiceUnavailable; break;
 			case 500: status = JsonApiResult::InternalError; break;
 			default: status = JsonApiResult::ConnectionError; break;
 			}
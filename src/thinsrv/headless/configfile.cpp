@@ -119,7 +119,8 @@ void ConfigFile::reloadFile() const
 				continue;
 			}
 
-			m_banlist << QPair<QHostAddress,int> { ipaddr, subnet.toInt() };
+			if(!m_banlist.add(m_banlist.size()+1, ipaddr, subnet.toInt()))
+				qWarning("Invalid subnet: %s", qPrintable(line));
 
 		} else if(section == AWL) {
 			QUrl url(line);
@@ -150,6 +151,7 @@ void ConfigFile::reloadFile() const
 
 QString ConfigFile::getConfigValue(const ConfigKey key, bool &found) const
 {
+	QMutexLocker lock(&m_mutex);
 	if(isModified())
 		reloadFile();
 
@@ -164,26 +166,11 @@ QString ConfigFile::getConfigValue(const ConfigKey key, bool &found) const
 
 bool ConfigFile::isAddressBanned(const QHostAddress &addr) const
 {
+	QMutexLocker lock(&m_mutex);
 	if(isModified())
 		reloadFile();
 
-	for(const QPair<QHostAddress,int> ipban : m_banlist) {
-		QHostAddress subnet = ipban.first;
-		int mask = ipban.second;
-
-		if(mask==0) {
-			switch(subnet.protocol()) {
-			case QAbstractSocket::IPv4Protocol: mask=32; break;
-			case QAbstractSocket::IPv6Protocol: mask=128; break;
-			default: break;
-			}
-		}
-
-		if(addr.isInSubnet(subnet, mask))
-			return true;
-	}
-
-	return false;
+	return m_banlist.contains(addr);
 }
 
 bool ConfigFile::isAllowedAnnouncementUrl(const QUrl &url) const
@@ -191,13 +178,17 @@ bool ConfigFile::isAllowedAnnouncementUrl(const QUrl &url) const
 	if(!getConfigBool(config::AnnounceWhiteList))
 		return true;
 
+	QMutexLocker lock(&m_mutex);
 	return m_announcewhitelist.contains(url);
 }
 
 RegisteredUser ConfigFile::getUserAccount(const QString &username, const QString &password) const
 {
+	QMutexLocker lock(&m_mutex);
 	if(m_users.contains(username)) {
-		const User &u = m_users[username];
+		const User u = m_users[username];
+		lock.unlock();
+
 		if(u.password.startsWith("*")) {
 			return RegisteredUser {
 				RegisteredUser::Banned,
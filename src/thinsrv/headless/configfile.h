@@ -21,10 +21,12 @@
 #define CONFIGFILE_H
 
 #include "../../libserver/serverconfig.h"
+#include "../../libserver/subnettrie.h"
 
 #include <QDateTime>
 #include <QHostAddress>
 #include <QUrl>
+#include <QMutex>
 
 namespace server {
 
@@ -73,6 +75,7 @@ private:
 
 	QString m_path;
 	ServerLog *m_logger;
+	mutable QMutex m_mutex; // configuration may be read from multiple threads
 
 	struct User {
 		QByteArray password;
@@ -82,7 +85,7 @@ private:
 	// Cached settings:
 	mutable QHash<QString, QString> m_config;
 	mutable QHash<QString, User> m_users;
-	mutable QList<QPair<QHostAddress, int>> m_banlist;
+	mutable SubnetTrie m_banlist;
 	mutable QList<QUrl> m_announcewhitelist;
 	mutable QDateTime m_lastmod;
 };
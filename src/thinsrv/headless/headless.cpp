@@ -29,11 +29,16 @@
 #include "webadmin/webadmin.h"
 #endif
 
+#ifdef HAVE_SNAPSHOTS
+#include "../libthicksrv/statesnapshotter.h"
+#endif
+
 #include <QCoreApplication>
 #include <QStringList>
 #include <QSslSocket>
 #include <QCommandLineParser>
 #include <QDir>
+#include <QThread>
 
 #ifdef Q_OS_UNIX
 #include "unixsignals.h"
@@ -131,6 +136,24 @@ bool start() {
 	QCommandLineOption sessionsOption(QStringList() << "sessions" << "s", "File backed sessions", "path");
 	parser.addOption(sessionsOption);
 
+	// --threads <count>
+	QCommandLineOption threadsOption("threads", "Number of session worker threads (0 to run all sessions in the main thread)", "count", QString::number(QThread::idealThreadCount()));
+	parser.addOption(threadsOption);
+
+	// --auth-threads <count>
+	QCommandLineOption authThreadsOption("auth-threads", "Number of password checking threads (0 to check passwords in the main thread)", "count", "1");
+	parser.addOption(authThreadsOption);
+
+	// --stall-threshold <milliseconds>
+	QCommandLineOption stallThresholdOption("stall-threshold", "Log a warning when a thread's event loop stalls for longer than this (0 to disable)", "milliseconds", "1000");
+	parser.addOption(stallThresholdOption);
+
+#ifdef HAVE_SNAPSHOTS
+	// --snapshot-threads <count>
+	QCommandLineOption snapshotThreadsOption("snapshot-threads", "Number of canvas snapshot threads (0 to disable snapshots)", "count", "1");
+	parser.addOption(snapshotThreadsOption);
+#endif
+
 	// --templates, -t <path>
 	QCommandLineOption templatesOption(QStringList() << "templates" << "t", "Session templates", "path");
 	parser.addOption(templatesOption);
@@ -239,6 +262,49 @@ bool start() {
 		}
 	}
 
+	{
+		// Note: worker threads must be set up before any sessions are loaded
+		bool ok;
+		const int threads = parser.value(threadsOption).toInt(&ok);
+		if(!ok || threads<0) {
+			qCritical("Invalid thread count %s", qPrintable(parser.value(threadsOption)));
+			return false;
+		}
+		server->setWorkerThreads(threads);
+	}
+
+	{
+		bool ok;
+		const int threads = parser.value(authThreadsOption).toInt(&ok);
+		if(!ok || threads<0) {
+			qCritical("Invalid auth thread count %s", qPrintable(parser.value(authThreadsOption)));
+			return false;
+		}
+		server->setAuthThreads(threads);
+	}
+
+	{
+		bool ok;
+		const int threshold = parser.value(stallThresholdOption).toInt(&ok);
+		if(!ok || threshold<0) {
+			qCritical("Invalid stall threshold %s", qPrintable(parser.value(stallThresholdOption)));
+			return false;
+		}
+		server->setStallThreshold(threshold);
+	}
+
+#ifdef HAVE_SNAPSHOTS
+	{
+		bool ok;
+		const int threads = parser.value(snapshotThreadsOption).toInt(&ok);
+		if(!ok || threads<0) {
+			qCritical("Invalid snapshot thread count %s", qPrintable(parser.value(snapshotThreadsOption)));
+			return false;
+		}
+		server->setSnapshotterFactory([](QThread *thread) { return new StateSnapshotter(thread); }, threads);
+	}
+#endif
+
 	{
 		QString sessionDirPath = parser.value(sessionsOption);
 		if(!sessionDirPath.isEmpty()) {
@@ -28,6 +28,9 @@
 #include "gui/gui.h"
 #include <QApplication>
 
+#elif defined(HAVE_SNAPSHOTS)
+#include <QGuiApplication>
+
 #else
 #include <QCoreApplication>
 #endif
@@ -74,7 +77,16 @@ int main(int argc, char *argv[]) {
 		app = new QApplication(argc, argv);
 	else
 #endif
+#ifdef HAVE_SNAPSHOTS
+	{
+		// The painting engine needs a GUI application, but not a display
+		if(!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+			qputenv("QT_QPA_PLATFORM", "offscreen");
+		app = new QGuiApplication(argc, argv);
+	}
+#else
 		app = new QCoreApplication(argc, argv);
+#endif
 
 
 	// Set common settings
@@ -28,6 +28,7 @@
 #include "../libserver/serverconfig.h"
 #include "../libserver/serverlog.h"
 #include "../libserver/sslserver.h"
+#include "../libserver/metrics.h"
 
 #include <QTcpSocket>
 #include <QFileInfo>
@@ -93,6 +94,26 @@ void MultiServer::setSessionDirectory(const QDir &path)
 	m_sessions->setSessionDir(path);
 }
 
+void MultiServer::setWorkerThreads(int count)
+{
+	m_sessions->setWorkerThreads(count);
+}
+
+void MultiServer::setAuthThreads(int count)
+{
+	m_sessions->setAuthThreads(count);
+}
+
+void MultiServer::setStallThreshold(int threshold)
+{
+	m_sessions->setStallThreshold(threshold);
+}
+
+void MultiServer::setSnapshotterFactory(const std::function<Snapshotter*(QThread*)> &factory, int threads)
+{
+	m_sessions->setSnapshotterFactory(factory, threads);
+}
+
 void MultiServer::setTemplateDirectory(const QDir &dir)
 {
 	const TemplateLoader *old = m_sessions->templateLoader();
@@ -347,6 +368,43 @@ void MultiServer::callJsonApiAsync(const QString &requestId, JsonApiMethod metho
 	emit jsonApiResult(requestId, result);
 }
 
+QByteArray MultiServer::prometheusMetrics()
+{
+	const metrics::ServerMetrics &m = metrics::global();
+	metrics::Writer writer;
+
+	writer.family("drawpile_start_time_seconds", "gauge", "Server start time in seconds since the epoch");
+	writer.sample("drawpile_start_time_seconds", m_started.toMSecsSinceEpoch() / 1000);
+
+	const qint64 rss = metrics::residentMemory();
+	if(rss >= 0) {
+		writer.family("drawpile_resident_memory_bytes", "gauge", "Resident memory size");
+		writer.sample("drawpile_resident_memory_bytes", rss);
+	}
+
+	writer.family("drawpile_messages_received_total", "counter", "Messages received by type");
+	writer.traffic("drawpile_messages_received_total", m.received, false);
+	writer.family("drawpile_received_bytes_total", "counter", "Bytes received by message type");
+	writer.traffic("drawpile_received_bytes_total", m.received, true);
+	writer.family("drawpile_messages_sent_total", "counter", "Messages sent by type");
+	writer.traffic("drawpile_messages_sent_total", m.sent, false);
+	writer.family("drawpile_sent_bytes_total", "counter", "Bytes sent by message type");
+	writer.traffic("drawpile_sent_bytes_total", m.sent, true);
+
+	writer.family("drawpile_logins_total", "counter", "Completed logins");
+	writer.sample("drawpile_logins_total", m.logins.load());
+	writer.family("drawpile_login_errors_total", "counter", "Logins that ended in an error");
+	writer.sample("drawpile_login_errors_total", m.loginErrors.load());
+	writer.family("drawpile_auth_failures_total", "counter", "Rejected passwords and auth tokens");
+	writer.sample("drawpile_auth_failures_total", m.authFailures.load());
+	writer.family("drawpile_login_duration_seconds", "histogram", "Time from connection to joining a session");
+	writer.histogram("drawpile_login_duration_seconds", m.loginTime);
+
+	m_sessions->writeMetrics(writer);
+
+	return writer.data();
+}
+
 /**
  * @brief Serverwide settings
  *
@@ -386,7 +444,20 @@ JsonApiResult MultiServer::serverJsonApi(JsonApiMethod method, const QStringList
 		config::ExtAuthAvatars,
 #endif
 		config::LogPurgeDays,
-		config::AllowCustomAvatars
+		config::AllowCustomAvatars,
+		config::FlushDelay,
+		config::AllowCompression,
+		config::UploadQueueSoftLimit,
+		config::UploadQueueHardLimit,
+		config::PointerCoalescingWindow,
+		config::HistoryDurability,
+		config::GroupCommitDelay,
+		config::GroupCommitSize,
+		config::HistoryCacheSize,
+		config::HibernationTime,
+		config::SnapshotInterval,
+		config::ServerAutoreset,
+		config::LogMaxEntries
 	};
 	const int settingCount = sizeof(settings) / sizeof(settings[0]);
 
@@ -430,6 +501,16 @@ JsonApiResult MultiServer::statusJsonApi(JsonApiMethod method, const QStringList
 	result["maxSessions"] = m_config->getConfigInt(config::SessionCountLimit);
 	result["users"] = m_sessions->totalUsers();
 
+	const HistoryCache::Stats cache = m_sessions->historyCacheStats();
+	result["historyCache"] = QJsonObject {
+		{"budget", double(cache.budget)},
+		{"size", double(cache.size)},
+		{"blocks", cache.blocks},
+		{"hits", double(cache.hits)},
+		{"misses", double(cache.misses)},
+		{"evictions", double(cache.evictions)}
+	};
+
 	return JsonApiResult { JsonApiResult::Ok, QJsonDocument(result) };
 }
 
@@ -553,6 +634,15 @@ JsonApiResult MultiServer::logJsonApi(JsonApiMethod method, const QStringList &p
 	auto q = m_config->logger()->query();
 	q.page(request.value("page").toInt(), 100);
 
+	if(request.contains("before")) {
+		// Keyset paging: more efficient than page numbers and stable while new entries are added
+		bool ok;
+		const qint64 before = request.value("before").toString().toLongLong(&ok);
+		if(!ok || before<=0)
+			return JsonApiErrorResult(JsonApiResult::BadRequest, "Invalid entry ID");
+		q.before(before);
+	}
+
 	if(request.contains("session")) {
 		QUuid s = request.value("session").toString();
 		if(s.isNull())
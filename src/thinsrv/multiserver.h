@@ -21,6 +21,7 @@
 #define DP_MULTISERVER_H
 
 #include "../libserver/jsonapi.h"
+#include "../libserver/snapshotter.h"
 
 #include <QObject>
 #include <QHostAddress>
@@ -28,6 +29,7 @@
 
 class QTcpServer;
 class QDir;
+class QThread;
 
 namespace server {
 
@@ -49,6 +51,10 @@ public:
 	void setRecordingPath(const QString &path);
 	void setSessionDirectory(const QDir &dir);
 	void setTemplateDirectory(const QDir &dir);
+	void setWorkerThreads(int count);
+	void setAuthThreads(int count);
+	void setStallThreshold(int threshold);
+	void setSnapshotterFactory(const std::function<Snapshotter*(QThread*)> &factory, int threads);
 
 #ifndef NDEBUG
 	void setRandomLag(uint lag);
@@ -93,6 +99,13 @@ public slots:
 	 */
 	void callJsonApiAsync(const QString &requestId, JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 
+	/**
+	 * @brief Get the server's metrics in the Prometheus text format
+	 *
+	 * This is used by the HTTP admin API.
+	 */
+	QByteArray prometheusMetrics();
+
 private slots:
 	void newClient();
 	void printStatusUpdate();
@@ -2,6 +2,7 @@
 #include "../dblog.h"
 
 #include <QtTest/QtTest>
+#include <QTemporaryDir>
 
 using server::Database;
 using server::DbLog;
@@ -45,10 +46,84 @@ private slots:
 		QCOMPARE(logEntryCount(), 1);
 	}
 
+	void testExcessLogPurging()
+	{
+		for(int i=0;i<5;++i)
+			logger->logMessage(Log().about(Log::Level::Info, Log::Topic::Status).message(QString::number(i)));
+
+		QCOMPARE(logger->purgeExcessLogs(5), 0);
+		QCOMPARE(logger->purgeExcessLogs(2), 3);
+
+		const auto entries = logger->getLogEntries(QUuid(), QDateTime(), Log::Level::Debug, 0, 0, 0);
+		QCOMPARE(entries.size(), 2);
+		QCOMPARE(entries.at(0).message(), QString("4"));
+		QCOMPARE(entries.at(1).message(), QString("3"));
+	}
+
+	void testKeysetPaging()
+	{
+		for(int i=0;i<5;++i)
+			logger->logMessage(Log().about(Log::Level::Info, Log::Topic::Status).message(QString::number(i)));
+
+		// Newest entries first
+		auto page = logger->query().page(0, 2).get();
+		QCOMPARE(page.size(), 2);
+		QCOMPARE(page.at(0).message(), QString("4"));
+		QCOMPARE(page.at(1).message(), QString("3"));
+
+		// A new entry doesn't shift the next page
+		logger->logMessage(Log().about(Log::Level::Info, Log::Topic::Status).message("new"));
+
+		page = logger->query().page(0, 2).before(page.last().id()).get();
+		QCOMPARE(page.size(), 2);
+		QCOMPARE(page.at(0).message(), QString("2"));
+		QCOMPARE(page.at(1).message(), QString("1"));
+
+		page = logger->query().page(0, 2).before(page.last().id()).get();
+		QCOMPARE(page.size(), 1);
+		QCOMPARE(page.at(0).message(), QString("0"));
+	}
+
+	void testBackgroundWriter()
+	{
+		// File databases are written by a background thread
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+
+		m_db.reset();
+		m_db.reset(new Database);
+		QVERIFY(m_db->openFile(dir.filePath("test.db")));
+		logger = dynamic_cast<DbLog*>(m_db->logger());
+		QVERIFY(logger);
+		logger->setSilent(true);
+
+		const QUuid session = QUuid::createUuid();
+		for(int i=0;i<1000;++i)
+			logger->logMessage(Log().about(Log::Level::Info, Log::Topic::Join).session(i%2 ? session : QUuid()).message(QString::number(i)));
+
+		// Queries see all the queued entries
+		QCOMPARE(logEntryCount(), 1000);
+		QCOMPARE(logger->query().session(session).get().size(), 500);
+
+		// Entries queued at shutdown are written too
+		logger->logMessage(Log().about(Log::Level::Info, Log::Topic::Status).message("last"));
+		m_db.reset();
+		m_db.reset(new Database);
+		QVERIFY(m_db->openFile(dir.filePath("test.db")));
+		logger = dynamic_cast<DbLog*>(m_db->logger());
+		QVERIFY(logger);
+		logger->setSilent(true);
+
+		QCOMPARE(logEntryCount(), 1001);
+		QCOMPARE(logger->query().page(0, 1).get().at(0).message(), QString("last"));
+
+		m_db.reset();
+	}
+
 private:
 	int logEntryCount()
 	{
-		return logger->getLogEntries(QUuid(), QDateTime(), Log::Level::Debug, 0, 0).size();
+		return logger->getLogEntries(QUuid(), QDateTime(), Log::Level::Debug, 0, 0, 0).size();
 	}
 
 	QScopedPointer<Database> m_db;
@@ -155,6 +155,28 @@ private slots:
 		QCOMPARE(db.getConfigBool(boolKey), true);
 	}
 
+	void testDatabaseBans()
+	{
+		Database db;
+		QVERIFY(db.openFile(":memory:"));
+
+		const QDateTime future = QDateTime::currentDateTimeUtc().addDays(1);
+		const QDateTime past = QDateTime::currentDateTimeUtc().addDays(-1);
+
+		const int id1 = db.addBan(QHostAddress("10.0.0.0"), 8, future, "subnet")["id"].toInt();
+		db.addBan(QHostAddress("192.168.1.1"), 0, future, "single");
+		db.addBan(QHostAddress("172.16.0.1"), 0, past, "expired");
+
+		QCOMPARE(db.isAddressBanned(QHostAddress("10.1.2.3")), true);
+		QCOMPARE(db.isAddressBanned(QHostAddress("11.1.2.3")), false);
+		QCOMPARE(db.isAddressBanned(QHostAddress("192.168.1.1")), true);
+		QCOMPARE(db.isAddressBanned(QHostAddress("192.168.1.2")), false);
+		QCOMPARE(db.isAddressBanned(QHostAddress("172.16.0.1")), false);
+
+		QVERIFY(db.deleteBan(id1));
+		QCOMPARE(db.isAddressBanned(QHostAddress("10.1.2.3")), false);
+	}
+
 	void testConfigFile()
 	{
 		ConfigFile cfg(":/test/test-config.cfg");
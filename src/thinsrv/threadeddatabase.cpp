@@ -0,0 +1,57 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "threadeddatabase.h"
+
+#include <QThread>
+#include <QSqlError>
+
+namespace server {
+
+ThreadedDatabase::ThreadedDatabase(const QSqlDatabase &db)
+	: m_db(db), m_thread(QThread::currentThread())
+{
+}
+
+QSqlDatabase ThreadedDatabase::connection() const
+{
+	QThread *thread = QThread::currentThread();
+	if(thread == m_thread || !m_db.isValid())
+		return m_db;
+
+	const QString name = QStringLiteral("%1-%2")
+		.arg(m_db.connectionName())
+		.arg(quintptr(thread), 0, 16);
+
+	if(QSqlDatabase::contains(name))
+		return QSqlDatabase::database(name, false);
+
+	QSqlDatabase db = QSqlDatabase::cloneDatabase(m_db, name);
+	db.setConnectOptions(QStringLiteral("QSQLITE_BUSY_TIMEOUT=%1").arg(BUSY_TIMEOUT));
+	if(!db.open())
+		qWarning("Couldn't open database connection %s: %s", qPrintable(name), qPrintable(db.lastError().text()));
+
+	QObject::connect(thread, &QThread::finished, [name]() {
+		QSqlDatabase::removeDatabase(name);
+	});
+
+	return db;
+}
+
+}
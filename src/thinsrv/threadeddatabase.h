@@ -0,0 +1,58 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADEDDATABASE_H
+#define THREADEDDATABASE_H
+
+#include <QSqlDatabase>
+
+class QThread;
+
+namespace server {
+
+/**
+ * @brief A database handle that can be used from any thread
+ *
+ * A QSqlDatabase connection may only be used in the thread that created it.
+ * This class opens an extra connection to the same database for each other
+ * thread it is used from. The extra connections are closed when their
+ * threads finish.
+ */
+class ThreadedDatabase
+{
+public:
+	ThreadedDatabase() : m_thread(nullptr) { }
+
+	//! Wrap an open connection. This must be called in the thread that opened the connection
+	explicit ThreadedDatabase(const QSqlDatabase &db);
+
+	//! Get a connection usable in the calling thread
+	QSqlDatabase connection() const;
+
+	//! Busy timeout (in milliseconds) used for all connections
+	static const int BUSY_TIMEOUT = 5000;
+
+private:
+	QSqlDatabase m_db;
+	QThread *m_thread;
+};
+
+}
+
+#endif
@@ -47,6 +47,22 @@ void Webadmin::setBasicAuth(const QString &userpass)
 
 void Webadmin::setSessions(MultiServer *server)
 {
+	// Metrics for Prometheus style monitoring
+	m_server->addRequestHandler("^/metrics/?$", [server](const HttpRequest &req) {
+		if(req.method() != HttpRequest::GET && req.method() != HttpRequest::HEAD)
+			return HttpResponse::MethodNotAllowed(QStringList() << "GET" << "HEAD");
+
+		QByteArray metrics;
+		QMetaObject::invokeMethod(
+			server, "prometheusMetrics", Qt::BlockingQueuedConnection,
+			Q_RETURN_ARG(QByteArray, metrics)
+			);
+
+		HttpResponse response(200, metrics);
+		response.setHeader("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+		return response;
+	});
+
 	m_server->addRequestHandler(".*", [server](const HttpRequest &req) {
 		JsonApiMethod m;
 		switch(req.method()) {